@@ -4,6 +4,8 @@
 #include "geometry/ray.h"
 #include "math/vecmath.h"
 
+#include <cmath>
+
 class Camera {
 public:
     Camera() = default;
@@ -15,6 +17,7 @@ public:
         // TODO: take fov_axis from scene parameters
         f32 axis = viewport_width;
         f32 focal_length = -(axis / 2.f) / tanf((fov * (M_PIf / 180.f)) / 2.f);
+        focal_distance = std::abs(focal_length);
 
         origin = point3(0.f);
         vec3 horizontal = vec3(viewport_width, 0.f, 0.f);
@@ -31,10 +34,17 @@ public:
         return Ray(origin, (screencoord - origin).normalized());
     }
 
+    /// Angle between the rays of two neighbouring pixels, the spread of their ray cones
+    f32
+    pixel_spread_angle(u32 res_y) const {
+        return std::atan(viewport_height / (focal_distance * static_cast<f32>(res_y)));
+    }
+
     point3 origin{0.f};
     point3 bottom_left{0.f};
     f32 viewport_width{};
     f32 viewport_height{};
+    f32 focal_distance{};
 };
 
 #endif
@@ -1,6 +1,8 @@
 
 #include "rgb2spec.h"
 
+#include "../utils/hash.h"
+
 #include <cmath>
 #include <cstdio>
 #include <cstring>
@@ -106,6 +108,16 @@ RGB2Spec::eval(const tuple3 &coeff, f32 lambda) {
     return rgb2spec_fma(.5f * x, y, .5f);
 }
 
+u64
+RGB2Spec::table_hash() const {
+    u64 hash = hash_bytes(Span<const u8>(reinterpret_cast<const u8 *>(m_scale.data()),
+                                         m_scale.size() * sizeof(f32)),
+                          res);
+    return hash_bytes(Span<const u8>(reinterpret_cast<const u8 *>(data.data()),
+                                     data.size() * sizeof(f32)),
+                      hash);
+}
+
 i32
 RGB2Spec::rgb2spec_find_interval(const f32 *values, f32 x) const {
     i32 left = 0;
@@ -25,6 +25,10 @@ public:
     static f32
     eval(const tuple3 &coeff, f32 lambda);
 
+    /// Identifies the table, coefficients fetched from different tables differ
+    u64
+    table_hash() const;
+
 private:
     i32
     rgb2spec_find_interval(const f32 *values, f32 x) const;
@@ -30,6 +30,12 @@ RgbSpectrum::make_empty() {
     };
 }
 
+u64
+RgbSpectrum::table_hash() {
+    static const u64 hash = rgb2spec.table_hash();
+    return hash;
+}
+
 f32
 RgbSpectrum::eval_single(f32 lambda) const {
     return RGB2Spec::eval(sigmoid_coeff, lambda);
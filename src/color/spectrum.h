@@ -77,6 +77,10 @@ struct RgbSpectrum {
     static RgbSpectrum
     make_empty();
 
+    /// Hash of the rgb2spec table that make uses
+    static u64
+    table_hash();
+
     f32
     eval_single(f32 lambda) const;
 
@@ -111,6 +115,9 @@ struct RgbSpectrumIlluminant : public RgbSpectrumUnbounded {
 
     // TODO: best to store this out-of-band in the case if illuminant textures...
     ColorSpace color_space = ColorSpace::sRGB;
+    /// Emitters are written to the scene cache as raw bytes, explicit padding keeps the
+    /// file free of uninitialized bytes
+    u8 padding[3]{};
 };
 
 enum class SpectrumType {
@@ -6,8 +6,45 @@
 
 #include <embree4/rtcore.h>
 #include <fmt/core.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
 #include <iostream>
 #include <limits>
+#include <type_traits>
+
+/// Rays traced by the current thread, render threads report them in the statistics
+struct RayCounters {
+    u64 rays = 0;
+    u64 shadow_rays = 0;
+    /// Rays traced in intersection packets and the lanes of those packets, including
+    /// the inactive ones
+    u64 packet_rays = 0;
+    u64 packet_lanes = 0;
+};
+
+inline thread_local RayCounters ray_counters{};
+
+/// Segment between two points that is tested for occlusion, see EmbreeDevice::is_visible
+struct ShadowRay {
+    point3 orig = point3(0.f);
+    point3 target = point3(0.f);
+    /// The segment continues past target to infinity, e.g. for the envmap. target is
+    /// then a unit distance away from orig.
+    bool is_infinite = false;
+};
+
+struct EmbreeConfig {
+    /// Passed to rtcNewDevice, e.g. "threads=16,set_affinity=1,hugepages=1"
+    std::string device_config{};
+    /// High quality enables SAH builds with spatial splits
+    RTCBuildQuality build_quality = RTC_BUILD_QUALITY_MEDIUM;
+    /// Compact uses less memory at the cost of some trace speed
+    bool compact = false;
+    /// Robust avoids missed hits on edges and vertices at the cost of some trace speed
+    bool robust = false;
+};
 
 inline void
 errorFunction(void *userPtr, enum RTCError error, const char *str) {
@@ -16,13 +53,38 @@ errorFunction(void *userPtr, enum RTCError error, const char *str) {
 
 class EmbreeDevice {
 public:
-    explicit EmbreeDevice(Scene &scene) : scene(&scene) {
-        device = initialize_device();
+    explicit EmbreeDevice(Scene &scene, const EmbreeConfig &config = {})
+        : scene(&scene), config(config) {
+        device = initialize_device(config.device_config);
+        rtcSetDeviceMemoryMonitorFunction(device, memory_monitor, &memory);
+
+        const auto build_start = std::chrono::steady_clock::now();
         initialize_scene();
+        const std::chrono::duration<f64> build_time{std::chrono::steady_clock::now() -
+                                                    build_start};
+
+        spdlog::info("BVH build took {:.3f} s, Embree uses {:.1f} MiB (peak {:.1f} MiB)",
+                     build_time.count(), memory.bytes.load() / (1024. * 1024.),
+                     memory.peak_bytes.load() / (1024. * 1024.));
+
+        // Use the widest packets the CPU supports natively, emulated ones are slower
+        // than single rays
+        if (rtcGetDeviceProperty(device, RTC_DEVICE_PROPERTY_NATIVE_RAY16_SUPPORTED)) {
+            packet_size = 16;
+        } else if (rtcGetDeviceProperty(device,
+                                        RTC_DEVICE_PROPERTY_NATIVE_RAY8_SUPPORTED)) {
+            packet_size = 8;
+        }
+
+        spdlog::info("Tracing camera rays in packets of {}", packet_size);
     }
 
+    /// All of the attributes are computed in one pass over the vertices of the triangle.
+    /// Hits of instanced meshes are in object space, they're transformed to world space
+    /// by the instance's matrices.
     Intersection
-    get_triangle_its(u32 mesh_index, u32 triangle_index, const vec2 &bary) {
+    get_triangle_its(u32 mesh_index, u32 triangle_index, const vec2 &bary,
+                     const Instance *instance = nullptr) {
         auto &mesh = scene->geometry.meshes.meshes[mesh_index];
         auto &meshes = scene->geometry.meshes;
 
@@ -33,20 +95,52 @@ public:
 
         point3 pos = barycentric_interp(bar, p0, p1, p2);
 
-        norm_vec3 normal = meshes.calc_normal(mesh.has_normals, i0, i1, i2,
-                                              mesh.normals_index, bar, p0, p1, p2);
-        norm_vec3 geometric_normal = meshes.calc_normal(
-            mesh.has_normals, i0, i1, i2, mesh.normals_index, bar, p0, p1, p2, true);
-        vec2 uv = meshes.calc_uvs(mesh.has_uvs, i0, i1, i2, mesh.uvs_index, bar);
+        norm_vec3 geometric_normal = Meshes::calc_geometric_normal(p0, p1, p2);
+        norm_vec3 normal = geometric_normal;
+        if (mesh.has_normals) {
+            normal = meshes.calc_normal(true, i0, i1, i2, mesh.normals_index, bar, p0, p1,
+                                        p2);
+        }
+
+        vec2 uv = vec2(0.f);
+        f32 uv_density = 0.f;
+        if (mesh.has_uvs) {
+            auto tri_uvs = meshes.get_tri_uvs(i0, i1, i2, mesh.uvs_index);
+            uv = barycentric_interp(bar, tri_uvs[0], tri_uvs[1], tri_uvs[2]);
+
+            if (instance != nullptr) {
+                // The density depends on the area in world space
+                uv_density = Meshes::calc_uv_density(
+                    tri_uvs, instance->to_world.transform_point(p0),
+                    instance->to_world.transform_point(p1),
+                    instance->to_world.transform_point(p2));
+            } else {
+                uv_density = Meshes::calc_uv_density(tri_uvs, p0, p1, p2);
+            }
+        }
+
+        if (instance != nullptr) {
+            pos = instance->to_world.transform_point(pos);
+            normal = instance->normals_to_world.transform_vec(normal).normalized();
+            geometric_normal =
+                instance->normals_to_world.transform_vec(geometric_normal).normalized();
+
+            // The geometric normal of a baked mesh comes from the winding in world space
+            if (instance->flips_winding) {
+                geometric_normal = -geometric_normal;
+            }
+        }
 
         return Intersection{
             .material_id = mesh.material_id,
-            .light_id = mesh.lights_start_id + triangle_index,
+            .light_id = mesh.light_id,
+            .triangle_index = triangle_index,
             .has_light = mesh.has_light,
             .normal = normal,
             .geometric_normal = geometric_normal,
             .pos = pos,
-            .uv = uv,
+            .tex_coords{uv},
+            .uv_density = uv_density,
         };
     }
 
@@ -56,27 +150,73 @@ public:
 
         auto &center = spheres.vertices[sphere_id].pos;
         auto normal = Spheres::calc_normal(pos, center);
+        f32 radius = spheres.vertices[sphere_id].radius;
 
         return Intersection{
             .material_id = spheres.material_ids[sphere_id],
             .light_id = spheres.light_ids[sphere_id],
+            .triangle_index = 0,
             .has_light = spheres.has_light[sphere_id],
             .normal = normal,
             .geometric_normal = Spheres::calc_normal(pos, center, true),
             .pos = pos,
-            .uv = Spheres::calc_uvs(normal),
+            .tex_coords{Spheres::calc_uvs(normal)},
+            .uv_density = Spheres::calc_uv_density(radius),
         };
     }
 
-    Option<Intersection>
-    cast_ray(point3 orig, vec3 dir) {
+    /// Builds the intersection of a hit found by any of the rtcIntersect functions.
+    /// inst_id is the instID[0] of the hit.
+    Intersection
+    resolve_hit(u32 geom_id, u32 prim_id, const vec2 &bary, const point3 &pos,
+                u32 inst_id = RTC_INVALID_GEOMETRY_ID) {
+        if (inst_id != RTC_INVALID_GEOMETRY_ID) {
+            // Geometry IDs in the group scenes count from the group's first mesh
+            auto &instances = scene->geometry.instances;
+            auto &instance = instances.instances[inst_id - instances_start_id];
+            u32 mesh_id = instances.groups[instance.group_id].meshes_start + geom_id;
+            return get_triangle_its(mesh_id, prim_id, bary, &instance);
+        } else if (geom_id < mesh_count) {
+            return get_triangle_its(geom_id, prim_id, bary);
+        } else {
+            return get_sphere_its(prim_id, pos);
+        }
+    }
+
+    Intersection
+    resolve_hit(const HitInfo &hit, const Ray &ray) {
+        return resolve_hit(hit.geom_id, hit.prim_id, hit.bary, ray.at(hit.t),
+                           hit.inst_id);
+    }
+
+    /// Cheap check that doesn't compute the attributes of the hit
+    bool
+    hit_has_light(u32 geom_id, u32 prim_id, u32 inst_id) const {
+        if (inst_id != RTC_INVALID_GEOMETRY_ID) {
+            // Shape groups can't have emitters
+            return false;
+        } else if (geom_id < mesh_count) {
+            return scene->geometry.meshes.meshes[geom_id].has_light;
+        } else {
+            return scene->geometry.spheres.has_light[prim_id];
+        }
+    }
+
+    bool
+    hit_has_light(const HitInfo &hit) const {
+        return hit_has_light(hit.geom_id, hit.prim_id, hit.inst_id);
+    }
+
+    /// Only finds the hit, resolve_hit() computes its attributes
+    Option<HitInfo>
+    trace_ray(const Ray &ray) {
         struct RTCRayHit rayhit {};
-        rayhit.ray.org_x = orig.x;
-        rayhit.ray.org_y = orig.y;
-        rayhit.ray.org_z = orig.z;
-        rayhit.ray.dir_x = dir.x;
-        rayhit.ray.dir_y = dir.y;
-        rayhit.ray.dir_z = dir.z;
+        rayhit.ray.org_x = ray.o.x;
+        rayhit.ray.org_y = ray.o.y;
+        rayhit.ray.org_z = ray.o.z;
+        rayhit.ray.dir_x = ray.dir.x;
+        rayhit.ray.dir_y = ray.dir.y;
+        rayhit.ray.dir_z = ray.dir.z;
         rayhit.ray.tnear = 0;
         rayhit.ray.tfar = std::numeric_limits<f32>::infinity();
         rayhit.ray.mask = -1;
@@ -85,33 +225,46 @@ public:
         rayhit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
 
         rtcIntersect1(rtc_scene, &rayhit);
+        ray_counters.rays++;
 
         if (rayhit.hit.geomID != RTC_INVALID_GEOMETRY_ID) {
-            if (rayhit.hit.geomID < mesh_count) {
-                return get_triangle_its(rayhit.hit.geomID, rayhit.hit.primID,
-                                        vec2(rayhit.hit.u, rayhit.hit.v));
-            } else {
-                point3 pos = orig + rayhit.ray.tfar * dir;
-                return get_sphere_its(rayhit.hit.primID, pos);
-            }
-
+            return HitInfo{
+                .geom_id = rayhit.hit.geomID,
+                .prim_id = rayhit.hit.primID,
+                .inst_id = rayhit.hit.instID[0],
+                .bary = vec2(rayhit.hit.u, rayhit.hit.v),
+                .t = rayhit.ray.tfar,
+            };
         } else {
             return {};
         }
     }
 
-    Option<Intersection>
-    cast_ray(const Ray &ray) {
-        return cast_ray(ray.o, ray.dir);
+    /// Traces a batch of coherent rays (e.g. camera rays of a tile) in packets
+    void
+    trace_rays(Span<const Ray> rays, Span<Option<HitInfo>> hits) {
+        for (u32 start = 0; start < rays.size(); start += packet_size) {
+            u32 count = std::min<u32>(packet_size, rays.size() - start);
+
+            if (packet_size == 16) {
+                trace_ray_packet<16>(rays.subspan(start, count),
+                                     hits.subspan(start, count));
+            } else if (packet_size == 8) {
+                trace_ray_packet<8>(rays.subspan(start, count),
+                                    hits.subspan(start, count));
+            } else {
+                hits[start] = trace_ray(rays[start]);
+            }
+        }
     }
 
     bool
-    is_visible(point3 a, point3 b) {
+    is_visible(point3 a, point3 b, bool is_infinite = false) {
         vec3 dir = b - a;
         point3 orig = a;
 
         // tfar is relative to the ray length
-        f32 tfar = 0.999f;
+        f32 tfar = is_infinite ? INFINITY : 0.999f;
 
         struct RTCRay rtc_ray {};
         rtc_ray.org_x = orig.x;
@@ -127,6 +280,7 @@ public:
         rtc_ray.time = 0;
 
         rtcOccluded1(rtc_scene, &rtc_ray);
+        ray_counters.shadow_rays++;
 
         if (rtc_ray.tfar == -INFINITY) {
             return false;
@@ -135,9 +289,36 @@ public:
         }
     }
 
+    /// Tests a batch of shadow rays with rtcOccluded4/8/16, writes 1 to visible for each
+    /// unoccluded ray. Without native packets the rays are tested one by one.
+    void
+    are_visible(Span<const ShadowRay> rays, Span<u8> visible) {
+        if (rays.size() == 1 || packet_size == 1) {
+            for (u32 i = 0; i < rays.size(); i++) {
+                visible[i] =
+                    is_visible(rays[i].orig, rays[i].target, rays[i].is_infinite);
+            }
+            return;
+        }
+
+        for (u32 start = 0; start < rays.size(); start += packet_size) {
+            u32 count = std::min<u32>(packet_size, rays.size() - start);
+            auto packet_rays = rays.subspan(start, count);
+            auto packet_visible = visible.subspan(start, count);
+
+            if (count <= 4) {
+                occluded_packet<4>(packet_rays, packet_visible);
+            } else if (count <= 8) {
+                occluded_packet<8>(packet_rays, packet_visible);
+            } else {
+                occluded_packet<16>(packet_rays, packet_visible);
+            }
+        }
+    }
+
     static RTCDevice
-    initialize_device() {
-        RTCDevice device = rtcNewDevice(nullptr);
+    initialize_device(const std::string &device_config) {
+        RTCDevice device = rtcNewDevice(device_config.c_str());
 
         if (!device) {
             spdlog::error(fmt::format("Cannot create Embree device, error: {}\n",
@@ -150,78 +331,114 @@ public:
 
     RTCScene
     initialize_scene() {
-        rtc_scene = rtcNewScene(device);
+        rtc_scene = new_scene();
 
         initialize_meshes();
         initialize_spheres();
+        initialize_instances();
 
         rtcCommitScene(rtc_scene);
 
         return rtc_scene;
     }
 
+    /// Creates a scene with the configured build quality and flags
+    RTCScene
+    new_scene() {
+        RTCScene new_scene = rtcNewScene(device);
+
+        rtcSetSceneBuildQuality(new_scene, config.build_quality);
+
+        i32 flags = RTC_SCENE_FLAG_NONE;
+        if (config.compact) {
+            flags |= RTC_SCENE_FLAG_COMPACT;
+        }
+        if (config.robust) {
+            flags |= RTC_SCENE_FLAG_ROBUST;
+        }
+        rtcSetSceneFlags(new_scene, static_cast<RTCSceneFlags>(flags));
+
+        return new_scene;
+    }
+
+    /// Meshes of shape groups are attached to the group scenes in initialize_instances()
     void
     initialize_meshes() {
+        auto &meshes = scene->geometry.meshes.meshes;
+        mesh_count = meshes.size();
+        for (u32 mesh_id = 0; mesh_id < mesh_count; mesh_id++) {
+            if (meshes[mesh_id].in_shape_group) {
+                continue;
+            }
+
+            /* The geometry ID of a mesh is its index, so that resolve_hit() can find it
+             * even though the meshes of shape groups are skipped.
+             * */
+            RTCGeometry geom = new_mesh_geometry(meshes[mesh_id]);
+            rtcAttachGeometryByID(rtc_scene, geom, mesh_id);
+            rtcReleaseGeometry(geom);
+        }
+    }
+
+    RTCGeometry
+    new_mesh_geometry(const Mesh &mesh) {
         auto &pos = scene->geometry.meshes.pos;
         auto &indices = scene->geometry.meshes.indices;
         auto &normals = scene->geometry.meshes.normals;
         auto &uvs = scene->geometry.meshes.uvs;
 
-        auto &meshes = scene->geometry.meshes.meshes;
-        mesh_count = meshes.size();
-        for (auto &mesh : meshes) {
-            RTCGeometry geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
-
-            size_t pos_byte_offset = mesh.pos_index * sizeof(point3);
-            size_t indices_byte_offset = mesh.indices_index * sizeof(u32);
-            size_t normals_byte_offset = mesh.normals_index * sizeof(vec3);
-            size_t uvs_byte_offset = mesh.uvs_index * sizeof(vec2);
+        RTCGeometry geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
+        rtcSetGeometryBuildQuality(geom, config.build_quality);
 
-            rtcSetSharedGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3,
-                                       pos.data(), pos_byte_offset, sizeof(point3),
-                                       mesh.num_vertices);
+        size_t pos_byte_offset = mesh.pos_index * sizeof(point3);
+        size_t indices_byte_offset = mesh.indices_index * sizeof(u32);
+        size_t normals_byte_offset = mesh.normals_index * sizeof(vec3);
+        size_t uvs_byte_offset = mesh.uvs_index * sizeof(vec2);
 
-            rtcSetSharedGeometryBuffer(geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3,
-                                       indices.data(), indices_byte_offset,
-                                       3 * sizeof(u32), mesh.num_indices / 3);
+        rtcSetSharedGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3,
+                                   pos.data(), pos_byte_offset, sizeof(point3),
+                                   mesh.num_vertices);
 
-            u32 attr_count = 0;
-            u32 normals_slot;
-            u32 uvs_slot;
+        rtcSetSharedGeometryBuffer(geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3,
+                                   indices.data(), indices_byte_offset,
+                                   3 * sizeof(u32), mesh.num_indices / 3);
 
-            if (mesh.has_normals) {
-                normals_slot = attr_count;
-                attr_count++;
-            }
+        u32 attr_count = 0;
+        u32 normals_slot;
+        u32 uvs_slot;
 
-            if (mesh.has_uvs) {
-                uvs_slot = attr_count;
-                attr_count++;
-            }
+        if (mesh.has_normals) {
+            normals_slot = attr_count;
+            attr_count++;
+        }
 
-            rtcSetGeometryVertexAttributeCount(geom, attr_count);
-            if (mesh.has_normals) {
-                rtcSetSharedGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE,
-                                           normals_slot, RTC_FORMAT_FLOAT3,
-                                           normals.data(), normals_byte_offset,
-                                           sizeof(vec3), mesh.num_vertices);
-            }
+        if (mesh.has_uvs) {
+            uvs_slot = attr_count;
+            attr_count++;
+        }
 
-            if (mesh.has_uvs) {
-                rtcSetSharedGeometryBuffer(
-                    geom, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, uvs_slot, RTC_FORMAT_FLOAT2,
-                    uvs.data(), uvs_byte_offset, sizeof(vec2), mesh.num_vertices);
-            }
+        // Embree can't interpolate the compact layout, the attributes are only
+        // interpolated by Meshes anyway
+        if (scene->geometry.meshes.compact) {
+            attr_count = 0;
+        }
 
-            rtcCommitGeometry(geom);
+        rtcSetGeometryVertexAttributeCount(geom, attr_count);
+        if (mesh.has_normals && attr_count > 0) {
+            rtcSetSharedGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE,
+                                       normals_slot, RTC_FORMAT_FLOAT3,
+                                       normals.data(), normals_byte_offset,
+                                       sizeof(vec3), mesh.num_vertices);
+        }
 
-            /* From Embree 4 docs:
-             * The geometry IDs are assigned sequentially, starting from 0, as long as no
-             * ge- ometry got detached.
-             * */
-            rtcAttachGeometry(rtc_scene, geom);
-            rtcReleaseGeometry(geom);
+        if (mesh.has_uvs && attr_count > 0) {
+            rtcSetSharedGeometryBuffer(
+                geom, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, uvs_slot, RTC_FORMAT_FLOAT2,
+                uvs.data(), uvs_byte_offset, sizeof(vec2), mesh.num_vertices);
         }
+
+        rtcCommitGeometry(geom);
+        return geom;
     }
 
     void
@@ -239,26 +456,214 @@ public:
 
         rtcCommitGeometry(geom);
 
-        rtcAttachGeometry(rtc_scene, geom);
+        rtcAttachGeometryByID(rtc_scene, geom, mesh_count);
         rtcReleaseGeometry(geom);
     }
 
+    /// Each shape group is built once as a sub-scene, instances place it with
+    /// RTC_GEOMETRY_TYPE_INSTANCE geometries.
+    void
+    initialize_instances() {
+        auto &meshes = scene->geometry.meshes.meshes;
+        auto &instances = scene->geometry.instances;
+
+        for (const auto &group : instances.groups) {
+            RTCScene group_scene = new_scene();
+
+            // Attached in order, so the geometry IDs are 0..n-1. Embree sizes the
+            // geometry arrays of a scene by the largest ID.
+            for (u32 mesh_id = group.meshes_start; mesh_id < group.meshes_end;
+                 mesh_id++) {
+                RTCGeometry geom = new_mesh_geometry(meshes[mesh_id]);
+                rtcAttachGeometry(group_scene, geom);
+                rtcReleaseGeometry(geom);
+            }
+
+            rtcCommitScene(group_scene);
+            group_scenes.push_back(group_scene);
+        }
+
+        instances_start_id = mesh_count + 1;
+        for (u32 i = 0; i < instances.instances.size(); i++) {
+            const auto &instance = instances.instances[i];
+
+            RTCGeometry geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_INSTANCE);
+            rtcSetGeometryInstancedScene(geom, group_scenes[instance.group_id]);
+            // mat4 is column-major as well
+            rtcSetGeometryTransform(geom, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR,
+                                    &instance.to_world.mat[0][0]);
+            rtcCommitGeometry(geom);
+
+            rtcAttachGeometryByID(rtc_scene, geom, instances_start_id + i);
+            rtcReleaseGeometry(geom);
+        }
+
+        if (!instances.instances.empty()) {
+            spdlog::info("Placed {} instances of {} shape groups",
+                         instances.instances.size(), instances.groups.size());
+        }
+    }
+
+    RTCScene
+    get_rtc_scene() const {
+        return rtc_scene;
+    }
+
     ~EmbreeDevice() {
-        rtcReleaseDevice(device);
         rtcReleaseScene(rtc_scene);
+        for (RTCScene group_scene : group_scenes) {
+            rtcReleaseScene(group_scene);
+        }
+        rtcReleaseDevice(device);
     }
 
+    // The memory monitor keeps a pointer to the device
+    EmbreeDevice(const EmbreeDevice &) = delete;
+    EmbreeDevice &
+    operator=(const EmbreeDevice &) = delete;
+
 private:
+    struct MemoryStats {
+        std::atomic<i64> bytes{0};
+        std::atomic<i64> peak_bytes{0};
+    };
+
+    static bool
+    memory_monitor(void *user_ptr, ssize_t bytes, bool post) {
+        auto *stats = static_cast<MemoryStats *>(user_ptr);
+        i64 current = stats->bytes.fetch_add(bytes) + bytes;
+
+        i64 peak = stats->peak_bytes.load();
+        while (current > peak &&
+               !stats->peak_bytes.compare_exchange_weak(peak, current)) {
+        }
+
+        return true;
+    }
+
+    template <u32 N>
+    void
+    trace_ray_packet(Span<const Ray> rays, Span<Option<HitInfo>> hits) {
+        using RTCRayHitN = std::conditional_t<N == 16, RTCRayHit16, RTCRayHit8>;
+
+        RTCRayHitN rayhit{};
+        alignas(64) i32 valid[N];
+
+        for (u32 lane = 0; lane < N; lane++) {
+            if (lane >= rays.size()) {
+                valid[lane] = 0;
+                continue;
+            }
+
+            const Ray &ray = rays[lane];
+            valid[lane] = -1;
+
+            rayhit.ray.org_x[lane] = ray.o.x;
+            rayhit.ray.org_y[lane] = ray.o.y;
+            rayhit.ray.org_z[lane] = ray.o.z;
+            rayhit.ray.dir_x[lane] = ray.dir.x;
+            rayhit.ray.dir_y[lane] = ray.dir.y;
+            rayhit.ray.dir_z[lane] = ray.dir.z;
+            rayhit.ray.tnear[lane] = 0.f;
+            rayhit.ray.tfar[lane] = std::numeric_limits<f32>::infinity();
+            rayhit.ray.time[lane] = 0.f;
+            rayhit.ray.mask[lane] = -1;
+            rayhit.ray.flags[lane] = 0;
+            rayhit.hit.geomID[lane] = RTC_INVALID_GEOMETRY_ID;
+            rayhit.hit.instID[0][lane] = RTC_INVALID_GEOMETRY_ID;
+        }
+
+        if constexpr (N == 16) {
+            rtcIntersect16(valid, rtc_scene, &rayhit);
+        } else {
+            rtcIntersect8(valid, rtc_scene, &rayhit);
+        }
+
+        ray_counters.rays += rays.size();
+        ray_counters.packet_rays += rays.size();
+        ray_counters.packet_lanes += N;
+
+        for (u32 lane = 0; lane < rays.size(); lane++) {
+            if (rayhit.hit.geomID[lane] != RTC_INVALID_GEOMETRY_ID) {
+                hits[lane] = HitInfo{
+                    .geom_id = rayhit.hit.geomID[lane],
+                    .prim_id = rayhit.hit.primID[lane],
+                    .inst_id = rayhit.hit.instID[0][lane],
+                    .bary = vec2(rayhit.hit.u[lane], rayhit.hit.v[lane]),
+                    .t = rayhit.ray.tfar[lane],
+                };
+            } else {
+                hits[lane] = {};
+            }
+        }
+    }
+
+    template <u32 N>
+    void
+    occluded_packet(Span<const ShadowRay> rays, Span<u8> visible) {
+        using RTCRayN =
+            std::conditional_t<N == 16, RTCRay16,
+                               std::conditional_t<N == 8, RTCRay8, RTCRay4>>;
+
+        RTCRayN rtc_rays{};
+        alignas(64) i32 valid[N];
+
+        for (u32 lane = 0; lane < N; lane++) {
+            if (lane >= rays.size()) {
+                valid[lane] = 0;
+                continue;
+            }
+
+            valid[lane] = -1;
+
+            // Same setup as is_visible(), tfar is relative to the ray length
+            vec3 dir = rays[lane].target - rays[lane].orig;
+            rtc_rays.org_x[lane] = rays[lane].orig.x;
+            rtc_rays.org_y[lane] = rays[lane].orig.y;
+            rtc_rays.org_z[lane] = rays[lane].orig.z;
+            rtc_rays.dir_x[lane] = dir.x;
+            rtc_rays.dir_y[lane] = dir.y;
+            rtc_rays.dir_z[lane] = dir.z;
+            rtc_rays.tnear[lane] = 0.001f;
+            rtc_rays.tfar[lane] = rays[lane].is_infinite ? INFINITY : 0.999f;
+            rtc_rays.time[lane] = 0.f;
+            rtc_rays.mask[lane] = -1;
+            rtc_rays.flags[lane] = 0;
+        }
+
+        if constexpr (N == 16) {
+            rtcOccluded16(valid, rtc_scene, &rtc_rays);
+        } else if constexpr (N == 8) {
+            rtcOccluded8(valid, rtc_scene, &rtc_rays);
+        } else {
+            rtcOccluded4(valid, rtc_scene, &rtc_rays);
+        }
+
+        ray_counters.shadow_rays += rays.size();
+
+        for (u32 lane = 0; lane < rays.size(); lane++) {
+            visible[lane] = rtc_rays.tfar[lane] != -INFINITY;
+        }
+    }
+
     Scene *scene;
+    EmbreeConfig config;
+    MemoryStats memory{};
 
-    /// goem_ids are assigned sequentially by Embree
-    /// we can know which type of object was intersected by looking at the counts for
-    /// the different geometries if they were created sequentially
+    /// Geometry IDs are assigned explicitly: meshes have their mesh index, the spheres
+    /// geometry is mesh_count and instances start at instances_start_id, so we can know
+    /// which type of object was intersected by looking at the counts
     u32 mesh_count{0};
     u32 sphere_count{0};
+    u32 instances_start_id{0};
+    /// Width of the packets trace_rays() and are_visible() use, 1 without native packet
+    /// support
+    u32 packet_size{1};
 
     RTCDevice device;
     RTCScene rtc_scene;
+    /// Sub-scenes of the shape groups
+    std::vector<RTCScene> group_scenes{};
 };
 
 #endif // PT_EMBREE_DEVICE_H
@@ -4,14 +4,101 @@
 #include "math/vecmath.h"
 #include "utils/basic_types.h"
 
-#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+
+/// Pixels are padded to 16 bytes, so that a row of an 8x8 tile spans exactly two cache
+/// lines and tiles owned by different threads never share a cache line.
+struct alignas(16) FramebufferPixel {
+    /// Sum of the samples
+    vec3 xyz;
+    u32 num_samples;
+};
 
 class Framebuffer {
 public:
-    Framebuffer() : image_x{0}, image_y{0} {};
+    static constexpr size_t CACHE_LINE_SIZE = 64;
 
+    Framebuffer() : image_x{0}, image_y{0}, row_stride{0} {};
+
+    /// The pixel memory isn't touched here, so that its pages can be placed on NUMA
+    /// nodes by first-touch. clear_rows() has to be called before rendering.
     Framebuffer(u32 image_x, u32 image_y) : image_x{image_x}, image_y{image_y} {
-        pixels = std::vector<vec3>(num_pixels(), vec3(0.f));
+        // Rows start on a cache line boundary
+        constexpr u32 pixels_per_line = CACHE_LINE_SIZE / sizeof(FramebufferPixel);
+        row_stride = (image_x + pixels_per_line - 1) / pixels_per_line * pixels_per_line;
+
+        size_t size =
+            static_cast<size_t>(row_stride) * image_y * sizeof(FramebufferPixel);
+        size = (size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+
+        pixels = std::unique_ptr<FramebufferPixel[], FreeDeleter>(
+            static_cast<FramebufferPixel *>(std::aligned_alloc(PAGE_SIZE, size)));
+
+        // A row of an 8x8 tile is a whole cache line of sums as well
+        constexpr u32 sums_per_line = CACHE_LINE_SIZE / sizeof(f64);
+        lum_sq_stride = (image_x + sums_per_line - 1) / sums_per_line * sums_per_line;
+
+        size_t lum_sq_size = static_cast<size_t>(lum_sq_stride) * image_y * sizeof(f64);
+        lum_sq_size = (lum_sq_size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+
+        lum_sq_sums = std::unique_ptr<f64[], FreeDeleter>(
+            static_cast<f64 *>(std::aligned_alloc(PAGE_SIZE, lum_sq_size)));
+
+        if (pixels == nullptr || lum_sq_sums == nullptr) {
+            throw std::bad_alloc();
+        }
+    }
+
+    /// Zeroes rows [row_start, row_end) of the framebuffer.
+    void
+    clear_rows(u32 row_start, u32 row_end) {
+        std::uninitialized_fill(get_row(row_start), get_row(row_end),
+                                FramebufferPixel{.xyz = vec3(0.f), .num_samples = 0});
+        std::uninitialized_fill(get_lum_sq_row(row_start), get_lum_sq_row(row_end), 0.);
+    }
+
+    /// Rows are stored top-down, in the same order as in the output image.
+    FramebufferPixel *
+    get_row(u32 row) {
+        return &pixels[static_cast<size_t>(row) * row_stride];
+    }
+
+    const FramebufferPixel *
+    get_row(u32 row) const {
+        return &pixels[static_cast<size_t>(row) * row_stride];
+    }
+
+    /// Sums of squared luminance (Y) of the samples, used for variance estimation.
+    f64 *
+    get_lum_sq_row(u32 row) {
+        return &lum_sq_sums[static_cast<size_t>(row) * lum_sq_stride];
+    }
+
+    const f64 *
+    get_lum_sq_row(u32 row) const {
+        return &lum_sq_sums[static_cast<size_t>(row) * lum_sq_stride];
+    }
+
+    /// Relative standard error of the pixel's mean luminance.
+    static f32
+    relative_error(const FramebufferPixel &pixel, f64 lum_sq_sum) {
+        if (pixel.num_samples < 2) {
+            return std::numeric_limits<f32>::infinity();
+        }
+
+        f32 n = static_cast<f32>(pixel.num_samples);
+        f32 mean = pixel.xyz.y / n;
+        f32 mean_sq = static_cast<f32>(lum_sq_sum / static_cast<f64>(n));
+        f32 variance = std::max(mean_sq - sqr(mean), 0.f) * n / (n - 1.f);
+        f32 std_error = std::sqrt(variance / n);
+
+        // Keeps almost black pixels from never converging
+        constexpr f32 min_mean = 0.001f;
+        return std_error / std::max(mean, min_mean);
     }
 
     u32
@@ -29,16 +116,24 @@ public:
         return image_y;
     }
 
-    std::vector<vec3> &
-    get_pixels() {
-        return pixels;
-    }
-
 private:
-    std::vector<vec3> pixels;
+    static constexpr size_t PAGE_SIZE = 4096;
+
+    struct FreeDeleter {
+        void
+        operator()(void *ptr) const {
+            std::free(ptr);
+        }
+    };
+
+    std::unique_ptr<FramebufferPixel[], FreeDeleter> pixels{};
+    std::unique_ptr<f64[], FreeDeleter> lum_sq_sums{};
 
     u32 image_x;
     u32 image_y;
+    /// Number of pixels between the starts of two rows
+    u32 row_stride;
+    u32 lum_sq_stride = 0;
 };
 
 #endif // PT_FRAMEBUFFER_H
@@ -1,21 +1,94 @@
 
 #include "geometry.h"
 
+#include "../math/quantization.h"
+
+#include <spdlog/spdlog.h>
+
+namespace {
+
+/// Spherical triangles outside of this range of solid angles are sampled by area, tiny
+/// ones lose precision and huge ones approach the hemisphere. Taken from PBRT-v4.
+constexpr f32 MIN_SPHERICAL_SAMPLE_AREA = 3e-4f;
+constexpr f32 MAX_SPHERICAL_SAMPLE_AREA = 6.22f;
+
+/// sin^2(1.5 deg), below it 1 - cos(theta_max) of a sphere's cone loses precision
+constexpr f32 SMALL_CONE_SIN2_THETA = 0.00068523f;
+
+/// Converts a pdf with respect to area at light_pos to the solid angle at pos, 0 if the
+/// surface is seen edge-on
+f32
+area_to_solid_angle_pdf(f32 pdf, const point3 &pos, const point3 &light_pos,
+                        const vec3 &light_normal) {
+    vec3 to_light = light_pos - pos;
+    f32 dist_sq = to_light.length_squared();
+    f32 cos_light = std::abs(vec3::dot(light_normal, to_light)) / std::sqrt(dist_sq);
+    if (!(cos_light > 0.f)) {
+        return 0.f;
+    }
+
+    return pdf * dist_sq / cos_light;
+}
+
+f32
+triangle_solid_angle(const Array<point3, 3> &tri_pos, const point3 &pos) {
+    return spherical_triangle_area((tri_pos[0] - pos).normalized(),
+                                   (tri_pos[1] - pos).normalized(),
+                                   (tri_pos[2] - pos).normalized());
+}
+
+bool
+use_spherical_sampling(f32 solid_angle) {
+    return solid_angle >= MIN_SPHERICAL_SAMPLE_AREA &&
+           solid_angle <= MAX_SPHERICAL_SAMPLE_AREA;
+}
+
+/// Pdf of the cone of directions towards a sphere
+f32
+sphere_cone_pdf(f32 sin2_theta_max) {
+    f32 one_minus_cos_theta_max = sin2_theta_max < SMALL_CONE_SIN2_THETA
+                                      ? sin2_theta_max * 0.5f
+                                      : 1.f - safe_sqrt(1.f - sin2_theta_max);
+    return 1.f / (2.f * M_PIf * one_minus_cos_theta_max);
+}
+
+} // namespace
+
 void
-Geometry::add_mesh(const MeshParams &mp, Option<u32> lights_start_id) {
+Geometry::reserve_meshes(const MeshCounts &counts) {
+    meshes.meshes.reserve(meshes.meshes.size() + counts.meshes);
+    meshes.indices.reserve(meshes.indices.size() + counts.indices);
+    meshes.pos.reserve(meshes.pos.size() + counts.vertices);
+
+    if (meshes.compact) {
+        meshes.shading.reserve(meshes.shading.size() + counts.shading);
+    } else {
+        meshes.normals.reserve(meshes.normals.size() + counts.normals);
+        meshes.uvs.reserve(meshes.uvs.size() + counts.uvs);
+    }
+}
+
+void
+Geometry::add_mesh(const MeshParams &mp, Option<u32> light_id) {
     u32 num_indices = mp.indices->size();
     u32 num_vertices = mp.pos->size();
 
-    // TODO: accidentally quadratic resizing...
-
     u32 indices_index = meshes.indices.size();
-    for (u32 &index : *mp.indices) {
-        meshes.indices.push_back(index);
-    }
+    meshes.indices.insert(meshes.indices.end(), mp.indices->begin(), mp.indices->end());
 
     u32 pos_index = meshes.pos.size();
-    for (auto &pos : *mp.pos) {
-        meshes.pos.push_back(pos);
+    meshes.pos.insert(meshes.pos.end(), mp.pos->begin(), mp.pos->end());
+
+    if (mp.normals != nullptr) {
+        meshes.full_float_shading_bytes += mp.normals->size() * sizeof(vec3);
+    }
+    if (mp.uvs != nullptr) {
+        meshes.full_float_shading_bytes += mp.uvs->size() * sizeof(vec2);
+    }
+
+    if (meshes.compact) {
+        add_compact_shading(mp, indices_index, pos_index, light_id);
+        return;
     }
 
     Option<u32> normals_index = {};
@@ -23,9 +96,8 @@ Geometry::add_mesh(const MeshParams &mp, Option<u32> lights_start_id) {
         normals_index = {meshes.normals.size()};
         assert(mp.normals->size() == mp.pos->size());
 
-        for (auto normal : *mp.normals) {
-            meshes.normals.push_back(normal);
-        }
+        meshes.normals.insert(meshes.normals.end(), mp.normals->begin(),
+                              mp.normals->end());
     }
 
     Option<u32> uvs_index = {};
@@ -33,12 +105,44 @@ Geometry::add_mesh(const MeshParams &mp, Option<u32> lights_start_id) {
         uvs_index = {meshes.uvs.size()};
         assert(mp.uvs->size() == mp.pos->size());
 
-        for (auto uv : *mp.uvs) {
-            meshes.uvs.push_back(uv);
+        meshes.uvs.insert(meshes.uvs.end(), mp.uvs->begin(), mp.uvs->end());
+    }
+
+    auto mesh = Mesh(indices_index, pos_index, mp.material_id, light_id,
+                     num_indices, num_vertices, normals_index, uvs_index);
+    meshes.meshes.push_back(mesh);
+}
+
+void
+Geometry::add_compact_shading(const MeshParams &mp, u32 indices_index, u32 pos_index,
+                              Option<u32> light_id) {
+    u32 num_indices = mp.indices->size();
+    u32 num_vertices = mp.pos->size();
+
+    Option<u32> shading_index = {};
+    if (mp.normals != nullptr || mp.uvs != nullptr) {
+        shading_index = {meshes.shading.size()};
+        assert(mp.normals == nullptr || mp.normals->size() == mp.pos->size());
+        assert(mp.uvs == nullptr || mp.uvs->size() == mp.pos->size());
+
+        for (u32 v = 0; v < num_vertices; v++) {
+            CompactShadingVertex vertex{.normal = 0, .uv = {0, 0}};
+            if (mp.normals != nullptr) {
+                vertex.normal = oct_encode((*mp.normals)[v].normalized());
+            }
+            if (mp.uvs != nullptr) {
+                vertex.uv[0] = f32_to_half((*mp.uvs)[v].x);
+                vertex.uv[1] = f32_to_half((*mp.uvs)[v].y);
+            }
+
+            meshes.shading.push_back(vertex);
         }
     }
 
-    auto mesh = Mesh(indices_index, pos_index, mp.material_id, lights_start_id,
+    Option<u32> normals_index = mp.normals != nullptr ? shading_index : Option<u32>{};
+    Option<u32> uvs_index = mp.uvs != nullptr ? shading_index : Option<u32>{};
+
+    auto mesh = Mesh(indices_index, pos_index, mp.material_id, light_id,
                      num_indices, num_vertices, normals_index, uvs_index);
     meshes.meshes.push_back(mesh);
 }
@@ -60,6 +164,35 @@ Geometry::add_sphere(SphereParams sp, Option<u32> light_id) {
     spheres.num_spheres++;
 }
 
+u32
+Geometry::add_shape_group(u32 meshes_start, u32 meshes_end) {
+    for (u32 i = meshes_start; i < meshes_end; i++) {
+        meshes.meshes[i].in_shape_group = true;
+    }
+
+    u32 group_id = instances.groups.size();
+    instances.groups.push_back(
+        ShapeGroup{.meshes_start = meshes_start, .meshes_end = meshes_end});
+    return group_id;
+}
+
+void
+Geometry::add_instance(u32 group_id, const mat4 &to_world) {
+    assert(group_id < instances.groups.size());
+
+    const auto &m = to_world.mat;
+    f32 det = m[0][0] * (m[1][1] * m[2][2] - m[2][1] * m[1][2]) -
+              m[1][0] * (m[0][1] * m[2][2] - m[2][1] * m[0][2]) +
+              m[2][0] * (m[0][1] * m[1][2] - m[1][1] * m[0][2]);
+
+    instances.instances.push_back(Instance{
+        .group_id = group_id,
+        .to_world = to_world,
+        .normals_to_world = to_world.transpose().inverse(),
+        .flips_winding = det < 0.f,
+    });
+}
+
 u32
 Geometry::get_next_shape_index(ShapeType type) const {
     switch (type) {
@@ -76,7 +209,7 @@ ShapeSample
 Geometry::sample_shape(ShapeIndex si, const point3 &pos, const vec3 &sample) const {
     switch (si.type) {
     case ShapeType::Mesh:
-        return meshes.sample(si, sample);
+        return meshes.sample(si, pos, sample);
     case ShapeType::Sphere:
         return spheres.sample(si.index, pos, sample);
     default:
@@ -84,6 +217,30 @@ Geometry::sample_shape(ShapeIndex si, const point3 &pos, const vec3 &sample) con
     }
 }
 
+ShapeSample
+Geometry::sample_shape_area(ShapeIndex si, const vec3 &sample) const {
+    switch (si.type) {
+    case ShapeType::Mesh:
+        return meshes.sample_area(si, sample);
+    case ShapeType::Sphere:
+        return spheres.sample_area(si.index, sample);
+    default:
+        assert(false);
+    }
+}
+
+f32
+Geometry::shape_pdf(ShapeIndex si, const point3 &pos, const point3 &light_pos) const {
+    switch (si.type) {
+    case ShapeType::Mesh:
+        return meshes.pdf(si, pos, light_pos);
+    case ShapeType::Sphere:
+        return spheres.pdf(si.index, pos, light_pos);
+    default:
+        assert(false);
+    }
+}
+
 f32
 Geometry::shape_area(ShapeIndex si) const {
     switch (si.type) {
@@ -100,13 +257,13 @@ Geometry::shape_area(ShapeIndex si) const {
 }
 
 Mesh::Mesh(u32 indices_index, u32 pos_index, u32 material_id,
-           Option<u32> p_lights_start_id, u32 num_indices, u32 num_vertices,
+           Option<u32> p_light_id, u32 num_indices, u32 num_vertices,
            Option<u32> p_normals_index, Option<u32> p_uvs_index)
     : indices_index(indices_index), pos_index(pos_index), material_id(material_id),
       num_indices(num_indices), num_vertices(num_vertices) {
 
-    if (p_lights_start_id.has_value()) {
-        lights_start_id = p_lights_start_id.value();
+    if (p_light_id.has_value()) {
+        light_id = p_light_id.value();
         has_light = true;
     }
 
@@ -148,26 +305,53 @@ Meshes::calc_tri_area(u32 mesh_indices_index, u32 mesh_pos_index, u32 triangle)
     return cross.length() / 2.f;
 }
 
+norm_vec3
+Meshes::calc_geometric_normal(const point3 &p0, const point3 &p1, const point3 &p2) {
+    vec3 v0 = p1 - p0;
+    vec3 v1 = p2 - p0;
+    norm_vec3 normal = vec3::cross(v0, v1).normalized();
+    if (normal.any_nan()) {
+        // TODO: Degenerate triangle hack...
+        normal = vec3(0.5f, 0.3f, -0.7f).normalized();
+    }
+
+    return normal;
+}
+
 norm_vec3
 Meshes::calc_normal(bool has_normals, u32 i0, u32 i1, u32 i2, u32 normals_index,
                     const vec3 &bar, const point3 &p0, const point3 &p1, const point3 &p2,
                     bool want_geometric_normal) const {
     if (has_normals && !want_geometric_normal) {
+        if (compact) {
+            vec3 n0 = oct_decode(shading[normals_index + i0].normal);
+            vec3 n1 = oct_decode(shading[normals_index + i1].normal);
+            vec3 n2 = oct_decode(shading[normals_index + i2].normal);
+            return barycentric_interp(bar, n0, n1, n2).normalized();
+        }
+
         vec3 n0 = normals[normals_index + i0];
         vec3 n1 = normals[normals_index + i1];
         vec3 n2 = normals[normals_index + i2];
         return barycentric_interp(bar, n0, n1, n2).normalized();
     } else {
-        vec3 v0 = p1 - p0;
-        vec3 v1 = p2 - p0;
-        norm_vec3 normal = vec3::cross(v0, v1).normalized();
-        if (normal.any_nan()) {
-            // TODO: Degenerate triangle hack...
-            normal = vec3(0.5f, 0.3f, -0.7f).normalized();
-        }
+        return calc_geometric_normal(p0, p1, p2);
+    }
+}
+
+Array<vec2, 3>
+Meshes::get_tri_uvs(u32 i0, u32 i1, u32 i2, u32 uvs_index) const {
+    if (compact) {
+        auto decode_uv = [this](u32 index) {
+            const auto &vertex = shading[index];
+            return vec2(half_to_f32(vertex.uv[0]), half_to_f32(vertex.uv[1]));
+        };
 
-        return normal;
+        return {decode_uv(uvs_index + i0), decode_uv(uvs_index + i1),
+                decode_uv(uvs_index + i2)};
     }
+
+    return {uvs[uvs_index + i0], uvs[uvs_index + i1], uvs[uvs_index + i2]};
 }
 
 vec2
@@ -176,17 +360,30 @@ Meshes::calc_uvs(bool has_uvs, u32 i0, u32 i1, u32 i2, u32 uvs_index,
     // Idk what's suppossed to happen here without explicit UVs..
     vec2 uv = vec2(0.);
     if (has_uvs) {
-        vec2 uv0 = uvs[uvs_index + i0];
-        vec2 uv1 = uvs[uvs_index + i1];
-        vec2 uv2 = uvs[uvs_index + i2];
+        auto [uv0, uv1, uv2] = get_tri_uvs(i0, i1, i2, uvs_index);
         uv = barycentric_interp(bar, uv0, uv1, uv2);
     }
 
     return uv;
 }
 
+f32
+Meshes::calc_uv_density(const Array<vec2, 3> &tri_uvs, const point3 &p0, const point3 &p1,
+                        const point3 &p2) {
+    vec2 duv1 = tri_uvs[1] - tri_uvs[0];
+    vec2 duv2 = tri_uvs[2] - tri_uvs[0];
+    f32 uv_area = std::abs(duv1.x * duv2.y - duv1.y * duv2.x);
+    f32 world_area = vec3::cross(p1 - p0, p2 - p0).length();
+
+    if (world_area == 0.f) {
+        return 0.f;
+    }
+
+    return std::sqrt(uv_area / world_area);
+}
+
 ShapeSample
-Meshes::sample(ShapeIndex si, const vec3 &sample) const {
+Meshes::sample_area(ShapeIndex si, const vec3 &sample) const {
     auto &mesh = meshes[si.index];
 
     const vec3 bar = sample_uniform_triangle(vec2(sample.y, sample.z));
@@ -204,12 +401,76 @@ Meshes::sample(ShapeIndex si, const vec3 &sample) const {
         .pos = sampled_pos,
         .normal = normal,
         .pdf = 1.f / area,
-        .area = area,
     };
 }
 
 ShapeSample
-Spheres::sample(u32 index, const point3 &illuminated_pos, const vec3 &sample) const {
+Meshes::sample(ShapeIndex si, const point3 &pos, const vec3 &sample) const {
+    const auto &mesh = meshes[si.index];
+    auto tri_indices = get_tri_indices(mesh.indices_index, si.triangle_index);
+    const auto tri_pos = get_tri_pos(mesh.pos_index, tri_indices);
+
+    f32 solid_angle = triangle_solid_angle(tri_pos, pos);
+    if (!use_spherical_sampling(solid_angle)) {
+        auto area_sample = sample_area(si, sample);
+        area_sample.pdf = area_to_solid_angle_pdf(
+            area_sample.pdf, pos, area_sample.pos,
+            calc_geometric_normal(tri_pos[0], tri_pos[1], tri_pos[2]));
+        return area_sample;
+    }
+
+    const vec3 bar = sample_spherical_triangle(tri_pos, pos, vec2(sample.y, sample.z));
+    point3 sampled_pos = barycentric_interp(bar, tri_pos[0], tri_pos[1], tri_pos[2]);
+
+    norm_vec3 normal =
+        calc_normal(mesh.has_normals, tri_indices[0], tri_indices[1], tri_indices[2],
+                    mesh.normals_index, bar, tri_pos[0], tri_pos[1], tri_pos[2]);
+
+    return ShapeSample{
+        .pos = sampled_pos,
+        .normal = normal,
+        .pdf = 1.f / solid_angle,
+    };
+}
+
+f32
+Meshes::pdf(ShapeIndex si, const point3 &pos, const point3 &light_pos) const {
+    const auto &mesh = meshes[si.index];
+    auto tri_indices = get_tri_indices(mesh.indices_index, si.triangle_index);
+    const auto tri_pos = get_tri_pos(mesh.pos_index, tri_indices);
+
+    f32 solid_angle = triangle_solid_angle(tri_pos, pos);
+    if (!use_spherical_sampling(solid_angle)) {
+        f32 area = calc_tri_area(mesh.indices_index, mesh.pos_index, si.triangle_index);
+        return area_to_solid_angle_pdf(
+            1.f / area, pos, light_pos,
+            calc_geometric_normal(tri_pos[0], tri_pos[1], tri_pos[2]));
+    }
+
+    return 1.f / solid_angle;
+}
+
+void
+Meshes::log_memory_usage() const {
+    constexpr f64 MIB = 1024. * 1024.;
+
+    u64 indices_bytes = indices.size() * sizeof(u32);
+    u64 pos_bytes = pos.size() * sizeof(point3);
+    u64 shading_bytes = normals.size() * sizeof(vec3) + uvs.size() * sizeof(vec2) +
+                        shading.size() * sizeof(CompactShadingVertex);
+
+    spdlog::info("Mesh data: indices {:.1f} MiB, positions {:.1f} MiB, shading "
+                 "attributes {:.1f} MiB",
+                 indices_bytes / MIB, pos_bytes / MIB, shading_bytes / MIB);
+
+    if (compact) {
+        spdlog::info("Compact mesh layout saves {:.1f} MiB",
+                     (static_cast<f64>(full_float_shading_bytes) - shading_bytes) / MIB);
+    }
+}
+
+ShapeSample
+Spheres::sample_area(u32 index, const vec3 &sample) const {
     vec3 sample_dir = sample_uniform_sphere(vec2(sample.x, sample.y));
     point3 center = vertices[index].pos;
     f32 radius = vertices[index].radius;
@@ -221,10 +482,68 @@ Spheres::sample(u32 index, const point3 &illuminated_pos, const vec3 &sample) co
         .pos = pos,
         .normal = calc_normal(pos, center),
         .pdf = 1.f / area,
-        .area = area,
     };
 }
 
+ShapeSample
+Spheres::sample(u32 index, const point3 &illuminated_pos, const vec3 &sample) const {
+    point3 center = vertices[index].pos;
+    f32 radius = vertices[index].radius;
+
+    vec3 to_center = center - illuminated_pos;
+    f32 dist_sq = to_center.length_squared();
+    if (dist_sq <= sqr(radius)) {
+        auto area_sample = sample_area(index, sample);
+        area_sample.pdf = area_to_solid_angle_pdf(area_sample.pdf, illuminated_pos,
+                                                  area_sample.pos, area_sample.normal);
+        return area_sample;
+    }
+
+    // Uniformly sample the cone of directions to the sphere, from PBRT-v4
+    f32 sin2_theta_max = sqr(radius) / dist_sq;
+    f32 sin_theta_max = std::sqrt(sin2_theta_max);
+    f32 cos_theta_max = safe_sqrt(1.f - sin2_theta_max);
+
+    f32 cos_theta = (cos_theta_max - 1.f) * sample.x + 1.f;
+    f32 sin2_theta = 1.f - sqr(cos_theta);
+    if (sin2_theta_max < SMALL_CONE_SIN2_THETA) {
+        sin2_theta = sin2_theta_max * sample.x;
+        cos_theta = std::sqrt(1.f - sin2_theta);
+    }
+
+    // Angle at the center of the sphere between the direction to illuminated_pos and
+    // the sampled point
+    f32 cos_alpha = sin2_theta / sin_theta_max +
+                    cos_theta * safe_sqrt(1.f - sin2_theta / sin2_theta_max);
+    f32 sin_alpha = safe_sqrt(1.f - sqr(cos_alpha));
+    f32 phi = sample.y * 2.f * M_PIf;
+
+    auto [axis, b1, b2] = coordinate_system(to_center / std::sqrt(dist_sq));
+    vec3 dir = b1 * (sin_alpha * std::cos(phi)) + b2 * (sin_alpha * std::sin(phi)) +
+               axis * cos_alpha;
+    point3 pos = center - radius * dir;
+
+    return ShapeSample{
+        .pos = pos,
+        .normal = calc_normal(pos, center),
+        .pdf = sphere_cone_pdf(sin2_theta_max),
+    };
+}
+
+f32
+Spheres::pdf(u32 index, const point3 &illuminated_pos, const point3 &light_pos) const {
+    point3 center = vertices[index].pos;
+    f32 radius = vertices[index].radius;
+
+    f32 dist_sq = (center - illuminated_pos).length_squared();
+    if (dist_sq <= sqr(radius)) {
+        return area_to_solid_angle_pdf(1.f / calc_sphere_area(radius), illuminated_pos,
+                                       light_pos, calc_normal(light_pos, center));
+    }
+
+    return sphere_cone_pdf(sqr(radius) / dist_sq);
+}
+
 f32
 Spheres::calc_sphere_area(f32 radius) {
     return 4.f * M_PIf * sqr(radius);
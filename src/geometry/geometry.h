@@ -2,6 +2,7 @@
 #define PT_GEOMETRY_H
 
 #include "../math/sampling.h"
+#include "../math/transform.h"
 #include "../math/vecmath.h"
 #include "../scene/emitter.h"
 #include "../utils/basic_types.h"
@@ -16,6 +17,9 @@ enum class ShapeType : u8 {
 // OPTIMIZE: could merge triangle index into type...
 struct ShapeIndex {
     ShapeType type;
+    /// Lights are written to the scene cache as raw bytes, explicit padding keeps the
+    /// file free of uninitialized bytes
+    u8 padding[3]{};
     u32 index;
     u32 triangle_index;
 };
@@ -23,12 +27,13 @@ struct ShapeIndex {
 struct ShapeSample {
     point3 pos;
     norm_vec3 normal;
+    /// With respect to the solid angle at the illuminated point, or with respect to area
+    /// for the sample_area() functions
     f32 pdf;
-    f32 area;
 };
 
 struct Mesh {
-    Mesh(u32 indices_index, u32 pos_index, u32 material_id, Option<u32> p_lights_start_id,
+    Mesh(u32 indices_index, u32 pos_index, u32 material_id, Option<u32> p_light_id,
          u32 num_indices, u32 num_vertices, Option<u32> p_normals_index,
          Option<u32> p_uvs_index);
 
@@ -39,8 +44,8 @@ struct Mesh {
 
     u32 pos_index;
     u32 indices_index;
-    u32 normals_index;
-    u32 uvs_index;
+    u32 normals_index = 0;
+    u32 uvs_index = 0;
 
     u32 num_vertices;
     u32 num_indices;
@@ -49,7 +54,10 @@ struct Mesh {
     bool has_normals = false;
     bool has_uvs = false;
     bool has_light = false;
-    u32 lights_start_id;
+    /// Meshes of shape groups are only placed in the scene by instances
+    bool in_shape_group = false;
+    /// Emissive meshes are a single light
+    u32 light_id = 0;
     u32 material_id;
 };
 
@@ -63,6 +71,38 @@ struct MeshParams {
     Option<Emitter> emitter = {};
 };
 
+/// Sizes of meshes that are about to be added, so that the buffers can be reserved once
+/// instead of growing with every mesh
+struct MeshCounts {
+    void
+    add(u64 num_indices, u64 num_vertices, bool has_normals, bool has_uvs,
+        bool has_light) {
+        meshes++;
+        indices += num_indices;
+        vertices += num_vertices;
+        normals += has_normals ? num_vertices : 0;
+        uvs += has_uvs ? num_vertices : 0;
+        shading += (has_normals || has_uvs) ? num_vertices : 0;
+        lights += has_light ? 1 : 0;
+    }
+
+    u64 meshes = 0;
+    u64 indices = 0;
+    u64 vertices = 0;
+    u64 normals = 0;
+    u64 uvs = 0;
+    /// Vertices in the compact shading buffer
+    u64 shading = 0;
+    u64 lights = 0;
+};
+
+/// Shading attributes of a vertex in the compact layout, the normal is oct-encoded and
+/// the UV is stored as two half floats.
+struct CompactShadingVertex {
+    u32 normal;
+    u16 uv[2];
+};
+
 // SOA layout
 struct Meshes {
     std::vector<Mesh> meshes{};
@@ -72,6 +112,14 @@ struct Meshes {
     std::vector<vec3> normals{};
     std::vector<vec2> uvs{};
 
+    /// In the compact layout, normals and UVs are interleaved in the shading buffer
+    /// instead of being stored in normals and uvs. Mesh::normals_index and
+    /// Mesh::uvs_index then both index into it. Has to be set before adding meshes.
+    bool compact = false;
+    std::vector<CompactShadingVertex> shading{};
+    /// Size the shading attributes would have in the full-float layout
+    u64 full_float_shading_bytes = 0;
+
     Array<u32, 3>
     get_tri_indices(u32 mesh_indices_index, u32 triangle) const;
     ;
@@ -84,16 +132,42 @@ struct Meshes {
     calc_tri_area(u32 mesh_indices_index, u32 mesh_pos_index, u32 triangle) const;
     ;
 
+    static norm_vec3
+    calc_geometric_normal(const point3 &p0, const point3 &p1, const point3 &p2);
+
     norm_vec3
     calc_normal(bool has_normals, u32 i0, u32 i1, u32 i2, u32 normals_index,
                 const vec3 &bar, const point3 &p0, const point3 &p1, const point3 &p2,
                 bool want_geometric_normal = false) const;
 
+    Array<vec2, 3>
+    get_tri_uvs(u32 i0, u32 i1, u32 i2, u32 uvs_index) const;
+
     vec2
     calc_uvs(bool has_uvs, u32 i0, u32 i1, u32 i2, u32 uvs_index, const vec3 &bar) const;
 
+    /// Square root of the ratio of the UV area and the world space area of a triangle,
+    /// converts the width of a ray footprint on the triangle to UV space
+    static f32
+    calc_uv_density(const Array<vec2, 3> &tri_uvs, const point3 &p0, const point3 &p1,
+                    const point3 &p2);
+
+    /// Uniform point on the triangle, sample.y and sample.z are used
+    ShapeSample
+    sample_area(ShapeIndex si, const vec3 &sample) const;
+
+    /// Point on the triangle for illuminating pos. Samples the solid angle subtended by
+    /// the triangle, or the area of triangles that are tiny or huge as seen from pos.
     ShapeSample
-    sample(ShapeIndex si, const vec3 &sample) const;
+    sample(ShapeIndex si, const point3 &pos, const vec3 &sample) const;
+
+    /// Solid angle pdf of sample() returning light_pos on the triangle
+    f32
+    pdf(ShapeIndex si, const point3 &pos, const point3 &light_pos) const;
+
+    /// Logs the size of the mesh buffers and what the compact layout saves
+    void
+    log_memory_usage() const;
 };
 
 // Used only for sphere creation
@@ -117,9 +191,19 @@ struct Spheres {
     std::vector<u32> light_ids{};
     u32 num_spheres = 0;
 
+    /// Uniform point on the sphere
+    ShapeSample
+    sample_area(u32 index, const vec3 &sample) const;
+
+    /// Point on the sphere for illuminating pos, samples the cone of directions to the
+    /// visible cap. Points inside the sphere sample the whole sphere.
     ShapeSample
     sample(u32 index, const point3 &illuminated_pos, const vec3 &sample) const;
 
+    /// Solid angle pdf of sample() returning light_pos on the sphere
+    f32
+    pdf(u32 index, const point3 &illuminated_pos, const point3 &light_pos) const;
+
     static f32
     calc_sphere_area(f32 radius);
 
@@ -132,26 +216,79 @@ struct Spheres {
 
     static vec2
     calc_uvs(const vec3 &normal);
+
+    /// Same as Meshes::calc_uv_density(), the UV square covers the whole sphere
+    static f32
+    calc_uv_density(f32 radius) {
+        return 1.f / std::sqrt(calc_sphere_area(radius));
+    }
+};
+
+/// Meshes of a Mitsuba shapegroup, the group is built once and placed by instances
+struct ShapeGroup {
+    u32 meshes_start;
+    u32 meshes_end;
+};
+
+struct Instance {
+    u32 group_id;
+    mat4 to_world;
+    /// Inverse transpose of to_world
+    mat4 normals_to_world;
+    /// Mirroring transforms flip the winding of the triangles
+    bool flips_winding;
+    /// Written to the scene cache as raw bytes, see ShapeIndex
+    u8 padding[3]{};
+};
+
+struct Instances {
+    std::vector<ShapeGroup> groups{};
+    std::vector<Instance> instances{};
 };
 
 struct Geometry {
     Meshes meshes{};
     Spheres spheres{};
+    Instances instances{};
 
+    /// Reserves the mesh buffers for meshes that will be added with add_mesh()
+    void
+    reserve_meshes(const MeshCounts &counts);
     void
-    add_mesh(const MeshParams &mp, Option<u32> lights_start_id);
+    add_mesh(const MeshParams &mp, Option<u32> light_id);
     void
     add_sphere(SphereParams sp, Option<u32> light_id);
 
+    /// Moves meshes [meshes_start, meshes_end) to a new shape group, returns its id
+    u32
+    add_shape_group(u32 meshes_start, u32 meshes_end);
+    void
+    add_instance(u32 group_id, const mat4 &to_world);
+
     /// Based on the shape type, returns the  index of the *next* shape in that category.
     u32
     get_next_shape_index(ShapeType type) const;
 
+    /// Samples a point on the shape for illuminating pos, the pdf is with respect to the
+    /// solid angle at pos
     ShapeSample
     sample_shape(ShapeIndex si, const point3 &pos, const vec3 &sample) const;
 
+    /// Samples a point on the shape uniformly, the pdf is with respect to area
+    ShapeSample
+    sample_shape_area(ShapeIndex si, const vec3 &sample) const;
+
+    /// Solid angle pdf of sample_shape() returning light_pos
+    f32
+    shape_pdf(ShapeIndex si, const point3 &pos, const point3 &light_pos) const;
+
     f32
     shape_area(ShapeIndex si) const;
+
+private:
+    void
+    add_compact_shading(const MeshParams &mp, u32 indices_index, u32 pos_index,
+                        Option<u32> light_id);
 };
 
 #endif // PT_GEOMETRY_H
@@ -0,0 +1,247 @@
+#include "geometry.h"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/matchers/catch_matchers_floating_point.hpp>
+
+#include <vector>
+
+/*
+ * Synthetic scene with many small meshes, like a scene exported from a DCC tool with
+ * every object in its own file. The benchmark compares adding the meshes to Geometry
+ * element by element (how add_mesh used to do it), with bulk copies and with bulk
+ * copies into buffers reserved up front.
+ * Run with: tests "[!benchmark]"
+ * */
+
+static constexpr u32 BENCH_NUM_MESHES = 4096;
+static constexpr u32 BENCH_GRID_SIZE = 32;
+
+struct GridMesh {
+    std::vector<u32> indices{};
+    std::vector<point3> pos{};
+    std::vector<vec3> normals{};
+    std::vector<vec2> uvs{};
+
+    MeshParams
+    params() {
+        return MeshParams{
+            .indices = &indices,
+            .pos = &pos,
+            .normals = &normals,
+            .uvs = &uvs,
+            .material_id = 0,
+        };
+    }
+};
+
+static GridMesh
+make_grid_mesh(u32 grid_size) {
+    GridMesh mesh{};
+    for (u32 y = 0; y < grid_size; y++) {
+        for (u32 x = 0; x < grid_size; x++) {
+            f32 u = static_cast<f32>(x) / static_cast<f32>(grid_size - 1);
+            f32 v = static_cast<f32>(y) / static_cast<f32>(grid_size - 1);
+            mesh.pos.emplace_back(u, v, 0.f);
+            mesh.normals.emplace_back(0.f, 0.f, 1.f);
+            mesh.uvs.emplace_back(u, v);
+        }
+    }
+
+    for (u32 y = 0; y + 1 < grid_size; y++) {
+        for (u32 x = 0; x + 1 < grid_size; x++) {
+            u32 i = y * grid_size + x;
+            mesh.indices.insert(mesh.indices.end(), {i, i + 1, i + grid_size + 1});
+            mesh.indices.insert(mesh.indices.end(),
+                                {i, i + grid_size + 1, i + grid_size});
+        }
+    }
+
+    return mesh;
+}
+
+TEST_CASE("Reserved mesh insertion", "[geometry]") {
+    for (bool compact : {false, true}) {
+        auto grid = make_grid_mesh(4);
+        auto mp = grid.params();
+
+        MeshCounts counts{};
+        for (u32 i = 0; i < 3; i++) {
+            counts.add(grid.indices.size(), grid.pos.size(), true, true, false);
+        }
+
+        Geometry geometry{};
+        geometry.meshes.compact = compact;
+        geometry.reserve_meshes(counts);
+
+        auto pos_capacity = geometry.meshes.pos.capacity();
+        for (u32 i = 0; i < 3; i++) {
+            geometry.add_mesh(mp, {});
+        }
+
+        const auto &meshes = geometry.meshes;
+        REQUIRE(meshes.pos.capacity() == pos_capacity);
+        REQUIRE(meshes.meshes.size() == 3);
+        REQUIRE(meshes.indices.size() == 3 * grid.indices.size());
+        REQUIRE(meshes.pos.size() == 3 * grid.pos.size());
+        REQUIRE(meshes.meshes[2].indices_index == 2 * grid.indices.size());
+        REQUIRE(meshes.meshes[2].pos_index == 2 * grid.pos.size());
+        REQUIRE(meshes.meshes[2].has_normals);
+        REQUIRE(meshes.meshes[2].has_uvs);
+        REQUIRE(meshes.indices[meshes.meshes[1].indices_index + 5] == grid.indices[5]);
+        REQUIRE(meshes.pos[meshes.meshes[1].pos_index + 7].x == grid.pos[7].x);
+
+        if (compact) {
+            REQUIRE(meshes.shading.size() == 3 * grid.pos.size());
+            REQUIRE(meshes.normals.empty());
+        } else {
+            REQUIRE(meshes.normals.size() == 3 * grid.pos.size());
+            REQUIRE(meshes.uvs.size() == 3 * grid.pos.size());
+        }
+    }
+}
+
+namespace {
+
+/// Estimates the integral of 1 + x over the directions from pos to the shape with both
+/// solid angle and area sampling. Checks that the samples are visible and that their
+/// pdfs match shape_pdf().
+void
+require_same_estimates(const Geometry &geometry, ShapeIndex si, const point3 &pos) {
+    constexpr u32 STRATA = 48;
+    constexpr f64 NUM_SAMPLES = STRATA * STRATA * STRATA;
+
+    auto integrand = [&](const point3 &light_pos) {
+        return 1. + (light_pos - pos).normalized().x;
+    };
+
+    f64 solid_angle_estimate = 0.;
+    f64 area_estimate = 0.;
+    for (u32 i = 0; i < STRATA * STRATA * STRATA; i++) {
+        auto stratum = [](u32 index) {
+            return (static_cast<f32>(index % STRATA) + 0.5f) / STRATA;
+        };
+        auto sample = vec3(stratum(i), stratum(i / STRATA), stratum(i / STRATA / STRATA));
+
+        auto shape_sample = geometry.sample_shape(si, pos, sample);
+        REQUIRE(shape_sample.pdf > 0.f);
+        REQUIRE_THAT(shape_sample.pdf,
+                     Catch::Matchers::WithinRel(
+                         geometry.shape_pdf(si, pos, shape_sample.pos), 1e-3f));
+        solid_angle_estimate += integrand(shape_sample.pos) / shape_sample.pdf;
+
+        // Points on the far side of a sphere don't contribute
+        auto area_sample = geometry.sample_shape_area(si, sample);
+        vec3 to_light = area_sample.pos - pos;
+        f32 cos_light = vec3::dot(area_sample.normal, -to_light.normalized());
+        if (si.type == ShapeType::Mesh) {
+            cos_light = std::abs(cos_light);
+        }
+        if (cos_light > 0.f) {
+            area_estimate += integrand(area_sample.pos) * cos_light /
+                             (to_light.length_squared() * area_sample.pdf);
+        }
+    }
+
+    REQUIRE_THAT(solid_angle_estimate / NUM_SAMPLES,
+                 Catch::Matchers::WithinRel(area_estimate / NUM_SAMPLES, 1e-2));
+}
+
+} // namespace
+
+TEST_CASE("Solid angle sampling of triangles", "[geometry]") {
+    std::vector<u32> indices = {0, 1, 2};
+    std::vector<point3> pos = {point3(0.f, 0.f, 0.f), point3(1.f, 0.f, 0.f),
+                               point3(0.f, 1.f, 0.f)};
+
+    Geometry geometry{};
+    geometry.add_mesh(MeshParams{.indices = &indices, .pos = &pos, .material_id = 0}, {});
+    auto si = ShapeIndex{.type = ShapeType::Mesh, .index = 0, .triangle_index = 0};
+
+    // Spherical sampling close to the triangle, area sampling far away from it
+    for (const auto &receiver : {point3(0.2f, 0.3f, 0.5f), point3(-0.5f, 0.2f, -0.3f),
+                                 point3(0.3f, 0.3f, 200.f)}) {
+        require_same_estimates(geometry, si, receiver);
+    }
+}
+
+TEST_CASE("Cone sampling of spheres", "[geometry]") {
+    Geometry geometry{};
+    geometry.add_sphere(
+        SphereParams{.center = point3(1.f, 2.f, 3.f), .radius = 1.f, .material_id = 0},
+        {});
+    auto si = ShapeIndex{.type = ShapeType::Sphere, .index = 0, .triangle_index = 0};
+
+    // The last cone is small enough for the Taylor expansion
+    for (const auto &receiver : {point3(1.f, 2.f, 5.f), point3(4.f, 0.f, 3.f),
+                                 point3(1.f, 2.f, 80.f)}) {
+        require_same_estimates(geometry, si, receiver);
+
+        for (u32 i = 0; i < 1024; i++) {
+            auto sample = vec3(static_cast<f32>(i % 32) / 32.f,
+                               static_cast<f32>(i / 32) / 32.f, 0.5f);
+            auto shape_sample = geometry.sample_shape(si, receiver, sample);
+            REQUIRE(vec3::dot(shape_sample.normal, receiver - shape_sample.pos) >= 0.f);
+        }
+    }
+
+    // Inside the sphere the whole sphere is sampled
+    auto inside = point3(1.f, 2.f, 3.5f);
+    for (u32 i = 0; i < 64; i++) {
+        auto sample = vec3(static_cast<f32>(i % 8) / 8.f + 0.06f,
+                           static_cast<f32>(i / 8) / 8.f + 0.06f, 0.5f);
+        auto shape_sample = geometry.sample_shape(si, inside, sample);
+        REQUIRE_THAT(shape_sample.pdf,
+                     Catch::Matchers::WithinRel(
+                         geometry.shape_pdf(si, inside, shape_sample.pos), 1e-3f));
+    }
+}
+
+TEST_CASE("Many-mesh scene loading", "[!benchmark][geometry]") {
+    auto grid = make_grid_mesh(BENCH_GRID_SIZE);
+    auto mp = grid.params();
+
+    BENCHMARK("Element-by-element push_back") {
+        Meshes meshes{};
+        for (u32 m = 0; m < BENCH_NUM_MESHES; m++) {
+            for (u32 index : grid.indices) {
+                meshes.indices.push_back(index);
+            }
+            for (const auto &pos : grid.pos) {
+                meshes.pos.push_back(pos);
+            }
+            for (const auto &normal : grid.normals) {
+                meshes.normals.push_back(normal);
+            }
+            for (const auto &uv : grid.uvs) {
+                meshes.uvs.push_back(uv);
+            }
+        }
+
+        return meshes.pos.size();
+    };
+
+    BENCHMARK("Bulk add_mesh") {
+        Geometry geometry{};
+        for (u32 m = 0; m < BENCH_NUM_MESHES; m++) {
+            geometry.add_mesh(mp, {});
+        }
+
+        return geometry.meshes.pos.size();
+    };
+
+    BENCHMARK("Reserved bulk add_mesh") {
+        MeshCounts counts{};
+        for (u32 m = 0; m < BENCH_NUM_MESHES; m++) {
+            counts.add(grid.indices.size(), grid.pos.size(), true, true, false);
+        }
+
+        Geometry geometry{};
+        geometry.reserve_meshes(counts);
+        for (u32 m = 0; m < BENCH_NUM_MESHES; m++) {
+            geometry.add_mesh(mp, {});
+        }
+
+        return geometry.meshes.pos.size();
+    };
+}
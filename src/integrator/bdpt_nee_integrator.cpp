@@ -6,8 +6,9 @@
 spectral
 Integrator::mis_xp_y1_y0(const Intersection &xp_its, const Intersection &y1_its,
                          const SampledLambdas &lambdas,
-                         const std::vector<Texture> &textures, const vec2 &uv,
-                         const point3 &y0, const norm_vec3 &xp_wo) const {
+                         const std::vector<Texture> &textures,
+                         const TexCoords &tex_coords, const point3 &y0,
+                         const norm_vec3 &xp_wo) const {
     norm_vec3 xp_y1_dir = (y1_its.pos - xp_its.pos).normalized();
 
     bool xp_y1_visible = vec3::dot(y1_its.normal, -xp_y1_dir) > 0.f &&
@@ -31,8 +32,8 @@ Integrator::mis_xp_y1_y0(const Intersection &xp_its, const Intersection &y1_its,
         ShadingGeometry::make(y1_its.normal, (y0 - y1_its.pos).normalized(), -xp_y1_dir);
 
     // TODO: fix UVs
-    spectral xp_brdf = xp_material->eval(xp_sgeom, lambdas, textures.data(), uv);
-    spectral y1_brdf = y1_material->eval(y1_sgeom, lambdas, textures.data(), uv);
+    spectral xp_brdf = xp_material->eval(xp_sgeom, lambdas, textures.data(), tex_coords);
+    spectral y1_brdf = y1_material->eval(y1_sgeom, lambdas, textures.data(), tex_coords);
 
     spectral res = xp_brdf * xp_sgeom.cos_theta * y1_brdf * y1_sgeom.cos_theta;
 
@@ -69,23 +70,33 @@ Integrator::integrator_bdpt_nee(Ray ray, Sampler &sampler,
     norm_vec3 xi_wo = -ray.dir;
     spectral xi_throughput = spectral::ONE();
     Intersection xi_its = Intersection::make_empty();
+    RayCone cone = camera_ray_cone();
 
     while (true) {
-        auto opt_its = device->cast_ray(ray);
-        if (!opt_its.has_value()) {
-            if (!sc.has_envmap) {
-                break;
-            } else {
-                const Envmap *envmap = &sc.envmap;
-                spectral envrad = envmap->get_ray_radiance(ray, lambdas);
-
-                // TODO: do envmap sampling...
-                radiance += envrad;
-                break;
+        auto opt_hit = device->trace_ray(ray);
+        if (!opt_hit.has_value()) {
+            if (sc.has_envmap) {
+                // The envmap is only sampled at the vertices that are connected to lights
+                if (depth < 3 || xi_is_dirac_delta || xp_is_dirac_delta) {
+                    radiance += xi_throughput * sc.envmap.get_ray_radiance(ray, lambdas);
+                } else {
+                    radiance +=
+                        envmap_mis(sc, xi_throughput, ray, last_pdf_bxdf, lambdas, 1);
+                }
             }
+
+            break;
         }
 
-        auto its = opt_its.value();
+        // The last bounce only contributes emission, which most hits don't have
+        bool is_last_bounce = max_depth > 0 && depth >= max_depth;
+        if (is_last_bounce && !device->hit_has_light(opt_hit.value())) {
+            break;
+        }
+
+        auto its = device->resolve_hit(opt_hit.value(), ray);
+        cone.propagate(its, ray.dir, opt_hit.value().t);
+
         auto bsdf_sample_rand = sampler.sample3();
         auto rr_sample = sampler.sample();
 
@@ -120,7 +131,7 @@ Integrator::integrator_bdpt_nee(Ray ray, Sampler &sampler,
         }
 
         // Do this before light sampling, because that "extends the path"
-        if (max_depth > 0 && depth >= max_depth) {
+        if (is_last_bounce) {
             break;
         }
 
@@ -132,12 +143,24 @@ Integrator::integrator_bdpt_nee(Ray ray, Sampler &sampler,
         xp_is_dirac_delta = xi_is_dirac_delta;
         xi_is_dirac_delta = material->is_dirac_delta();
         if (!xp_is_dirac_delta && !xi_is_dirac_delta && depth >= 2) {
-            f32 light_sample = sampler.sample();
-            auto sampled_light = sc.sample_lights(light_sample);
-            if (sampled_light.has_value()) {
+            vec2 light_sample = sampler.sample2();
+            auto sampled_light = sc.sample_lights(its.pos, its.normal, light_sample);
+            if (sampled_light.has_value() && sampled_light->is_envmap) {
+                // There's no light path from the envmap, it's sampled like in MISNEE
+                auto shadow_sample =
+                    sample_envmap(its, ray, material, xi_throughput, lambdas,
+                                  sampled_light->pdf, sampler.sample2(), 1);
+
+                if (shadow_sample.has_value() &&
+                    device->is_visible(shadow_sample->ray.orig, shadow_sample->ray.target,
+                                       true)) {
+                    radiance += shadow_sample->contrib;
+                }
+            } else if (sampled_light.has_value()) {
                 auto shape_rng = sampler.sample3();
-                auto shape_sample = sc.geometry.sample_shape(
-                    sampled_light.value().light.shape, its.pos, shape_rng);
+                // y0 starts a light path, so it's sampled by area
+                auto shape_sample =
+                    sc.sample_light_area(sampled_light.value().light_id, shape_rng);
 
                 // TODO:
                 // radiance += mis_xp_xc_y0();
@@ -153,9 +176,9 @@ Integrator::integrator_bdpt_nee(Ray ray, Sampler &sampler,
 
                 auto y1_ray = spawn_ray(shape_sample.pos, shape_sample.normal, wi);
 
-                auto opt_its_y1 = device->cast_ray(y1_ray);
-                if (opt_its_y1.has_value()) {
-                    Intersection y1_its = opt_its_y1.value();
+                auto opt_hit_y1 = device->trace_ray(y1_ray);
+                if (opt_hit_y1.has_value()) {
+                    Intersection y1_its = device->resolve_hit(opt_hit_y1.value(), y1_ray);
 
                     bool is_y1_frontfacing = vec3::dot(-wi, y1_its.normal) >= 0.f;
                     if (!is_y1_frontfacing) {
@@ -167,7 +190,8 @@ Integrator::integrator_bdpt_nee(Ray ray, Sampler &sampler,
 
                     if (is_y1_frontfacing || y1_material->is_twosided) {
                         spectral emission =
-                            sampled_light.value().light.emitter.emission(lambdas);
+                            lights[sampled_light.value().light_id].emitter.emission(
+                                lambdas);
 
                         norm_vec3 xp_y0 = (shape_sample.pos - xp_its.pos).normalized();
 
@@ -176,17 +200,14 @@ Integrator::integrator_bdpt_nee(Ray ray, Sampler &sampler,
                         if (xp_y0_cos_theta > 0.f) {
                             f32 xp_y0_magsq =
                                 (xp_its.pos - shape_sample.pos).length_squared();
-                            // TODO!!!: currently calculating the shape PDF by
-                            // assuming pdf = 1. / area
-                            //  will have to change with non-uniform sampling !
                             f32 pdf_y0 = shape_sample.pdf * sampled_light.value().pdf *
                                          xp_y0_magsq / xp_y0_cos_theta;
 
                             f32 pdf_y1 = vec3::dot(wi, shape_sample.normal) / M_PIf;
 
                             spectral xp_y1_y0_throu =
-                                mis_xp_y1_y0(xp_its, y1_its, lambdas, textures, xi_its.uv,
-                                             shape_sample.pos, xp_wo);
+                                mis_xp_y1_y0(xp_its, y1_its, lambdas, textures,
+                                             xi_its.tex_coords, shape_sample.pos, xp_wo);
 
                             if (pdf_y0 <= 0.f) {
                                 fmt::println("{} {} {}", pdf_y0, xp_y0_magsq,
@@ -221,7 +242,7 @@ Integrator::integrator_bdpt_nee(Ray ray, Sampler &sampler,
 
         auto bsdf_sample_opt =
             material->sample(its.normal, -ray.dir, bsdf_sample_rand, lambdas,
-                             textures.data(), its.uv, is_frontfacing);
+                             textures.data(), its.tex_coords, is_frontfacing);
 
         if (!bsdf_sample_opt.has_value()) {
             break;
@@ -8,19 +8,51 @@
 #include "../utils/sampler.h"
 #include "integrator_type.h"
 
+#include <algorithm>
+
+/// A single sample of a pixel
+struct PixelSample {
+    uvec2 pixel;
+    u32 sample_index;
+};
+
+/// num_light_samples is the number of light samples taken at each vertex, the light
+/// sampler depends on the position and the normal of the last hit
+spectral
+bxdf_mis(const Scene &sc, const spectral &throughput, const point3 &last_hit_pos,
+         const vec3 &last_hit_normal, f32 last_pdf_bxdf, const Intersection &its,
+         const spectral &emission, u32 num_light_samples);
+
+/// Radiance of the envmap reaching the ray that escaped the scene, weighted against
+/// sampling the envmap at the last hit with num_light_samples samples
+spectral
+envmap_mis(const Scene &sc, const spectral &throughput, const Ray &ray, f32 last_pdf_bxdf,
+           const SampledLambdas &lambdas, u32 num_light_samples);
+
+/// A light sample that contributes if its shadow ray isn't occluded
+struct ShadowSample {
+    ShadowRay ray;
+    spectral contrib;
+};
+
 class Integrator {
 public:
-    Integrator(IntegratorType integrator_type, RenderContext *rc, EmbreeDevice *device)
-        : rc{rc}, integrator_type{integrator_type}, device{device} {}
-
-    void
-    integrate_pixel(uvec2 pixel) const {
+    /// Light samples at a vertex are tested for visibility in batches of this size
+    static constexpr u32 SHADOW_BATCH_SIZE = 16;
+
+    Integrator(IntegratorType integrator_type, RenderContext *rc, EmbreeDevice *device,
+               u32 light_samples = 1)
+        : rc{rc}, integrator_type{integrator_type}, device{device},
+          light_samples{std::max(light_samples, 1U)} {}
+
+    /// Renders a single sample of a pixel, sample_index seeds the sampler.
+    /// Returns the XYZ radiance of the sample.
+    vec3
+    integrate_pixel(uvec2 pixel, u32 sample_index) const {
         uvec2 dim = uvec2(rc->attribs.resx, rc->attribs.resy);
 
-        auto pixel_index = ((dim.y - 1U - pixel.y) * dim.x) + pixel.x;
-
         Sampler sampler{};
-        sampler.init_frame(uvec2(pixel.x, pixel.y), uvec2(dim.x, dim.y), frame);
+        sampler.init_frame(uvec2(pixel.x, pixel.y), uvec2(dim.x, dim.y), sample_index);
 
         auto cam_sample = sampler.sample2();
         auto ray = gen_ray(pixel.x, pixel.y, dim.x, dim.y, cam_sample, rc->cam,
@@ -31,17 +63,31 @@ public:
         spectral radiance = spectral::ZERO();
 
         if (integrator_type == IntegratorType::Naive ||
-            integrator_type == IntegratorType::MISNEE) {
-            radiance = integrator_mis_nee(ray, sampler, lambdas);
+            integrator_type == IntegratorType::MISNEE ||
+            integrator_type == IntegratorType::Wavefront) {
+            radiance = integrator_mis_nee(ray, device->trace_ray(ray), sampler, lambdas);
         } else if (integrator_type == IntegratorType::BDPTNEE) {
             radiance = integrator_bdpt_nee(ray, sampler, lambdas);
         }
 
-        rc->fb.get_pixels()[pixel_index] += lambdas.to_xyz(radiance);
+        return lambdas.to_xyz(radiance);
     }
 
+    /// Renders a batch of samples, e.g. all samples of a tile in a pass.
+    /// The camera rays are traced together in packets, the rest of the paths one by one.
+    /// Writes the XYZ radiance of each sample to results.
+    void
+    integrate_pixels(Span<const PixelSample> samples, Span<vec3> results) const;
+
+    IntegratorType
+    get_type() const {
+        return integrator_type;
+    }
+
+    /// first_hit is the already traced hit of the camera ray
     spectral
-    integrator_mis_nee(Ray ray, Sampler &sampler, const SampledLambdas &lambdas) const;
+    integrator_mis_nee(Ray ray, Option<HitInfo> first_hit, Sampler &sampler,
+                       const SampledLambdas &lambdas) const;
 
     spectral
     integrator_bdpt_nee(Ray ray, Sampler &sampler, const SampledLambdas &lambdas) const;
@@ -49,17 +95,52 @@ public:
     spectral
     mis_xp_y1_y0(const Intersection &xp_its, const Intersection &y1_its,
                  const SampledLambdas &lambdas, const std::vector<Texture> &textures,
-                 const vec2 &uv, const point3 &y0, const norm_vec3 &xp_wo) const;
+                 const TexCoords &tex_coords, const point3 &y0,
+                 const norm_vec3 &xp_wo) const;
 
+    /// Takes light_samples light samples at the vertex, their shadow rays are traced
+    /// together.
     spectral
-    light_mis(const Scene &sc, const Intersection &its, const Ray &traced_ray,
-              const LightSample &light_sample, const norm_vec3 &geom_normal,
-              const ShapeSample &shape_sample, const Material *material,
-              const spectral &throughput, const SampledLambdas &lambdas) const;
-
-    u32 frame = 0;
+    light_mis(const Intersection &its, const Ray &traced_ray, const Material *material,
+              const spectral &throughput, const SampledLambdas &lambdas,
+              Sampler &sampler) const;
+
+    /// Samples a light or the envmap for the vertex, nothing if the sample can't
+    /// contribute. The contribution is divided by light_samples.
+    Option<ShadowSample>
+    sample_light(const Intersection &its, const Ray &traced_ray, const Material *material,
+                 const spectral &throughput, const SampledLambdas &lambdas,
+                 Sampler &sampler) const;
+
+    /// Samples the envmap for the vertex, select_pdf is the probability of the envmap
+    /// having been chosen. The contribution is divided by num_samples.
+    Option<ShadowSample>
+    sample_envmap(const Intersection &its, const Ray &traced_ray,
+                  const Material *material, const spectral &throughput,
+                  const SampledLambdas &lambdas, f32 select_pdf, const vec2 &sample,
+                  u32 num_samples) const;
+
+    /// Contribution of a light sample that is already known to be visible, pdf_light is
+    /// the solid angle pdf of its direction. Already divided by the number of light
+    /// samples.
+    spectral
+    light_contrib(const Scene &sc, const Intersection &its, f32 pdf_light,
+                  const spectral &emission, const ShadingGeometry &sgeom_light,
+                  const Material *material, const spectral &throughput,
+                  const SampledLambdas &lambdas, u32 num_samples) const;
 
 private:
+    friend class WavefrontIntegrator;
+
+    /// Cone of a camera ray, widened along the path for texture filtering
+    RayCone
+    camera_ray_cone() const {
+        return RayCone{
+            .width = 0.f,
+            .spread = rc->cam.pixel_spread_angle(rc->attribs.resy),
+        };
+    }
+
     static Ray
     gen_ray(u32 x, u32 y, u32 res_x, u32 res_y, const vec2 &sample, const Camera &cam,
             const mat4 &cam_to_world) {
@@ -81,5 +162,6 @@ private:
     RenderContext *rc;
     IntegratorType integrator_type;
     EmbreeDevice *device;
+    u32 light_samples;
 };
 #endif
@@ -5,6 +5,8 @@ enum class IntegratorType : uint {
     Naive,
     MISNEE,
     BDPTNEE,
+    /// Same estimator as MISNEE, but paths are traced in stages over a pool of paths
+    Wavefront,
 };
 
 #endif // PT_INTEGRATOR_TYPE_H
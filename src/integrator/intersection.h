@@ -4,22 +4,38 @@
 #include "../geometry/geometry.h"
 #include "../geometry/ray.h"
 #include "../math/vecmath.h"
+#include "../scene/texture.h"
 #include "../utils/basic_types.h"
 
+/// Compact hit record returned by tracing. The shading attributes are only computed for
+/// the hits that need them, see EmbreeDevice::resolve_hit().
+struct HitInfo {
+    u32 geom_id;
+    u32 prim_id;
+    /// RTC_INVALID_GEOMETRY_ID if the hit isn't instanced
+    u32 inst_id;
+    vec2 bary;
+    f32 t;
+};
+
 struct Intersection {
     static Intersection
     make_empty() {
         return Intersection{.material_id = 0,
                             .light_id = 0,
+                            .triangle_index = 0,
                             .has_light = false,
                             .normal{0.f, 1.f, 0.f},
                             .geometric_normal{0.f, 1.f, 0.f},
                             .pos{0.f, 0.f, 0.f},
-                            .uv{0.f, 0.f}};
+                            .tex_coords{vec2(0.f, 0.f)},
+                            .uv_density = 0.f};
     }
 
     u32 material_id;
     u32 light_id;
+    /// Triangle of mesh hits, mesh lights need it for the pdf of the hit point
+    u32 triangle_index;
     bool has_light;
     /// "shading" normal affected by interpolation or normal maps
     norm_vec3 normal;
@@ -27,7 +43,32 @@ struct Intersection {
     /// avoidance
     norm_vec3 geometric_normal;
     point3 pos;
-    vec2 uv;
+    /// The footprint is set by the integrator, see RayCone
+    TexCoords tex_coords;
+    /// See Meshes::calc_uv_density()
+    f32 uv_density;
+};
+
+/// Ray cone for choosing the mip level of texture lookups, from "Improved Shader and
+/// Texture Level of Detail Using Ray Cones" - Akenine-Möller et al. 2021.
+/// Surfaces are assumed to be flat, so the cone keeps the spread angle of a camera pixel
+/// along the whole path and only widens with the distance travelled.
+struct RayCone {
+    /// Smallest cosine between the ray and the surface, limits the blur at grazing angles
+    static constexpr f32 MIN_COS_THETA = 0.05f;
+
+    /// Widens the cone up to the hit and sets the footprint of its texture coordinates
+    void
+    propagate(Intersection &its, const vec3 &ray_dir, f32 distance) {
+        width += spread * distance;
+
+        f32 cos_theta = std::max(std::abs(vec3::dot(ray_dir, its.geometric_normal)),
+                                 MIN_COS_THETA);
+        its.tex_coords.footprint = width / cos_theta * its.uv_density;
+    }
+
+    f32 width = 0.f;
+    f32 spread = 0.f;
 };
 
 inline constexpr float
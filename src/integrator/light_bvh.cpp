@@ -0,0 +1,398 @@
+#include "light_bvh.h"
+
+#include "../math/math_utils.h"
+#include "../utils/task_pool.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+constexpr u32 NUM_BUCKETS = 12;
+constexpr u64 BOUNDS_GRAIN_SIZE = 4096;
+
+f32
+safe_acos(f32 value) {
+    return std::acos(std::clamp(value, -1.f, 1.f));
+}
+
+/// cos(max(0, theta_a - theta_b))
+f32
+cos_sub_clamped(f32 sin_theta_a, f32 cos_theta_a, f32 sin_theta_b, f32 cos_theta_b) {
+    if (cos_theta_a > cos_theta_b) {
+        return 1.f;
+    }
+    return cos_theta_a * cos_theta_b + sin_theta_a * sin_theta_b;
+}
+
+/// sin(max(0, theta_a - theta_b))
+f32
+sin_sub_clamped(f32 sin_theta_a, f32 cos_theta_a, f32 sin_theta_b, f32 cos_theta_b) {
+    if (cos_theta_a > cos_theta_b) {
+        return 0.f;
+    }
+    return sin_theta_a * cos_theta_b - cos_theta_a * sin_theta_b;
+}
+
+f32
+sin_from_cos(f32 cos_theta) {
+    return std::sqrt(std::max(0.f, 1.f - sqr(cos_theta)));
+}
+
+/// Cost of a node from PBRT-v4, the power times the solid angle of the emission and
+/// the surface area of the bounds. Long thin nodes are penalized by axis_ratio.
+f32
+split_cost(const LightBounds &lb, f32 axis_ratio) {
+    f32 theta_o = safe_acos(lb.cos_theta_o);
+    f32 theta_e = safe_acos(lb.cos_theta_e);
+    f32 theta_w = std::min(theta_o + theta_e, M_PIf);
+    f32 sin_theta_o = sin_from_cos(lb.cos_theta_o);
+    f32 m_omega = 2.f * M_PIf * (1.f - lb.cos_theta_o) +
+                  M_PIf / 2.f *
+                      (2.f * theta_w * sin_theta_o - std::cos(theta_o - 2.f * theta_w) -
+                       2.f * theta_o * sin_theta_o + lb.cos_theta_o);
+
+    return lb.power * m_omega * axis_ratio * lb.bounds.surface_area();
+}
+
+/// Bounds of a triangle of a mesh light with a unit power, the normal cone contains
+/// the shading normals
+LightBounds
+triangle_bounds(const Meshes &meshes, const Mesh &mesh, u32 triangle) {
+    auto lb = LightBounds{};
+    lb.power = 1.f;
+
+    auto tri_indices = meshes.get_tri_indices(mesh.indices_index, triangle);
+    auto tri_pos = meshes.get_tri_pos(mesh.pos_index, tri_indices);
+    for (const auto &pos : tri_pos) {
+        lb.bounds.extend(pos);
+    }
+
+    lb.axis = Meshes::calc_geometric_normal(tri_pos[0], tri_pos[1], tri_pos[2]);
+    lb.cos_theta_o = 1.f;
+
+    // Emission is one-sided with respect to the shading normal, the cone has to contain
+    // the interpolated normals
+    if (mesh.has_normals) {
+        const Array<vec3, 3> corners = {vec3(1.f, 0.f, 0.f), vec3(0.f, 1.f, 0.f),
+                                        vec3(0.f, 0.f, 1.f)};
+        for (const auto &bar : corners) {
+            norm_vec3 normal = meshes.calc_normal(
+                true, tri_indices[0], tri_indices[1], tri_indices[2], mesh.normals_index,
+                bar, tri_pos[0], tri_pos[1], tri_pos[2]);
+            lb.cos_theta_o = std::min(lb.cos_theta_o, vec3::dot(lb.axis, normal));
+        }
+
+        // Normals on both sides aren't bounded by the cone of their corners
+        if (lb.cos_theta_o < 0.f) {
+            lb.cos_theta_o = -1.f;
+        }
+    }
+
+    return lb;
+}
+
+} // namespace
+
+LightBounds
+LightBounds::make(const Light &light, const Geometry &geom, f32 power) {
+    auto lb = LightBounds{};
+
+    const auto &si = light.shape;
+    if (si.type == ShapeType::Sphere) {
+        const auto &sphere = geom.spheres.vertices[si.index];
+        lb.bounds.extend(sphere.pos - vec3(sphere.radius));
+        lb.bounds.extend(sphere.pos + vec3(sphere.radius));
+        lb.cos_theta_o = -1.f;
+    } else {
+        const auto &mesh = geom.meshes.meshes[si.index];
+        for (u32 i = 0; i < mesh.num_triangles(); i++) {
+            lb = merge(lb, triangle_bounds(geom.meshes, mesh, i));
+        }
+    }
+
+    lb.power = power;
+    // Area lights emit into the hemisphere of their normal
+    lb.cos_theta_e = 0.f;
+    return lb;
+}
+
+LightBounds
+LightBounds::merge(const LightBounds &a, const LightBounds &b) {
+    if (a.power == 0.f) {
+        return b;
+    } else if (b.power == 0.f) {
+        return a;
+    }
+
+    LightBounds merged = a;
+    merged.bounds.extend(b.bounds);
+    merged.power = a.power + b.power;
+    merged.cos_theta_e = std::min(a.cos_theta_e, b.cos_theta_e);
+
+    // Union of the cones of normals
+    f32 theta_a = safe_acos(a.cos_theta_o);
+    f32 theta_b = safe_acos(b.cos_theta_o);
+    f32 theta_d = angle_between(a.axis, b.axis);
+    if (std::min(theta_d + theta_b, M_PIf) <= theta_a) {
+        return merged;
+    } else if (std::min(theta_d + theta_a, M_PIf) <= theta_b) {
+        merged.axis = b.axis;
+        merged.cos_theta_o = b.cos_theta_o;
+        return merged;
+    }
+
+    f32 theta_o = (theta_a + theta_d + theta_b) * 0.5f;
+    vec3 rotation_axis = vec3::cross(a.axis, b.axis);
+    if (theta_o >= M_PIf || rotation_axis.length_squared() == 0.f) {
+        merged.cos_theta_o = -1.f;
+        return merged;
+    }
+
+    // Rotate the axis of a towards b
+    f32 theta_r = theta_o - theta_a;
+    vec3 k = rotation_axis / rotation_axis.length();
+    vec3 axis = a.axis * std::cos(theta_r) + vec3::cross(k, a.axis) * std::sin(theta_r);
+    merged.axis = axis / axis.length();
+    merged.cos_theta_o = std::cos(theta_o);
+    return merged;
+}
+
+f32
+LightBounds::importance(const point3 &pos, const vec3 &normal) const {
+    point3 center = bounds.center();
+    vec3 to_pos = pos - center;
+    f32 dist_sq = to_pos.length_squared();
+    f32 radius_sq = bounds.diagonal().length_squared() * 0.25f;
+
+    // Clamped, so that points close to the lights don't get arbitrarily large values
+    f32 clamped_dist_sq = std::max(dist_sq, bounds.diagonal().length() * 0.5f);
+
+    vec3 wi = dist_sq > 0.f ? to_pos / std::sqrt(dist_sq) : vec3(0.f, 0.f, 1.f);
+    f32 cos_theta_w = vec3::dot(axis, wi);
+    f32 sin_theta_w = sin_from_cos(cos_theta_w);
+
+    // Angle subtended by the bounding sphere
+    f32 cos_theta_b = -1.f;
+    if (dist_sq > radius_sq) {
+        cos_theta_b = std::sqrt(std::max(0.f, 1.f - radius_sq / dist_sq));
+    }
+    f32 sin_theta_b = sin_from_cos(cos_theta_b);
+
+    // Minimum angle between the emission cone and the direction to pos
+    f32 sin_theta_o = sin_from_cos(cos_theta_o);
+    f32 cos_theta_x = cos_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+    f32 sin_theta_x = sin_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+    f32 cos_theta_p = cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+    if (cos_theta_p <= cos_theta_e) {
+        return 0.f;
+    }
+
+    f32 importance = power * cos_theta_p / clamped_dist_sq;
+
+    // Materials may transmit, so both sides of the surface receive light
+    if (normal.length_squared() > 0.f) {
+        f32 cos_theta_i = std::abs(vec3::dot(wi, normal));
+        f32 sin_theta_i = sin_from_cos(cos_theta_i);
+        importance *= cos_sub_clamped(sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b);
+    }
+
+    return std::max(importance, 0.f);
+}
+
+LightBvh::LightBvh(const std::vector<Light> &lights, const Geometry &geom,
+                   Span<const f32> powers, TaskPool *pool) {
+    bit_trails.assign(lights.size(), NOT_IN_BVH);
+
+    std::vector<BuildLight> build_lights(lights.size());
+    auto compute_bounds = [&](u64 i) {
+        f32 power = powers[i] > 0.f ? powers[i] : 0.f;
+        build_lights[i] = BuildLight{
+            .light_id = static_cast<u32>(i),
+            .bounds = power > 0.f ? LightBounds::make(lights[i], geom, power)
+                                  : LightBounds{},
+        };
+    };
+
+    if (pool != nullptr) {
+        pool->parallel_for(lights.size(), BOUNDS_GRAIN_SIZE, compute_bounds);
+    } else {
+        for (u64 i = 0; i < lights.size(); i++) {
+            compute_bounds(i);
+        }
+    }
+
+    std::erase_if(build_lights,
+                  [](const BuildLight &light) { return light.bounds.power == 0.f; });
+    if (build_lights.empty()) {
+        return;
+    }
+
+    nodes.reserve(2 * build_lights.size() - 1);
+    build(build_lights, 0, build_lights.size(), 0, 0);
+}
+
+u32
+LightBvh::build(std::vector<BuildLight> &build_lights, u64 start, u64 end, u64 bit_trail,
+                u32 depth) {
+    u32 node_index = nodes.size();
+    if (end - start == 1) {
+        const auto &light = build_lights[start];
+        nodes.push_back(
+            Node{.bounds = light.bounds, .index = light.light_id, .is_leaf = true});
+        bit_trails[light.light_id] = bit_trail;
+        return node_index;
+    }
+
+    auto bounds = Bounds3{};
+    auto centroid_bounds = Bounds3{};
+    for (u64 i = start; i < end; i++) {
+        bounds.extend(build_lights[i].bounds.bounds);
+        centroid_bounds.extend(build_lights[i].bounds.bounds.center());
+    }
+
+    // Find the cheapest split between buckets along each axis
+    f32 min_cost = std::numeric_limits<f32>::infinity();
+    i32 min_axis = -1;
+    u32 min_bucket = 0;
+    vec3 diagonal = bounds.diagonal();
+    for (u32 axis = 0; axis < 3 && depth < MAX_SAH_DEPTH; axis++) {
+        f32 axis_min = centroid_bounds.min[axis];
+        f32 axis_extent = centroid_bounds.max[axis] - axis_min;
+        if (!(axis_extent > 0.f)) {
+            continue;
+        }
+
+        Array<LightBounds, NUM_BUCKETS> buckets{};
+        for (u64 i = start; i < end; i++) {
+            const auto &lb = build_lights[i].bounds;
+            f32 offset = (lb.bounds.center()[axis] - axis_min) / axis_extent;
+            u32 bucket =
+                std::min(static_cast<u32>(offset * NUM_BUCKETS), NUM_BUCKETS - 1);
+            buckets[bucket] = LightBounds::merge(buckets[bucket], lb);
+        }
+
+        f32 axis_ratio = diagonal.max_component() / diagonal[axis];
+        for (u32 split = 0; split + 1 < NUM_BUCKETS; split++) {
+            auto below = LightBounds{};
+            auto above = LightBounds{};
+            for (u32 b = 0; b <= split; b++) {
+                below = LightBounds::merge(below, buckets[b]);
+            }
+            for (u32 b = split + 1; b < NUM_BUCKETS; b++) {
+                above = LightBounds::merge(above, buckets[b]);
+            }
+
+            f32 cost = split_cost(below, axis_ratio) + split_cost(above, axis_ratio);
+            if (cost > 0.f && cost < min_cost) {
+                min_cost = cost;
+                min_axis = static_cast<i32>(axis);
+                min_bucket = split;
+            }
+        }
+    }
+
+    u64 mid = (start + end) / 2;
+    if (min_axis >= 0) {
+        u32 axis = min_axis;
+        f32 axis_min = centroid_bounds.min[axis];
+        f32 axis_extent = centroid_bounds.max[axis] - axis_min;
+        auto split = std::partition(
+            build_lights.begin() + start, build_lights.begin() + end,
+            [&](const BuildLight &light) {
+                f32 offset =
+                    (light.bounds.bounds.center()[axis] - axis_min) / axis_extent;
+                u32 bucket =
+                    std::min(static_cast<u32>(offset * NUM_BUCKETS), NUM_BUCKETS - 1);
+                return bucket <= min_bucket;
+            });
+
+        mid = split - build_lights.begin();
+        if (mid == start || mid == end) {
+            mid = (start + end) / 2;
+        }
+    }
+
+    nodes.push_back(Node{.bounds = LightBounds{}, .index = 0, .is_leaf = false});
+    u32 first = build(build_lights, start, mid, bit_trail, depth + 1);
+    u32 second = build(build_lights, mid, end, bit_trail | (1ULL << depth), depth + 1);
+
+    nodes[node_index].bounds =
+        LightBounds::merge(nodes[first].bounds, nodes[second].bounds);
+    nodes[node_index].index = second;
+    return node_index;
+}
+
+Option<LightBvh::Sample>
+LightBvh::sample(const point3 &pos, const vec3 &normal, f32 sample) const {
+    if (nodes.empty()) {
+        return {};
+    }
+
+    u32 node_index = 0;
+    f32 pmf = 1.f;
+    while (true) {
+        const auto &node = nodes[node_index];
+        if (node.is_leaf) {
+            // The importance of other nodes was checked when they were chosen
+            if (node_index > 0 || node.bounds.importance(pos, normal) > 0.f) {
+                return Sample{.light_id = node.index, .pdf = pmf};
+            }
+            return {};
+        }
+
+        f32 importance_first = nodes[node_index + 1].bounds.importance(pos, normal);
+        f32 importance_second = nodes[node.index].bounds.importance(pos, normal);
+        if (importance_first == 0.f && importance_second == 0.f) {
+            return {};
+        }
+
+        // The sample is rescaled, so that it can be reused at the next level
+        f32 prob_first = importance_first / (importance_first + importance_second);
+        if (sample < prob_first) {
+            node_index = node_index + 1;
+            sample = std::min(sample / prob_first, ONE_MINUS_EPSILON);
+            pmf *= prob_first;
+        } else {
+            node_index = node.index;
+            sample =
+                std::min((sample - prob_first) / (1.f - prob_first), ONE_MINUS_EPSILON);
+            pmf *= 1.f - prob_first;
+        }
+    }
+}
+
+f32
+LightBvh::pdf(u32 light_id, const point3 &pos, const vec3 &normal) const {
+    u64 bit_trail = bit_trails[light_id];
+    if (bit_trail == NOT_IN_BVH) {
+        return 0.f;
+    }
+
+    u32 node_index = 0;
+    f32 pmf = 1.f;
+    while (!nodes[node_index].is_leaf) {
+        const auto &node = nodes[node_index];
+        f32 importance_first = nodes[node_index + 1].bounds.importance(pos, normal);
+        f32 importance_second = nodes[node.index].bounds.importance(pos, normal);
+        if (importance_first == 0.f && importance_second == 0.f) {
+            return 0.f;
+        }
+
+        f32 prob_first = importance_first / (importance_first + importance_second);
+        if ((bit_trail & 1) == 0) {
+            node_index = node_index + 1;
+            pmf *= prob_first;
+        } else {
+            node_index = node.index;
+            pmf *= 1.f - prob_first;
+        }
+        bit_trail >>= 1;
+    }
+
+    if (node_index == 0 && nodes[0].bounds.importance(pos, normal) == 0.f) {
+        return 0.f;
+    }
+
+    return pmf;
+}
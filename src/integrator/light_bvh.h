@@ -0,0 +1,134 @@
+#ifndef PT_LIGHT_BVH_H
+#define PT_LIGHT_BVH_H
+
+#include "../geometry/geometry.h"
+#include "../math/vecmath.h"
+#include "../scene/light.h"
+#include "../utils/basic_types.h"
+
+#include <limits>
+#include <vector>
+
+class TaskPool;
+
+/// Empty by default
+struct Bounds3 {
+    void
+    extend(const point3 &pos) {
+        for (u32 axis = 0; axis < 3; axis++) {
+            min[axis] = std::min(min[axis], pos[axis]);
+            max[axis] = std::max(max[axis], pos[axis]);
+        }
+    }
+
+    void
+    extend(const Bounds3 &other) {
+        extend(other.min);
+        extend(other.max);
+    }
+
+    point3
+    center() const {
+        return point3((min.x + max.x) * 0.5f, (min.y + max.y) * 0.5f,
+                      (min.z + max.z) * 0.5f);
+    }
+
+    vec3
+    diagonal() const {
+        return max - min;
+    }
+
+    f32
+    surface_area() const {
+        vec3 d = diagonal();
+        return 2.f * (d.x * d.y + d.x * d.z + d.y * d.z);
+    }
+
+    point3 min = point3(std::numeric_limits<f32>::max());
+    point3 max = point3(std::numeric_limits<f32>::lowest());
+};
+
+/// Bounds of the positions, the normals and the power of a set of lights. From
+/// "Importance Sampling of Many Lights with Adaptive Tree Splitting" - Conty Estevez and
+/// Kulla 2018, in the form used by PBRT-v4. Empty by default.
+struct LightBounds {
+    /// Bounds of a single light with the given power
+    static LightBounds
+    make(const Light &light, const Geometry &geom, f32 power);
+
+    static LightBounds
+    merge(const LightBounds &a, const LightBounds &b);
+
+    /// Conservative estimate of the light arriving at pos, a normal of 0 skips the
+    /// cosine at the receiver. 0 only if the lights can't illuminate pos.
+    f32
+    importance(const point3 &pos, const vec3 &normal) const;
+
+    Bounds3 bounds{};
+    /// Axis of the cone of the normals of the lights
+    vec3 axis = vec3(0.f, 0.f, 1.f);
+    f32 power = 0.f;
+    /// Half-angle of the cone of normals
+    f32 cos_theta_o = 1.f;
+    /// Angle from a normal over which light is emitted
+    f32 cos_theta_e = 1.f;
+};
+
+/// Bounding volume hierarchy over the lights for sampling lights according to their
+/// contribution to a shading point. The hierarchy is traversed stochastically, choosing
+/// between the children according to their importance.
+class LightBvh {
+public:
+    LightBvh() = default;
+
+    /// powers are the powers of the lights, lights without power are never sampled.
+    /// The bounds of the lights are computed in parallel if there's a pool.
+    LightBvh(const std::vector<Light> &lights, const Geometry &geom,
+             Span<const f32> powers, TaskPool *pool = nullptr);
+
+    struct Sample {
+        u32 light_id;
+        f32 pdf;
+    };
+
+    Option<Sample>
+    sample(const point3 &pos, const vec3 &normal, f32 sample) const;
+
+    /// Probability of sample() returning the light
+    f32
+    pdf(u32 light_id, const point3 &pos, const vec3 &normal) const;
+
+    u32
+    get_num_nodes() const {
+        return nodes.size();
+    }
+
+private:
+    struct Node {
+        LightBounds bounds;
+        /// The first child of an interior node is the next node, this is the second one
+        u32 index;
+        bool is_leaf;
+    };
+
+    struct BuildLight {
+        u32 light_id;
+        LightBounds bounds;
+    };
+
+    /// Below this depth nodes are split in the middle, so that the bit trails fit into
+    /// 62 bits
+    static constexpr u32 MAX_SAH_DEPTH = 30;
+    static constexpr u64 NOT_IN_BVH = ~0ULL;
+
+    u32
+    build(std::vector<BuildLight> &build_lights, u64 start, u64 end, u64 bit_trail,
+          u32 depth);
+
+    std::vector<Node> nodes{};
+    /// Path from the root to the leaf of each light, bit i is set if the second child
+    /// is taken at depth i
+    std::vector<u64> bit_trails{};
+};
+
+#endif // PT_LIGHT_BVH_H
@@ -1,46 +1,106 @@
-
 #include "light_sampler.h"
 
-LightSampler::LightSampler(const std::vector<Light> &lights, const Geometry &geom) {
+#include "../utils/task_pool.h"
+
+#include <spdlog/spdlog.h>
+
+namespace {
+
+/// Power of a light is a 100-step spectral integration
+constexpr u64 POWER_GRAIN_SIZE = 4096;
+
+} // namespace
+
+LightSampler::LightSampler(const std::vector<Light> &lights, const Geometry &geom,
+                           LightSamplerType type, TaskPool *pool)
+    : type{type} {
     if (lights.empty()) {
         return;
     }
 
     has_lights = true;
 
-    f32 total_power = 0.f;
-    for (auto light : lights) {
-        f32 power = light.power(geom);
-        total_power += power;
+    std::vector<f32> powers(lights.size());
+    auto compute_power = [&](u64 i) { powers[i] = lights[i].power(); };
+    if (pool != nullptr) {
+        pool->parallel_for(lights.size(), POWER_GRAIN_SIZE, compute_power);
+    } else {
+        for (u64 i = 0; i < lights.size(); i++) {
+            compute_power(i);
+        }
     }
 
-    auto pmf = std::vector<f32>();
-    pmf.reserve(lights.size());
+    sampling_dist = AliasTable(powers);
+    if (type == LightSamplerType::Bvh) {
+        bvh = LightBvh(lights, geom, powers, pool);
+        spdlog::info("Light BVH has {} nodes", bvh.get_num_nodes());
+    }
+}
 
-    for (auto light : lights) {
-        f32 prob = light.power(geom) / total_power;
-        pmf.push_back(prob);
+LightSampler::LightSampler(std::vector<f32> &&pmf, const std::vector<Light> &lights,
+                           const Geometry &geom, LightSamplerType type)
+    : type{type} {
+    if (pmf.empty()) {
+        return;
     }
 
-    sampling_dist = PiecewiseDist1D(std::move(pmf));
+    has_lights = true;
+    sampling_dist = AliasTable(pmf);
+
+    // The BVH only needs the relative powers of the lights
+    if (type == LightSamplerType::Bvh) {
+        bvh = LightBvh(lights, geom, sampling_dist.get_pmf());
+    }
 }
 
 Option<LightSample>
-LightSampler::sample(const std::vector<Light> &lights, f32 sample) {
+LightSampler::sample(const point3 &pos, const vec3 &normal, const vec2 &sample) const {
+    if (sample.y < envmap_prob) {
+        return LightSample{
+            .pdf = envmap_prob,
+            .light_id = 0,
+            .is_envmap = true,
+        };
+    }
+
     if (!has_lights) {
         return {};
     }
 
-    u32 light_index = sampling_dist.sample(sample);
-    f32 pdf = sampling_dist.pdf(light_index);
+    // The rest of sample.y is uniform again
+    f32 lights_prob = 1.f - envmap_prob;
+    f32 remapped = std::min((sample.y - envmap_prob) / lights_prob, ONE_MINUS_EPSILON);
+    vec2 lights_sample = vec2(sample.x, remapped);
+
+    u32 light_index = 0;
+    f32 pdf = 0.f;
+    if (type == LightSamplerType::Bvh) {
+        auto bvh_sample = bvh.sample(pos, normal, lights_sample.x);
+        if (!bvh_sample.has_value()) {
+            return {};
+        }
+
+        light_index = bvh_sample->light_id;
+        pdf = bvh_sample->pdf;
+    } else {
+        light_index = sampling_dist.sample(lights_sample);
+        pdf = sampling_dist.pdf(light_index);
+    }
 
     return LightSample{
-        .pdf = pdf,
-        .light = lights[light_index],
+        .pdf = pdf * lights_prob,
+        .light_id = light_index,
+        .is_envmap = false,
     };
 }
 
 f32
-LightSampler::light_sample_pdf(u32 light_id) const {
-    return sampling_dist.pdf(light_id);
+LightSampler::light_sample_pdf(u32 light_id, const point3 &pos,
+                               const vec3 &normal) const {
+    f32 lights_prob = 1.f - envmap_prob;
+    if (type == LightSamplerType::Bvh) {
+        return bvh.pdf(light_id, pos, normal) * lights_prob;
+    }
+
+    return sampling_dist.pdf(light_id) * lights_prob;
 }
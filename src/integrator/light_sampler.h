@@ -2,30 +2,85 @@
 #define PT_LIGHT_SAMPLER_H
 
 #include "../geometry/geometry.h"
-#include "../math/piecewise_dist.h"
+#include "../math/alias_table.h"
 #include "../scene/light.h"
+#include "light_bvh.h"
+
+class TaskPool;
 
 struct LightSample {
     f32 pdf;
-    Light light;
+    /// Index into the lights, unused if the envmap was chosen
+    u32 light_id;
+    bool is_envmap;
+};
+
+enum class LightSamplerType : u8 {
+    /// Lights are chosen according to their power only
+    Power,
+    /// Lights are chosen according to their estimated contribution to the shading
+    /// point, see LightBvh
+    Bvh,
 };
 
 class LightSampler {
 public:
     LightSampler() = default;
-    explicit LightSampler(const std::vector<Light> &lights, const Geometry &geom);
 
-    /// Sample lights according to power
+    /// The powers of the lights are computed in parallel if there's a pool
+    explicit LightSampler(const std::vector<Light> &lights, const Geometry &geom,
+                          LightSamplerType type = LightSamplerType::Power,
+                          TaskPool *pool = nullptr);
+
+    /// Restores a light sampler from the probabilities of the lights, see get_pmf()
+    explicit LightSampler(std::vector<f32> &&pmf, const std::vector<Light> &lights,
+                          const Geometry &geom,
+                          LightSamplerType type = LightSamplerType::Power);
+
+    /// The envmap is chosen with ENVMAP_PROB if there are also lights, the lights with
+    /// the rest of the probability
+    void
+    set_has_envmap(bool has_envmap) {
+        envmap_prob = has_envmap ? (has_lights ? ENVMAP_PROB : 1.f) : 0.f;
+    }
+
+    /// Samples a light or the envmap for illuminating pos, normal is the surface normal
+    /// there
     Option<LightSample>
-    sample(const std::vector<Light> &lights, f32 sample);
+    sample(const point3 &pos, const vec3 &normal, const vec2 &sample) const;
 
-    /// The pdf of a light being sampled
+    /// The pdf of the light being sampled for illuminating pos
     f32
-    light_sample_pdf(u32 light_id) const;
+    light_sample_pdf(u32 light_id, const point3 &pos, const vec3 &normal) const;
+
+    /// The pdf of the envmap being sampled, the same everywhere
+    f32
+    envmap_sample_pdf() const {
+        return envmap_prob;
+    }
+
+    /// Probabilities of the lights according to their power
+    const std::vector<f32> &
+    get_pmf() const {
+        return sampling_dist.get_pmf();
+    }
+
+    LightSamplerType
+    get_type() const {
+        return type;
+    }
 
 private:
+    /// As in the BVH light sampler of PBRT-v4, which splits the probability evenly
+    /// between the infinite lights and the BVH. The power of the envmap isn't comparable
+    /// with the power of the lights without knowing the extent of the scene.
+    static constexpr f32 ENVMAP_PROB = 0.5f;
+
     bool has_lights = false;
-    PiecewiseDist1D sampling_dist;
+    f32 envmap_prob = 0.f;
+    LightSamplerType type = LightSamplerType::Power;
+    AliasTable sampling_dist;
+    LightBvh bvh;
 };
 
 #endif // PT_LIGHT_SAMPLER_H
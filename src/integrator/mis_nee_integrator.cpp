@@ -5,12 +5,110 @@
 #include "integrator.h"
 #include "intersection.h"
 
+void
+Integrator::integrate_pixels(Span<const PixelSample> samples, Span<vec3> results) const {
+    if (integrator_type == IntegratorType::BDPTNEE) {
+        for (u32 i = 0; i < samples.size(); i++) {
+            results[i] = integrate_pixel(samples[i].pixel, samples[i].sample_index);
+        }
+
+        return;
+    }
+
+    uvec2 dim = uvec2(rc->attribs.resx, rc->attribs.resy);
+
+    std::vector<Sampler> samplers(samples.size());
+    std::vector<SampledLambdas> lambdas(samples.size());
+    std::vector<Ray> rays{};
+    rays.reserve(samples.size());
+
+    // Same order of sampler use as in integrate_pixel()
+    for (u32 i = 0; i < samples.size(); i++) {
+        const PixelSample &ps = samples[i];
+        samplers[i].init_frame(ps.pixel, dim, ps.sample_index);
+
+        auto cam_sample = samplers[i].sample2();
+        rays.push_back(gen_ray(ps.pixel.x, ps.pixel.y, dim.x, dim.y, cam_sample, rc->cam,
+                               rc->attribs.camera_to_world));
+
+        lambdas[i] = SampledLambdas::new_sample_uniform(samplers[i].sample());
+    }
+
+    std::vector<Option<HitInfo>> first_hits(samples.size());
+    device->trace_rays(rays, first_hits);
+
+    for (u32 i = 0; i < samples.size(); i++) {
+        spectral radiance =
+            integrator_mis_nee(rays[i], first_hits[i], samplers[i], lambdas[i]);
+        results[i] = lambdas[i].to_xyz(radiance);
+    }
+}
+
 // Multisple Importance Sampling for lights
 spectral
-Integrator::light_mis(const Scene &sc, const Intersection &its, const Ray &traced_ray,
-                      const LightSample &light_sample, const norm_vec3 &geom_normal,
-                      const ShapeSample &shape_sample, const Material *material,
-                      const spectral &throughput, const SampledLambdas &lambdas) const {
+Integrator::light_mis(const Intersection &its, const Ray &traced_ray,
+                      const Material *material, const spectral &throughput,
+                      const SampledLambdas &lambdas, Sampler &sampler) const {
+    spectral radiance = spectral::ZERO();
+
+    Array<ShadowRay, SHADOW_BATCH_SIZE> shadow_rays{};
+    Array<spectral, SHADOW_BATCH_SIZE> contribs{};
+    Array<u8, SHADOW_BATCH_SIZE> visible{};
+
+    for (u32 batch_start = 0; batch_start < light_samples;
+         batch_start += SHADOW_BATCH_SIZE) {
+        u32 batch_size = std::min(SHADOW_BATCH_SIZE, light_samples - batch_start);
+        u32 num_shadow_rays = 0;
+
+        for (u32 i = 0; i < batch_size; i++) {
+            auto shadow_sample =
+                sample_light(its, traced_ray, material, throughput, lambdas, sampler);
+            if (shadow_sample.has_value()) {
+                shadow_rays[num_shadow_rays] = shadow_sample->ray;
+                contribs[num_shadow_rays] = shadow_sample->contrib;
+                num_shadow_rays++;
+            }
+        }
+
+        if (num_shadow_rays == 0) {
+            continue;
+        }
+
+        device->are_visible(Span<const ShadowRay>(shadow_rays.data(), num_shadow_rays),
+                            Span<u8>(visible.data(), num_shadow_rays));
+
+        for (u32 i = 0; i < num_shadow_rays; i++) {
+            if (visible[i]) {
+                radiance += contribs[i];
+            }
+        }
+    }
+
+    return radiance;
+}
+
+Option<ShadowSample>
+Integrator::sample_light(const Intersection &its, const Ray &traced_ray,
+                         const Material *material, const spectral &throughput,
+                         const SampledLambdas &lambdas, Sampler &sampler) const {
+    auto &sc = rc->scene;
+
+    vec2 light_sample = sampler.sample2();
+    auto sampled_light = sc.sample_lights(its.pos, its.normal, light_sample);
+    if (!sampled_light.has_value()) {
+        return {};
+    }
+
+    auto shape_rng = sampler.sample3();
+    if (sampled_light->is_envmap) {
+        return sample_envmap(its, traced_ray, material, throughput, lambdas,
+                             sampled_light->pdf, vec2(shape_rng.x, shape_rng.y),
+                             light_samples);
+    }
+
+    auto shape_sample =
+        sc.sample_light_shape(sampled_light->light_id, its.pos, shape_rng);
+
     point3 light_pos = shape_sample.pos;
     norm_vec3 pl = (light_pos - its.pos).normalized();
     f32 cos_light = vec3::dot(shape_sample.normal, -pl);
@@ -18,57 +116,106 @@ Integrator::light_mis(const Scene &sc, const Intersection &its, const Ray &trace
     auto sgeom_light = ShadingGeometry::make(its.normal, pl, -traced_ray.dir);
 
     // Quickly precheck if light is reachable
-    if (sgeom_light.nowi > 0.f && cos_light > 0.f) {
-        point3 ray_orig = offset_ray(its.pos, geom_normal);
-        if (device->is_visible(ray_orig, light_pos)) {
-            f32 pl_mag_sq = (light_pos - its.pos).length_squared();
-            // Probability of sampling this light in terms of solid angle from the
-            // probability distribution of the lights. Formula from
-            // https://www.pbr-book.org/4ed/Radiometry,_Spectra,_and_Color/Working_with_Radiometric_Integrals#IntegralsoverArea
-            f32 pdf_light = shape_sample.pdf * light_sample.pdf * (pl_mag_sq / cos_light);
+    if (sgeom_light.nowi <= 0.f || cos_light <= 0.f || shape_sample.pdf <= 0.f) {
+        return {};
+    }
 
-            spectral bxdf_light =
-                material->eval(sgeom_light, lambdas, sc.textures.data(), its.uv);
-            f32 mat_pdf = material->pdf(sgeom_light, lambdas);
+    // Probability of sampling this light in terms of solid angle, the shape is already
+    // sampled with respect to solid angle
+    f32 pdf_light = shape_sample.pdf * sampled_light->pdf;
+    spectral emission = sc.lights[sampled_light->light_id].emitter.emission(lambdas);
+
+    return ShadowSample{
+        .ray =
+            ShadowRay{
+                .orig = offset_ray(its.pos, its.geometric_normal),
+                .target = light_pos,
+            },
+        .contrib = light_contrib(sc, its, pdf_light, emission, sgeom_light, material,
+                                 throughput, lambdas, light_samples),
+    };
+}
 
-            f32 weight_light = mis_power_heuristic(pdf_light, mat_pdf);
+Option<ShadowSample>
+Integrator::sample_envmap(const Intersection &its, const Ray &traced_ray,
+                          const Material *material, const spectral &throughput,
+                          const SampledLambdas &lambdas, f32 select_pdf,
+                          const vec2 &sample, u32 num_samples) const {
+    auto &sc = rc->scene;
 
-            spectral light_emission = light_sample.light.emitter.emission(lambdas);
+    auto envmap_sample = sc.envmap.sample(sample, lambdas);
+    auto sgeom_light =
+        ShadingGeometry::make(its.normal, envmap_sample.dir, -traced_ray.dir);
 
-            return bxdf_light * sgeom_light.nowi * (1.f / pdf_light) * light_emission *
-                   weight_light * throughput;
-        }
+    if (sgeom_light.nowi <= 0.f || envmap_sample.pdf <= 0.f) {
+        return {};
     }
 
-    return spectral::ZERO();
+    point3 orig = offset_ray(its.pos, its.geometric_normal);
+
+    return ShadowSample{
+        .ray =
+            ShadowRay{
+                .orig = orig,
+                .target = orig + envmap_sample.dir,
+                .is_infinite = true,
+            },
+        .contrib = light_contrib(sc, its, envmap_sample.pdf * select_pdf,
+                                 envmap_sample.radiance, sgeom_light, material,
+                                 throughput, lambdas, num_samples),
+    };
 }
 
 spectral
-bxdf_mis(const Scene &sc, const spectral &throughput, const point3 &last_hit_pos,
-         f32 last_pdf_bxdf, const Intersection &its, const spectral &emission) {
-    norm_vec3 pl_norm = (its.pos - last_hit_pos).normalized();
-    f32 pl_mag_sq = (its.pos - last_hit_pos).length_squared();
-    f32 cos_light = vec3::dot(its.normal, -pl_norm);
+Integrator::light_contrib(const Scene &sc, const Intersection &its, f32 pdf_light,
+                          const spectral &emission, const ShadingGeometry &sgeom_light,
+                          const Material *material, const spectral &throughput,
+                          const SampledLambdas &lambdas, u32 num_samples) const {
+    spectral bxdf_light = material->eval(sgeom_light, lambdas, sc.textures.data(),
+                                         its.tex_coords);
+    f32 mat_pdf = material->pdf(sgeom_light, lambdas);
+
+    // Power heuristic with num_samples samples from the light distribution
+    f32 samples = static_cast<f32>(num_samples);
+    f32 weight_light = mis_power_heuristic(samples * pdf_light, mat_pdf);
+
+    return bxdf_light * sgeom_light.nowi * (1.f / (pdf_light * samples)) * emission *
+           weight_light * throughput;
+}
 
+spectral
+bxdf_mis(const Scene &sc, const spectral &throughput, const point3 &last_hit_pos,
+         const vec3 &last_hit_normal, f32 last_pdf_bxdf, const Intersection &its,
+         const spectral &emission, u32 num_light_samples) {
     // last_pdf_bxdf is the probability of this light having been sampled
     // from the probability distribution of the BXDF of the *preceding*
     // hit.
 
-    // TODO!!!: currently calculating the shape PDF by assuming pdf = 1. / area
-    //  will have to change with non-uniform sampling !
-    f32 light_area = sc.geometry.shape_area(sc.lights[its.light_id].shape);
-
     // pdf_light is the probability of this point being sampled from the
-    // probability distribution of the lights.
-    f32 pdf_light = sc.light_sampler.light_sample_pdf(its.light_id) * pl_mag_sq /
-                    (light_area * cos_light);
+    // probability distribution of the lights, in terms of solid angle.
+    f32 pdf_light =
+        sc.light_sampler.light_sample_pdf(its.light_id, last_hit_pos, last_hit_normal) *
+        sc.light_shape_pdf(its.light_id, its.triangle_index, last_hit_pos, its.pos);
 
-    f32 bxdf_weight = mis_power_heuristic(last_pdf_bxdf, pdf_light);
+    f32 bxdf_weight = mis_power_heuristic(
+        last_pdf_bxdf, static_cast<f32>(num_light_samples) * pdf_light);
     return throughput * emission * bxdf_weight;
 }
 
 spectral
-Integrator::integrator_mis_nee(Ray ray, Sampler &sampler, const SampledLambdas &lambdas) const {
+envmap_mis(const Scene &sc, const spectral &throughput, const Ray &ray, f32 last_pdf_bxdf,
+           const SampledLambdas &lambdas, u32 num_light_samples) {
+    // Same as bxdf_mis(), the envmap is chosen with the same probability everywhere
+    f32 pdf_light = sc.light_sampler.envmap_sample_pdf() * sc.envmap.pdf(ray.dir);
+
+    f32 num_samples = static_cast<f32>(num_light_samples);
+    f32 bxdf_weight = mis_power_heuristic(last_pdf_bxdf, num_samples * pdf_light);
+    return throughput * sc.envmap.get_ray_radiance(ray, lambdas) * bxdf_weight;
+}
+
+spectral
+Integrator::integrator_mis_nee(Ray ray, Option<HitInfo> first_hit, Sampler &sampler,
+                               const SampledLambdas &lambdas) const {
     auto &sc = rc->scene;
     auto &lights = rc->scene.lights;
     auto &materials = rc->scene.materials;
@@ -81,23 +228,33 @@ Integrator::integrator_mis_nee(Ray ray, Sampler &sampler, const SampledLambdas &
     f32 last_pdf_bxdf = 0.f;
     bool last_hit_specular = false;
     point3 last_hit_pos(0.f);
+    vec3 last_hit_normal(0.f);
+    RayCone cone = camera_ray_cone();
 
     while (true) {
-        auto opt_its = device->cast_ray(ray);
-        if (!opt_its.has_value()) {
-            if (!sc.has_envmap) {
-                break;
-            } else {
-                const Envmap *envmap = &sc.envmap;
-                spectral envrad = envmap->get_ray_radiance(ray, lambdas);
-
-                // TODO: do envmap sampling...
-                radiance += envrad;
-                break;
+        auto opt_hit = depth == 1 ? first_hit : device->trace_ray(ray);
+        if (!opt_hit.has_value()) {
+            if (sc.has_envmap) {
+                if (integrator_type == IntegratorType::Naive || depth == 1 ||
+                    last_hit_specular) {
+                    radiance += throughput * sc.envmap.get_ray_radiance(ray, lambdas);
+                } else {
+                    radiance += envmap_mis(sc, throughput, ray, last_pdf_bxdf, lambdas,
+                                           light_samples);
+                }
             }
+
+            break;
         }
 
-        auto its = opt_its.value();
+        // The last bounce only contributes emission, which most hits don't have
+        bool is_last_bounce = max_depth > 0 && depth >= max_depth;
+        if (is_last_bounce && !device->hit_has_light(opt_hit.value())) {
+            break;
+        }
+
+        auto its = device->resolve_hit(opt_hit.value(), ray);
+        cone.propagate(its, ray.dir, opt_hit.value().t);
 
         auto bsdf_sample_rand = sampler.sample3();
         auto rr_sample = sampler.sample();
@@ -123,37 +280,26 @@ Integrator::integrator_mis_nee(Ray ray, Sampler &sampler, const SampledLambdas &
                 radiance += throughput * emission;
             } else {
                 auto bxdf_mis_contrib =
-                    bxdf_mis(sc, throughput, last_hit_pos, last_pdf_bxdf, its, emission);
+                    bxdf_mis(sc, throughput, last_hit_pos, last_hit_normal, last_pdf_bxdf,
+                             its, emission, light_samples);
 
                 radiance += bxdf_mis_contrib;
             }
         }
 
         // Do this before light sampling, because that "extends the path"
-        if (max_depth > 0 && depth >= max_depth) {
+        if (is_last_bounce) {
             break;
         }
 
         last_hit_specular = material->is_dirac_delta();
         if (integrator_type != IntegratorType::Naive && !last_hit_specular) {
-            f32 light_sample = sampler.sample();
-            auto sampled_light = sc.sample_lights(light_sample);
-            if (sampled_light.has_value()) {
-                auto shape_rng = sampler.sample3();
-                auto shape_sample = sc.geometry.sample_shape(
-                    sampled_light.value().light.shape, its.pos, shape_rng);
-
-                auto light_mis_contrib =
-                    light_mis(sc, its, ray, sampled_light.value(), its.geometric_normal,
-                              shape_sample, material, throughput, lambdas);
-
-                radiance += light_mis_contrib;
-            }
+            radiance += light_mis(its, ray, material, throughput, lambdas, sampler);
         }
 
         auto bsdf_sample_opt =
             material->sample(its.normal, -ray.dir, bsdf_sample_rand, lambdas,
-                             textures.data(), its.uv, is_frontfacing);
+                             textures.data(), its.tex_coords, is_frontfacing);
 
         if (!bsdf_sample_opt.has_value()) {
             break;
@@ -177,6 +323,7 @@ Integrator::integrator_mis_nee(Ray ray, Sampler &sampler, const SampledLambdas &
 
         ray = bxdf_ray;
         last_hit_pos = its.pos;
+        last_hit_normal = its.normal;
         last_pdf_bxdf = bsdf_sample.pdf;
         depth++;
 
@@ -0,0 +1,131 @@
+#include "../scene/scene.h"
+#include "light_bvh.h"
+
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/matchers/catch_matchers_floating_point.hpp>
+
+#include <random>
+#include <vector>
+
+namespace {
+
+/// Emissive quads facing +z scattered over a plane, an emissive sphere and a quad facing
+/// -z above them
+struct LightGrid {
+    LightGrid() {
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<f32> dist(0.f, 1.f);
+
+        auto add_quad = [&](const point3 &corner, f32 size, bool flipped, f32 radiance) {
+            std::vector<u32> indices = flipped ? std::vector<u32>{0, 2, 1, 0, 3, 2}
+                                               : std::vector<u32>{0, 1, 2, 0, 2, 3};
+            std::vector<point3> pos = {corner, corner + vec3(size, 0.f, 0.f),
+                                       corner + vec3(size, size, 0.f),
+                                       corner + vec3(0.f, size, 0.f)};
+
+            auto emission =
+                RgbSpectrumIlluminant::make(tuple3(radiance), ColorSpace::sRGB);
+            sc.add_mesh(MeshParams{
+                .indices = &indices,
+                .pos = &pos,
+                .material_id = 0,
+                .emitter = Emitter(emission),
+            });
+        };
+
+        for (u32 i = 0; i < 64; i++) {
+            add_quad(point3(dist(rng) * 20.f, dist(rng) * 20.f, 0.f),
+                     0.1f + dist(rng) * 0.5f, false, 0.5f + dist(rng) * 5.f);
+        }
+
+        add_quad(point3(5.f, 5.f, 10.f), 2.f, true, 3.f);
+
+        auto sphere_emission =
+            RgbSpectrumIlluminant::make(tuple3(10.f), ColorSpace::sRGB);
+        sc.add_sphere(SphereParams{
+            .center = point3(10.f, 10.f, 5.f),
+            .radius = 0.5f,
+            .material_id = 0,
+            .emitter = Emitter(sphere_emission),
+        });
+
+        std::vector<f32> powers{};
+        for (const auto &light : sc.lights) {
+            powers.push_back(light.power());
+        }
+
+        bvh = LightBvh(sc.lights, sc.geometry, powers);
+    }
+
+    Scene sc{};
+    LightBvh bvh{};
+};
+
+} // namespace
+
+TEST_CASE("Light BVH pdfs sum to one", "[light_bvh]") {
+    LightGrid grid{};
+    REQUIRE(grid.sc.lights.size() == 66);
+    REQUIRE(grid.bvh.get_num_nodes() == 2 * grid.sc.lights.size() - 1);
+
+    const Array<point3, 3> positions = {point3(3.f, 4.f, 1.f), point3(10.f, 10.f, 7.f),
+                                        point3(-5.f, 30.f, 0.5f)};
+    const Array<vec3, 3> normals = {vec3(0.f), vec3(0.f, 0.f, 1.f),
+                                    vec3(0.f, 0.6f, 0.8f)};
+
+    for (const auto &pos : positions) {
+        for (const auto &normal : normals) {
+            f64 sum = 0.;
+            for (u32 i = 0; i < grid.sc.lights.size(); i++) {
+                sum += grid.bvh.pdf(i, pos, normal);
+            }
+            REQUIRE_THAT(sum, Catch::Matchers::WithinAbs(1., 1e-5));
+        }
+    }
+}
+
+TEST_CASE("Light BVH samples match the pdf", "[light_bvh]") {
+    LightGrid grid{};
+    auto pos = point3(8.f, 12.f, 2.f);
+    auto normal = vec3(0.f, 0.f, 1.f);
+
+    constexpr u32 NUM_SAMPLES = 100000;
+    std::vector<f64> frequencies(grid.sc.lights.size(), 0.);
+    for (u32 i = 0; i < NUM_SAMPLES; i++) {
+        f32 sample = (static_cast<f32>(i) + 0.5f) / static_cast<f32>(NUM_SAMPLES);
+        auto light_sample = grid.bvh.sample(pos, normal, sample);
+        REQUIRE(light_sample.has_value());
+
+        auto pdf = grid.bvh.pdf(light_sample->light_id, pos, normal);
+        REQUIRE_THAT(light_sample->pdf, Catch::Matchers::WithinRel(pdf, 1e-5f));
+        frequencies[light_sample->light_id] += 1. / NUM_SAMPLES;
+    }
+
+    for (u32 i = 0; i < grid.sc.lights.size(); i++) {
+        REQUIRE_THAT(frequencies[i],
+                     Catch::Matchers::WithinAbs(grid.bvh.pdf(i, pos, normal), 1e-3));
+    }
+}
+
+TEST_CASE("Light BVH doesn't sample lights facing away", "[light_bvh]") {
+    LightGrid grid{};
+
+    // Below the quads on the plane, only the sphere and the quad facing -z can
+    // illuminate the point
+    auto pos = point3(10.f, 10.f, -1.f);
+    auto normal = vec3(0.f);
+    u32 sphere_id = grid.sc.lights.size() - 1;
+
+    for (u32 i = 0; i < grid.sc.lights.size(); i++) {
+        f32 pdf = grid.bvh.pdf(i, pos, normal);
+        if (i + 2 > sphere_id) {
+            REQUIRE(pdf > 0.f);
+        } else {
+            REQUIRE(pdf == 0.f);
+        }
+    }
+
+    // Above the quad facing -z, nothing on the plane is visible to it
+    auto above = point3(6.f, 6.f, 12.f);
+    REQUIRE(grid.bvh.pdf(sphere_id - 1, above, normal) == 0.f);
+}
@@ -0,0 +1,346 @@
+#include "wavefront_integrator.h"
+
+#include "utils.h"
+
+#include <algorithm>
+
+#include <embree4/rtcore.h>
+
+WavefrontIntegrator::WavefrontIntegrator(const Integrator *integrator)
+    : integrator{integrator}, rc{integrator->rc}, device{integrator->device} {
+    path_jobs.resize(POOL_SIZE, nullptr);
+    sample_ids.resize(POOL_SIZE, 0);
+    samplers.resize(POOL_SIZE);
+    lambdas.resize(POOL_SIZE);
+    throughputs.resize(POOL_SIZE);
+    radiances.resize(POOL_SIZE);
+    ray_origs.resize(POOL_SIZE, point3(0.f));
+    ray_dirs.resize(POOL_SIZE, norm_vec3(0.f, 0.f, 1.f));
+    last_hit_positions.resize(POOL_SIZE, point3(0.f));
+    last_hit_normals.resize(POOL_SIZE, vec3(0.f));
+    last_pdfs_bxdf.resize(POOL_SIZE, 0.f);
+    depths.resize(POOL_SIZE, 0);
+    last_hits_specular.resize(POOL_SIZE, 0);
+    ray_cones.resize(POOL_SIZE);
+
+    hit_geom_ids.resize(POOL_SIZE, RTC_INVALID_GEOMETRY_ID);
+    hit_prim_ids.resize(POOL_SIZE, 0);
+    hit_inst_ids.resize(POOL_SIZE, RTC_INVALID_GEOMETRY_ID);
+    hit_barys.resize(POOL_SIZE, vec2(0.f));
+    hit_ts.resize(POOL_SIZE, 0.f);
+    intersections.resize(POOL_SIZE, Intersection::make_empty());
+    queue_rays.reserve(POOL_SIZE);
+    queue_hits.reserve(POOL_SIZE);
+
+    u32 max_shadow_rays = POOL_SIZE * integrator->light_samples;
+    shadow_paths.reserve(max_shadow_rays);
+    shadow_rays.reserve(max_shadow_rays);
+    shadow_contribs.reserve(max_shadow_rays);
+    shadow_visible.reserve(max_shadow_rays);
+
+    free_paths.reserve(POOL_SIZE);
+    active_paths.reserve(POOL_SIZE);
+    next_active_paths.reserve(POOL_SIZE);
+    shade_queue.reserve(POOL_SIZE);
+    finished_paths.reserve(POOL_SIZE);
+}
+
+void
+WavefrontIntegrator::render(const NextJob &next_job, const JobDone &job_done) {
+    current_job = nullptr;
+    out_of_jobs = false;
+
+    free_paths.clear();
+    for (u32 i = POOL_SIZE; i > 0; i--) {
+        free_paths.push_back(i - 1);
+    }
+    active_paths.clear();
+
+    while (true) {
+        generate(next_job, job_done);
+        if (active_paths.empty()) {
+            break;
+        }
+
+        intersect();
+        shade();
+        trace_shadow_rays();
+        accumulate(job_done);
+    }
+}
+
+void
+WavefrontIntegrator::generate(const NextJob &next_job, const JobDone &job_done) {
+    uvec2 dim = uvec2(rc->attribs.resx, rc->attribs.resy);
+
+    while (!free_paths.empty() && !out_of_jobs) {
+        if (current_job == nullptr ||
+            current_job->next_sample == current_job->samples.size()) {
+            current_job = next_job();
+            if (current_job == nullptr) {
+                out_of_jobs = true;
+            } else if (current_job->samples.empty()) {
+                // Converged tiles don't get any samples
+                job_done(*current_job);
+                current_job = nullptr;
+            }
+
+            continue;
+        }
+
+        u32 p = free_paths.back();
+        free_paths.pop_back();
+
+        const PixelSample &ps = current_job->samples[current_job->next_sample];
+        path_jobs[p] = current_job;
+        sample_ids[p] = current_job->next_sample;
+        current_job->next_sample++;
+
+        Sampler &sampler = samplers[p];
+        sampler.init_frame(ps.pixel, dim, ps.sample_index);
+
+        auto cam_sample = sampler.sample2();
+        Ray ray = Integrator::gen_ray(ps.pixel.x, ps.pixel.y, dim.x, dim.y, cam_sample,
+                                      rc->cam, rc->attribs.camera_to_world);
+
+        lambdas[p] = SampledLambdas::new_sample_uniform(sampler.sample());
+        throughputs[p] = spectral::ONE();
+        radiances[p] = spectral::ZERO();
+        ray_origs[p] = ray.o;
+        ray_dirs[p] = ray.dir;
+        last_hit_positions[p] = point3(0.f);
+        last_hit_normals[p] = vec3(0.f);
+        last_pdfs_bxdf[p] = 0.f;
+        depths[p] = 1;
+        last_hits_specular[p] = false;
+        ray_cones[p] = integrator->camera_ray_cone();
+
+        active_paths.push_back(p);
+    }
+}
+
+void
+WavefrontIntegrator::intersect() {
+    queue_rays.clear();
+    for (u32 p : active_paths) {
+        queue_rays.push_back(Ray(ray_origs[p], ray_dirs[p]));
+    }
+
+    // The device traces packets as wide as the CPU supports natively, or single rays
+    queue_hits.resize(active_paths.size());
+    device->trace_rays(queue_rays, queue_hits);
+
+    for (u32 i = 0; i < active_paths.size(); i++) {
+        u32 p = active_paths[i];
+        if (!queue_hits[i].has_value()) {
+            hit_geom_ids[p] = RTC_INVALID_GEOMETRY_ID;
+            continue;
+        }
+
+        const HitInfo &hit = queue_hits[i].value();
+        hit_geom_ids[p] = hit.geom_id;
+        hit_prim_ids[p] = hit.prim_id;
+        hit_inst_ids[p] = hit.inst_id;
+        hit_barys[p] = hit.bary;
+        hit_ts[p] = hit.t;
+    }
+}
+
+void
+WavefrontIntegrator::shade() {
+    auto &sc = rc->scene;
+    auto &lights = sc.lights;
+    auto &materials = sc.materials;
+    auto &textures = sc.textures;
+    auto max_depth = rc->attribs.max_depth;
+
+    next_active_paths.clear();
+    shadow_paths.clear();
+    shadow_rays.clear();
+    shadow_contribs.clear();
+    finished_paths.clear();
+    shade_queue.clear();
+
+    // Misses are handled right away, hits are shaded grouped by material type
+    constexpr u32 num_material_types = static_cast<u32>(MaterialType::Dielectric) + 1;
+    u32 type_counts[num_material_types + 1]{};
+
+    for (u32 p : active_paths) {
+        if (hit_geom_ids[p] == RTC_INVALID_GEOMETRY_ID) {
+            if (sc.has_envmap) {
+                Ray ray(ray_origs[p], ray_dirs[p]);
+                if (depths[p] == 1 || last_hits_specular[p]) {
+                    radiances[p] +=
+                        throughputs[p] * sc.envmap.get_ray_radiance(ray, lambdas[p]);
+                } else {
+                    radiances[p] += envmap_mis(sc, throughputs[p], ray, last_pdfs_bxdf[p],
+                                               lambdas[p], integrator->light_samples);
+                }
+            }
+
+            finished_paths.push_back(p);
+            continue;
+        }
+
+        // The last bounce only contributes emission, which most hits don't have
+        if (max_depth > 0 && depths[p] >= max_depth &&
+            !device->hit_has_light(hit_geom_ids[p], hit_prim_ids[p], hit_inst_ids[p])) {
+            finished_paths.push_back(p);
+            continue;
+        }
+
+        point3 pos = ray_origs[p] + hit_ts[p] * ray_dirs[p];
+        intersections[p] = device->resolve_hit(hit_geom_ids[p], hit_prim_ids[p],
+                                               hit_barys[p], pos, hit_inst_ids[p]);
+        ray_cones[p].propagate(intersections[p], ray_dirs[p], hit_ts[p]);
+
+        auto type = materials[intersections[p].material_id].type;
+        type_counts[static_cast<u32>(type) + 1]++;
+        shade_queue.push_back(p);
+    }
+
+    // Counting sort of the hits by material type
+    for (u32 t = 1; t <= num_material_types; t++) {
+        type_counts[t] += type_counts[t - 1];
+    }
+
+    next_active_paths.resize(shade_queue.size());
+    for (u32 p : shade_queue) {
+        auto type = materials[intersections[p].material_id].type;
+        next_active_paths[type_counts[static_cast<u32>(type)]++] = p;
+    }
+
+    std::swap(shade_queue, next_active_paths);
+    next_active_paths.clear();
+
+    for (u32 p : shade_queue) {
+        Sampler &sampler = samplers[p];
+        Intersection &its = intersections[p];
+        Ray ray(ray_origs[p], ray_dirs[p]);
+        u32 depth = depths[p];
+
+        auto bsdf_sample_rand = sampler.sample3();
+        auto rr_sample = sampler.sample();
+
+        auto material = &materials[its.material_id];
+        bool is_frontfacing = vec3::dot(-ray.dir, its.normal) >= 0.f;
+
+        if (!is_frontfacing && !material->is_twosided) {
+            finished_paths.push_back(p);
+            continue;
+        }
+
+        if (!is_frontfacing) {
+            its.normal = -its.normal;
+            its.geometric_normal = -its.geometric_normal;
+        }
+
+        if (its.has_light && is_frontfacing) {
+            spectral emission = lights[its.light_id].emitter.emission(lambdas[p]);
+
+            if (depth == 1 || last_hits_specular[p]) {
+                radiances[p] += throughputs[p] * emission;
+            } else {
+                radiances[p] +=
+                    bxdf_mis(sc, throughputs[p], last_hit_positions[p],
+                             last_hit_normals[p], last_pdfs_bxdf[p], its, emission,
+                             integrator->light_samples);
+            }
+        }
+
+        if (max_depth > 0 && depth >= max_depth) {
+            finished_paths.push_back(p);
+            continue;
+        }
+
+        last_hits_specular[p] = material->is_dirac_delta();
+        for (u32 i = 0; i < integrator->light_samples && !last_hits_specular[p]; i++) {
+            auto shadow_sample = integrator->sample_light(
+                its, ray, material, throughputs[p], lambdas[p], sampler);
+
+            // The visibility is tested for all paths at once in the shadow stage
+            if (shadow_sample.has_value()) {
+                shadow_paths.push_back(p);
+                shadow_rays.push_back(shadow_sample->ray);
+                shadow_contribs.push_back(shadow_sample->contrib);
+            }
+        }
+
+        auto bsdf_sample_opt =
+            material->sample(its.normal, -ray.dir, bsdf_sample_rand, lambdas[p],
+                             textures.data(), its.tex_coords, is_frontfacing);
+
+        if (!bsdf_sample_opt.has_value()) {
+            finished_paths.push_back(p);
+            continue;
+        }
+        auto bsdf_sample = bsdf_sample_opt.value();
+
+        auto sgeom_bxdf = ShadingGeometry::make(its.normal, bsdf_sample.wi, -ray.dir);
+
+        auto spawn_ray_normal =
+            (bsdf_sample.did_refract) ? -its.geometric_normal : its.geometric_normal;
+        Ray bxdf_ray = spawn_ray(its.pos, spawn_ray_normal, bsdf_sample.wi);
+
+        auto rr = russian_roulette(depth, rr_sample, throughputs[p]);
+        if (!rr.has_value()) {
+            finished_paths.push_back(p);
+            continue;
+        }
+
+        auto roulette_compensation = rr.value();
+        throughputs[p] *= bsdf_sample.bsdf * sgeom_bxdf.cos_theta *
+                          (1.f / (bsdf_sample.pdf * roulette_compensation));
+
+        ray_origs[p] = bxdf_ray.o;
+        ray_dirs[p] = bxdf_ray.dir;
+        last_hit_positions[p] = its.pos;
+        last_hit_normals[p] = its.normal;
+        last_pdfs_bxdf[p] = bsdf_sample.pdf;
+        depths[p] = depth + 1;
+
+        if (depths[p] == 1024) {
+            // FIXME: specular infinite path caused by self-intersections
+            finished_paths.push_back(p);
+            continue;
+        }
+
+        next_active_paths.push_back(p);
+    }
+
+    std::swap(active_paths, next_active_paths);
+}
+
+void
+WavefrontIntegrator::trace_shadow_rays() {
+    if (shadow_rays.empty()) {
+        return;
+    }
+
+    shadow_visible.resize(shadow_rays.size());
+    device->are_visible(shadow_rays, shadow_visible);
+
+    for (u32 i = 0; i < shadow_rays.size(); i++) {
+        if (shadow_visible[i]) {
+            radiances[shadow_paths[i]] += shadow_contribs[i];
+        }
+    }
+}
+
+void
+WavefrontIntegrator::accumulate(const JobDone &job_done) {
+    for (u32 p : finished_paths) {
+        WavefrontJob &job = *path_jobs[p];
+        job.results[sample_ids[p]] = lambdas[p].to_xyz(radiances[p]);
+        free_paths.push_back(p);
+
+        job.samples_left--;
+        if (job.samples_left == 0) {
+            if (&job == current_job) {
+                current_job = nullptr;
+            }
+
+            job_done(job);
+        }
+    }
+}
@@ -0,0 +1,125 @@
+#ifndef PT_WAVEFRONT_INTEGRATOR_H
+#define PT_WAVEFRONT_INTEGRATOR_H
+
+#include "../color/sampled_spectrum.h"
+#include "../math/vecmath.h"
+#include "../utils/basic_types.h"
+#include "../utils/sampler.h"
+#include "integrator.h"
+#include "intersection.h"
+
+#include <functional>
+#include <vector>
+
+/// Samples of one tile job. The integrator writes the XYZ radiance of each sample to
+/// results, the job is done once samples_left drops to 0.
+struct WavefrontJob {
+    std::vector<PixelSample> samples{};
+    std::vector<vec3> results{};
+    u32 next_sample = 0;
+    u32 samples_left = 0;
+};
+
+/// Traces many paths at once in stages: generate, intersect, shade, shadow test and
+/// accumulate. The state of the paths is stored in SoA arrays and the stages run over
+/// queues of path indices, so that Embree gets packets of rays and the paths are shaded
+/// sorted by their material type.
+///
+/// The pool is refilled with the samples of the next job as soon as paths of the current
+/// one finish, so it stays full across jobs and only drains at the end of a batch.
+///
+/// Embree 4 doesn't have the stream API anymore, rays are traced in packets of
+/// EmbreeDevice::trace_rays().
+///
+/// Computes the same estimator as the MIS NEE integrator. Each render thread has its own
+/// instance.
+class WavefrontIntegrator {
+public:
+    static constexpr u32 POOL_SIZE = 1024;
+
+    /// Returns the next job, or nullptr when there are none left
+    using NextJob = std::function<WavefrontJob *()>;
+    /// Called once every sample of the job has its result
+    using JobDone = std::function<void(WavefrontJob &)>;
+
+    explicit WavefrontIntegrator(const Integrator *integrator);
+
+    /// Renders jobs until next_job runs out of them and all paths have finished
+    void
+    render(const NextJob &next_job, const JobDone &job_done);
+
+private:
+    /// Starts paths for the next samples in the free slots of the pool, takes new jobs
+    /// when the current one has no samples left
+    void
+    generate(const NextJob &next_job, const JobDone &job_done);
+
+    void
+    intersect();
+
+    void
+    shade();
+
+    void
+    trace_shadow_rays();
+
+    void
+    accumulate(const JobDone &job_done);
+
+    const Integrator *integrator;
+    RenderContext *rc;
+    EmbreeDevice *device;
+
+    WavefrontJob *current_job = nullptr;
+    bool out_of_jobs = false;
+
+    /*
+     * Path state
+     * */
+    std::vector<WavefrontJob *> path_jobs{};
+    std::vector<u32> sample_ids{};
+    std::vector<Sampler> samplers{};
+    std::vector<SampledLambdas> lambdas{};
+    std::vector<spectral> throughputs{};
+    std::vector<spectral> radiances{};
+    std::vector<point3> ray_origs{};
+    std::vector<norm_vec3> ray_dirs{};
+    std::vector<point3> last_hit_positions{};
+    std::vector<vec3> last_hit_normals{};
+    std::vector<f32> last_pdfs_bxdf{};
+    std::vector<u32> depths{};
+    std::vector<u8> last_hits_specular{};
+    std::vector<RayCone> ray_cones{};
+
+    /*
+     * Results of the intersect stage
+     * */
+    std::vector<u32> hit_geom_ids{};
+    std::vector<u32> hit_prim_ids{};
+    std::vector<u32> hit_inst_ids{};
+    std::vector<vec2> hit_barys{};
+    std::vector<f32> hit_ts{};
+    std::vector<Intersection> intersections{};
+    /// Rays and hits of the active paths in queue order
+    std::vector<Ray> queue_rays{};
+    std::vector<Option<HitInfo>> queue_hits{};
+
+    /*
+     * Shadow rays of the current bounce, a path has one for each light sample
+     * */
+    std::vector<u32> shadow_paths{};
+    std::vector<ShadowRay> shadow_rays{};
+    std::vector<spectral> shadow_contribs{};
+    std::vector<u8> shadow_visible{};
+
+    /*
+     * Queues of path indices
+     * */
+    std::vector<u32> free_paths{};
+    std::vector<u32> active_paths{};
+    std::vector<u32> next_active_paths{};
+    std::vector<u32> shade_queue{};
+    std::vector<u32> finished_paths{};
+};
+
+#endif // PT_WAVEFRONT_INTEGRATOR_H
@@ -0,0 +1,243 @@
+#include "image_writer.h"
+
+#include "../color/color_space.h"
+#include "../math/vecmath.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include <spdlog/spdlog.h>
+#include <tinyexr.h>
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+void
+FramebufferSnapshot::copy_from(const Framebuffer &fb) {
+    width = fb.get_res_x();
+    height = fb.get_res_y();
+    pixels.resize(static_cast<size_t>(width) * height,
+                  FramebufferPixel{.xyz = vec3(0.f), .num_samples = 0});
+
+    for (u32 y = 0; y < height; y++) {
+        const FramebufferPixel *row = fb.get_row(y);
+        std::copy(row, row + width, pixels.begin() + static_cast<size_t>(y) * width);
+    }
+}
+
+namespace ImageWriter {
+
+void
+convert_snapshot(const FramebufferSnapshot &snapshot, ImagePlanes &planes,
+                 u32 num_threads) {
+    planes.width = snapshot.width;
+    planes.height = snapshot.height;
+
+    size_t num_pixels = snapshot.pixels.size();
+    planes.r.resize(num_pixels);
+    planes.g.resize(num_pixels);
+    planes.b.resize(num_pixels);
+    planes.samples.resize(num_pixels);
+
+    auto convert_rows = [&](u32 row_start, u32 row_end) {
+        for (size_t i = static_cast<size_t>(row_start) * snapshot.width;
+             i < static_cast<size_t>(row_end) * snapshot.width; i++) {
+            const FramebufferPixel &pixel = snapshot.pixels[i];
+
+            vec3 xyz = vec3(0.f);
+            if (pixel.num_samples > 0) {
+                xyz = pixel.xyz / static_cast<f32>(pixel.num_samples);
+            }
+            tuple3 rgb = xyz_to_srgb(tuple3(xyz.x, xyz.y, xyz.z));
+
+            planes.r[i] = rgb.x;
+            planes.g[i] = rgb.y;
+            planes.b[i] = rgb.z;
+            planes.samples[i] = static_cast<f32>(pixel.num_samples);
+        }
+    };
+
+    num_threads = std::clamp(num_threads, 1U, std::max(snapshot.height, 1U));
+
+    std::vector<std::jthread> threads{};
+    for (u32 t = 1; t < num_threads; t++) {
+        u32 row_start = static_cast<u64>(snapshot.height) * t / num_threads;
+        u32 row_end = static_cast<u64>(snapshot.height) * (t + 1) / num_threads;
+        threads.emplace_back(convert_rows, row_start, row_end);
+    }
+
+    convert_rows(0, snapshot.height / num_threads);
+}
+
+void
+write_exr(const std::string &filename, const ImagePlanes &planes) {
+    EXRHeader header;
+    InitEXRHeader(&header);
+
+    EXRImage image;
+    InitEXRImage(&image);
+
+    image.num_channels = 4;
+
+    // Must be BGR(A) order, since most of EXR viewers expect this channel order.
+    // Channels are sorted by name, the sample count AOV comes after the color.
+    const f32 *image_ptr[4];
+    image_ptr[0] = planes.b.data();
+    image_ptr[1] = planes.g.data();
+    image_ptr[2] = planes.r.data();
+    image_ptr[3] = planes.samples.data();
+    const char *channel_names[4] = {"B", "G", "R", "samples"};
+
+    image.images = (unsigned char **)image_ptr;
+    image.width = planes.width;
+    image.height = planes.height;
+
+    header.num_channels = 4;
+    header.channels =
+        (EXRChannelInfo *)malloc(sizeof(EXRChannelInfo) * header.num_channels);
+    for (int i = 0; i < header.num_channels; i++) {
+        strncpy(header.channels[i].name, channel_names[i], 255);
+        header.channels[i].name[strlen(channel_names[i])] = '\0';
+    }
+
+    header.pixel_types = (int *)malloc(sizeof(int) * header.num_channels);
+    header.requested_pixel_types = (int *)malloc(sizeof(int) * header.num_channels);
+    for (int i = 0; i < header.num_channels; i++) {
+        header.pixel_types[i] = TINYEXR_PIXELTYPE_FLOAT; // pixel type of input image
+        header.requested_pixel_types[i] =
+            TINYEXR_PIXELTYPE_FLOAT; // pixel type of output image to be stored in .EXR
+    }
+
+    const char *err;
+    int ret = SaveEXRImageToFile(&image, &header, filename.c_str(), &err);
+    if (ret != TINYEXR_SUCCESS) {
+        spdlog::error("Error when saving output image file: {}\n", err);
+        FreeEXRErrorMessage(err);
+    }
+
+    free(header.channels);
+    free(header.pixel_types);
+    free(header.requested_pixel_types);
+}
+
+static u8
+to_srgb8(f32 linear) {
+    // Reinhard
+    f32 v = std::max(linear, 0.f);
+    v = v / (1.f + v);
+
+    if (v <= 0.0031308f) {
+        v = 12.92f * v;
+    } else {
+        v = 1.055f * std::pow(v, 1.f / 2.4f) - 0.055f;
+    }
+
+    return static_cast<u8>(std::clamp(v * 255.f + 0.5f, 0.f, 255.f));
+}
+
+void
+write_png_preview(const std::string &filename, const ImagePlanes &planes) {
+    std::vector<u8> rgb(static_cast<size_t>(planes.width) * planes.height * 3);
+    for (size_t i = 0; i < planes.r.size(); i++) {
+        rgb[i * 3 + 0] = to_srgb8(planes.r[i]);
+        rgb[i * 3 + 1] = to_srgb8(planes.g[i]);
+        rgb[i * 3 + 2] = to_srgb8(planes.b[i]);
+    }
+
+    int ret = stbi_write_png(filename.c_str(), planes.width, planes.height, 3, rgb.data(),
+                             planes.width * 3);
+    if (ret == 0) {
+        spdlog::error("Error when saving preview image file '{}'", filename);
+    }
+}
+
+} // namespace ImageWriter
+
+AsyncImageWriter::AsyncImageWriter(std::string exr_filename, std::string png_filename,
+                                   u32 num_convert_threads)
+    : exr_filename(std::move(exr_filename)), png_filename(std::move(png_filename)),
+      num_convert_threads{num_convert_threads} {
+    writer_thread =
+        std::jthread([this](std::stop_token stop_token) { writer_loop(stop_token); });
+}
+
+AsyncImageWriter::~AsyncImageWriter() {
+    flush();
+    writer_thread.request_stop();
+    writer_thread.join();
+}
+
+void
+AsyncImageWriter::write(const Framebuffer &fb) {
+    u32 target;
+    {
+        std::unique_lock lock(mutex);
+        // Back-pressure, only one write can wait
+        queue_changed.wait(lock, [this] { return !pending.has_value(); });
+
+        target = writing.has_value() ? 1 - writing.value() : 0;
+    }
+
+    // The writer thread only touches the snapshot once it's pending
+    snapshots[target].copy_from(fb);
+
+    {
+        std::lock_guard lock(mutex);
+        pending = target;
+    }
+
+    queue_changed.notify_all();
+}
+
+void
+AsyncImageWriter::flush() {
+    std::unique_lock lock(mutex);
+    queue_changed.wait(lock,
+                       [this] { return !pending.has_value() && !writing.has_value(); });
+}
+
+std::chrono::duration<f64>
+AsyncImageWriter::last_write_duration() {
+    std::lock_guard lock(mutex);
+    return last_duration;
+}
+
+void
+AsyncImageWriter::writer_loop(std::stop_token stop_token) {
+    while (true) {
+        u32 index;
+        {
+            std::unique_lock lock(mutex);
+            queue_changed.wait(lock, stop_token, [this] { return pending.has_value(); });
+
+            if (!pending.has_value()) {
+                // Stop was requested and there's nothing left to write
+                return;
+            }
+
+            index = pending.value();
+            pending.reset();
+            writing = index;
+        }
+
+        queue_changed.notify_all();
+
+        const auto write_start = std::chrono::steady_clock::now();
+        ImageWriter::convert_snapshot(snapshots[index], planes, num_convert_threads);
+        ImageWriter::write_exr(exr_filename, planes);
+        if (!png_filename.empty()) {
+            ImageWriter::write_png_preview(png_filename, planes);
+        }
+
+        const auto write_end = std::chrono::steady_clock::now();
+
+        {
+            std::lock_guard lock(mutex);
+            writing.reset();
+            last_duration = write_end - write_start;
+        }
+
+        queue_changed.notify_all();
+    }
+}
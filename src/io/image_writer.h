@@ -1,86 +1,107 @@
 #ifndef PT_IMAGE_WRITER_H
 #define PT_IMAGE_WRITER_H
 
-#include "../color/color_space.h"
 #include "../framebuffer.h"
-#include "../math/vecmath.h"
 #include "../utils/basic_types.h"
 
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 
-#include <spdlog/spdlog.h>
-#include <tinyexr.h>
+/// Raw copy of the framebuffer, taken while the render threads are between batches.
+struct FramebufferSnapshot {
+    void
+    copy_from(const Framebuffer &fb);
+
+    u32 width = 0;
+    u32 height = 0;
+    /// Rows are stored top-down and tightly packed
+    std::vector<FramebufferPixel> pixels{};
+};
+
+/// Normalized linear sRGB image and the per-pixel sample counts, one plane per channel.
+struct ImagePlanes {
+    u32 width = 0;
+    u32 height = 0;
+    std::vector<f32> r{};
+    std::vector<f32> g{};
+    std::vector<f32> b{};
+    std::vector<f32> samples{};
+};
 
 namespace ImageWriter {
 
+/// Normalizes the pixels by their own sample counts and converts them to sRGB.
+/// The rows are split between num_threads threads.
 void
-write_framebuffer(const std::string &filename, Framebuffer &fb, u32 num_samples) {
-    auto width = fb.get_res_x();
-    auto height = fb.get_res_y();
-
-    std::vector<vec3> &pixels = fb.get_pixels();
-
-    EXRHeader header;
-    InitEXRHeader(&header);
-
-    EXRImage image;
-    InitEXRImage(&image);
-
-    image.num_channels = 3;
-
-    std::vector<f32> images[3];
-    images[0].resize(width * height);
-    images[1].resize(width * height);
-    images[2].resize(width * height);
-
-    for (int i = 0; i < width * height; i++) {
-        vec3 xyz = pixels[i] / static_cast<float>(num_samples);
-        tuple3 rgb = xyz_to_srgb(tuple3(xyz.x, xyz.y, xyz.z));
-
-        images[0][i] = rgb.x;
-        images[1][i] = rgb.y;
-        images[2][i] = rgb.z;
-    }
-
-    float *image_ptr[3];
-    image_ptr[0] = &(images[2].at(0)); // B
-    image_ptr[1] = &(images[1].at(0)); // G
-    image_ptr[2] = &(images[0].at(0)); // R
-
-    image.images = (unsigned char **)image_ptr;
-    image.width = width;
-    image.height = height;
-
-    header.num_channels = 3;
-    header.channels =
-        (EXRChannelInfo *)malloc(sizeof(EXRChannelInfo) * header.num_channels);
-    // Must be BGR(A) order, since most of EXR viewers expect this channel order.
-    strncpy(header.channels[0].name, "B", 255);
-    header.channels[0].name[strlen("B")] = '\0';
-    strncpy(header.channels[1].name, "G", 255);
-    header.channels[1].name[strlen("G")] = '\0';
-    strncpy(header.channels[2].name, "R", 255);
-    header.channels[2].name[strlen("R")] = '\0';
-
-    header.pixel_types = (int *)malloc(sizeof(int) * header.num_channels);
-    header.requested_pixel_types = (int *)malloc(sizeof(int) * header.num_channels);
-    for (int i = 0; i < header.num_channels; i++) {
-        header.pixel_types[i] = TINYEXR_PIXELTYPE_FLOAT; // pixel type of input image
-        header.requested_pixel_types[i] =
-            TINYEXR_PIXELTYPE_FLOAT; // pixel type of output image to be stored in .EXR
-    }
-
-    const char *err;
-    int ret = SaveEXRImageToFile(&image, &header, filename.c_str(), &err);
-    if (ret != TINYEXR_SUCCESS) {
-        spdlog::error("Error when saving output image file: {}\n", err);
-    }
-
-    free(header.channels);
-    free(header.pixel_types);
-    free(header.requested_pixel_types);
-}
+convert_snapshot(const FramebufferSnapshot &snapshot, ImagePlanes &planes,
+                 u32 num_threads);
+
+/// The per-pixel sample counts are written to the "samples" channel.
+void
+write_exr(const std::string &filename, const ImagePlanes &planes);
+
+/// Writes a Reinhard-tonemapped 8-bit sRGB preview.
+void
+write_png_preview(const std::string &filename, const ImagePlanes &planes);
 
 } // namespace ImageWriter
 
+/// Writes images on a background thread, so that the render threads don't have to wait
+/// for the conversion and tinyexr.
+///
+/// The framebuffer is double-buffered: write() copies it into the free snapshot while
+/// the other one may still be being written out. At most one write is queued, write()
+/// blocks if there already is one.
+class AsyncImageWriter {
+public:
+    /// An empty png_filename disables the preview.
+    AsyncImageWriter(std::string exr_filename, std::string png_filename,
+                     u32 num_convert_threads);
+
+    /// Finishes the queued writes.
+    ~AsyncImageWriter();
+
+    AsyncImageWriter(const AsyncImageWriter &) = delete;
+    AsyncImageWriter &
+    operator=(const AsyncImageWriter &) = delete;
+
+    /// The framebuffer must not be written to during the call.
+    void
+    write(const Framebuffer &fb);
+
+    /// Blocks until all queued writes are done.
+    void
+    flush();
+
+    /// How long the conversion and writing of the last image took
+    std::chrono::duration<f64>
+    last_write_duration();
+
+private:
+    void
+    writer_loop(std::stop_token stop_token);
+
+    std::string exr_filename;
+    std::string png_filename;
+    u32 num_convert_threads;
+
+    FramebufferSnapshot snapshots[2]{};
+    ImagePlanes planes{};
+
+    std::mutex mutex;
+    std::condition_variable_any queue_changed;
+    /// Index of the snapshot waiting to be written
+    Option<u32> pending{};
+    /// Index of the snapshot being written
+    Option<u32> writing{};
+    std::chrono::duration<f64> last_duration{0.};
+
+    std::jthread writer_thread;
+};
+
 #endif // PT_IMAGE_WRITER_H
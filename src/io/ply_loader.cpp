@@ -0,0 +1,496 @@
+#include "ply_loader.h"
+
+#include "../utils/mapped_file.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string_view>
+
+#include <fmt/core.h>
+
+static_assert(std::endian::native == std::endian::little,
+              "PLY data is read without swapping the bytes");
+static_assert(sizeof(point3) == 3 * sizeof(f32) && sizeof(vec3) == 3 * sizeof(f32),
+              "Packed PLY vertices are copied straight into the vectors");
+
+namespace {
+
+enum class PlyType : u8 {
+    I8,
+    U8,
+    I16,
+    U16,
+    I32,
+    U32,
+    F32,
+    F64,
+};
+
+u32
+type_size(PlyType type) {
+    switch (type) {
+    case PlyType::I8:
+    case PlyType::U8:
+        return 1;
+    case PlyType::I16:
+    case PlyType::U16:
+        return 2;
+    case PlyType::I32:
+    case PlyType::U32:
+    case PlyType::F32:
+        return 4;
+    case PlyType::F64:
+        return 8;
+    }
+
+    return 0;
+}
+
+PlyType
+parse_type(std::string_view name) {
+    if (name == "char" || name == "int8") {
+        return PlyType::I8;
+    } else if (name == "uchar" || name == "uint8") {
+        return PlyType::U8;
+    } else if (name == "short" || name == "int16") {
+        return PlyType::I16;
+    } else if (name == "ushort" || name == "uint16") {
+        return PlyType::U16;
+    } else if (name == "int" || name == "int32") {
+        return PlyType::I32;
+    } else if (name == "uint" || name == "uint32") {
+        return PlyType::U32;
+    } else if (name == "float" || name == "float32") {
+        return PlyType::F32;
+    } else if (name == "double" || name == "float64") {
+        return PlyType::F64;
+    }
+
+    throw std::runtime_error(fmt::format("Unknown PLY property type: '{}'", name));
+}
+
+template <typename T>
+T
+read_raw(const u8 *data) {
+    T value;
+    std::memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+f64
+read_scalar(const u8 *data, PlyType type) {
+    switch (type) {
+    case PlyType::I8:
+        return read_raw<i8>(data);
+    case PlyType::U8:
+        return read_raw<u8>(data);
+    case PlyType::I16:
+        return read_raw<i16>(data);
+    case PlyType::U16:
+        return read_raw<u16>(data);
+    case PlyType::I32:
+        return read_raw<i32>(data);
+    case PlyType::U32:
+        return read_raw<u32>(data);
+    case PlyType::F32:
+        return read_raw<f32>(data);
+    case PlyType::F64:
+        return read_raw<f64>(data);
+    }
+
+    return 0.;
+}
+
+bool
+is_integer(PlyType type) {
+    return type != PlyType::F32 && type != PlyType::F64;
+}
+
+/// Only for integer types, doesn't go through a double
+i64
+read_integer(const u8 *data, PlyType type) {
+    switch (type) {
+    case PlyType::I8:
+        return read_raw<i8>(data);
+    case PlyType::U8:
+        return read_raw<u8>(data);
+    case PlyType::I16:
+        return read_raw<i16>(data);
+    case PlyType::U16:
+        return read_raw<u16>(data);
+    case PlyType::I32:
+        return read_raw<i32>(data);
+    case PlyType::U32:
+        return read_raw<u32>(data);
+    default:
+        return 0;
+    }
+}
+
+struct PlyProperty {
+    std::string name;
+    PlyType type;
+    bool is_list = false;
+    PlyType count_type = PlyType::U8;
+    /// Offset in the element, only valid if the element has no lists
+    u32 offset = 0;
+};
+
+struct PlyElement {
+    Option<u32>
+    find_property(std::initializer_list<std::string_view> names) const {
+        for (u32 i = 0; i < properties.size(); i++) {
+            for (auto name : names) {
+                if (properties[i].name == name) {
+                    return i;
+                }
+            }
+        }
+
+        return {};
+    }
+
+    std::string name;
+    u64 count = 0;
+    std::vector<PlyProperty> properties{};
+    bool has_lists = false;
+    /// Size of one element, only valid if the element has no lists
+    u32 stride = 0;
+};
+
+struct PlyHeader {
+    std::vector<PlyElement> elements{};
+    u64 data_offset = 0;
+};
+
+PlyHeader
+parse_header(Span<const u8> bytes, const std::string &path) {
+    constexpr std::string_view END_HEADER = "end_header";
+
+    std::string_view text(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    if (!text.starts_with("ply")) {
+        throw std::runtime_error(fmt::format("'{}' isn't a PLY file", path));
+    }
+
+    PlyHeader header{};
+    u64 line_start = 0;
+    while (true) {
+        u64 line_end = text.find('\n', line_start);
+        if (line_end == std::string_view::npos) {
+            throw std::runtime_error(fmt::format("PLY header of '{}' has no end", path));
+        }
+
+        auto line = text.substr(line_start, line_end - line_start);
+        if (line.ends_with('\r')) {
+            line.remove_suffix(1);
+        }
+        line_start = line_end + 1;
+
+        std::istringstream tokens{std::string(line)};
+        std::string keyword;
+        tokens >> keyword;
+
+        if (keyword == END_HEADER) {
+            header.data_offset = line_start;
+            break;
+        } else if (keyword == "format") {
+            std::string format;
+            tokens >> format;
+            if (format != "binary_little_endian") {
+                throw std::runtime_error(fmt::format(
+                    "PLY format '{}' of '{}' isn't supported, only binary_little_endian",
+                    format, path));
+            }
+        } else if (keyword == "element") {
+            PlyElement element{};
+            tokens >> element.name >> element.count;
+            header.elements.push_back(std::move(element));
+        } else if (keyword == "property") {
+            if (header.elements.empty()) {
+                throw std::runtime_error(
+                    fmt::format("PLY property outside of an element in '{}'", path));
+            }
+
+            auto &element = header.elements.back();
+            PlyProperty property{};
+            std::string type;
+            tokens >> type;
+
+            if (type == "list") {
+                std::string count_type;
+                tokens >> count_type >> type;
+                property.is_list = true;
+                property.count_type = parse_type(count_type);
+                element.has_lists = true;
+            }
+
+            property.type = parse_type(type);
+            tokens >> property.name;
+            property.offset = element.stride;
+            if (!property.is_list) {
+                element.stride += type_size(property.type);
+            }
+
+            element.properties.push_back(std::move(property));
+        }
+        // comment, obj_info and the version line are ignored
+    }
+
+    return header;
+}
+
+/// Reads the element data sequentially with bounds checks
+class PlyReader {
+public:
+    PlyReader(Span<const u8> bytes, u64 offset, const std::string &path)
+        : bytes{bytes}, offset{offset}, path{path} {}
+
+    const u8 *
+    take(u64 size) {
+        if (size > remaining()) {
+            throw std::runtime_error(fmt::format("PLY file '{}' is truncated", path));
+        }
+
+        const u8 *data = bytes.data() + offset;
+        offset += size;
+        return data;
+    }
+
+    /// Takes count items of item_size bytes, counts from the file may be arbitrarily
+    /// large
+    const u8 *
+    take_array(u64 count, u64 item_size) {
+        if (item_size != 0 && count > remaining() / item_size) {
+            throw std::runtime_error(fmt::format("PLY file '{}' is truncated", path));
+        }
+
+        return take(count * item_size);
+    }
+
+    u64
+    remaining() const {
+        return bytes.size() - offset;
+    }
+
+    u64
+    take_list_count(PlyType count_type) {
+        f64 count = read_scalar(take(type_size(count_type)), count_type);
+        if (count < 0.) {
+            throw std::runtime_error(
+                fmt::format("PLY file '{}' has a negative list size", path));
+        }
+
+        return static_cast<u64>(count);
+    }
+
+    /// Skips one element of an element with lists
+    void
+    skip_element(const PlyElement &element) {
+        for (const auto &property : element.properties) {
+            if (property.is_list) {
+                u64 count = take_list_count(property.count_type);
+                take_array(count, type_size(property.type));
+            } else {
+                take(type_size(property.type));
+            }
+        }
+    }
+
+private:
+    Span<const u8> bytes;
+    u64 offset;
+    const std::string &path;
+};
+
+void
+read_vertices(PlyReader &reader, const PlyElement &element, PlyMesh &mesh,
+              const std::string &path) {
+    if (element.has_lists) {
+        throw std::runtime_error(
+            fmt::format("PLY vertices with list properties in '{}'", path));
+    }
+
+    auto x = element.find_property({"x"});
+    auto y = element.find_property({"y"});
+    auto z = element.find_property({"z"});
+    if (!x.has_value() || !y.has_value() || !z.has_value()) {
+        throw std::runtime_error(fmt::format("PLY vertices have no position: {}", path));
+    }
+
+    auto nx = element.find_property({"nx"});
+    auto ny = element.find_property({"ny"});
+    auto nz = element.find_property({"nz"});
+    bool has_normals = nx.has_value() && ny.has_value() && nz.has_value();
+
+    auto u = element.find_property({"u", "s", "texture_u", "texture_s"});
+    auto v = element.find_property({"v", "t", "texture_v", "texture_t"});
+    bool has_uvs = u.has_value() && v.has_value();
+
+    const auto &props = element.properties;
+    auto read_attrib = [&](const u8 *vertex, u32 prop) {
+        const auto &property = props[prop];
+        if (property.type == PlyType::F32) {
+            return read_raw<f32>(vertex + property.offset);
+        }
+        return static_cast<f32>(read_scalar(vertex + property.offset, property.type));
+    };
+
+    // Three consecutive floats are copied at once
+    auto is_packed_vec3 = [&](u32 a, u32 b, u32 c) {
+        return props[a].type == PlyType::F32 && props[b].type == PlyType::F32 &&
+               props[c].type == PlyType::F32 && props[b].offset == props[a].offset + 4 &&
+               props[c].offset == props[a].offset + 8;
+    };
+
+    auto read_vec3 = [&](const u8 *vertex, u32 a, u32 b, u32 c, bool packed) {
+        f32 xyz[3];
+        if (packed) {
+            std::memcpy(xyz, vertex + props[a].offset, sizeof(xyz));
+        } else {
+            xyz[0] = read_attrib(vertex, a);
+            xyz[1] = read_attrib(vertex, b);
+            xyz[2] = read_attrib(vertex, c);
+        }
+        return vec3(xyz[0], xyz[1], xyz[2]);
+    };
+
+    bool pos_packed = is_packed_vec3(*x, *y, *z);
+    bool normals_packed = has_normals && is_packed_vec3(*nx, *ny, *nz);
+
+    const u8 *data = reader.take_array(element.count, element.stride);
+
+    mesh.pos.resize(element.count, point3(0.f));
+    if (has_normals) {
+        mesh.normals.resize(element.count, vec3(0.f));
+    }
+    if (has_uvs) {
+        mesh.uvs.resize(element.count, vec2(0.f));
+    }
+
+    // The usual layout of only float positions is the same as in memory
+    if (pos_packed && props[*x].offset == 0 && element.stride == sizeof(point3)) {
+        std::memcpy(mesh.pos.data(), data, element.count * sizeof(point3));
+        return;
+    }
+
+    for (u64 i = 0; i < element.count; i++) {
+        const u8 *vertex = data + i * element.stride;
+
+        vec3 pos = read_vec3(vertex, *x, *y, *z, pos_packed);
+        mesh.pos[i] = point3(pos.x, pos.y, pos.z);
+
+        if (has_normals) {
+            mesh.normals[i] = read_vec3(vertex, *nx, *ny, *nz, normals_packed);
+        }
+
+        if (has_uvs) {
+            mesh.uvs[i] = vec2(read_attrib(vertex, *u), read_attrib(vertex, *v));
+        }
+    }
+}
+
+void
+read_faces(PlyReader &reader, const PlyElement &element, PlyMesh &mesh,
+           const std::string &path) {
+    auto indices_prop = element.find_property({"vertex_indices", "vertex_index"});
+    if (!indices_prop.has_value() || !element.properties[*indices_prop].is_list) {
+        throw std::runtime_error(
+            fmt::format("PLY faces have no vertex indices: {}", path));
+    }
+
+    const auto &indices_property = element.properties[*indices_prop];
+    u32 index_size = type_size(indices_property.type);
+    if (!is_integer(indices_property.type)) {
+        throw std::runtime_error(
+            fmt::format("PLY faces have non-integer vertex indices: {}", path));
+    }
+
+    // Most faces are triangles, a face takes at least a byte
+    mesh.indices.reserve(std::min(element.count, reader.remaining()) * 3);
+
+    for (u64 f = 0; f < element.count; f++) {
+        for (u32 p = 0; p < element.properties.size(); p++) {
+            const auto &property = element.properties[p];
+            if (p != *indices_prop) {
+                if (property.is_list) {
+                    u64 count = reader.take_list_count(property.count_type);
+                    reader.take_array(count, type_size(property.type));
+                } else {
+                    reader.take(type_size(property.type));
+                }
+                continue;
+            }
+
+            u64 count = reader.take_list_count(property.count_type);
+            if (count != 3 && count != 4) {
+                throw std::runtime_error(fmt::format(
+                    "PLY file has a face with {} vertices: {}", count, path));
+            }
+
+            const u8 *face = reader.take(count * index_size);
+            u32 corners[4];
+            for (u32 c = 0; c < count; c++) {
+                // Checked before narrowing, the upper bound is checked once all
+                // vertices are read
+                i64 index = read_integer(face + c * index_size, indices_property.type);
+                if (index < 0 || index > std::numeric_limits<u32>::max()) {
+                    throw std::runtime_error(fmt::format(
+                        "PLY file has an out of range vertex index: {}", path));
+                }
+                corners[c] = static_cast<u32>(index);
+            }
+
+            mesh.indices.insert(mesh.indices.end(), {corners[0], corners[1], corners[2]});
+            if (count == 4) {
+                mesh.indices.insert(mesh.indices.end(),
+                                    {corners[0], corners[2], corners[3]});
+            }
+        }
+    }
+}
+
+} // namespace
+
+PlyMesh
+load_ply(const std::string &path) {
+    MappedFile file(path);
+    file.advise_sequential();
+
+    auto header = parse_header(file.bytes(), path);
+    PlyReader reader(file.bytes(), header.data_offset, path);
+
+    PlyMesh mesh{};
+    bool has_faces = false;
+
+    for (const auto &element : header.elements) {
+        if (element.name == "vertex") {
+            read_vertices(reader, element, mesh, path);
+        } else if (element.name == "face") {
+            read_faces(reader, element, mesh, path);
+            has_faces = true;
+        } else if (!element.has_lists) {
+            reader.take_array(element.count, element.stride);
+        } else {
+            for (u64 i = 0; i < element.count; i++) {
+                reader.skip_element(element);
+            }
+        }
+    }
+
+    if (mesh.pos.size() < 3 || !has_faces) {
+        throw std::runtime_error(fmt::format("PLY file has no triangles: {}", path));
+    }
+
+    for (u32 index : mesh.indices) {
+        if (index >= mesh.pos.size()) {
+            throw std::runtime_error(
+                fmt::format("PLY file has an out of range vertex index: {}", path));
+        }
+    }
+
+    return mesh;
+}
@@ -0,0 +1,25 @@
+#ifndef PT_PLY_LOADER_H
+#define PT_PLY_LOADER_H
+
+#include "../math/vecmath.h"
+#include "../utils/basic_types.h"
+
+#include <string>
+#include <vector>
+
+/// Vertices and triangles of a PLY file in object space. normals and uvs are empty if
+/// the file doesn't have them.
+struct PlyMesh {
+    std::vector<u32> indices{};
+    std::vector<point3> pos{};
+    std::vector<vec3> normals{};
+    std::vector<vec2> uvs{};
+};
+
+/// Loads a binary little-endian PLY file. The file is memory-mapped and the vertex and
+/// face blocks are read straight from the mapping. Vertex properties may be in any order
+/// and of any scalar type, quads are split into two triangles.
+PlyMesh
+load_ply(const std::string &path);
+
+#endif // PT_PLY_LOADER_H
@@ -1,8 +1,10 @@
 #ifndef PT_PROGRESS_BAR_H
 #define PT_PROGRESS_BAR_H
 
+#include <algorithm>
 #include <chrono>
 #include <iostream>
+#include <string_view>
 
 #include <fmt/chrono.h>
 #include <fmt/core.h>
@@ -15,10 +17,37 @@ public:
     void
     print(u64 current_count, u64 total_count, std::chrono::duration<f64> elapsed) {
         f64 progress = (f64)(current_count) / (f64)(total_count);
+        auto remaining = elapsed * (1. / progress) - elapsed;
+
+        print_bar(fmt::format("Sample {} / {}", current_count, total_count), progress,
+                  remaining);
+    }
+
+    /// For renders that are limited by time instead of the number of samples
+    void
+    print_timed(u64 current_count, std::chrono::duration<f64> elapsed,
+                std::chrono::duration<f64> time_limit) {
+        f64 progress = std::min(elapsed / time_limit, 1.);
+
+        auto remaining = time_limit - elapsed;
+        if (remaining.count() < 0.) {
+            remaining = std::chrono::duration<f64>(0.);
+        }
+
+        print_bar(fmt::format("Sample {}", current_count), progress, remaining);
+    }
+
+    std::string_view bar_start = "[";
+    std::string_view bar_end = "]";
+    std::string_view bar_filler_done = "*";
+    std::string_view bar_filler_left = " ";
 
+private:
+    void
+    print_bar(std::string_view label, f64 progress,
+              std::chrono::duration<f64> remaining) {
         fmt::print("\r");
-        fmt::print("Sample {} / {} - {:.0f}%", current_count, total_count,
-                   progress * 100);
+        fmt::print("{} - {:.0f}%", label, progress * 100);
         fmt::print("{}", bar_start);
 
         u32 done_count = (u32)((f64)bar_length * progress);
@@ -31,8 +60,6 @@ public:
             fmt::print("{}", bar_filler_left);
         }
 
-        auto remaining = elapsed * (1. / progress) - elapsed;
-
         fmt::print(" time remaining: {:%H:%M:%S}",
                    std::chrono::floor<std::chrono::seconds>(remaining));
 
@@ -41,12 +68,6 @@ public:
         std::cout << std::flush;
     }
 
-    std::string_view bar_start = "[";
-    std::string_view bar_end = "]";
-    std::string_view bar_filler_done = "*";
-    std::string_view bar_filler_left = " ";
-
-private:
     u32 bar_length = 40;
 };
 
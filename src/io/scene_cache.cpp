@@ -0,0 +1,390 @@
+#include "scene_cache.h"
+
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <spdlog/spdlog.h>
+#include <unistd.h>
+
+namespace {
+
+std::atomic<u32> num_temp_files{0};
+
+constexpr u32 CACHE_MAGIC = 0x43535450; // "PTSC"
+/// Arrays start on this boundary, so that they can be read straight from the mapping
+constexpr u64 ARRAY_ALIGNMENT = 16;
+
+/// Sizes of the cached structs, a cache written by a build with a different layout is
+/// rejected even if FORMAT_VERSION wasn't bumped
+constexpr Array<u32, 8> LAYOUT_FINGERPRINT = {
+    sizeof(Mesh),         sizeof(Light),
+    sizeof(Instance),     sizeof(ShapeGroup),
+    sizeof(SphereVertex), sizeof(CompactShadingVertex),
+    sizeof(point3),       sizeof(vec3),
+};
+
+class CacheWriter {
+public:
+    explicit CacheWriter(const std::string &path)
+        : out(path, std::ios::binary | std::ios::trunc) {
+        if (!out) {
+            throw std::runtime_error(fmt::format("Couldn't create '{}'", path));
+        }
+    }
+
+    template <typename T>
+    void
+    write(const T &value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        write_bytes(&value, sizeof(T));
+    }
+
+    void
+    write_string(const std::string &value) {
+        write<u32>(value.size());
+        write_bytes(value.data(), value.size());
+    }
+
+    template <typename T>
+    void
+    write_array(const T *data, u64 count) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        write<u64>(count);
+
+        u64 padding = (ARRAY_ALIGNMENT - offset % ARRAY_ALIGNMENT) % ARRAY_ALIGNMENT;
+        constexpr std::array<char, ARRAY_ALIGNMENT> zeros{};
+        write_bytes(zeros.data(), padding);
+
+        write_bytes(data, count * sizeof(T));
+    }
+
+    template <typename T>
+    void
+    write_array(const std::vector<T> &values) {
+        write_array(values.data(), values.size());
+    }
+
+    void
+    finish() {
+        out.flush();
+        if (!out) {
+            throw std::runtime_error("Error while writing the scene cache");
+        }
+    }
+
+private:
+    void
+    write_bytes(const void *data, u64 size) {
+        out.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+        offset += size;
+    }
+
+    std::ofstream out;
+    u64 offset = 0;
+};
+
+class CacheReader {
+public:
+    CacheReader(Span<const u8> bytes, u64 offset) : bytes{bytes}, offset{offset} {}
+
+    template <typename T>
+    T
+    read() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        check_remaining(sizeof(T));
+
+        T value;
+        std::memcpy(&value, bytes.data() + offset, sizeof(T));
+        offset += sizeof(T);
+        return value;
+    }
+
+    std::string
+    read_string() {
+        u32 size = read<u32>();
+        check_remaining(size);
+
+        std::string value(reinterpret_cast<const char *>(bytes.data() + offset), size);
+        offset += size;
+        return value;
+    }
+
+    /// Returns the array in the mapping
+    template <typename T>
+    Span<const T>
+    read_array() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        u64 count = read<u64>();
+        offset += (ARRAY_ALIGNMENT - offset % ARRAY_ALIGNMENT) % ARRAY_ALIGNMENT;
+
+        check_remaining(count * sizeof(T));
+        // The mapping is page-aligned and the arrays are aligned in the file
+        auto data = reinterpret_cast<const T *>(bytes.data() + offset);
+        offset += count * sizeof(T);
+        return Span<const T>(data, count);
+    }
+
+    /// Bulk copy of an array in the mapping
+    template <typename T>
+    void
+    read_array(std::vector<T> &values) {
+        auto array = read_array<T>();
+        values.assign(array.begin(), array.end());
+    }
+
+    u64
+    get_offset() const {
+        return offset;
+    }
+
+private:
+    void
+    check_remaining(u64 size) const {
+        if (offset + size > bytes.size()) {
+            throw std::runtime_error("Scene cache is truncated");
+        }
+    }
+
+    Span<const u8> bytes;
+    u64 offset;
+};
+
+void
+write_cache_file(const std::string &path, const Scene &sc,
+                 const std::vector<std::string> &assets) {
+    CacheWriter writer(path);
+
+    writer.write(CACHE_MAGIC);
+    writer.write(SceneCache::FORMAT_VERSION);
+    writer.write(LAYOUT_FINGERPRINT);
+    writer.write<u32>(sc.geometry.meshes.compact);
+    writer.write(RgbSpectrum::table_hash());
+
+    writer.write<u32>(assets.size());
+    for (const auto &asset : assets) {
+        auto stamp = AssetStamp::make(asset);
+        writer.write_string(stamp.path);
+        writer.write(stamp.size);
+        writer.write(stamp.mtime);
+    }
+
+    const auto &textures = sc.texture_cache.get_textures();
+    writer.write<u32>(textures.size());
+    for (const auto &texture : textures) {
+        auto image = texture->decode();
+
+        writer.write_string(texture->get_path());
+        writer.write(image.get_width());
+        writer.write(image.get_height());
+        writer.write<u32>(static_cast<u32>(image.get_data_type()));
+        writer.write(image.get_quant_range());
+        writer.write_array(static_cast<const u8 *>(image.get_pixels()),
+                           image.size_bytes());
+
+        image.free();
+    }
+
+    const auto &meshes = sc.geometry.meshes;
+    writer.write_array(meshes.meshes);
+    writer.write_array(meshes.indices);
+    writer.write_array(meshes.pos);
+    writer.write_array(meshes.normals);
+    writer.write_array(meshes.uvs);
+    writer.write_array(meshes.shading);
+    writer.write(meshes.full_float_shading_bytes);
+
+    const auto &spheres = sc.geometry.spheres;
+    std::vector<u8> spheres_have_light(spheres.has_light.begin(),
+                                       spheres.has_light.end());
+    writer.write_array(spheres.vertices);
+    writer.write_array(spheres.material_ids);
+    writer.write_array(spheres_have_light);
+    writer.write_array(spheres.light_ids);
+    writer.write(spheres.num_spheres);
+
+    writer.write_array(sc.geometry.instances.groups);
+    writer.write_array(sc.geometry.instances.instances);
+
+    writer.write_array(sc.lights);
+    writer.write_array(sc.light_sampler.get_pmf());
+
+    writer.finish();
+}
+
+} // namespace
+
+AssetStamp
+AssetStamp::make(const std::string &path) {
+    std::error_code err;
+    u64 size = std::filesystem::file_size(path, err);
+    if (err) {
+        size = 0;
+    }
+
+    auto write_time = std::filesystem::last_write_time(path, err);
+    i64 mtime = err ? 0 : write_time.time_since_epoch().count();
+
+    return AssetStamp{.path = path, .size = size, .mtime = mtime};
+}
+
+Option<SceneCache>
+SceneCache::open(const std::string &cache_path, bool compact_meshes) {
+    if (!std::filesystem::exists(cache_path)) {
+        return {};
+    }
+
+    try {
+        // The descriptor is kept, so that texture pages are read from the same file that
+        // was validated, even if another process replaces the cache in the meantime
+        SceneCache cache(cache_path, MappedFile{cache_path, true});
+        cache.file.advise_sequential();
+
+        CacheReader reader(cache.file.bytes(), 0);
+
+        if (reader.read<u32>() != CACHE_MAGIC || reader.read<u32>() != FORMAT_VERSION ||
+            reader.read<Array<u32, 8>>() != LAYOUT_FINGERPRINT) {
+            spdlog::info("Scene cache '{}' was written by a different version",
+                         cache_path);
+            return {};
+        }
+
+        if (reader.read<u32>() != static_cast<u32>(compact_meshes)) {
+            spdlog::info("Scene cache '{}' has a different mesh layout", cache_path);
+            return {};
+        }
+
+        if (reader.read<u64>() != RgbSpectrum::table_hash()) {
+            spdlog::info("Scene cache '{}' was written with a different rgb2spec table",
+                         cache_path);
+            return {};
+        }
+
+        u32 num_assets = reader.read<u32>();
+        for (u32 i = 0; i < num_assets; i++) {
+            AssetStamp stamp{};
+            stamp.path = reader.read_string();
+            stamp.size = reader.read<u64>();
+            stamp.mtime = reader.read<i64>();
+
+            if (AssetStamp::make(stamp.path) != stamp) {
+                spdlog::info("Scene cache is stale, '{}' has changed", stamp.path);
+                return {};
+            }
+        }
+
+        u32 num_textures = reader.read<u32>();
+        for (u32 i = 0; i < num_textures; i++) {
+            std::string path = reader.read_string();
+            cache.texture_offsets[path] = reader.get_offset();
+
+            // Skip the texture record
+            reader.read<i32>();
+            reader.read<i32>();
+            reader.read<u32>();
+            reader.read<QuantizationRange>();
+            reader.read_array<u8>();
+        }
+
+        cache.geometry_offset = reader.get_offset();
+        return cache;
+    } catch (const std::exception &e) {
+        spdlog::warn("Couldn't read scene cache '{}': {}", cache_path, e.what());
+        return {};
+    }
+}
+
+void
+SceneCache::write(const std::string &cache_path, const Scene &sc,
+                  const std::vector<std::string> &assets) {
+    // Processes that map the old cache keep their copy. Every writer has its own
+    // temporary file, so that processes rebuilding the same cache don't write into each
+    // other's file.
+    auto tmp_path = fmt::format("{}.{}-{}.tmp", cache_path, ::getpid(), num_temp_files++);
+    try {
+        write_cache_file(tmp_path, sc, assets);
+    } catch (...) {
+        std::error_code err;
+        std::filesystem::remove(tmp_path, err);
+        throw;
+    }
+
+    std::filesystem::rename(tmp_path, cache_path);
+}
+
+void
+SceneCache::restore_geometry(Scene &sc) const {
+    CacheReader reader(file.bytes(), geometry_offset);
+
+    auto &meshes = sc.geometry.meshes;
+    reader.read_array(meshes.meshes);
+    reader.read_array(meshes.indices);
+    reader.read_array(meshes.pos);
+    reader.read_array(meshes.normals);
+    reader.read_array(meshes.uvs);
+    reader.read_array(meshes.shading);
+    meshes.full_float_shading_bytes = reader.read<u64>();
+
+    auto &spheres = sc.geometry.spheres;
+    reader.read_array(spheres.vertices);
+    reader.read_array(spheres.material_ids);
+    auto spheres_have_light = reader.read_array<u8>();
+    spheres.has_light.assign(spheres_have_light.begin(), spheres_have_light.end());
+    reader.read_array(spheres.light_ids);
+    spheres.num_spheres = reader.read<u32>();
+
+    reader.read_array(sc.geometry.instances.groups);
+    reader.read_array(sc.geometry.instances.instances);
+
+    reader.read_array(sc.lights);
+    sc.init_mesh_lights();
+
+    std::vector<f32> light_pmf{};
+    reader.read_array(light_pmf);
+    sc.light_sampler =
+        LightSampler(std::move(light_pmf), sc.lights, sc.geometry, sc.light_sampler_type);
+}
+
+void
+SceneCache::restore_textures(TextureCache &texture_cache) const {
+    Option<i32> fd{};
+
+    for (const auto &texture : texture_cache.get_textures()) {
+        auto offset = texture_offsets.find(texture->get_path());
+        if (offset == texture_offsets.end()) {
+            continue;
+        }
+
+        CacheReader reader(file.bytes(), offset->second);
+        i32 width = reader.read<i32>();
+        i32 height = reader.read<i32>();
+        auto data_type = static_cast<TextureDataType>(reader.read<u32>());
+        auto quant_range = reader.read<QuantizationRange>();
+        auto pixels = reader.read_array<u8>();
+
+        ImageTexture layout(width, height, nullptr, data_type);
+        layout.set_quant_range(quant_range);
+        if (data_type != texture->get_data_type() ||
+            pixels.size() != layout.size_bytes()) {
+            continue;
+        }
+
+        // One duplicate of the mapping's descriptor is shared by all textures, it refers
+        // to the validated file even if the cache file is replaced
+        if (!fd.has_value()) {
+            i32 source_fd = ::fcntl(file.get_fd(), F_DUPFD_CLOEXEC, 0);
+            if (source_fd < 0) {
+                throw std::runtime_error(fmt::format("Couldn't duplicate '{}': {}", path,
+                                                     std::strerror(errno)));
+            }
+
+            fd = texture_cache.add_source(source_fd);
+        }
+
+        u64 pixels_offset = pixels.data() - file.bytes().data();
+        texture->set_source(fd.value(), pixels_offset, layout);
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef PT_SCENE_CACHE_H
+#define PT_SCENE_CACHE_H
+
+#include "../scene/scene.h"
+#include "../scene/texture.h"
+#include "../utils/basic_types.h"
+#include "../utils/mapped_file.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Size and modification time of a file the cache was built from
+struct AssetStamp {
+    static AssetStamp
+    make(const std::string &path);
+
+    bool
+    operator==(const AssetStamp &other) const = default;
+
+    std::string path;
+    u64 size;
+    i64 mtime;
+};
+
+/// Binary cache of the parts of a scene that are expensive to load: the geometry, the
+/// lights with their sampling probabilities and the mip pyramids of the textures.
+/// Materials are cheap to parse and contain pointers, so they always come from the XML.
+///
+/// The cache is valid as long as the scene file and all of the assets it references
+/// keep their sizes and modification times, and the rgb2spec table doesn't change. On
+/// reload the file is memory-mapped and the buffers are copied out of the mapping in
+/// bulk. Texture pages are read from the file by the texture cache when they are first
+/// sampled.
+class SceneCache {
+public:
+    /// Bump when the layout of the file or of any of the cached structs changes
+    static constexpr u32 FORMAT_VERSION = 4;
+
+    /// Maps the cache file and checks that it's still valid, returns nothing if it's
+    /// missing or stale.
+    static Option<SceneCache>
+    open(const std::string &cache_path, bool compact_meshes);
+
+    /// Writes the cache of a fully loaded scene. assets are the paths of the scene file
+    /// and of every file it references. The images of the texture cache are decoded one
+    /// at a time.
+    static void
+    write(const std::string &cache_path, const Scene &sc,
+          const std::vector<std::string> &assets);
+
+    /// Replaces the geometry, lights and light sampler of the scene with the cached ones
+    void
+    restore_geometry(Scene &sc) const;
+
+    /// Makes the textures that are in the cache read their pages from the cache file
+    void
+    restore_textures(TextureCache &texture_cache) const;
+
+private:
+    SceneCache(const std::string &path, MappedFile &&file)
+        : path{path}, file{std::move(file)} {}
+
+    std::string path;
+    MappedFile file;
+    /// Offset of the geometry section in the mapping
+    u64 geometry_offset = 0;
+    /// Offsets of the texture records
+    std::unordered_map<std::string, u64> texture_offsets{};
+};
+
+#endif // PT_SCENE_CACHE_H
@@ -1,9 +1,13 @@
 #include "scene_loader.h"
 
+#include <algorithm>
+#include <chrono>
 #include <ranges>
+#include <thread>
 #include <utility>
 
 #include "../color/spectral_data.h"
+#include "ply_loader.h"
 #include <fmt/core.h>
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
@@ -34,12 +38,46 @@ child_node_attr(const pugi::xml_node parent, const std::string &node_name,
 }
 
 void
-SceneLoader::load_scene(Scene &sc) {
+SceneLoader::load_scene(Scene &sc, const std::string &cache_path) {
+    using Clock = std::chrono::steady_clock;
     auto scene = doc.child("scene");
 
+    if (!cache_path.empty()) {
+        cache = SceneCache::open(cache_path, sc.geometry.meshes.compact);
+        if (cache.has_value()) {
+            spdlog::info("Loading geometry and textures from scene cache '{}'",
+                         cache_path);
+        }
+    }
+
+    TaskPool pool(std::thread::hardware_concurrency());
+
+    // Image textures are only registered with the texture cache here. Without a memory
+    // budget, they are decoded at the end, otherwise when they are first sampled.
+    auto phase_start = Clock::now();
+    prefetch_meshes(scene, pool);
+    if (!cache.has_value()) {
+        sc.reserve_meshes(count_meshes(scene));
+    }
+    auto meshes_time = Clock::now() - phase_start;
+
+    // Materials and shapes are added serially in document order, so that their ids
+    // don't depend on the order in which the tasks finished
+    phase_start = Clock::now();
     load_materials(scene, sc);
     load_shapes(sc, scene);
+    auto shapes_time = Clock::now() - phase_start;
 
+    phase_start = Clock::now();
+    if (cache.has_value()) {
+        cache->restore_geometry(sc);
+        cache->restore_textures(sc.texture_cache);
+    } else {
+        sc.init_light_sampler(&pool);
+    }
+    auto lights_time = Clock::now() - phase_start;
+
+    phase_start = Clock::now();
     auto envmap_node = scene.child("emitter");
     if (envmap_node) {
         std::string filename = envmap_node.child("string").attribute("value").as_string();
@@ -48,56 +86,245 @@ SceneLoader::load_scene(Scene &sc) {
         auto transform_node = envmap_node.child("transform");
         auto to_world_transform = parse_transform(transform_node);
 
-        auto envmap = Envmap(file_path, to_world_transform);
+        auto envmap = Envmap(file_path, to_world_transform, &pool);
         sc.set_envmap(std::move(envmap));
     }
+    auto envmap_time = Clock::now() - phase_start;
+
+    prefetched_meshes.clear();
+
+    phase_start = Clock::now();
+    if (cache.has_value()) {
+        cache.reset();
+    } else if (!cache_path.empty()) {
+        try {
+            SceneCache::write(cache_path, sc, asset_paths);
+            spdlog::info("Wrote scene cache '{}'", cache_path);
+
+            // The textures were decoded for the cache, page them in from there
+            auto written = SceneCache::open(cache_path, sc.geometry.meshes.compact);
+            if (written.has_value()) {
+                written->restore_textures(sc.texture_cache);
+            }
+        } catch (const std::exception &e) {
+            spdlog::warn("Couldn't write scene cache '{}': {}", cache_path, e.what());
+        }
+    }
+    auto cache_time = Clock::now() - phase_start;
+
+    // After the scene cache, so that the textures paged from it aren't decoded
+    phase_start = Clock::now();
+    if (sc.texture_cache.get_memory_budget() == 0) {
+        sc.texture_cache.preload(pool);
+    }
+    auto textures_time = Clock::now() - phase_start;
+
+    using ms = std::chrono::duration<f64, std::milli>;
+    spdlog::info("Scene loaded on {} threads - meshes: {:.1f} ms, materials and shapes: "
+                 "{:.1f} ms, lights: {:.1f} ms, envmap: {:.1f} ms, cache: {:.1f} ms, "
+                 "textures: {:.1f} ms",
+                 pool.num_threads(), ms(meshes_time).count(), ms(shapes_time).count(),
+                 ms(lights_time).count(), ms(envmap_time).count(), ms(cache_time).count(),
+                 ms(textures_time).count());
 }
 
-void
-SceneLoader::load_shapes(Scene &sc, const pugi::xml_node &scene) {
-    for (pugi::xml_node shape : scene.children("shape")) {
+MeshCounts
+SceneLoader::count_meshes(const pugi::xml_node &scene) const {
+    MeshCounts counts{};
+
+    auto count_shape = [&](const pugi::xml_node &shape) {
         str type = shape.attribute("type").as_string();
+        bool has_light = static_cast<bool>(shape.child("emitter"));
+
+        if (type == "rectangle") {
+            counts.add(RECTANGLE_NUM_INDICES, RECTANGLE_NUM_VERTICES, false, false,
+                       has_light);
+        } else if (type == "cube") {
+            counts.add(CUBE_NUM_INDICES, CUBE_NUM_VERTICES, false, false, has_light);
+        } else if (type == "obj" || type == "ply") {
+            auto prefetched = prefetched_meshes.find(shape.internal_object());
+            if (prefetched != prefetched_meshes.end()) {
+                const auto &mesh = prefetched->second;
+                counts.add(mesh.indices.size(), mesh.pos.size(), !mesh.normals.empty(),
+                           !mesh.uvs.empty(), has_light);
+            }
+        }
+    };
+
+    for (pugi::xml_node shape : scene.children("shape")) {
+        if (shape.attribute("type").as_string() == str("shapegroup")) {
+            for (pugi::xml_node group_shape : shape.children("shape")) {
+                count_shape(group_shape);
+            }
+        } else {
+            count_shape(shape);
+        }
+    }
+
+    return counts;
+}
+
+void
+SceneLoader::prefetch_meshes(const pugi::xml_node &scene, TaskPool &pool) {
+    if (cache.has_value()) {
+        return;
+    }
 
-        u32 mat_id;
+    std::vector<pugi::xml_node> mesh_nodes{};
+    auto collect_mesh = [&](const pugi::xml_node &shape) {
+        str type = shape.attribute("type").as_string();
+        if (type == "obj" || type == "ply") {
+            mesh_nodes.push_back(shape);
+        }
+    };
 
-        auto ref_node = shape.child("ref");
-        auto bsdf_node = shape.child("bsdf");
-        if (ref_node) {
-            std::string bsdf_id = ref_node.attribute("id").as_string();
-            mat_id = materials.at(bsdf_id);
-        } else if (bsdf_node) {
-            auto [mat, _] = load_material(sc, bsdf_node);
-            mat_id = sc.add_material(std::move(mat));
+    for (pugi::xml_node shape : scene.children("shape")) {
+        if (shape.attribute("type").as_string() == str("shapegroup")) {
+            for (pugi::xml_node group_shape : shape.children("shape")) {
+                collect_mesh(group_shape);
+            }
         } else {
-            throw std::runtime_error("Shape has no material");
+            collect_mesh(shape);
         }
+    }
 
-        auto transform_node = shape.child("transform");
+    std::vector<LoadedMesh> meshes(mesh_nodes.size());
+    pool.parallel_for(mesh_nodes.size(), 1, [&](u64 i) {
+        auto transform_node = mesh_nodes[i].child("transform");
         mat4 transform = mat4::identity();
         if (transform_node) {
             transform = parse_transform(transform_node);
         }
 
-        auto emitter_node = shape.child("emitter");
-        Option<Emitter> emitter = {};
-        if (emitter_node) {
-            emitter = load_emitter(emitter_node, sc);
-        }
+        meshes[i] = parse_mesh_file(mesh_nodes[i], transform, &pool);
+    });
 
-        if (type == "rectangle") {
-            load_rectangle(shape, mat_id, transform, emitter, sc);
-        } else if (type == "cube") {
-            load_cube(shape, mat_id, transform, emitter, sc);
-        } else if (type == "obj") {
-            load_obj(shape, mat_id, transform, emitter, sc);
-        } else if (type == "sphere") {
-            load_sphere(shape, mat_id, transform, emitter, sc);
+    for (u64 i = 0; i < mesh_nodes.size(); i++) {
+        prefetched_meshes.emplace(mesh_nodes[i].internal_object(), std::move(meshes[i]));
+    }
+}
+
+void
+SceneLoader::load_shapes(Scene &sc, const pugi::xml_node &scene) {
+    for (pugi::xml_node shape : scene.children("shape")) {
+        str type = shape.attribute("type").as_string();
+
+        if (type == "shapegroup") {
+            load_shape_group(sc, shape);
+        } else if (type == "instance") {
+            load_instance(sc, shape);
         } else {
-            throw std::runtime_error(fmt::format("Unknown shape type: {}", type));
+            load_shape(sc, shape);
         }
     }
 }
 
+void
+SceneLoader::load_shape_group(Scene &sc, const pugi::xml_node &shape_group) {
+    std::string id = shape_group.attribute("id").as_string();
+    if (id.empty()) {
+        throw std::runtime_error("Shapegroup has no id");
+    }
+
+    u32 meshes_start = sc.geometry.get_next_shape_index(ShapeType::Mesh);
+
+    for (pugi::xml_node shape : shape_group.children("shape")) {
+        str type = shape.attribute("type").as_string();
+
+        // Spheres are all in one Embree geometry, so they can't be instanced
+        if (type == "shapegroup" || type == "instance" || type == "sphere") {
+            throw std::runtime_error(fmt::format(
+                "Shape type '{}' isn't supported in shapegroup '{}'", type, id));
+        }
+
+        // Lights are sampled in world space, every instance would need its own lights
+        if (shape.child("emitter")) {
+            throw std::runtime_error(
+                fmt::format("Emitters aren't supported in shapegroup '{}'", id));
+        }
+
+        load_shape(sc, shape);
+    }
+
+    if (cache.has_value()) {
+        return;
+    }
+
+    u32 meshes_end = sc.geometry.get_next_shape_index(ShapeType::Mesh);
+    shape_groups[id] = sc.geometry.add_shape_group(meshes_start, meshes_end);
+}
+
+void
+SceneLoader::load_instance(Scene &sc, const pugi::xml_node &instance) {
+    if (cache.has_value()) {
+        return;
+    }
+
+    std::string group_id = instance.child("ref").attribute("id").as_string();
+
+    auto group = shape_groups.find(group_id);
+    if (group == shape_groups.end()) {
+        throw std::runtime_error(
+            fmt::format("Instance references unknown shapegroup '{}'", group_id));
+    }
+
+    auto transform_node = instance.child("transform");
+    mat4 transform = mat4::identity();
+    if (transform_node) {
+        transform = parse_transform(transform_node);
+    }
+
+    sc.geometry.add_instance(group->second, transform);
+}
+
+void
+SceneLoader::load_shape(Scene &sc, const pugi::xml_node &shape) {
+    str type = shape.attribute("type").as_string();
+
+    u32 mat_id;
+
+    auto ref_node = shape.child("ref");
+    auto bsdf_node = shape.child("bsdf");
+    if (ref_node) {
+        std::string bsdf_id = ref_node.attribute("id").as_string();
+        mat_id = materials.at(bsdf_id);
+    } else if (bsdf_node) {
+        auto [mat, _] = load_material(sc, bsdf_node);
+        mat_id = sc.add_material(std::move(mat));
+    } else {
+        throw std::runtime_error("Shape has no material");
+    }
+
+    // Only the inline materials are needed, their ids depend on the order of the shapes
+    if (cache.has_value()) {
+        return;
+    }
+
+    auto transform_node = shape.child("transform");
+    mat4 transform = mat4::identity();
+    if (transform_node) {
+        transform = parse_transform(transform_node);
+    }
+
+    auto emitter_node = shape.child("emitter");
+    Option<Emitter> emitter = {};
+    if (emitter_node) {
+        emitter = load_emitter(emitter_node, sc);
+    }
+
+    if (type == "rectangle") {
+        load_rectangle(shape, mat_id, transform, emitter, sc);
+    } else if (type == "cube") {
+        load_cube(shape, mat_id, transform, emitter, sc);
+    } else if (type == "obj" || type == "ply") {
+        load_mesh_file(shape, mat_id, transform, emitter, sc);
+    } else if (type == "sphere") {
+        load_sphere(shape, mat_id, transform, emitter, sc);
+    } else {
+        throw std::runtime_error(fmt::format("Unknown shape type: {}", type));
+    }
+}
+
 void
 SceneLoader::load_materials(pugi::xml_node scene, Scene &sc) {
     // HACK: default material
@@ -164,7 +391,7 @@ SceneLoader::load_material(Scene &scene, pugi::xml_node &bsdf) {
 }
 
 Material
-SceneLoader::load_plastic_material(Scene &sc, const pugi::xml_node &bsdf) const {
+SceneLoader::load_plastic_material(Scene &sc, const pugi::xml_node &bsdf) {
     Spectrum int_ior(POLYPROPYLENE_ETA);
     Spectrum ext_ior(AIR_ETA);
 
@@ -187,7 +414,7 @@ SceneLoader::load_plastic_material(Scene &sc, const pugi::xml_node &bsdf) const
 }
 
 Material
-SceneLoader::load_roughp_lastic_material(Scene &sc, const pugi::xml_node &bsdf) const {
+SceneLoader::load_roughp_lastic_material(Scene &sc, const pugi::xml_node &bsdf) {
     Spectrum int_ior(POLYPROPYLENE_ETA);
     Spectrum ext_ior(AIR_ETA);
 
@@ -280,15 +507,21 @@ SceneLoader::load_dielectric_material(Scene &sc, const pugi::xml_node &bsdf) con
 }
 
 u32
-SceneLoader::load_texture(Scene &sc, const pugi::xml_node &texture_node) const {
+SceneLoader::load_texture(Scene &sc, const pugi::xml_node &texture_node) {
     if (str(texture_node.name()) == "texture") {
         auto filename_node = child_node(texture_node, "filename");
         auto file_name = filename_node.attribute("value").as_string();
         auto file_path = this->scene_base_path + "/" + file_name;
 
-        auto texture = Texture::make_image_texture(file_path, true);
+        auto existing = image_texture_ids.find(file_path);
+        if (existing != image_texture_ids.end()) {
+            return existing->second;
+        }
 
-        u32 tex_id = sc.add_texture(std::move(texture));
+        auto *image = sc.texture_cache.add(file_path, true);
+        u32 tex_id = sc.add_texture(Texture::make_image_texture(image));
+        asset_paths.push_back(file_path);
+        image_texture_ids.emplace(file_path, tex_id);
         return tex_id;
     } else {
         tuple3 rgb = parse_tuple3(texture_node.attribute("value").as_string());
@@ -509,12 +742,85 @@ SceneLoader::load_sphere(pugi::xml_node node, u32 mat_id, mat4 transform,
     sc.add_sphere(sphere);
 }
 
-void
-SceneLoader::load_obj(pugi::xml_node shape_node, u32 mat_id, const mat4 &transform,
-                      Option<Emitter> emitter, Scene &sc) {
+std::string
+SceneLoader::mesh_path(const pugi::xml_node &shape_node) const {
     std::string filename = shape_node.child("string").attribute("value").as_string();
-    auto file_path = scene_base_path + "/" + filename;
+    return scene_base_path + "/" + filename;
+}
 
+void
+SceneLoader::load_mesh_file(pugi::xml_node shape_node, u32 mat_id,
+                            const mat4 &transform, Option<Emitter> emitter, Scene &sc) {
+    asset_paths.push_back(mesh_path(shape_node));
+
+    LoadedMesh mesh{};
+    auto prefetched = prefetched_meshes.find(shape_node.internal_object());
+    if (prefetched != prefetched_meshes.end()) {
+        mesh = std::move(prefetched->second);
+        prefetched_meshes.erase(prefetched);
+    } else {
+        mesh = parse_mesh_file(shape_node, transform, nullptr);
+    }
+
+    MeshParams mp = {
+        .indices = &mesh.indices,
+        .pos = &mesh.pos,
+        .normals = mesh.normals.empty() ? nullptr : &mesh.normals,
+        .uvs = mesh.uvs.empty() ? nullptr : &mesh.uvs,
+        .material_id = mat_id,
+        .emitter = std::move(emitter),
+    };
+
+    sc.add_mesh(mp);
+}
+
+SceneLoader::LoadedMesh
+SceneLoader::parse_mesh_file(const pugi::xml_node &shape_node, const mat4 &transform,
+                             TaskPool *pool) const {
+    auto file_path = mesh_path(shape_node);
+
+    bool face_normals = false;
+    auto face_normals_node = child_node(shape_node, "face_normals");
+    if (face_normals_node) {
+        face_normals = face_normals_node.attribute("value").as_bool();
+    }
+
+    LoadedMesh mesh{};
+    if (shape_node.attribute("type").as_string() == str("ply")) {
+        auto ply = load_ply(file_path);
+        mesh = LoadedMesh{
+            .indices = std::move(ply.indices),
+            .pos = std::move(ply.pos),
+            .normals = face_normals ? std::vector<vec3>{} : std::move(ply.normals),
+            .uvs = std::move(ply.uvs),
+        };
+    } else {
+        mesh = parse_obj(file_path, face_normals);
+    }
+
+    auto &pos = mesh.pos;
+    auto &normals = mesh.normals;
+    auto inv_trans = transform.transpose().inverse();
+    auto transform_vertex = [&](u64 v) {
+        pos[v] = transform.transform_point(pos[v]);
+        if (!normals.empty()) {
+            normals[v] = inv_trans.transform_vec(normals[v]);
+        }
+    };
+
+    if (pool != nullptr) {
+        pool->parallel_for(pos.size(), TRANSFORM_GRAIN_SIZE, transform_vertex);
+    } else {
+        for (u64 v = 0; v < pos.size(); v++) {
+            transform_vertex(v);
+        }
+    }
+
+    return mesh;
+}
+
+SceneLoader::LoadedMesh
+SceneLoader::parse_obj(const std::string &file_path, bool face_normals) {
     tinyobj::ObjReaderConfig reader_config;
     reader_config.mtl_search_path = "./";
     reader_config.triangulate = true;
@@ -534,19 +840,14 @@ SceneLoader::load_obj(pugi::xml_node shape_node, u32 mat_id, const mat4 &transfo
         spdlog::warn("Warning when reading obj file");
     }
 
-    bool face_normals = false;
-    auto face_normals_node = child_node(shape_node, "face_normals");
-    if (face_normals_node) {
-        face_normals = face_normals_node.attribute("value").as_bool();
-    }
-
     auto &attrib = reader.GetAttrib();
     auto &shapes = reader.GetShapes();
 
-    std::vector<point3> pos{};
-    std::vector<vec3> normals{};
-    std::vector<vec2> uvs{};
-    std::vector<u32> indices{};
+    LoadedMesh mesh{};
+    auto &pos = mesh.pos;
+    auto &normals = mesh.normals;
+    auto &uvs = mesh.uvs;
+    auto &indices = mesh.indices;
 
     if (shapes.size() != 1) {
         throw std::runtime_error(
@@ -556,6 +857,7 @@ SceneLoader::load_obj(pugi::xml_node shape_node, u32 mat_id, const mat4 &transfo
 
     // Wavefront OBJ format is so cursed....
     // Load indices
+    indices.reserve(shape->mesh.num_face_vertices.size() * 3);
     for (size_t f = 0; f < shape->mesh.num_face_vertices.size(); f++) {
         auto fv = size_t(shape->mesh.num_face_vertices[f]);
         if (fv != 3) {
@@ -599,6 +901,10 @@ SceneLoader::load_obj(pugi::xml_node shape_node, u32 mat_id, const mat4 &transfo
     }
 
     // Copy vertices
+    pos.reserve(pos_size);
+    normals.reserve(face_normals ? 0 : pos_size);
+    uvs.reserve(uvs_size);
+
     for (int v = 0; v < pos_size; v++) {
         tinyobj::real_t x = attrib.vertices[3 * v];
         tinyobj::real_t y = attrib.vertices[3 * v + 1];
@@ -623,25 +929,7 @@ SceneLoader::load_obj(pugi::xml_node shape_node, u32 mat_id, const mat4 &transfo
         uvs.push_back(uv);
     }
 
-    for (auto &po : pos) {
-        po = transform.transform_point(po);
-    }
-
-    auto inv_trans = transform.transpose().inverse();
-    for (auto &normal : normals) {
-        normal = inv_trans.transform_vec(normal);
-    }
-
-    MeshParams mp = {
-        .indices = &indices,
-        .pos = &pos,
-        .normals = (face_normals) ? nullptr : &normals,
-        .uvs = &uvs,
-        .material_id = mat_id,
-        .emitter = std::move(emitter),
-    };
-
-    sc.add_mesh(mp);
+    return mesh;
 }
 
 Option<SceneAttribs>
@@ -12,6 +12,8 @@
 #include "../scene/scene.h"
 #include "../scene/texture.h"
 #include "../utils/basic_types.h"
+#include "../utils/task_pool.h"
+#include "scene_cache.h"
 
 struct SceneAttribs {
     u32 resx = 1280;
@@ -37,14 +39,43 @@ public:
 
         auto path = std::filesystem::path(scene_path);
         scene_base_path = path.parent_path();
+        asset_paths.push_back(scene_path);
     }
 
     std::optional<SceneAttribs>
     load_scene_attribs();
+
+    /// Also initializes the light sampler. With a cache_path, the geometry, lights and
+    /// textures are taken from the scene cache if it's valid, else the cache is written.
     void
-    load_scene(Scene &sc);
+    load_scene(Scene &sc, const std::string &cache_path = "");
 
 private:
+    /// Vertices of an OBJ or PLY file, normals and uvs are empty if the mesh doesn't
+    /// have them
+    struct LoadedMesh {
+        std::vector<u32> indices{};
+        std::vector<point3> pos{};
+        std::vector<vec3> normals{};
+        std::vector<vec2> uvs{};
+    };
+
+    /// Number of vertices transformed by one task
+    static constexpr u64 TRANSFORM_GRAIN_SIZE = 16384;
+
+    static constexpr u64 RECTANGLE_NUM_INDICES = 6;
+    static constexpr u64 RECTANGLE_NUM_VERTICES = 4;
+    static constexpr u64 CUBE_NUM_INDICES = 36;
+    static constexpr u64 CUBE_NUM_VERTICES = 8;
+
+    /// Parses the OBJ and PLY files of the scene concurrently
+    void
+    prefetch_meshes(const pugi::xml_node &scene, TaskPool &pool);
+
+    /// Sizes of all meshes of the scene, the OBJ and PLY files have to be prefetched
+    MeshCounts
+    count_meshes(const pugi::xml_node &scene) const;
+
     static void
     load_rectangle(pugi::xml_node shape, u32 mat_id, const mat4 &transform,
                    Option<Emitter>, Scene &sc);
@@ -53,9 +84,22 @@ private:
     load_cube(pugi::xml_node shape_node, u32 mat_id, const mat4 &transform,
               Option<Emitter>, Scene &sc);
 
+    /// Loads an "obj" or "ply" shape
     void
-    load_obj(pugi::xml_node shape_node, u32 mat_id, const mat4 &transform,
-             Option<Emitter>, Scene &sc);
+    load_mesh_file(pugi::xml_node shape_node, u32 mat_id, const mat4 &transform,
+                   Option<Emitter>, Scene &sc);
+
+    /// Safe to call from multiple threads, the vertices are transformed to world space
+    /// on the pool if there is one
+    LoadedMesh
+    parse_mesh_file(const pugi::xml_node &shape_node, const mat4 &transform,
+                    TaskPool *pool) const;
+
+    static LoadedMesh
+    parse_obj(const std::string &file_path, bool face_normals);
+
+    std::string
+    mesh_path(const pugi::xml_node &shape_node) const;
 
     void
     load_sphere(pugi::xml_node node, u32 id, mat4 mat_1, Option<Emitter> emitter_id,
@@ -76,6 +120,16 @@ private:
     void
     load_shapes(Scene &sc, const pugi::xml_node &scene);
 
+    void
+    load_shape(Scene &sc, const pugi::xml_node &shape);
+
+    /// The meshes of the group are built once as an Embree sub-scene
+    void
+    load_shape_group(Scene &sc, const pugi::xml_node &shape_group);
+
+    void
+    load_instance(Scene &sc, const pugi::xml_node &instance);
+
     std::tuple<Material, std::string>
     load_material(Scene &scene, pugi::xml_node &bsdf);
 
@@ -83,10 +137,10 @@ private:
     load_diffuse_material(Scene &sc, const pugi::xml_node &bsdf);
 
     Material
-    load_plastic_material(Scene &sc, const pugi::xml_node &bsdf) const;
+    load_plastic_material(Scene &sc, const pugi::xml_node &bsdf);
 
     Material
-    load_roughp_lastic_material(Scene &sc, const pugi::xml_node &bsdf) const;
+    load_roughp_lastic_material(Scene &sc, const pugi::xml_node &bsdf);
 
     Material
     load_conductor_material(Scene &sc, const pugi::xml_node &bsdf) const;
@@ -104,11 +158,23 @@ private:
     parse_transform_rotate(const pugi::xml_node &transform_node);
 
     u32
-    load_texture(Scene &sc, const pugi::xml_node &texture_node) const;
+    load_texture(Scene &sc, const pugi::xml_node &texture_node);
 
     std::string scene_base_path;
     pugi::xml_document doc;
     std::unordered_map<std::string, u32> materials;
+    /// Shapegroup ids to their index in Geometry::instances
+    std::unordered_map<std::string, u32> shape_groups;
+
+    /// Valid scene cache, only the materials are loaded from the XML then
+    Option<SceneCache> cache{};
+    /// Files the scene is loaded from, the cache is invalidated when any of them changes
+    std::vector<std::string> asset_paths{};
+    /// Texture ids of the image files, materials that use the same file share a texture
+    std::unordered_map<std::string, u32> image_texture_ids{};
+
+    /// Parsed mesh files by their shape node
+    std::unordered_map<pugi::xml_node_struct *, LoadedMesh> prefetched_meshes{};
 };
 
 #endif // PT_SCENE_LOADER_H
@@ -0,0 +1,188 @@
+#include "ply_loader.h"
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+namespace {
+
+std::string
+write_ply(const std::string &name, const std::string &header,
+          const std::vector<u8> &data) {
+    auto path = (std::filesystem::temp_directory_path() / name).string();
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << header;
+    out.write(reinterpret_cast<const char *>(data.data()),
+              static_cast<std::streamsize>(data.size()));
+    return path;
+}
+
+template <typename T>
+void
+append(std::vector<u8> &data, T value) {
+    u8 bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    data.insert(data.end(), bytes, bytes + sizeof(T));
+}
+
+} // namespace
+
+TEST_CASE("PLY with packed float attributes and a quad", "[ply]") {
+    const std::string header = "ply\n"
+                               "format binary_little_endian 1.0\n"
+                               "comment written by the test\n"
+                               "element vertex 4\n"
+                               "property float x\n"
+                               "property float y\n"
+                               "property float z\n"
+                               "property float nx\n"
+                               "property float ny\n"
+                               "property float nz\n"
+                               "property float u\n"
+                               "property float v\n"
+                               "element face 1\n"
+                               "property list uchar int vertex_indices\n"
+                               "end_header\n";
+
+    std::vector<u8> data{};
+    const f32 corners[4][2] = {{0.f, 0.f}, {1.f, 0.f}, {1.f, 1.f}, {0.f, 1.f}};
+    for (const auto &corner : corners) {
+        append(data, corner[0]);
+        append(data, corner[1]);
+        append(data, 2.f);
+        append(data, 0.f);
+        append(data, 0.f);
+        append(data, 1.f);
+        append(data, corner[0]);
+        append(data, corner[1]);
+    }
+    append<u8>(data, 4);
+    for (i32 i = 0; i < 4; i++) {
+        append(data, i);
+    }
+
+    auto mesh = load_ply(write_ply("pt_test_quad.ply", header, data));
+
+    REQUIRE(mesh.pos.size() == 4);
+    REQUIRE(mesh.pos[2].x == 1.f);
+    REQUIRE(mesh.pos[2].y == 1.f);
+    REQUIRE(mesh.pos[2].z == 2.f);
+    REQUIRE(mesh.normals.size() == 4);
+    REQUIRE(mesh.normals[3].z == 1.f);
+    REQUIRE(mesh.uvs.size() == 4);
+    REQUIRE(mesh.uvs[1].x == 1.f);
+    REQUIRE(mesh.indices == std::vector<u32>{0, 1, 2, 0, 2, 3});
+}
+
+TEST_CASE("PLY with mixed property types and extra elements", "[ply]") {
+    const std::string header = "ply\r\n"
+                               "format binary_little_endian 1.0\r\n"
+                               "element vertex 3\r\n"
+                               "property uchar red\r\n"
+                               "property double z\r\n"
+                               "property double x\r\n"
+                               "property double y\r\n"
+                               "element face 1\r\n"
+                               "property uchar flags\r\n"
+                               "property list uint8 uint16 vertex_index\r\n"
+                               "element edge 1\r\n"
+                               "property list uchar int vertices\r\n"
+                               "end_header\r\n";
+
+    std::vector<u8> data{};
+    for (u32 v = 0; v < 3; v++) {
+        append<u8>(data, 255);
+        append<f64>(data, 3.);
+        append<f64>(data, v);
+        append<f64>(data, -1.);
+    }
+    append<u8>(data, 7);
+    append<u8>(data, 3);
+    append<u16>(data, 2);
+    append<u16>(data, 1);
+    append<u16>(data, 0);
+    append<u8>(data, 2);
+    append<i32>(data, 0);
+    append<i32>(data, 1);
+
+    auto mesh = load_ply(write_ply("pt_test_mixed.ply", header, data));
+
+    REQUIRE(mesh.pos.size() == 3);
+    REQUIRE(mesh.pos[1].x == 1.f);
+    REQUIRE(mesh.pos[1].y == -1.f);
+    REQUIRE(mesh.pos[1].z == 3.f);
+    REQUIRE(mesh.normals.empty());
+    REQUIRE(mesh.uvs.empty());
+    REQUIRE(mesh.indices == std::vector<u32>{2, 1, 0});
+}
+
+TEST_CASE("PLY errors", "[ply]") {
+    const std::string header = "ply\n"
+                               "format binary_little_endian 1.0\n"
+                               "element vertex 3\n"
+                               "property float x\n"
+                               "property float y\n"
+                               "property float z\n"
+                               "element face 1\n"
+                               "property list uchar int vertex_indices\n"
+                               "end_header\n";
+
+    std::vector<u8> data{};
+    for (u32 i = 0; i < 9; i++) {
+        append(data, 0.f);
+    }
+    append<u8>(data, 3);
+    append<i32>(data, 0);
+    append<i32>(data, 1);
+
+    // Missing the last index
+    REQUIRE_THROWS(load_ply(write_ply("pt_test_truncated.ply", header, data)));
+
+    auto negative = data;
+    append<i32>(negative, -1);
+    REQUIRE_THROWS(load_ply(write_ply("pt_test_negative.ply", header, negative)));
+
+    // The size of the vertex block overflows
+    std::string huge_header = header;
+    huge_header.replace(huge_header.find("vertex 3"), 8, "vertex 2305843009213693952");
+    REQUIRE_THROWS(load_ply(write_ply("pt_test_huge.ply", huge_header, data)));
+
+    append<i32>(data, 3);
+    REQUIRE_THROWS(load_ply(write_ply("pt_test_out_of_range.ply", header, data)));
+
+    std::string ascii_header = header;
+    ascii_header.replace(ascii_header.find("binary_little_endian"), 20, "ascii");
+    REQUIRE_THROWS(load_ply(write_ply("pt_test_ascii.ply", ascii_header, data)));
+}
+
+TEST_CASE("PLY with only float positions", "[ply]") {
+    const std::string header = "ply\n"
+                               "format binary_little_endian 1.0\n"
+                               "element vertex 3\n"
+                               "property float x\n"
+                               "property float y\n"
+                               "property float z\n"
+                               "element face 1\n"
+                               "property list uchar uint vertex_indices\n"
+                               "end_header\n";
+
+    std::vector<u8> data{};
+    for (u32 i = 0; i < 9; i++) {
+        append(data, static_cast<f32>(i));
+    }
+    append<u8>(data, 3);
+    append<u32>(data, 0);
+    append<u32>(data, 2);
+    append<u32>(data, 1);
+
+    auto mesh = load_ply(write_ply("pt_test_positions.ply", header, data));
+
+    REQUIRE(mesh.pos.size() == 3);
+    REQUIRE(mesh.pos[1].x == 3.f);
+    REQUIRE(mesh.pos[2].z == 8.f);
+    REQUIRE(mesh.normals.empty());
+    REQUIRE(mesh.indices == std::vector<u32>{0, 2, 1});
+}
@@ -7,13 +7,32 @@
 #include "render_context.h"
 #include "utils/basic_types.h"
 #include "utils/render_threads.h"
+#include "utils/thread_placement.h"
 
-#include <bit>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <csignal>
+#include <limits>
 
 #include <CLI/CLI.hpp>
 #include <spdlog/spdlog.h>
 
+namespace {
+
+std::atomic<bool> stop_requested{false};
+
+static_assert(std::atomic<bool>::is_always_lock_free);
+
+extern "C" void
+handle_stop_signal(int signal) {
+    stop_requested.store(true);
+    // A second signal kills the process
+    std::signal(signal, SIG_DFL);
+}
+
+} // namespace
+
 int
 main(int argc, char **argv) {
     /*
@@ -24,25 +43,114 @@ main(int argc, char **argv) {
     bool silent = false;
     std::string scene_path{};
     IntegratorType integrator_type = IntegratorType::MISNEE;
+    ThreadConfig thread_config{};
+    std::string affinity = "none";
+    AdaptiveSampling adaptive{};
+    u32 max_spp = 0;
+    f64 time_limit_secs = 0.;
+    bool preview = false;
+    u32 light_samples = 1;
+    EmbreeConfig embree_config{};
+    bool compact_meshes = false;
+    std::string scene_cache_path{};
+    u64 texture_memory_mib = 0;
+    std::string coeff_cache_dir{};
+    TextureDataType coeff_type = TextureDataType::F32;
+    LightSamplerType light_sampler_type = LightSamplerType::Power;
 
     CLI::App app{"A path-tracer by Tomáš Král, 2023-2024."};
     // argv = app.ensure_utf8(argv);
 
     std::map<std::string, IntegratorType> map{{"naive", IntegratorType::Naive},
                                               {"mis_nee", IntegratorType::MISNEE},
-                                              {"bdpt_nee", IntegratorType::BDPTNEE}};
+                                              {"bdpt_nee", IntegratorType::BDPTNEE},
+                                              {"wavefront", IntegratorType::Wavefront}};
 
     app.add_option("--samples", spp, "Samples per pixel (SPP).");
+    app.add_option("--time-limit", time_limit_secs,
+                   "Render until the time limit (in seconds) is reached instead of "
+                   "stopping at the SPP.")
+        ->default_val(0.);
     app.add_option("-s,--scene", scene_path, "Path to the scene file.");
+    app.add_option("--scene-cache", scene_cache_path,
+                   "Binary cache of the loaded scene, written if it's missing or stale.");
     app.add_flag("--silent,!--no-silent", silent, "Silent run.")->default_val(true);
     app.add_option("-i,--integrator", integrator_type, "Integrator")
         ->transform(CLI::CheckedTransformer(map, CLI::ignore_case))
         ->default_val(IntegratorType::MISNEE);
+    app.add_option("--light-samples", light_samples,
+                   "Number of light samples at each path vertex.")
+        ->default_val(1)
+        ->check(CLI::PositiveNumber);
+    std::map<std::string, RTCBuildQuality> bvh_quality_map{
+        {"low", RTC_BUILD_QUALITY_LOW},
+        {"medium", RTC_BUILD_QUALITY_MEDIUM},
+        {"high", RTC_BUILD_QUALITY_HIGH}};
+
+    app.add_option("--bvh-quality", embree_config.build_quality,
+                   "BVH build quality: low (fast builds for previews), medium or high "
+                   "(SAH with spatial splits for final frames).")
+        ->transform(CLI::CheckedTransformer(bvh_quality_map, CLI::ignore_case))
+        ->default_val(RTC_BUILD_QUALITY_MEDIUM);
+    app.add_flag("--bvh-compact", embree_config.compact,
+                 "Use Embree's compact BVH layout for huge scenes.");
+    app.add_flag("--bvh-robust", embree_config.robust,
+                 "Use Embree's robust traversal mode.");
+    app.add_flag("--compact-meshes", compact_meshes,
+                 "Store mesh normals oct-encoded and UVs as half floats.");
+    app.add_option("--texture-memory", texture_memory_mib,
+                   "Memory budget of the texture cache in MiB, 0 keeps all textures that "
+                   "were sampled in memory.")
+        ->default_val(0);
+    app.add_option("--coeff-cache", coeff_cache_dir,
+                   "Directory where the spectral coefficients of RGB textures are cached "
+                   "between runs.");
+    std::map<std::string, TextureDataType> coeff_type_map{{"f32", TextureDataType::F32},
+                                                          {"f16", TextureDataType::F16},
+                                                          {"u16", TextureDataType::U16}};
+    app.add_option("--texture-coeffs", coeff_type,
+                   "Storage of the spectral coefficients of RGB textures: f32, f16 or "
+                   "u16 (normalized to the range of each texture).")
+        ->transform(CLI::CheckedTransformer(coeff_type_map, CLI::ignore_case))
+        ->default_val(TextureDataType::F32);
+    std::map<std::string, LightSamplerType> light_sampler_map{
+        {"power", LightSamplerType::Power}, {"bvh", LightSamplerType::Bvh}};
+    app.add_option("--light-sampler", light_sampler_type,
+                   "Light selection: power, or bvh (according to the contribution to the "
+                   "shading point, for scenes with many lights).")
+        ->transform(CLI::CheckedTransformer(light_sampler_map, CLI::ignore_case))
+        ->default_val(LightSamplerType::Power);
+    app.add_option("--embree-config", embree_config.device_config,
+                   "Extra Embree device config, e.g. \"isa=avx2,hugepages=1\".");
+    app.add_option("-t,--threads", thread_config.num_threads,
+                   "Number of render threads, 0 uses all available CPUs.")
+        ->default_val(0);
+    app.add_option("--affinity", affinity,
+                   "Thread pinning: none, compact, scatter or a CPU list "
+                   "(e.g. 0-7,16-23).")
+        ->default_val("none");
+    app.add_flag("--preview", preview,
+                 "Also write a tonemapped PNG preview next to the EXR.");
+    app.add_flag("--numa", thread_config.numa,
+                 "NUMA-aware placement of render threads and framebuffer memory.");
+    app.add_option("--adaptive-threshold", adaptive.threshold,
+                   "Relative error at which pixels stop getting samples, 0 disables "
+                   "adaptive sampling.")
+        ->default_val(0.f);
+    app.add_option("--adaptive-min-samples", adaptive.min_samples,
+                   "Samples a pixel needs before it's tested for convergence.")
+        ->default_val(16);
+    app.add_option("--adaptive-max-samples", max_spp,
+                   "Maximum samples of a single pixel with adaptive sampling, 0 means 8x "
+                   "the SPP.")
+        ->default_val(0);
 
     CLI11_PARSE(app, argc, argv)
 
-    std::string output_filename =
-        std::filesystem::path(scene_path).filename().stem().string() + ".exr";
+    std::string output_stem =
+        std::filesystem::path(scene_path).filename().stem().string();
+    std::string output_filename = output_stem + ".exr";
+    std::string preview_filename = preview ? output_stem + ".png" : "";
 
     spdlog::set_level(spdlog::level::info);
 
@@ -50,6 +158,15 @@ main(int argc, char **argv) {
         spdlog::set_level(spdlog::level::err);
     }
 
+    try {
+        thread_config.set_affinity(affinity);
+    } catch (const std::exception &e) {
+        spdlog::error("{}", e.what());
+        return 1;
+    }
+
+    auto thread_placements = plan_thread_placement(thread_config, CpuTopology::detect());
+
     /*
      * Load scene attribs from the scene file
      * */
@@ -70,46 +187,182 @@ main(int argc, char **argv) {
 
     RenderContext rc(attribs);
 
+    rc.scene.geometry.meshes.compact = compact_meshes;
+    rc.scene.texture_cache.set_memory_budget(texture_memory_mib * 1024 * 1024);
+    rc.scene.texture_cache.set_coeff_type(coeff_type);
+    rc.scene.light_sampler_type = light_sampler_type;
+    try {
+        rc.scene.texture_cache.set_coeff_cache_dir(coeff_cache_dir);
+    } catch (const std::exception &e) {
+        spdlog::error("Couldn't create the coefficient cache: {}", e.what());
+        return 1;
+    }
+
     spdlog::info("Loading the scene");
     try {
-        scene_loader.load_scene(rc.scene);
+        scene_loader.load_scene(rc.scene, scene_cache_path);
     } catch (const std::exception &e) {
         spdlog::error("Error while loading the scene {}", e.what());
         return 1;
     }
 
-    rc.scene.init_light_sampler();
+    rc.scene.geometry.meshes.log_memory_usage();
 
     spdlog::info("Creating Embree acceleration structure");
-    auto embree_device = EmbreeDevice(rc.scene);
+    // Give Embree's build threads the same CPU budget as the render threads, the user's
+    // config comes last so that it can override this
+    std::string device_config = fmt::format("threads={}", thread_placements.size());
+    if (thread_config.affinity != AffinityMode::None || thread_config.numa) {
+        device_config += ",set_affinity=1";
+    }
+    if (!embree_config.device_config.empty()) {
+        device_config += "," + embree_config.device_config;
+    }
+    embree_config.device_config = device_config;
+
+    EmbreeDevice embree_device(rc.scene, embree_config);
 
-    Integrator integrator(integrator_type, &rc, &embree_device);
+    Integrator integrator(integrator_type, &rc, &embree_device, light_samples);
 
-    RenderThreads render_threads(rc.attribs, &integrator);
+    u64 num_pixels = rc.fb.num_pixels();
 
-    spdlog::info("Rendering a {}x{} image at {} spp.", attribs.resx, attribs.resy, spp);
+    const bool time_limited = time_limit_secs > 0.;
+    const std::chrono::duration<f64> time_limit{time_limit_secs};
+
+    // The samples saved on converged pixels can be spent on noisy pixels, up to
+    // max_spp samples per pixel
+    if (time_limited) {
+        max_spp = std::numeric_limits<u32>::max() / 2;
+        adaptive.sample_budget = std::numeric_limits<i64>::max();
+    } else if (adaptive.enabled()) {
+        adaptive.sample_budget = num_pixels * spp;
+        if (max_spp == 0) {
+            max_spp = spp * 8;
+        }
+        max_spp = std::max(max_spp, spp);
+    } else {
+        max_spp = spp;
+    }
+
+    // Conversion of the image runs alongside the render threads, so it only gets a few
+    u32 num_convert_threads = std::max<u32>(thread_placements.size() / 4, 1);
+    AsyncImageWriter image_writer(output_filename, preview_filename, num_convert_threads);
+
+    RenderThreads render_threads(rc.attribs, std::move(thread_placements),
+                                 thread_config.numa, adaptive, &integrator, &rc.fb,
+                                 &rc.scene.texture_cache);
+
+    if (time_limited) {
+        spdlog::info("Rendering a {}x{} image for {:.1f} s.", attribs.resx, attribs.resy,
+                     time_limit.count());
+    } else {
+        spdlog::info("Rendering a {}x{} image at {} spp.", attribs.resx, attribs.resy,
+                     spp);
+    }
+
+    // Interrupted renders still write out the samples they have
+    std::signal(SIGINT, handle_stop_signal);
+    std::signal(SIGTERM, handle_stop_signal);
 
     ProgressBar pb;
     const auto start{std::chrono::steady_clock::now()};
 
-    for (u32 s = 1; s <= spp; s++) {
-        render_threads.start_new_frame();
+    auto elapsed = [&] {
+        return std::chrono::duration<f64>(std::chrono::steady_clock::now() - start);
+    };
+
+    auto print_progress = [&] {
+        u64 avg_spp = render_threads.samples_done() / num_pixels;
+        if (time_limited) {
+            pb.print_timed(avg_spp, elapsed(), time_limit);
+        } else if (avg_spp > 0) {
+            pb.print(avg_spp, spp, elapsed());
+        }
+    };
+
+    u32 samples_done = 0;
+    bool stopped = false;
+    // Time of one sample per pixel in the last batch
+    std::chrono::duration<f64> sample_time{0.};
+
+    while (samples_done < max_spp && !render_threads.adaptive_done() && !stopped &&
+           !stop_requested) {
+        // Threads only need to synchronize when the framebuffer is written out, which
+        // happens when the number of samples doubles...
+        u32 batch_end = std::min(samples_done == 0 ? 1 : samples_done * 2, max_spp);
 
-        const auto end{std::chrono::steady_clock::now()};
-        const std::chrono::duration<f64> elapsed{end - start};
+        if (time_limited && samples_done > 0) {
+            // Only start as many samples as are predicted to fit into the remaining time,
+            // with some slack for the timing noise
+            auto remaining = time_limit - elapsed() - image_writer.last_write_duration();
+            f64 samples_fit = 0.9 * remaining / sample_time;
+            if (samples_fit < 1.) {
+                break;
+            }
 
-        // Update the framebuffer when the number of samples doubles...
-        if (std::popcount(s) == 1) {
-            ImageWriter::write_framebuffer(output_filename, rc.fb, s);
+            u32 max_batch = std::min(samples_fit, static_cast<f64>(max_spp));
+            batch_end = std::min(batch_end, samples_done + max_batch);
         }
 
-        integrator.frame += 1;
-        pb.print(s, spp, elapsed);
+        const auto batch_start{std::chrono::steady_clock::now()};
+        render_threads.start_samples(batch_end);
+
+        while (!render_threads.wait_samples(std::chrono::milliseconds(100))) {
+            print_progress();
+
+            if (!stopped &&
+                (stop_requested || (time_limited && elapsed() >= time_limit))) {
+                // Finish the tiles in flight and keep what was rendered
+                render_threads.cancel_batch();
+                stopped = true;
+            }
+        }
+
+        const auto batch_end_time{std::chrono::steady_clock::now()};
+        sample_time = (batch_end_time - batch_start) / (batch_end - samples_done);
+
+        samples_done = batch_end;
+        print_progress();
+
+        // Blocks only if the previous image is still waiting to be written
+        image_writer.write(rc.fb);
+    }
+
+    if (stop_requested) {
+        fmt::println("");
+        spdlog::warn("Render was interrupted, the image has the samples rendered so far");
     }
 
     render_threads.schedule_stop();
+    image_writer.flush();
+
+    const std::chrono::duration<f64> total_time{std::chrono::steady_clock::now() -
+                                                start};
+    RenderStats stats = render_threads.stats();
+
+    fmt::println("");
+    spdlog::info("Render took {:.2f} s ({:.2f} s in render batches)", total_time.count(),
+                 stats.wall_time.count());
+    spdlog::info("Thread utilization: {:.1f}% ({} threads, {} jobs, {} steals)",
+                 stats.utilization() * 100., stats.num_threads, stats.num_jobs,
+                 stats.num_steals);
+    if (stats.wall_time.count() > 0.) {
+        spdlog::info("Traced {:.1f} M rays, {:.2f} M rays/s", stats.num_rays / 1e6,
+                     stats.num_rays / 1e6 / stats.wall_time.count());
+    }
+    if (stats.num_packet_lanes > 0) {
+        spdlog::info("Packet lane occupancy: {:.1f}%", stats.packet_occupancy() * 100.);
+    }
+
+    if (adaptive.enabled()) {
+        u32 num_tiles = ((attribs.resx + TILE_SIZE - 1) / TILE_SIZE) *
+                        ((attribs.resy + TILE_SIZE - 1) / TILE_SIZE);
+        spdlog::info("Adaptive sampling: {:.1f} spp on average, {} of {} tiles converged",
+                     static_cast<f64>(stats.num_samples) / static_cast<f64>(num_pixels),
+                     render_threads.num_converged_tiles(), num_tiles);
+    }
 
-    ImageWriter::write_framebuffer(output_filename, rc.fb, spp);
+    rc.scene.texture_cache.log_stats();
 
     return 0;
 }
@@ -11,7 +11,7 @@ ConductorMaterial::pdf() {
 
 spectral
 ConductorMaterial::eval(const ShadingGeometry &sgeom, const SampledLambdas &lambdas,
-                        const Texture *textures, const vec2 &uv) const {
+                        const Texture *textures, const TexCoords &tex_coords) const {
     if (m_perfect) {
         return spectral::ONE() / sgeom.cos_theta;
     } else {
@@ -31,11 +31,11 @@ ConductorMaterial::eval(const ShadingGeometry &sgeom, const SampledLambdas &lamb
 BSDFSample
 ConductorMaterial::sample(const norm_vec3 &normal, const norm_vec3 &wo,
                           const SampledLambdas &lambdas, const Texture *textures,
-                          const vec2 &uv) const {
+                          const TexCoords &tex_coords) const {
     norm_vec3 wi = vec3::reflect(wo, normal).normalized();
     auto sgeom = ShadingGeometry::make(normal, wi, wo);
     return BSDFSample{
-        .bsdf = eval(sgeom, lambdas, textures, uv),
+        .bsdf = eval(sgeom, lambdas, textures, tex_coords),
         .wi = wi,
         .pdf = 1.f,
         .did_refract = false,
@@ -11,11 +11,11 @@ struct ConductorMaterial {
 
     spectral
     eval(const ShadingGeometry &sgeom, const SampledLambdas &lambdas,
-         const Texture *textures, const vec2 &uv) const;
+         const Texture *textures, const TexCoords &tex_coords) const;
 
     BSDFSample
     sample(const norm_vec3 &normal, const norm_vec3 &wo, const SampledLambdas &lambdas,
-           const Texture *textures, const vec2 &uv) const;
+           const Texture *textures, const TexCoords &tex_coords) const;
 
     // No Fresnel calculations, perfect reflector...
     bool m_perfect;
@@ -17,7 +17,7 @@ DielectricMaterial::eval() {
 BSDFSample
 DielectricMaterial::sample(const norm_vec3 &normal, const norm_vec3 &wo,
                            const vec2 &sample, const SampledLambdas &lambdas,
-                           const Texture *textures, const vec2 &uv,
+                           const Texture *textures, const TexCoords &tex_coords,
                            bool is_frontfacing) const {
     f32 int_ior = m_int_ior.eval_single(lambdas[0]);
     f32 ext_ior = m_ext_ior.eval_single(lambdas[0]);
@@ -13,8 +13,8 @@ struct DielectricMaterial {
 
     BSDFSample
     sample(const norm_vec3 &normal, const norm_vec3 &wo, const vec2 &sample,
-           const SampledLambdas &lambdas, const Texture *textures, const vec2 &uv,
-           bool is_frontfacing) const;
+           const SampledLambdas &lambdas, const Texture *textures,
+           const TexCoords &tex_coords, bool is_frontfacing) const;
 
     Spectrum m_int_ior;
     Spectrum m_ext_ior;
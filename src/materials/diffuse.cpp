@@ -9,10 +9,9 @@ DiffuseMaterial::pdf(const ShadingGeometry &sgeom) {
 
 spectral
 DiffuseMaterial::eval(const ShadingGeometry &sgeom, const SampledLambdas &lambdas,
-                      const Texture *textures, const vec2 &uv) const {
+                      const Texture *textures, const TexCoords &tex_coords) const {
     const Texture *texture = &textures[reflectance_tex_id];
-    tuple3 refl_sigmoid_coeff = texture->fetch(uv);
-    spectral refl = RgbSpectrum::from_coeff(refl_sigmoid_coeff).eval(lambdas);
+    spectral refl = texture->fetch_spectrum(tex_coords, lambdas);
 
     return refl / M_PIf;
 }
@@ -20,12 +19,12 @@ DiffuseMaterial::eval(const ShadingGeometry &sgeom, const SampledLambdas &lambda
 BSDFSample
 DiffuseMaterial::sample(const norm_vec3 &normal, const norm_vec3 &wo, const vec2 &sample,
                         const SampledLambdas &lambdas, const Texture *textures,
-                        const vec2 &uv) const {
+                        const TexCoords &tex_coords) const {
     norm_vec3 sample_dir = sample_cosine_hemisphere(sample);
     norm_vec3 wi = transform_frame(sample_dir, normal);
     auto sgeom = ShadingGeometry::make(normal, wi, wo);
     return BSDFSample{
-        .bsdf = eval(sgeom, lambdas, textures, uv),
+        .bsdf = eval(sgeom, lambdas, textures, tex_coords),
         .wi = wi,
         .pdf = DiffuseMaterial::pdf(sgeom),
         .did_refract = false,
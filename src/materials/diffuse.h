@@ -12,11 +12,12 @@ struct DiffuseMaterial {
 
     spectral
     eval(const ShadingGeometry &sgeom, const SampledLambdas &lambdas,
-         const Texture *textures, const vec2 &uv) const;
+         const Texture *textures, const TexCoords &tex_coords) const;
 
     BSDFSample
     sample(const norm_vec3 &normal, const norm_vec3 &wo, const vec2 &sample,
-           const SampledLambdas &lambdas, const Texture *textures, const vec2 &uv) const;
+           const SampledLambdas &lambdas, const Texture *textures,
+           const TexCoords &tex_coords) const;
 
     u32 reflectance_tex_id;
 };
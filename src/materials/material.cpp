@@ -112,24 +112,24 @@ Material::make_rough_plastic(f32 alpha, Spectrum ext_ior, Spectrum int_ior,
 
 Option<BSDFSample>
 Material::sample(const norm_vec3 &normal, const norm_vec3 &wo, const vec3 &sample,
-                 const SampledLambdas &lambdas, const Texture *textures, const vec2 &uv,
-                 bool is_frontfacing) const {
+                 const SampledLambdas &lambdas, const Texture *textures,
+                 const TexCoords &tex_coords, bool is_frontfacing) const {
     switch (type) {
     case MaterialType::Diffuse:
         return diffuse.sample(normal, wo, vec2(sample.x, sample.y), lambdas, textures,
-                              uv);
+                              tex_coords);
     case MaterialType::Plastic:
-        return plastic->sample(normal, wo, sample, lambdas, textures, uv);
+        return plastic->sample(normal, wo, sample, lambdas, textures, tex_coords);
     case MaterialType::RoughPlastic:
-        return rough_plastic->sample(normal, wo, sample, lambdas, textures, uv);
+        return rough_plastic->sample(normal, wo, sample, lambdas, textures, tex_coords);
     case MaterialType::Conductor:
-        return conductor->sample(normal, wo, lambdas, textures, uv);
+        return conductor->sample(normal, wo, lambdas, textures, tex_coords);
     case MaterialType::RoughConductor:
         return rough_conductor->sample(normal, wo, vec2(sample.x, sample.y), lambdas,
-                                       textures, uv);
+                                       textures, tex_coords);
     case MaterialType::Dielectric:
         return dielectric->sample(normal, wo, vec2(sample.x, sample.y), lambdas, textures,
-                                  uv, is_frontfacing);
+                                  tex_coords, is_frontfacing);
     }
 }
 
@@ -153,18 +153,18 @@ Material::pdf(const ShadingGeometry &sgeom, const SampledLambdas &λ) const {
 
 spectral
 Material::eval(const ShadingGeometry &sgeom, const SampledLambdas &lambdas,
-               const Texture *textures, const vec2 &uv) const {
+               const Texture *textures, const TexCoords &tex_coords) const {
     switch (type) {
     case MaterialType::Diffuse:
-        return diffuse.eval(sgeom, lambdas, textures, uv);
+        return diffuse.eval(sgeom, lambdas, textures, tex_coords);
     case MaterialType::Plastic:
-        return plastic->eval(sgeom, lambdas, textures, uv);
+        return plastic->eval(sgeom, lambdas, textures, tex_coords);
     case MaterialType::RoughPlastic:
-        return rough_plastic->eval(sgeom, lambdas, textures, uv);
+        return rough_plastic->eval(sgeom, lambdas, textures, tex_coords);
     case MaterialType::RoughConductor:
         return rough_conductor->eval(sgeom, lambdas);
     case MaterialType::Conductor:
-        return conductor->eval(sgeom, lambdas, textures, uv);
+        return conductor->eval(sgeom, lambdas, textures, tex_coords);
     case MaterialType::Dielectric:
         return DielectricMaterial::eval();
     }
@@ -52,8 +52,8 @@ struct Material {
 
     Option<BSDFSample>
     sample(const norm_vec3 &normal, const norm_vec3 &wo, const vec3 &sample,
-           const SampledLambdas &lambdas, const Texture *textures, const vec2 &uv,
-           bool is_frontfacing) const;
+           const SampledLambdas &lambdas, const Texture *textures,
+           const TexCoords &tex_coords, bool is_frontfacing) const;
 
     // Probability density function of sampling the BRDF
     f32
@@ -61,7 +61,7 @@ struct Material {
 
     spectral
     eval(const ShadingGeometry &sgeom, const SampledLambdas &lambdas,
-         const Texture *textures, const vec2 &uv) const;
+         const Texture *textures, const TexCoords &tex_coords) const;
 
     bool
     is_dirac_delta() const;
@@ -18,11 +18,12 @@ struct PlasticMaterial {
 
     spectral
     eval(const ShadingGeometry &sgeom, const SampledLambdas &lambdas,
-         const Texture *textures, const vec2 &uv) const;
+         const Texture *textures, const TexCoords &tex_coords) const;
 
     BSDFSample
     sample(const norm_vec3 &normal, const norm_vec3 &ωo, const vec3 &ξ,
-           const SampledLambdas &λ, const Texture *textures, const vec2 &uv) const;
+           const SampledLambdas &λ, const Texture *textures,
+           const TexCoords &tex_coords) const;
 
     Spectrum ext_ior;
     Spectrum int_ior;
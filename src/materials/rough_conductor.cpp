@@ -32,7 +32,8 @@ RoughConductorMaterial::eval(const ShadingGeometry &sgeom,
 Option<BSDFSample>
 RoughConductorMaterial::sample(const norm_vec3 &normal, const norm_vec3 &wo,
                                const vec2 &ξ, const SampledLambdas &lambdas,
-                               const Texture *textures, const vec2 &uv) const {
+                               const Texture *textures,
+                               const TexCoords &tex_coords) const {
     norm_vec3 wi = TrowbridgeReitzGGX::sample(normal, wo, ξ, m_alpha);
     auto sgeom = ShadingGeometry::make(normal, wi, wo);
 
@@ -18,7 +18,8 @@ struct RoughConductorMaterial {
 
     Option<BSDFSample>
     sample(const norm_vec3 &normal, const norm_vec3 &wo, const vec2 &ξ,
-           const SampledLambdas &lambdas, const Texture *textures, const vec2 &uv) const;
+           const SampledLambdas &lambdas, const Texture *textures,
+           const TexCoords &tex_coords) const;
 
     // real part of the IOR
     Spectrum m_eta;
@@ -20,7 +20,7 @@ RoughPlasticMaterial::pdf(const ShadingGeometry &sgeom, const SampledLambdas &λ
 
 spectral
 RoughPlasticMaterial::eval(const ShadingGeometry &sgeom, const SampledLambdas &lambdas,
-                           const Texture *textures, const vec2 &uv) const {
+                           const Texture *textures, const TexCoords &tex_coords) const {
     f32 int_ior_s = int_ior.eval_single(lambdas[0]);
     f32 ext_ior_s = ext_ior.eval_single(lambdas[0]);
     /// This is external / internal !
@@ -48,8 +48,7 @@ RoughPlasticMaterial::eval(const ShadingGeometry &sgeom, const SampledLambdas &l
     f32 fresnel_o = fresnel_dielectric(rel_ior, cos_theta_in);
 
     const Texture *texture = &textures[diffuse_reflectance_id];
-    tuple3 refl_sigmoid_coeff = texture->fetch(uv);
-    spectral α = RgbSpectrum::from_coeff(refl_sigmoid_coeff).eval(lambdas);
+    spectral α = texture->fetch_spectrum(tex_coords, lambdas);
 
     f32 re = 0.919317f;
     f32 ior_pow = int_ior_s;
@@ -76,7 +75,7 @@ RoughPlasticMaterial::eval(const ShadingGeometry &sgeom, const SampledLambdas &l
 Option<BSDFSample>
 RoughPlasticMaterial::sample(const norm_vec3 &normal, const norm_vec3 &ωo, const vec3 &ξ,
                              const SampledLambdas &λ, const Texture *textures,
-                             const vec2 &uv) const {
+                             const TexCoords &tex_coords) const {
     f32 int_η = int_ior.eval_single(λ[0]);
     f32 ext_η = ext_ior.eval_single(λ[0]);
     f32 rel_η = int_η / ext_η;
@@ -94,7 +93,7 @@ RoughPlasticMaterial::sample(const norm_vec3 &normal, const norm_vec3 &ωo, cons
         }
 
         return BSDFSample{
-            .bsdf = eval(sgeom, λ, textures, uv),
+            .bsdf = eval(sgeom, λ, textures, tex_coords),
             .wi = wi,
             .pdf = pdf(sgeom, λ),
         };
@@ -105,7 +104,7 @@ RoughPlasticMaterial::sample(const norm_vec3 &normal, const norm_vec3 &ωo, cons
         auto sgeom = ShadingGeometry::make(normal, ωi, ωo);
 
         return BSDFSample{
-            .bsdf = eval(sgeom, λ, textures, uv),
+            .bsdf = eval(sgeom, λ, textures, tex_coords),
             .wi = ωi,
             .pdf = pdf(sgeom, λ),
         };
@@ -13,11 +13,12 @@ struct RoughPlasticMaterial {
 
     spectral
     eval(const ShadingGeometry &sgeom, const SampledLambdas &lambdas,
-         const Texture *textures, const vec2 &uv) const;
+         const Texture *textures, const TexCoords &tex_coords) const;
 
     Option<BSDFSample>
     sample(const norm_vec3 &normal, const norm_vec3 &ωo, const vec3 &ξ,
-           const SampledLambdas &λ, const Texture *textures, const vec2 &uv) const;
+           const SampledLambdas &λ, const Texture *textures,
+           const TexCoords &tex_coords) const;
 
     f32 alpha;
     Spectrum ext_ior;
@@ -0,0 +1,57 @@
+#include "alias_table.h"
+
+#include <cmath>
+
+AliasTable::AliasTable(Span<const f32> weights) {
+    u64 num_bins = weights.size();
+    if (num_bins == 0) {
+        return;
+    }
+
+    // Accumulated in double, so that millions of small weights don't get lost
+    f64 sum = 0.;
+    for (f32 weight : weights) {
+        sum += weight > 0.f ? static_cast<f64>(weight) : 0.;
+    }
+
+    pmf.resize(num_bins);
+    bins.resize(num_bins);
+
+    // Probabilities scaled so that the average bin has 1
+    std::vector<f64> scaled(num_bins);
+    std::vector<u32> small{};
+    std::vector<u32> large{};
+    for (u64 i = 0; i < num_bins; i++) {
+        f64 prob = 1. / static_cast<f64>(num_bins);
+        if (sum > 0.) {
+            prob = weights[i] > 0.f ? static_cast<f64>(weights[i]) / sum : 0.;
+        }
+
+        pmf[i] = static_cast<f32>(prob);
+        scaled[i] = prob * static_cast<f64>(num_bins);
+        (scaled[i] < 1. ? small : large).push_back(i);
+    }
+
+    // Each small bin is filled up with probability from a large one
+    while (!small.empty() && !large.empty()) {
+        u32 s = small.back();
+        small.pop_back();
+        u32 l = large.back();
+
+        bins[s] = Bin{.threshold = static_cast<f32>(scaled[s]), .alias = l};
+
+        scaled[l] = (scaled[l] + scaled[s]) - 1.;
+        if (scaled[l] < 1.) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+
+    // What's left is 1 up to rounding errors
+    for (u32 i : large) {
+        bins[i] = Bin{.threshold = 1.f, .alias = i};
+    }
+    for (u32 i : small) {
+        bins[i] = Bin{.threshold = 1.f, .alias = i};
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef PT_ALIAS_TABLE_H
+#define PT_ALIAS_TABLE_H
+
+#include "../utils/basic_types.h"
+#include "vecmath.h"
+
+#include <algorithm>
+#include <vector>
+
+/// Discrete distribution that is sampled in constant time with Walker's alias method.
+/// Built with Vose's algorithm.
+class AliasTable {
+public:
+    AliasTable() = default;
+
+    /// The weights don't have to be normalized. Negative and NaN weights are treated as
+    /// 0. If all weights are 0, the distribution is uniform.
+    explicit AliasTable(Span<const f32> weights);
+
+    /// sample.x chooses a bin and sample.y chooses between the bin and its alias. A
+    /// single f32 doesn't have enough bits for both with millions of bins.
+    u32
+    sample(const vec2 &sample) const {
+        u32 num_bins = bins.size();
+        u32 index = std::min(static_cast<u32>(sample.x * static_cast<f32>(num_bins)),
+                             num_bins - 1);
+
+        const auto &bin = bins[index];
+        return sample.y < bin.threshold ? index : bin.alias;
+    }
+
+    /// Same as sample(), remapped is set to sample.y rescaled to [0, 1) within the
+    /// choice between the bin and its alias, so that it can be used as a new sample
+    u32
+    sample(const vec2 &sample, f32 &remapped) const {
+        u32 num_bins = bins.size();
+        u32 index = std::min(static_cast<u32>(sample.x * static_cast<f32>(num_bins)),
+                             num_bins - 1);
+
+        const auto &bin = bins[index];
+        if (sample.y < bin.threshold) {
+            remapped = std::min(sample.y / bin.threshold, ONE_MINUS_EPSILON);
+            return index;
+        }
+
+        f32 alias_sample = (sample.y - bin.threshold) / (1.f - bin.threshold);
+        remapped = std::min(alias_sample, ONE_MINUS_EPSILON);
+        return bin.alias;
+    }
+
+    f32
+    pdf(u32 index) const {
+        return pmf[index];
+    }
+
+    u32
+    size() const {
+        return pmf.size();
+    }
+
+    const std::vector<f32> &
+    get_pmf() const {
+        return pmf;
+    }
+
+private:
+    struct Bin {
+        /// Probability of choosing the bin itself instead of its alias
+        f32 threshold;
+        u32 alias;
+    };
+
+    std::vector<Bin> bins{};
+    std::vector<f32> pmf{};
+};
+
+#endif // PT_ALIAS_TABLE_H
@@ -3,10 +3,13 @@
 
 #include "../utils/basic_types.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 
 static constexpr f32 EPS = 0.00001f;
+/// Largest f32 below 1, keeps samples in [0, 1)
+static constexpr f32 ONE_MINUS_EPSILON = 0x1.fffffep-1f;
 
 template <typename T>
 T
@@ -48,4 +51,15 @@ lerp(f32 t, const T &start, const T &end) {
     return start * (1.f - t) + end * t;
 }
 
+/// Numerically stable angle between two unit vectors
+template <typename V>
+f32
+angle_between(const V &a, const V &b) {
+    if (V::dot(a, b) < 0.f) {
+        return M_PIf - 2.f * std::asin(std::min((a + b).length() * 0.5f, 1.f));
+    } else {
+        return 2.f * std::asin(std::min((b - a).length() * 0.5f, 1.f));
+    }
+}
+
 #endif // PT_MATH_UTILS_H
@@ -1,43 +1,60 @@
 #include "piecewise_dist.h"
 
 #include "../math/sampling.h"
+#include "../utils/task_pool.h"
 
 #include <algorithm>
 #include <numeric>
 
-PiecewiseDist2D::PiecewiseDist2D(const std::vector<f32> &grid, int width, int height) {
+namespace {
+
+/// Rows of an environment map are a few thousand texels
+constexpr u64 ROW_GRAIN_SIZE = 16;
+
+} // namespace
+
+PiecewiseDist2D::PiecewiseDist2D(const std::vector<f32> &grid, int width, int height,
+                                 TaskPool *pool) {
     conditionals = std::vector<PiecewiseDist1D>(height);
     std::vector<f32> marginals_sums(height);
 
-    for (int r = 0; r < height; r++) {
-        auto row = Span<f32>(const_cast<f32 *>(&grid[r * width]), width);
-        auto conditional = PiecewiseDist1D(row);
-        conditionals.emplace_back(std::move(conditional));
+    auto build_row = [&](u64 r) {
+        auto row = Span<const f32>(&grid[r * width], width);
+        conditionals[r] = PiecewiseDist1D(row);
 
-        f32 sum = std::accumulate(row.begin(), row.end(), 0.f);
-        marginals_sums.push_back(sum);
+        f64 sum = std::accumulate(row.begin(), row.end(), 0.);
+        marginals_sums[r] = static_cast<f32>(sum);
+    };
+
+    if (pool != nullptr) {
+        pool->parallel_for(height, ROW_GRAIN_SIZE, build_row);
+    } else {
+        for (int r = 0; r < height; r++) {
+            build_row(r);
+        }
     }
 
-    marginals = PiecewiseDist1D(Span<f32>(marginals_sums.data(), marginals_sums.size()));
+    marginals = PiecewiseDist1D(Span<const f32>(marginals_sums));
 }
 
 Tuple<vec2, f32>
-PiecewiseDist2D::sample(const vec2 &sample) {
+PiecewiseDist2D::sample(const vec2 &sample) const {
     auto [v, im] = marginals.sample_continuous(sample.x);
     auto [u, ic] = conditionals[im].sample_continuous(sample.y);
 
-    f32 pdf0 = marginals.pdf(im);
-    f32 pdf1 = conditionals[im].pdf(ic);
+    f32 pdf0 = marginals.pdf(im) * static_cast<f32>(marginals.size());
+    f32 pdf1 = conditionals[im].pdf(ic) * static_cast<f32>(conditionals[im].size());
 
     return {vec2(u, v), pdf0 * pdf1};
 }
 
 f32
-PiecewiseDist2D::pdf(const vec2 &sample) {
-    auto [pdf0, im] = marginals.sample_continuous(sample.x);
-    auto [pdf1, _] = conditionals[im].sample_continuous(sample.y);
+PiecewiseDist2D::pdf(const vec2 &uv) const {
+    auto [pdf0, im] = marginals.pdf(uv.y);
+    auto [pdf1, _] = conditionals[im].pdf(uv.x);
 
-    return pdf0 * pdf1;
+    return pdf0 * static_cast<f32>(marginals.size()) * pdf1 *
+           static_cast<f32>(conditionals[im].size());
 }
 
 PiecewiseDist1D::PiecewiseDist1D(PiecewiseDist1D &&other) noexcept {
@@ -47,30 +64,34 @@ PiecewiseDist1D::PiecewiseDist1D(PiecewiseDist1D &&other) noexcept {
 
 void
 PiecewiseDist1D::create_cmf() {
-    cmf.reserve(pmf.size());
+    // Summed in double precision, so that the CMF of long rows stays accurate
+    f64 total = std::accumulate(pmf.begin(), pmf.end(), 0.);
+    assert(std::abs(total - 1.) < 0.00001);
 
-    f32 cmf_sum = 0.f;
+    // Normalizing makes the last bin with a non-zero probability end exactly at 1, the
+    // empty bins after it are never sampled
+    cmf.reserve(pmf.size());
+    f64 cmf_sum = 0.;
     for (f32 i : pmf) {
         cmf_sum += i;
-        cmf.push_back(cmf_sum);
+        cmf.push_back(static_cast<f32>(cmf_sum / total));
     }
-
-    f32 err = std::abs(cmf[cmf.size() - 1] - 1.f);
-    assert(err < 0.00001f);
-
-    cmf[cmf.size() - 1] = 1.f;
 }
 
 PiecewiseDist1D::PiecewiseDist1D(std::vector<f32> &&p_pmf) : pmf{std::move(p_pmf)} {
     create_cmf();
 }
 
-PiecewiseDist1D::PiecewiseDist1D(Span<f32> vals) {
+PiecewiseDist1D::PiecewiseDist1D(Span<const f32> vals) {
     pmf.reserve(vals.size());
 
-    f32 sum = std::accumulate(vals.begin(), vals.end(), 0.f);
-    for (auto v : vals) {
-        pmf.push_back(v / sum);
+    f64 sum = std::accumulate(vals.begin(), vals.end(), 0.);
+    if (sum == 0.) {
+        pmf.assign(vals.size(), 1.f / static_cast<f32>(vals.size()));
+    } else {
+        for (auto v : vals) {
+            pmf.push_back(static_cast<f32>(v / sum));
+        }
     }
 
     create_cmf();
@@ -82,21 +103,20 @@ PiecewiseDist1D::pdf(u32 index) const {
 }
 
 u32
-PiecewiseDist1D::sample(f32 sample) {
-    return sample_discrete_cmf(Span<f32>(cmf.data(), cmf.size()), sample);
+PiecewiseDist1D::sample(f32 sample) const {
+    return sample_discrete_cmf(Span<const f32>(cmf), sample);
 }
 
 Tuple<f32, u32>
-PiecewiseDist1D::sample_continuous(f32 sample) {
-    return sample_continuous_cmf(Span<f32>(cmf.data(), cmf.size()), sample);
+PiecewiseDist1D::sample_continuous(f32 sample) const {
+    return sample_continuous_cmf(Span<const f32>(cmf), sample);
 }
 
 Tuple<f32, u32>
 PiecewiseDist1D::pdf(f32 sample) const {
-    u32 offset = sample * (f32)cmf.size();
-    if (offset > cmf.size() - 1) {
-        offset = cmf.size();
-    }
+    f32 clamped = std::clamp(sample, 0.f, 1.f);
+    u32 offset = std::min(static_cast<u32>(clamped * static_cast<f32>(cmf.size())),
+                          static_cast<u32>(cmf.size() - 1));
 
     return {pmf[offset], offset};
 }
@@ -6,6 +6,8 @@
 
 #include <vector>
 
+class TaskPool;
+
 class PiecewiseDist1D {
 public:
     PiecewiseDist1D() = default;
@@ -20,21 +22,33 @@ public:
     /// Expects normalized probabilites !
     explicit PiecewiseDist1D(std::vector<f32> &&p_pmf);
 
-    /// Calculates probabilities
-    explicit PiecewiseDist1D(Span<f32> vals);
+    /// Calculates probabilities, all of them are the same if vals are all 0
+    explicit PiecewiseDist1D(Span<const f32> vals);
 
     f32
     pdf(u32 index) const;
 
     u32
-    sample(f32 sample);
+    sample(f32 sample) const;
 
+    /// Returns a value in [0, 1) and the index of its bin
     Tuple<f32, u32>
-    sample_continuous(f32 sample);
+    sample_continuous(f32 sample) const;
 
+    /// Probability of the bin that the value in [0, 1) falls into and its index
     Tuple<f32, u32>
     pdf(f32 sample) const;
 
+    u32
+    size() const {
+        return pmf.size();
+    }
+
+    const std::vector<f32> &
+    get_pmf() const {
+        return pmf;
+    }
+
     PiecewiseDist1D &
     operator=(PiecewiseDist1D &other) = delete;
 
@@ -55,14 +69,19 @@ private:
 class PiecewiseDist2D {
 public:
     explicit PiecewiseDist2D() = default;
-    explicit PiecewiseDist2D(const std::vector<f32> &grid, int width, int height);
 
-    /// Returns uv-coords and the pdf
+    /// grid is stored by rows, which go along u. The rows are built in parallel if
+    /// there's a pool.
+    explicit PiecewiseDist2D(const std::vector<f32> &grid, int width, int height,
+                             TaskPool *pool = nullptr);
+
+    /// Returns uv-coords and the pdf with respect to the area of the unit square
     Tuple<vec2, f32>
-    sample(const vec2 &sample);
+    sample(const vec2 &sample) const;
 
+    /// pdf of sample() returning uv with respect to the area of the unit square
     f32
-    pdf(const vec2 &sample);
+    pdf(const vec2 &uv) const;
 
 private:
     /// probability distributions in rows
@@ -0,0 +1,104 @@
+#ifndef PT_QUANTIZATION_H
+#define PT_QUANTIZATION_H
+
+#include "../utils/basic_types.h"
+#include "vecmath.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+/// Octahedral encoding of a unit vector into two 16-bit snorms.
+/// From "A Survey of Efficient Representations for Independent Unit Vectors" - Cigolle
+/// et al. 2014.
+inline u32
+oct_encode(const norm_vec3 &n) {
+    f32 l1_norm = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    f32 x = n.x / l1_norm;
+    f32 y = n.y / l1_norm;
+
+    // Fold the lower hemisphere over the diagonals
+    if (n.z < 0.f) {
+        f32 folded_x = (1.f - std::abs(y)) * (x >= 0.f ? 1.f : -1.f);
+        f32 folded_y = (1.f - std::abs(x)) * (y >= 0.f ? 1.f : -1.f);
+        x = folded_x;
+        y = folded_y;
+    }
+
+    auto to_snorm16 = [](f32 v) {
+        return static_cast<u16>(
+            static_cast<i16>(std::round(std::clamp(v, -1.f, 1.f) * 32767.f)));
+    };
+
+    return static_cast<u32>(to_snorm16(x)) | (static_cast<u32>(to_snorm16(y)) << 16);
+}
+
+inline norm_vec3
+oct_decode(u32 encoded) {
+    auto from_snorm16 = [](u16 v) {
+        return std::max(static_cast<f32>(static_cast<i16>(v)) / 32767.f, -1.f);
+    };
+
+    f32 x = from_snorm16(static_cast<u16>(encoded & 0xffff));
+    f32 y = from_snorm16(static_cast<u16>(encoded >> 16));
+    f32 z = 1.f - std::abs(x) - std::abs(y);
+
+    if (z < 0.f) {
+        f32 unfolded_x = (1.f - std::abs(y)) * (x >= 0.f ? 1.f : -1.f);
+        f32 unfolded_y = (1.f - std::abs(x)) * (y >= 0.f ? 1.f : -1.f);
+        x = unfolded_x;
+        y = unfolded_y;
+    }
+
+    return vec3(x, y, z).normalized();
+}
+
+/// IEEE 754 binary16, rounds to nearest-even. Values out of range become infinity.
+inline u16
+f32_to_half(f32 value) {
+    u32 bits = std::bit_cast<u32>(value);
+    u32 sign = (bits >> 16) & 0x8000;
+    u32 abs_bits = bits & 0x7fffffff;
+
+    if (abs_bits >= 0x7f800000) {
+        // Inf or NaN
+        u32 mantissa = abs_bits > 0x7f800000 ? 0x200 : 0;
+        return static_cast<u16>(sign | 0x7c00 | mantissa);
+    }
+
+    if (abs_bits >= 0x477ff000) {
+        // Rounds to more than the largest half
+        return static_cast<u16>(sign | 0x7c00);
+    }
+
+    if (abs_bits < 0x38800000) {
+        // Subnormal half, the f32 is scaled so that the mantissa is rounded by the FPU
+        f32 subnormal = std::bit_cast<f32>(abs_bits) + 0.5f;
+        return static_cast<u16>(sign | (std::bit_cast<u32>(subnormal) - 0x3f000000));
+    }
+
+    u32 mantissa_odd = (abs_bits >> 13) & 1;
+    abs_bits += 0xc8000fff + mantissa_odd;
+    return static_cast<u16>(sign | (abs_bits >> 13));
+}
+
+inline f32
+half_to_f32(u16 half) {
+    u32 sign = static_cast<u32>(half & 0x8000) << 16;
+    u32 exponent = (half >> 10) & 0x1f;
+    u32 mantissa = half & 0x3ff;
+
+    if (exponent == 0) {
+        // Zero or subnormal
+        f32 value = std::ldexp(static_cast<f32>(mantissa), -24);
+        return std::bit_cast<f32>(std::bit_cast<u32>(value) | sign);
+    }
+
+    if (exponent == 0x1f) {
+        return std::bit_cast<f32>(sign | 0x7f800000 | (mantissa << 13));
+    }
+
+    return std::bit_cast<f32>(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
+#endif // PT_QUANTIZATION_H
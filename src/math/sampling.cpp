@@ -1,5 +1,8 @@
 #include "sampling.h"
 
+#include <algorithm>
+#include <cmath>
+
 vec2
 sample_uniform_disk_concentric(const vec2 &u) {
     vec2 u_offset = (2.f * u) - vec2(1.f, 1.f);
@@ -56,34 +59,114 @@ sample_uniform_triangle(const vec2 &sample) {
     return vec3(b0, b1, b2);
 }
 
+f32
+spherical_triangle_area(const vec3 &a, const vec3 &b, const vec3 &c) {
+    f32 numerator = std::abs(vec3::dot(a, vec3::cross(b, c)));
+    f32 denominator = 1.f + vec3::dot(a, b) + vec3::dot(a, c) + vec3::dot(b, c);
+    return std::abs(2.f * std::atan2(numerator, denominator));
+}
+
+namespace {
+
+/// The part of v perpendicular to the unit vector w, normalized
+vec3
+gram_schmidt(const vec3 &v, const vec3 &w) {
+    vec3 perpendicular = v - vec3::dot(v, w) * w;
+    return perpendicular / perpendicular.length();
+}
+
+} // namespace
+
+vec3
+sample_spherical_triangle(const Array<point3, 3> &v, const point3 &p,
+                          const vec2 &sample) {
+    vec3 a = (v[0] - p).normalized();
+    vec3 b = (v[1] - p).normalized();
+    vec3 c = (v[2] - p).normalized();
+
+    vec3 n_ab = vec3::cross(a, b);
+    vec3 n_bc = vec3::cross(b, c);
+    vec3 n_ca = vec3::cross(c, a);
+    if (n_ab.length_squared() == 0.f || n_bc.length_squared() == 0.f ||
+        n_ca.length_squared() == 0.f) {
+        return vec3(1.f / 3.f);
+    }
+    n_ab = n_ab / n_ab.length();
+    n_bc = n_bc / n_bc.length();
+    n_ca = n_ca / n_ca.length();
+
+    // Angles at the vertices of the spherical triangle
+    f32 alpha = angle_between(n_ab, -n_ca);
+    f32 beta = angle_between(n_bc, -n_ab);
+    f32 gamma = angle_between(n_ca, -n_bc);
+
+    // Uniformly sample the area of the sub-triangle that is cut off by the arc from a
+    f32 area_pi = alpha + beta + gamma;
+    f32 sub_area_pi = std::lerp(M_PIf, area_pi, sample.x);
+
+    // Find the third vertex of the sub-triangle on the arc between a and c
+    f32 cos_alpha = std::cos(alpha);
+    f32 sin_alpha = std::sin(alpha);
+    f32 sin_phi = std::sin(sub_area_pi) * cos_alpha - std::cos(sub_area_pi) * sin_alpha;
+    f32 cos_phi = std::cos(sub_area_pi) * cos_alpha + std::sin(sub_area_pi) * sin_alpha;
+    f32 k1 = cos_phi + cos_alpha;
+    f32 k2 = sin_phi - sin_alpha * vec3::dot(a, b);
+    f32 cos_b = (k2 + (k2 * cos_phi - k1 * sin_phi) * cos_alpha) /
+                ((k2 * sin_phi + k1 * cos_phi) * sin_alpha);
+    // NaN if the triangle covers nearly the whole hemisphere
+    cos_b = std::isnan(cos_b) ? 1.f : std::clamp(cos_b, -1.f, 1.f);
+    f32 sin_b = safe_sqrt(1.f - sqr(cos_b));
+    vec3 c_sub = cos_b * a + sin_b * gram_schmidt(c, a);
+
+    // Sample the arc between b and the new vertex
+    f32 cos_theta = 1.f - sample.y * (1.f - vec3::dot(c_sub, b));
+    f32 sin_theta = safe_sqrt(1.f - sqr(cos_theta));
+    vec3 w = cos_theta * b + sin_theta * gram_schmidt(c_sub, b);
+
+    // Barycentrics of the point that the direction hits (Moller-Trumbore)
+    vec3 e1 = v[1] - v[0];
+    vec3 e2 = v[2] - v[0];
+    vec3 s1 = vec3::cross(w, e2);
+    f32 divisor = vec3::dot(s1, e1);
+    if (divisor == 0.f) {
+        return vec3(1.f / 3.f);
+    }
+
+    vec3 s = p - v[0];
+    f32 b1 = std::clamp(vec3::dot(s, s1) / divisor, 0.f, 1.f);
+    f32 b2 = std::clamp(vec3::dot(w, vec3::cross(s, e1)) / divisor, 0.f, 1.f);
+    if (b1 + b2 > 1.f) {
+        f32 sum = b1 + b2;
+        b1 /= sum;
+        b2 /= sum;
+    }
+
+    return vec3(1.f - b1 - b2, b1, b2);
+}
+
 u32
-sample_discrete_cmf(Span<f32> cmf, f32 sample) {
-    // TODO: binary search
-    for (u32 i = 0; i < cmf.size(); i++) {
-        if (sample < cmf[i]) {
-            return i;
-        }
+sample_discrete_cmf(Span<const f32> cmf, f32 sample) {
+    auto it = std::upper_bound(cmf.begin(), cmf.end(), sample);
+    if (it == cmf.end()) {
+        // Only possible if the CMF doesn't quite end at 1
+        return cmf.size() - 1;
     }
 
-    assert(false);
+    return it - cmf.begin();
 }
+
 Tuple<f32, u32>
-sample_continuous_cmf(Span<f32> cdf, f32 sample) {
-    // TODO: binary search
-    u32 offset = 0;
-    for (u32 i = 0; i < cdf.size(); i++) {
-        if (sample < cdf[i]) {
-            offset = i;
-            break;
-        }
-    }
+sample_continuous_cmf(Span<const f32> cdf, f32 sample) {
+    u32 offset = sample_discrete_cmf(cdf, sample);
 
-    f32 du = sample - cdf[offset];
-    if ((cdf[offset + 1] - cdf[offset]) > 0) {
-        du /= (cdf[offset + 1] - cdf[offset]);
+    f32 cdf_start = offset == 0 ? 0.f : cdf[offset - 1];
+    f32 du = sample - cdf_start;
+    if ((cdf[offset] - cdf_start) > 0.f) {
+        du /= (cdf[offset] - cdf_start);
     }
 
-    f32 res = (offset + du) / cdf.size();
+    f32 res = (static_cast<f32>(offset) + std::clamp(du, 0.f, 1.f)) /
+              static_cast<f32>(cdf.size());
 
-    return {res, offset};
+    return {std::min(res, ONE_MINUS_EPSILON), offset};
 }
@@ -29,13 +29,27 @@ sample_uniform_hemisphere(const vec2 &sample);
 vec3
 sample_uniform_triangle(const vec2 &sample);
 
-/// Samples a CMF, return an index into the CMF slice.
-/// Expects a normalized CMF.
+/// Solid angle of the spherical triangle with the unit vectors a, b, c as its vertices.
+/// From "The Solid Angle of a Plane Triangle" - Van Oosterom and Strackee 1983.
+f32
+spherical_triangle_area(const vec3 &a, const vec3 &b, const vec3 &c);
+
+/// Samples a direction from p uniformly over the solid angle subtended by the triangle,
+/// returns the barycentric coordinates of the point that the direction hits. From
+/// "Stratified Sampling of Spherical Triangles" - Arvo 1995, in the form used by PBRT-v4.
+/// The triangle mustn't be degenerate as seen from p.
+vec3
+sample_spherical_triangle(const Array<point3, 3> &v, const point3 &p,
+                          const vec2 &sample);
+
+/// Samples a CMF, return an index into the CMF slice. Bins with 0 probability are
+/// never returned. Expects a normalized CMF.
 u32
-sample_discrete_cmf(Span<f32> cmf, f32 sample);
+sample_discrete_cmf(Span<const f32> cmf, f32 sample);
 
-/// Samples a CMF, return a value in [0, 1), and an index into the CDF slice.
+/// Samples a CMF, return a value in [0, 1), and an index into the CDF slice. The value is
+/// distributed uniformly inside of the bin.
 Tuple<f32, u32>
-sample_continuous_cmf(Span<f32> cdf, f32 sample);
+sample_continuous_cmf(Span<const f32> cdf, f32 sample);
 
 #endif // PT_SAMPLING_H
@@ -0,0 +1,116 @@
+#include "alias_table.h"
+
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/matchers/catch_matchers_floating_point.hpp>
+
+#include <vector>
+
+namespace {
+
+/// Frequencies of the indices over a stratified grid of samples
+std::vector<f64>
+sample_frequencies(const AliasTable &table, u32 strata_y) {
+    std::vector<f64> counts(table.size(), 0.);
+    u32 strata_x = table.size();
+
+    for (u32 x = 0; x < strata_x; x++) {
+        for (u32 y = 0; y < strata_y; y++) {
+            vec2 sample((static_cast<f32>(x) + 0.5f) / static_cast<f32>(strata_x),
+                        (static_cast<f32>(y) + 0.5f) / static_cast<f32>(strata_y));
+            counts[table.sample(sample)] += 1.;
+        }
+    }
+
+    for (auto &count : counts) {
+        count /= static_cast<f64>(strata_x) * strata_y;
+    }
+
+    return counts;
+}
+
+} // namespace
+
+TEST_CASE("Alias table sampling", "[alias_table]") {
+    std::vector<f32> weights = {1.f, 0.f, 5.f, 0.25f, 2.f, 0.f, 0.75f, 3.f, 0.001f};
+    AliasTable table(weights);
+
+    f32 sum = 0.f;
+    for (f32 weight : weights) {
+        sum += weight;
+    }
+
+    auto frequencies = sample_frequencies(table, 10000);
+    for (u32 i = 0; i < weights.size(); i++) {
+        REQUIRE_THAT(table.pdf(i), Catch::Matchers::WithinAbs(weights[i] / sum, 1e-6));
+        REQUIRE_THAT(frequencies[i], Catch::Matchers::WithinAbs(weights[i] / sum, 1e-4));
+
+        if (weights[i] == 0.f) {
+            REQUIRE(frequencies[i] == 0.);
+        }
+    }
+
+    // The edges of the sample domain stay in range
+    REQUIRE(table.sample(vec2(0.f, 0.f)) < weights.size());
+    REQUIRE(table.sample(vec2(0.99999994f, 0.99999994f)) < weights.size());
+}
+
+TEST_CASE("Alias table of many bins", "[alias_table]") {
+    std::vector<f32> weights(100000);
+    for (u32 i = 0; i < weights.size(); i++) {
+        weights[i] = static_cast<f32>(i % 7) * 0.1f;
+    }
+    AliasTable table(weights);
+
+    // Off by at most a few strata of the bins that have i as their alias
+    auto frequencies = sample_frequencies(table, 256);
+    for (u32 i = 0; i < weights.size(); i++) {
+        REQUIRE_THAT(frequencies[i], Catch::Matchers::WithinAbs(table.pdf(i), 2e-7));
+    }
+}
+
+TEST_CASE("Alias table without weights is uniform", "[alias_table]") {
+    std::vector<f32> weights(4, 0.f);
+    AliasTable table(weights);
+
+    auto frequencies = sample_frequencies(table, 100);
+    for (u32 i = 0; i < weights.size(); i++) {
+        REQUIRE(table.pdf(i) == 0.25f);
+        REQUIRE_THAT(frequencies[i], Catch::Matchers::WithinAbs(0.25, 1e-6));
+    }
+}
+
+TEST_CASE("Alias table remaps the sample", "[alias_table]") {
+    std::vector<f32> weights = {3.f, 1.f, 0.f, 4.f};
+    AliasTable table(weights);
+
+    // Every index gets a uniform range of remapped samples
+    constexpr u32 STRATA = 512;
+    std::vector<std::vector<f32>> remapped_samples(weights.size());
+    for (u32 x = 0; x < STRATA; x++) {
+        for (u32 y = 0; y < STRATA; y++) {
+            vec2 sample((static_cast<f32>(x) + 0.5f) / STRATA,
+                        (static_cast<f32>(y) + 0.5f) / STRATA);
+            f32 remapped = -1.f;
+            u32 index = table.sample(sample, remapped);
+
+            REQUIRE(index == table.sample(sample));
+            REQUIRE(remapped >= 0.f);
+            REQUIRE(remapped < 1.f);
+            remapped_samples[index].push_back(remapped);
+        }
+    }
+
+    for (u32 i = 0; i < weights.size(); i++) {
+        if (weights[i] == 0.f) {
+            REQUIRE(remapped_samples[i].empty());
+            continue;
+        }
+
+        f64 mean = 0.;
+        for (f32 remapped : remapped_samples[i]) {
+            mean += remapped;
+        }
+        mean /= static_cast<f64>(remapped_samples[i].size());
+        REQUIRE_THAT(mean, Catch::Matchers::WithinAbs(0.5, 1e-2));
+    }
+}
@@ -0,0 +1,67 @@
+#include "piecewise_dist.h"
+
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/matchers/catch_matchers_floating_point.hpp>
+
+#include <vector>
+
+TEST_CASE("Piecewise 2D distribution sampling", "[piecewise_dist]") {
+    constexpr int WIDTH = 7;
+    constexpr int HEIGHT = 5;
+
+    // A row and a column without any probability
+    std::vector<f32> grid(WIDTH * HEIGHT);
+    for (int r = 0; r < HEIGHT; r++) {
+        for (int c = 0; c < WIDTH; c++) {
+            bool is_empty = r == 2 || c == 6;
+            grid[c + r * WIDTH] = is_empty ? 0.f : static_cast<f32>(1 + (r * 3 + c) % 4);
+        }
+    }
+
+    PiecewiseDist2D dist(grid, WIDTH, HEIGHT);
+
+    f64 sum = 0.;
+    for (f32 v : grid) {
+        sum += v;
+    }
+
+    constexpr u32 STRATA = 256;
+    std::vector<f64> counts(WIDTH * HEIGHT, 0.);
+    for (u32 x = 0; x < STRATA; x++) {
+        for (u32 y = 0; y < STRATA; y++) {
+            vec2 sample((static_cast<f32>(x) + 0.5f) / static_cast<f32>(STRATA),
+                        (static_cast<f32>(y) + 0.5f) / static_cast<f32>(STRATA));
+            auto [uv, pdf] = dist.sample(sample);
+
+            REQUIRE(uv.x >= 0.f);
+            REQUIRE(uv.x < 1.f);
+            REQUIRE(uv.y >= 0.f);
+            REQUIRE(uv.y < 1.f);
+            REQUIRE_THAT(dist.pdf(uv), Catch::Matchers::WithinRel(pdf, 1e-5f));
+
+            int c = static_cast<int>(uv.x * WIDTH);
+            int r = static_cast<int>(uv.y * HEIGHT);
+            REQUIRE(grid[c + r * WIDTH] > 0.f);
+            // Density over the unit square
+            REQUIRE_THAT(pdf, Catch::Matchers::WithinRel(grid[c + r * WIDTH] / sum *
+                                                             WIDTH * HEIGHT,
+                                                         1e-4));
+            counts[c + r * WIDTH] += 1.;
+        }
+    }
+
+    for (int i = 0; i < WIDTH * HEIGHT; i++) {
+        REQUIRE_THAT(counts[i] / (STRATA * STRATA),
+                     Catch::Matchers::WithinAbs(grid[i] / sum, 0.002));
+    }
+}
+
+TEST_CASE("Piecewise 2D distribution of zeros is uniform", "[piecewise_dist]") {
+    std::vector<f32> grid(4 * 3, 0.f);
+    PiecewiseDist2D dist(grid, 4, 3);
+
+    auto [uv, pdf] = dist.sample(vec2(0.3f, 0.8f));
+    REQUIRE_THAT(pdf, Catch::Matchers::WithinRel(1.f, 1e-5f));
+    REQUIRE_THAT(uv.x, Catch::Matchers::WithinAbs(0.8f, 1e-5f));
+    REQUIRE_THAT(uv.y, Catch::Matchers::WithinAbs(0.3f, 1e-5f));
+}
@@ -0,0 +1,34 @@
+#include "quantization.h"
+
+#include <catch2/catch_test_macros.hpp>
+
+TEST_CASE("Octahedral normal encoding round trip", "[quantization]") {
+    const vec3 dirs[] = {
+        vec3(0.f, 0.f, 1.f),   vec3(0.f, 0.f, -1.f), vec3(1.f, 0.f, 0.f),
+        vec3(0.f, -1.f, 0.f),  vec3(1.f, 1.f, 1.f),  vec3(-0.3f, 0.8f, -0.5f),
+        vec3(0.2f, -0.1f, -0.9f),
+    };
+
+    for (auto dir : dirs) {
+        norm_vec3 n = dir.normalized();
+        norm_vec3 decoded = oct_decode(oct_encode(n));
+
+        REQUIRE(vec3::dot(n, decoded) > 0.99999f);
+    }
+}
+
+TEST_CASE("Half float conversion", "[quantization]") {
+    REQUIRE(half_to_f32(f32_to_half(0.f)) == 0.f);
+    REQUIRE(half_to_f32(f32_to_half(1.f)) == 1.f);
+    REQUIRE(half_to_f32(f32_to_half(-2.5f)) == -2.5f);
+    REQUIRE(half_to_f32(f32_to_half(65504.f)) == 65504.f);
+    REQUIRE(std::isinf(half_to_f32(f32_to_half(1e6f))));
+
+    // Smallest subnormal half
+    REQUIRE(half_to_f32(f32_to_half(5.9604645e-8f)) == 5.9604645e-8f);
+
+    // UVs in [0, 1] keep 11 bits of precision
+    for (f32 uv = 0.f; uv <= 1.f; uv += 0.01f) {
+        REQUIRE(std::abs(half_to_f32(f32_to_half(uv)) - uv) <= 0.0005f * uv + 1e-7f);
+    }
+}
@@ -1,5 +1,10 @@
 #include "envmap.h"
 
+#include "../color/spectrum_consts.h"
+#include "../math/math_utils.h"
+#include "../utils/task_pool.h"
+
+#include <algorithm>
 #include <cmath>
 
 /*
@@ -7,28 +12,58 @@
  * https://www.pbr-book.org/3ed-2018/Light_Transport_I_Surface_Reflection/Sampling_Light_Sources#InfiniteAreaLight::Sample_Li
  * */
 
-/*__global__ static void
-calc_texture(int width, int height, f32 *img, cudaTextureObject_t tex_obj) {
-    for (int v = 0; v < height; v++) {
-        f32 vp = (f32)v / (f32)height;
-        f32 sin_theta = sin(M_PIf * f32(v + 0.5f) / f32(height));
-        for (int u = 0; u < width; ++u) {
-            f32 up = (f32)u / (f32)width;
-            auto elem = tex2D<float4>(tex_obj, up, vp);
-
-// FIXME: this should calculate the power of the RGBSpectrum...
-img[u + v * width] = avg<f32>(elem.x, elem.y, elem.z);
-img[u + v * width] *= sin_theta;
-}
+namespace {
+
+/// A row of an 8K envmap is 8192 texels
+constexpr u64 ROW_GRAIN_SIZE = 4;
+
+/// The luminance only guides the sampling, so a coarse spectral integration is enough
+constexpr u32 LUMINANCE_STEP = 10;
+
+/// Luminance of the spectrum uplifted from the texel
+f32
+luminance(const tuple3 &coeff) {
+    auto spectrum = RgbSpectrum::from_coeff(coeff);
+
+    f32 sum = 0.f;
+    for (u32 lambda = LAMBDA_MIN; lambda <= LAMBDA_MAX; lambda += LUMINANCE_STEP) {
+        f32 l = static_cast<f32>(lambda);
+        sum += spectrum.eval_single(l) * CIE_Y.eval_single(l);
+    }
+
+    return sum * static_cast<f32>(LUMINANCE_STEP) / CIE_Y_INTEGRAL;
 }
-}*/
 
-Envmap::Envmap(const std::string &texture_path, const mat4 &to_world_transform)
+} // namespace
+
+Envmap::Envmap(const std::string &texture_path, const mat4 &to_world_transform,
+               TaskPool *pool)
     : ImageTexture(ImageTexture::make(texture_path, true)),
       to_world_transform(to_world_transform.inverse()) {
     std::vector<f32> img(width * height, 0.f);
 
-    sampling_dist = PiecewiseDist2D(img, width, height);
+    // Rows of the distribution go along v, which starts at the bottom of the image.
+    // The sine compensates for the stretching of the rows near the poles.
+    auto compute_row = [&](u64 r) {
+        u32 texel_y = height - 1 - r;
+        f32 sin_theta = std::sin(M_PIf * (static_cast<f32>(r) + 0.5f) /
+                                 static_cast<f32>(height));
+
+        for (i32 x = 0; x < width; x++) {
+            auto coeff = texel<TextureDataType::F32>(0, x, texel_y);
+            img[x + r * width] = luminance(coeff) * sin_theta;
+        }
+    };
+
+    if (pool != nullptr) {
+        pool->parallel_for(height, ROW_GRAIN_SIZE, compute_row);
+    } else {
+        for (i32 r = 0; r < height; r++) {
+            compute_row(r);
+        }
+    }
+
+    sampling_dist = PiecewiseDist2D(img, width, height, pool);
 }
 
 spectral
@@ -38,51 +73,64 @@ Envmap::get_ray_radiance(const Ray &ray, const SampledLambdas &lambdas) const {
     tray.dir = tray.dir.normalize();
     tray.transform(to_world_transform);*/
 
-    // Mapping from ray direction to UV on equirectangular texture
-    // (1 / 2pi, 1 / pi)
-    const vec2 pi_reciprocals = vec2(0.1591f, 0.3183f);
-    vec2 uv = vec2(std::atan2(-ray.dir.z, -ray.dir.x), std::asin(ray.dir.y));
-    uv *= pi_reciprocals;
-    uv += 0.5;
-
-    auto coeff = fetch(uv);
-    return RgbSpectrum::from_coeff(coeff).eval(lambdas);
+    return radiance(dir_to_uv(ray.dir), lambdas);
 }
 
-Tuple<tuple3, norm_vec3, f32>
-Envmap::sample(const vec2 &sample) {
+EnvmapSample
+Envmap::sample(const vec2 &sample, const SampledLambdas &lambdas) const {
     auto [uv, pdf] = sampling_dist.sample(sample);
-    if (pdf == 0.f) {
-        return {tuple3(0.f), norm_vec3(0.f), pdf};
-    }
 
-    f32 theta = uv[1] * M_PIf;
-    f32 phi = uv[0] * 2.f * M_PIf;
-    f32 sin_theta = std::sin(theta);
-    f32 cos_theta = std::cos(theta);
-    f32 sin_phi = std::sin(phi);
-    f32 cos_phi = std::cos(phi);
-    norm_vec3 dir =
-        vec3(sin_theta * cos_phi, cos_theta, sin_theta * sin_phi).normalized();
-
-    pdf /= (2.f * sqr(M_PIf) * sin_theta);
-    if (sin_theta == 0.f) {
-        pdf = 0.f;
+    // The rows at the poles are squashed into a point
+    f32 sin_theta = std::sin(uv.y * M_PIf);
+    if (pdf == 0.f || sin_theta <= 0.f) {
+        return EnvmapSample{
+            .radiance = spectral::ZERO(),
+            .dir = norm_vec3(0.f, 1.f, 0.f),
+            .pdf = 0.f,
+        };
     }
 
-    return {fetch(uv), dir, pdf};
+    return EnvmapSample{
+        .radiance = radiance(uv, lambdas),
+        .dir = uv_to_dir(uv),
+        .pdf = pdf / (2.f * sqr(M_PIf) * sin_theta),
+    };
 }
 
 f32
-Envmap::pdf(const vec3 &dir) {
-    const vec2 pi_reciprocals = vec2(0.1591f, 0.3183f);
-    vec2 uv = vec2(std::atan2(-dir.z, -dir.x), std::asin(dir.y));
-    uv *= pi_reciprocals;
-    uv += 0.5;
-    uv.y = -uv.y;
+Envmap::pdf(const vec3 &dir) const {
+    vec2 uv = dir_to_uv(dir);
 
-    f32 theta = uv[1] * M_PIf;
-    f32 sin_theta = std::sin(theta);
+    f32 sin_theta = std::sin(uv.y * M_PIf);
+    if (sin_theta <= 0.f) {
+        return 0.f;
+    }
 
     return sampling_dist.pdf(uv) / (2.f * sqr(M_PIf) * sin_theta);
 }
+
+vec2
+Envmap::dir_to_uv(const vec3 &dir) {
+    // Mapping from ray direction to UV on equirectangular texture
+    vec2 uv = vec2(std::atan2(-dir.z, -dir.x), std::asin(std::clamp(dir.y, -1.f, 1.f)));
+    uv *= vec2(1.f / (2.f * M_PIf), 1.f / M_PIf);
+    uv += 0.5;
+
+    return uv;
+}
+
+norm_vec3
+Envmap::uv_to_dir(const vec2 &uv) {
+    f32 phi = (uv.x - 0.5f) * 2.f * M_PIf;
+    f32 elevation = (uv.y - 0.5f) * M_PIf;
+    f32 cos_elevation = std::cos(elevation);
+
+    return vec3(-cos_elevation * std::cos(phi), std::sin(elevation),
+                -cos_elevation * std::sin(phi))
+        .normalized();
+}
+
+spectral
+Envmap::radiance(const vec2 &uv, const SampledLambdas &lambdas) const {
+    return fetch_spectrum<TextureDataType::F32>(TexCoords{uv}, lambdas);
+}
@@ -6,23 +6,45 @@
 #include "../math/vecmath.h"
 #include "texture.h"
 
+class TaskPool;
+
+struct EnvmapSample {
+    spectral radiance;
+    norm_vec3 dir;
+    /// With respect to solid angle
+    f32 pdf;
+};
+
 class Envmap : ImageTexture {
 public:
     Envmap() : ImageTexture(){};
 
-    explicit Envmap(const std::string &texture_path, const mat4 &to_world_transform);
+    /// The sampling distribution is built in parallel if there's a pool
+    explicit Envmap(const std::string &texture_path, const mat4 &to_world_transform,
+                    TaskPool *pool = nullptr);
 
     spectral
     get_ray_radiance(const Ray &ray, const SampledLambdas &lambdas) const;
 
-    /// Returns radiance, direction and pdf
-    Tuple<tuple3, norm_vec3, f32>
-    sample(const vec2 &sample);
+    /// Samples a direction according to the luminance of the envmap
+    EnvmapSample
+    sample(const vec2 &sample, const SampledLambdas &lambdas) const;
 
+    /// Solid angle pdf of sample() returning dir
     f32
-    pdf(const vec3 &dir);
+    pdf(const vec3 &dir) const;
 
 private:
+    /// Mapping from a direction to the equirectangular texture, v goes from -y to +y
+    static vec2
+    dir_to_uv(const vec3 &dir);
+
+    static norm_vec3
+    uv_to_dir(const vec2 &uv);
+
+    spectral
+    radiance(const vec2 &uv, const SampledLambdas &lambdas) const;
+
     mat4 to_world_transform = mat4::identity();
     PiecewiseDist2D sampling_dist{};
 };
@@ -0,0 +1,376 @@
+#ifndef PT_IMAGE_TEXTURE_H
+#define PT_IMAGE_TEXTURE_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "../color/spectrum.h"
+#include "../color/spectrum_consts.h"
+#include "../math/math_utils.h"
+#include "../math/quantization.h"
+#include "../math/vecmath.h"
+#include "../utils/basic_types.h"
+
+/// Texture coordinates of a shading point and the width of the ray footprint around them
+/// in UV space. A footprint of 0 selects the finest mip level.
+struct TexCoords {
+    vec2 uv;
+    f32 footprint = 0.f;
+};
+
+/// F16 and U16 are only used for sigmoid coefficients, see to_normalized_coeffs
+enum class TextureDataType : u8 {
+    U8,
+    F32,
+    F16,
+    U16,
+};
+
+constexpr f32 COEFF_LAMBDA_MIN = static_cast<f32>(LAMBDA_MIN);
+constexpr f32 COEFF_LAMBDA_SPAN = static_cast<f32>(LAMBDA_MAX - LAMBDA_MIN);
+
+/// Quantized textures store the sigmoid polynomial over t = (lambda - LAMBDA_MIN) /
+/// (LAMBDA_MAX - LAMBDA_MIN) instead of lambda. The quadratic coefficient is ~1e-4 and
+/// gets multiplied by lambda^2 ~ 1e5, so it wouldn't survive quantization otherwise.
+inline tuple3
+to_normalized_coeffs(const tuple3 &coeff) {
+    f32 l = COEFF_LAMBDA_MIN;
+    f32 span = COEFF_LAMBDA_SPAN;
+    return tuple3(coeff.x * span * span, span * (2.f * coeff.x * l + coeff.y),
+                  (coeff.x * l + coeff.y) * l + coeff.z);
+}
+
+inline tuple3
+from_normalized_coeffs(const tuple3 &normalized) {
+    f32 l = COEFF_LAMBDA_MIN;
+    f32 span = COEFF_LAMBDA_SPAN;
+    f32 c0 = normalized.x / (span * span);
+    f32 c1 = normalized.y / span - 2.f * c0 * l;
+    return tuple3(c0, c1, normalized.z - (c0 * l + c1) * l);
+}
+
+/// Maps the U16 channels of a texel back to normalized coefficients: min + (q - 1) *
+/// scale. 0 and 0xffff are reserved for -inf and inf, which rgb2spec returns for black
+/// and white.
+struct QuantizationRange {
+    static constexpr u16 NEG_INF = 0;
+    static constexpr u16 POS_INF = 0xffff;
+    static constexpr f32 NUM_STEPS = 0xfffd;
+
+    Array<f32, 3> min{};
+    Array<f32, 3> scale{};
+};
+
+/// Image texture with a mip pyramid. Each level is stored in tiles of TILE_SIZE x
+/// TILE_SIZE RGBA texels, so that the texels of a bilinear lookup are close in memory.
+/// All levels are in one allocation, the finest level first.
+class ImageTexture {
+public:
+    static constexpr u32 TILE_SIZE = 4;
+    static constexpr u32 NUM_CHANNELS = 4;
+    /// Enough for the largest allowed texture dimensions
+    static constexpr u32 MAX_MIP_LEVELS = 21;
+
+    ImageTexture() = default;
+
+    /// pixels has to be a whole pyramid in the layout of this class, e.g. a copy of the
+    /// pixels of another texture
+    ImageTexture(i32 width, i32 height, void *pixels, TextureDataType data_type)
+        : width{width}, height{height}, pixels{pixels}, data_type{data_type} {
+        init_levels();
+    }
+
+    static ImageTexture
+    make(const std::string &texture_path, bool is_rgb,
+         TextureDataType coeff_type = TextureDataType::F32);
+
+    /// Builds the pyramid from the RGBA texels of the finest level. The levels are
+    /// downsampled in RGB and converted to sigmoid coefficients afterwards if is_rgb.
+    /// F16 and U16 require is_rgb.
+    static ImageTexture
+    make_mipmapped(i32 width, i32 height, std::vector<f32> &&rgba,
+                   TextureDataType data_type, bool is_rgb);
+
+    /// Trilinear lookup, the mip level is chosen so that a texel is about as large as
+    /// the footprint
+    template <TextureDataType DT>
+    tuple3
+    fetch(const TexCoords &tex_coords) const {
+        return fetch<DT>(tex_coords, [this](u64 index) { return texel_data<DT>(index); });
+    }
+
+    /// Lookup that reads the texels through texel_data(texel index), which returns a
+    /// pointer to the channels of the texel
+    template <TextureDataType DT, typename TexelData>
+    tuple3
+    fetch(const TexCoords &tex_coords, const TexelData &texel_data) const {
+        return filter<DT>(tex_coords, texel_data,
+                          [](const tuple3 &texel) { return texel; });
+    }
+
+    /// Reflectance of a texture of sigmoid coefficients. The texels are evaluated before
+    /// they are filtered, because the coefficients of black and white are infinite.
+    template <TextureDataType DT>
+    spectral
+    fetch_spectrum(const TexCoords &tex_coords, const SampledLambdas &lambdas) const {
+        return fetch_spectrum<DT>(tex_coords, lambdas,
+                                  [this](u64 index) { return texel_data<DT>(index); });
+    }
+
+    template <TextureDataType DT, typename TexelData>
+    spectral
+    fetch_spectrum(const TexCoords &tex_coords, const SampledLambdas &lambdas,
+                   const TexelData &texel_data) const {
+        return filter<DT>(tex_coords, texel_data, [&lambdas](const tuple3 &coeff) {
+            return RgbSpectrum::from_coeff(coeff).eval(lambdas);
+        });
+    }
+
+    template <TextureDataType DT>
+    tuple3
+    fetch_bilinear(u32 level, const vec2 &uv) const {
+        return fetch_bilinear<DT>(level, uv,
+                                  [this](u64 index) { return texel_data<DT>(index); });
+    }
+
+    template <TextureDataType DT, typename TexelData>
+    tuple3
+    fetch_bilinear(u32 level, const vec2 &uv, const TexelData &texel_data) const {
+        return filter_bilinear<DT>(level, uv, texel_data,
+                                   [](const tuple3 &texel) { return texel; });
+    }
+
+    template <TextureDataType DT>
+    tuple3
+    texel(u32 level, u32 x, u32 y) const {
+        return decode_texel<DT>(texel_data<DT>(texel_index(level, x, y)));
+    }
+
+    template <TextureDataType DT>
+    tuple3
+    decode_texel(const void *data) const {
+        if constexpr (DT == TextureDataType::F32) {
+            const f32 *texel = static_cast<const f32 *>(data);
+            return tuple3(texel[0], texel[1], texel[2]);
+        } else if constexpr (DT == TextureDataType::F16) {
+            const u16 *texel = static_cast<const u16 *>(data);
+            return from_normalized_coeffs(tuple3(
+                half_to_f32(texel[0]), half_to_f32(texel[1]), half_to_f32(texel[2])));
+        } else if constexpr (DT == TextureDataType::U16) {
+            const u16 *texel = static_cast<const u16 *>(data);
+            tuple3 normalized(0.f);
+            for (u32 c = 0; c < 3; c++) {
+                if (texel[c] == QuantizationRange::NEG_INF) {
+                    normalized[c] = -std::numeric_limits<f32>::infinity();
+                } else if (texel[c] == QuantizationRange::POS_INF) {
+                    normalized[c] = std::numeric_limits<f32>::infinity();
+                } else {
+                    normalized[c] = quant_range.min[c] +
+                                    static_cast<f32>(texel[c] - 1) * quant_range.scale[c];
+                }
+            }
+            return from_normalized_coeffs(normalized);
+        } else {
+            const u8 *texel = static_cast<const u8 *>(data);
+            return tuple3(static_cast<f32>(texel[0]), static_cast<f32>(texel[1]),
+                          static_cast<f32>(texel[2])) *
+                   (1.f / 255.f);
+        }
+    }
+
+    /// Data type of the pyramid ImageTexture::make creates for a file, coeff_type is
+    /// the data type of sigmoid coefficients
+    static TextureDataType
+    data_type_for(const std::string &texture_path, bool is_rgb,
+                  TextureDataType coeff_type = TextureDataType::F32) {
+        // Sigmoid coefficients aren't in [0, 1], so they can't be stored as U8
+        if (is_rgb) {
+            return coeff_type;
+        } else if (texture_path.ends_with(".exr")) {
+            return TextureDataType::F32;
+        }
+
+        return TextureDataType::U8;
+    }
+
+    static constexpr u64
+    texel_size(TextureDataType data_type) {
+        switch (data_type) {
+        case TextureDataType::U8:
+            return NUM_CHANNELS * sizeof(u8);
+        case TextureDataType::F16:
+        case TextureDataType::U16:
+            return NUM_CHANNELS * sizeof(u16);
+        default:
+            return NUM_CHANNELS * sizeof(f32);
+        }
+    }
+
+    void
+    free() const {
+        std::free(pixels);
+    }
+
+    i32
+    get_width() const {
+        return width;
+    }
+
+    i32
+    get_height() const {
+        return height;
+    }
+
+    const void *
+    get_pixels() const {
+        return pixels;
+    }
+
+    TextureDataType
+    get_data_type() const {
+        return data_type;
+    }
+
+    const QuantizationRange &
+    get_quant_range() const {
+        return quant_range;
+    }
+
+    void
+    set_quant_range(const QuantizationRange &range) {
+        quant_range = range;
+    }
+
+    u32
+    get_num_levels() const {
+        return num_levels;
+    }
+
+    u64
+    get_num_texels() const {
+        return num_texels;
+    }
+
+    /// Size of the whole pyramid
+    u64
+    size_bytes() const {
+        return num_texels * texel_size(data_type);
+    }
+
+protected:
+    struct MipLevel {
+        u32 width;
+        u32 height;
+        u32 tiles_x;
+        /// Index of the first texel of the level
+        u64 offset;
+    };
+
+    /// Trilinear filter of eval(texel), eval returns something that can be lerped
+    template <TextureDataType DT, typename TexelData, typename Eval>
+    auto
+    filter(const TexCoords &tex_coords, const TexelData &texel_data,
+           const Eval &eval) const {
+        if (tex_coords.footprint <= 0.f || num_levels == 1) {
+            return filter_bilinear<DT>(0, tex_coords.uv, texel_data, eval);
+        }
+
+        f32 texels = tex_coords.footprint * static_cast<f32>(std::max(width, height));
+        f32 lod = std::log2(texels);
+        if (!(lod > 0.f)) {
+            return filter_bilinear<DT>(0, tex_coords.uv, texel_data, eval);
+        } else if (lod >= static_cast<f32>(num_levels - 1)) {
+            return filter_bilinear<DT>(num_levels - 1, tex_coords.uv, texel_data, eval);
+        }
+
+        u32 level = static_cast<u32>(lod);
+        f32 t = lod - static_cast<f32>(level);
+        return lerp(t, filter_bilinear<DT>(level, tex_coords.uv, texel_data, eval),
+                    filter_bilinear<DT>(level + 1, tex_coords.uv, texel_data, eval));
+    }
+
+    /// The texture repeats outside of [0, 1]
+    template <TextureDataType DT, typename TexelData, typename Eval>
+    auto
+    filter_bilinear(u32 level, const vec2 &uv, const TexelData &texel_data,
+                    const Eval &eval) const {
+        const auto &mip = levels[level];
+
+        f32 x = (uv.x - std::floor(uv.x)) * static_cast<f32>(mip.width) - 0.5f;
+        f32 y = (1.f - (uv.y - std::floor(uv.y))) * static_cast<f32>(mip.height) - 0.5f;
+
+        f32 x_floor = std::floor(x);
+        f32 y_floor = std::floor(y);
+        f32 tx = x - x_floor;
+        f32 ty = y - y_floor;
+
+        auto wrap = [](i32 coord, u32 size) {
+            i32 wrapped = coord % static_cast<i32>(size);
+            return static_cast<u32>(wrapped < 0 ? wrapped + static_cast<i32>(size)
+                                                : wrapped);
+        };
+
+        u32 x0 = wrap(static_cast<i32>(x_floor), mip.width);
+        u32 y0 = wrap(static_cast<i32>(y_floor), mip.height);
+        u32 x1 = x0 + 1 == mip.width ? 0 : x0 + 1;
+        u32 y1 = y0 + 1 == mip.height ? 0 : y0 + 1;
+
+        auto texel = [&](u32 tx, u32 ty) {
+            return eval(decode_texel<DT>(texel_data(texel_index(level, tx, ty))));
+        };
+
+        auto top = lerp(tx, texel(x0, y0), texel(x1, y0));
+        auto bottom = lerp(tx, texel(x0, y1), texel(x1, y1));
+        return lerp(ty, top, bottom);
+    }
+
+    /// Computes the sizes and offsets of the levels from width and height
+    void
+    init_levels();
+
+    void
+    store_level(u32 level, const std::vector<f32> &rgba);
+
+    u16
+    quantize_u16(f32 normalized, u32 channel) const {
+        if (std::isinf(normalized)) {
+            return normalized < 0.f ? QuantizationRange::NEG_INF
+                                    : QuantizationRange::POS_INF;
+        } else if (std::isnan(normalized) || quant_range.scale[channel] == 0.f) {
+            return 1;
+        }
+
+        f32 steps = (normalized - quant_range.min[channel]) / quant_range.scale[channel];
+        return static_cast<u16>(
+            std::lround(std::clamp(steps, 0.f, QuantizationRange::NUM_STEPS)) + 1);
+    }
+
+    template <TextureDataType DT>
+    const void *
+    texel_data(u64 index) const {
+        return static_cast<const u8 *>(pixels) + index * texel_size(DT);
+    }
+
+    u64
+    texel_index(u32 level, u32 x, u32 y) const {
+        const auto &mip = levels[level];
+        u64 tile = static_cast<u64>(y / TILE_SIZE) * mip.tiles_x + x / TILE_SIZE;
+        return mip.offset + tile * TILE_SIZE * TILE_SIZE + (y % TILE_SIZE) * TILE_SIZE +
+               x % TILE_SIZE;
+    }
+
+    i32 width = 0;
+    i32 height = 0;
+    void *pixels = nullptr;
+    TextureDataType data_type = TextureDataType::F32;
+    /// Only used by U16
+    QuantizationRange quant_range{};
+    u32 num_levels = 0;
+    u64 num_texels = 0;
+    Array<MipLevel, MAX_MIP_LEVELS> levels{};
+};
+
+#endif // PT_IMAGE_TEXTURE_H
@@ -4,14 +4,17 @@
 #include "../geometry/geometry.h"
 #include "../utils/basic_types.h"
 
+/// An emissive sphere or a whole emissive mesh, the triangles of mesh lights are chosen
+/// by Scene::light_triangles
 struct Light {
     ShapeIndex shape;
     Emitter emitter;
+    /// Area of the whole shape, computed once when the light is added
+    f32 area;
 
     f32
-    power(const Geometry &geom) const {
+    power() const {
         // Mitusba's format doesn't use twosided lights from what I can tell
-        f32 area = geom.shape_area(shape);
         return M_PI * emitter.power() * area;
     }
 };
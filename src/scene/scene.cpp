@@ -15,27 +15,36 @@ Scene::add_texture(Texture &&texture) {
 }
 
 void
-Scene::init_light_sampler() {
-    light_sampler = LightSampler(lights, geometry);
+Scene::init_light_sampler(TaskPool *pool) {
+    light_sampler = LightSampler(lights, geometry, light_sampler_type, pool);
+    light_sampler.set_has_envmap(has_envmap);
+}
+
+void
+Scene::reserve_meshes(const MeshCounts &counts) {
+    geometry.reserve_meshes(counts);
+    lights.reserve(lights.size() + counts.lights);
+    light_triangles.reserve(light_triangles.size() + counts.lights);
 }
 
 void
 Scene::add_mesh(MeshParams mp) {
     u32 next_mesh_id = geometry.get_next_shape_index(ShapeType::Mesh);
-    Option<u32> lights_start_id = {};
+    Option<u32> light_id = {};
 
     if (mp.emitter.has_value()) {
-        lights_start_id = Option<u32>(lights.size());
-
-        for (u32 i = 0; i < mp.indices->size() / 3; i++) {
-            auto si = ShapeIndex{
-                .type = ShapeType::Mesh, .index = next_mesh_id, .triangle_index = i};
+        light_id = Option<u32>(lights.size());
 
-            lights.push_back(Light{.shape = si, .emitter = mp.emitter.value()});
-        }
+        auto si = ShapeIndex{.type = ShapeType::Mesh, .index = next_mesh_id};
+        lights.push_back(Light{.shape = si, .emitter = mp.emitter.value(), .area = 0.f});
+        light_triangles.emplace_back();
     }
 
-    geometry.add_mesh(mp, lights_start_id);
+    geometry.add_mesh(mp, light_id);
+
+    if (light_id.has_value()) {
+        init_mesh_light(light_id.value());
+    }
 }
 
 void
@@ -47,14 +56,91 @@ Scene::add_sphere(SphereParams sp) {
         light_id = Option<u32>(lights.size());
         auto si = ShapeIndex{.type = ShapeType::Sphere, .index = next_sphere_id};
 
-        lights.push_back(Light{.shape = si, .emitter = sp.emitter.value()});
+        lights.push_back(Light{.shape = si,
+                               .emitter = sp.emitter.value(),
+                               .area = Spheres::calc_sphere_area(sp.radius)});
+        light_triangles.emplace_back();
     }
 
     geometry.add_sphere(sp, light_id);
 }
 
-Scene::~Scene() {
-    for (auto &tex : textures) {
-        tex.free();
+void
+Scene::init_mesh_lights() {
+    light_triangles.clear();
+    light_triangles.resize(lights.size());
+
+    for (u32 light_id = 0; light_id < lights.size(); light_id++) {
+        if (lights[light_id].shape.type == ShapeType::Mesh) {
+            init_mesh_light(light_id);
+        }
+    }
+}
+
+void
+Scene::init_mesh_light(u32 light_id) {
+    auto &light = lights[light_id];
+    const auto &mesh = geometry.meshes.meshes[light.shape.index];
+
+    std::vector<f32> areas(mesh.num_triangles());
+    f64 total_area = 0.;
+    for (u32 i = 0; i < mesh.num_triangles(); i++) {
+        areas[i] = geometry.meshes.calc_tri_area(mesh.indices_index, mesh.pos_index, i);
+        total_area += areas[i];
+    }
+
+    light.area = static_cast<f32>(total_area);
+    light_triangles[light_id] = AliasTable(areas);
+}
+
+ShapeSample
+Scene::sample_light_shape(u32 light_id, const point3 &pos, const vec3 &sample) const {
+    const auto &light = lights[light_id];
+    if (light.shape.type != ShapeType::Mesh) {
+        return geometry.sample_shape(light.shape, pos, sample);
+    }
+
+    // The choice of the triangle leaves sample.y uniform for sampling the triangle
+    f32 remapped = 0.f;
+    auto si = light.shape;
+    const auto &triangles = light_triangles[light_id];
+    si.triangle_index = triangles.sample(vec2(sample.x, sample.y), remapped);
+
+    auto shape_sample =
+        geometry.sample_shape(si, pos, vec3(sample.x, remapped, sample.z));
+    shape_sample.pdf *= triangles.pdf(si.triangle_index);
+    return shape_sample;
+}
+
+ShapeSample
+Scene::sample_light_area(u32 light_id, const vec3 &sample) const {
+    const auto &light = lights[light_id];
+    if (light.shape.type != ShapeType::Mesh) {
+        return geometry.sample_shape_area(light.shape, sample);
+    }
+
+    f32 remapped = 0.f;
+    auto si = light.shape;
+    const auto &triangles = light_triangles[light_id];
+    si.triangle_index = triangles.sample(vec2(sample.x, sample.y), remapped);
+
+    // Triangles are chosen by area, so the whole mesh is sampled uniformly
+    auto shape_sample =
+        geometry.sample_shape_area(si, vec3(sample.x, remapped, sample.z));
+    shape_sample.pdf = 1.f / light.area;
+    return shape_sample;
+}
+
+f32
+Scene::light_shape_pdf(u32 light_id, u32 triangle_index, const point3 &pos,
+                       const point3 &light_pos) const {
+    const auto &light = lights[light_id];
+    if (light.shape.type != ShapeType::Mesh) {
+        return geometry.shape_pdf(light.shape, pos, light_pos);
     }
+
+    auto si = light.shape;
+    si.triangle_index = triangle_index;
+    return light_triangles[light_id].pdf(triangle_index) *
+           geometry.shape_pdf(si, pos, light_pos);
 }
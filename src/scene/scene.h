@@ -4,6 +4,7 @@
 #include "../geometry/geometry.h"
 #include "../integrator/light_sampler.h"
 #include "../materials/material.h"
+#include "../math/alias_table.h"
 #include "envmap.h"
 #include "light.h"
 #include "texture.h"
@@ -11,14 +12,17 @@
 struct Scene {
     Scene() = default;
 
-    ~Scene();
-
+    /// The light sampler chooses between the envmap and the lights from now on
     void
     set_envmap(Envmap &&a_envmap) {
         envmap = std::move(a_envmap);
         has_envmap = true;
+        light_sampler.set_has_envmap(true);
     };
 
+    /// Reserves the geometry and light buffers for meshes that will be added
+    void
+    reserve_meshes(const MeshCounts &counts);
     void
     add_mesh(MeshParams mp);
     void
@@ -30,18 +34,53 @@ struct Scene {
     u32
     add_texture(Texture &&texture);
 
+    /// The powers of the lights are computed in parallel if there's a pool
     void
-    init_light_sampler();
+    init_light_sampler(TaskPool *pool = nullptr);
 
+    /// Builds the area distributions of the triangles of mesh lights, the lights and
+    /// the geometry have to be loaded already
+    void
+    init_mesh_lights();
+
+    /// Builds the area distribution of the triangles of one mesh light and its area
+    void
+    init_mesh_light(u32 light_id);
+
+    /// Samples a light or the envmap for illuminating pos, normal is the surface normal
+    /// there
     Option<LightSample>
-    sample_lights(f32 sample) {
-        return light_sampler.sample(lights, sample);
+    sample_lights(const point3 &pos, const vec3 &normal, const vec2 &sample) const {
+        return light_sampler.sample(pos, normal, sample);
     }
 
+    /// Samples a point on the light for illuminating pos, the pdf is with respect to
+    /// the solid angle at pos. Mesh lights first choose a triangle according to its area
+    /// with sample.x and sample.y.
+    ShapeSample
+    sample_light_shape(u32 light_id, const point3 &pos, const vec3 &sample) const;
+
+    /// Samples a point on the light uniformly by area, the pdf is with respect to area
+    ShapeSample
+    sample_light_area(u32 light_id, const vec3 &sample) const;
+
+    /// Solid angle pdf of sample_light_shape() returning light_pos, triangle_index is
+    /// the triangle of mesh lights that light_pos lies on
+    f32
+    light_shape_pdf(u32 light_id, u32 triangle_index, const point3 &pos,
+                    const point3 &light_pos) const;
+
     Geometry geometry{};
+    /// Has to be set before the scene is loaded
+    LightSamplerType light_sampler_type = LightSamplerType::Power;
     LightSampler light_sampler{};
     std::vector<Light> lights{};
+    /// Area distributions of the triangles of mesh lights, indexed by light id. Empty
+    /// for other shapes.
+    std::vector<AliasTable> light_triangles{};
 
+    /// Owns the images of the image textures
+    TextureCache texture_cache{};
     std::vector<Texture> textures{};
 
     ChunkAllocator<> material_allocator{};
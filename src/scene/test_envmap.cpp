@@ -0,0 +1,63 @@
+#include "envmap.h"
+
+#include "../math/sampling.h"
+#include "test_images.h"
+
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/matchers/catch_matchers_floating_point.hpp>
+
+#include <string>
+
+namespace {
+
+/// Binary PPM of a dim sky with a small bright sun
+TempPpm
+write_sky_ppm(const std::string &name, u32 width, u32 height) {
+    return TempPpm(name, width, height, [](u32 x, u32 y) {
+        bool is_sun = x >= 40 && x < 44 && y >= 6 && y < 9;
+        if (is_sun) {
+            return Array<u8, 3>{255, 250, 240};
+        }
+
+        return Array<u8, 3>{static_cast<u8>(20 + x), static_cast<u8>(30 + y), 60};
+    });
+}
+
+} // namespace
+
+TEST_CASE("Envmap sampling matches its pdf", "[envmap]") {
+    auto ppm = write_sky_ppm("pt_test_envmap.ppm", 64, 32);
+    Envmap envmap(ppm.get_path(), mat4::identity());
+    auto lambdas = SampledLambdas::new_sample_uniform(0.4f);
+
+    constexpr u32 STRATA = 128;
+    f64 importance_estimate = 0.;
+    f64 uniform_estimate = 0.;
+    for (u32 x = 0; x < STRATA; x++) {
+        for (u32 y = 0; y < STRATA; y++) {
+            vec2 sample((static_cast<f32>(x) + 0.5f) / static_cast<f32>(STRATA),
+                        (static_cast<f32>(y) + 0.5f) / static_cast<f32>(STRATA));
+
+            auto envmap_sample = envmap.sample(sample, lambdas);
+            if (envmap_sample.pdf > 0.f) {
+                REQUIRE_THAT(envmap.pdf(envmap_sample.dir),
+                             Catch::Matchers::WithinRel(envmap_sample.pdf, 1e-3f));
+
+                Ray ray(point3(0.f), envmap_sample.dir);
+                auto radiance = envmap.get_ray_radiance(ray, lambdas);
+                REQUIRE_THAT(radiance[0], Catch::Matchers::WithinRel(
+                                              envmap_sample.radiance[0], 1e-4f));
+
+                importance_estimate += envmap_sample.radiance[0] / envmap_sample.pdf;
+            }
+
+            Ray ray(point3(0.f), sample_uniform_sphere(sample).normalized());
+            uniform_estimate += envmap.get_ray_radiance(ray, lambdas)[0] * 4. * M_PI;
+        }
+    }
+
+    // Both estimate the integral of the radiance over the sphere
+    importance_estimate /= STRATA * STRATA;
+    uniform_estimate /= STRATA * STRATA;
+    REQUIRE_THAT(importance_estimate, Catch::Matchers::WithinRel(uniform_estimate, 0.01));
+}
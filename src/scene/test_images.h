@@ -0,0 +1,49 @@
+#ifndef PT_TEST_IMAGES_H
+#define PT_TEST_IMAGES_H
+
+#include "../utils/basic_types.h"
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <system_error>
+
+/// Binary PPM in the temporary directory for the texture tests, the file is removed
+/// when it goes out of scope
+class TempPpm {
+public:
+    /// texel(x, y) returns the RGB bytes of a texel
+    template <typename F>
+    TempPpm(const std::string &name, u32 width, u32 height, F texel)
+        : path{(std::filesystem::temp_directory_path() / name).string()} {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out << "P6\n" << width << " " << height << "\n255\n";
+        for (u32 y = 0; y < height; y++) {
+            for (u32 x = 0; x < width; x++) {
+                Array<u8, 3> rgb = texel(x, y);
+                out.put(static_cast<char>(rgb[0]));
+                out.put(static_cast<char>(rgb[1]));
+                out.put(static_cast<char>(rgb[2]));
+            }
+        }
+    }
+
+    ~TempPpm() {
+        std::error_code err;
+        std::filesystem::remove(path, err);
+    }
+
+    TempPpm(const TempPpm &) = delete;
+    TempPpm &
+    operator=(const TempPpm &) = delete;
+
+    const std::string &
+    get_path() const {
+        return path;
+    }
+
+private:
+    std::string path;
+};
+
+#endif // PT_TEST_IMAGES_H
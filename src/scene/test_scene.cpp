@@ -0,0 +1,61 @@
+#include "scene.h"
+
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/matchers/catch_matchers_floating_point.hpp>
+
+#include <vector>
+
+TEST_CASE("Mesh lights are sampled uniformly by area", "[scene]") {
+    // Two triangles with areas 0.5 and 1.5, the second one is at x >= 1
+    std::vector<u32> indices = {0, 1, 2, 1, 3, 4};
+    std::vector<point3> pos = {point3(0.f, 0.f, 0.f), point3(1.f, 0.f, 0.f),
+                               point3(0.f, 1.f, 0.f), point3(4.f, 0.f, 0.f),
+                               point3(1.f, 1.f, 0.f)};
+
+    Scene sc{};
+    auto emission = RgbSpectrumIlluminant::make(tuple3(1.f), ColorSpace::sRGB);
+    sc.add_mesh(MeshParams{
+        .indices = &indices,
+        .pos = &pos,
+        .material_id = 0,
+        .emitter = Emitter(emission),
+    });
+
+    REQUIRE(sc.lights.size() == 1);
+    REQUIRE(sc.geometry.meshes.meshes[0].light_id == 0);
+    REQUIRE_THAT(sc.lights[0].area, Catch::Matchers::WithinAbs(2.f, 1e-6f));
+
+    constexpr u32 STRATA = 64;
+    f64 first_triangle = 0.;
+    f64 mean_x = 0.;
+    f64 mean_y = 0.;
+    for (u32 i = 0; i < STRATA * STRATA * STRATA; i++) {
+        auto stratum = [](u32 index) {
+            return (static_cast<f32>(index % STRATA) + 0.5f) / STRATA;
+        };
+        auto sample = vec3(stratum(i), stratum(i / STRATA), stratum(i / STRATA / STRATA));
+        auto shape_sample = sc.sample_light_area(0, sample);
+
+        REQUIRE(shape_sample.pdf == 0.5f);
+
+        // Solid angle sampling chooses the triangles the same way
+        auto receiver = point3(1.f, 0.5f, 1.f);
+        auto light_sample = sc.sample_light_shape(0, receiver, sample);
+        u32 triangle = light_sample.pos.x < 1.f ? 0 : 1;
+        REQUIRE((shape_sample.pos.x < 1.f) == (triangle == 0));
+        f32 pdf = sc.light_shape_pdf(0, triangle, receiver, light_sample.pos);
+        REQUIRE_THAT(light_sample.pdf, Catch::Matchers::WithinRel(pdf, 1e-3f));
+
+        first_triangle += shape_sample.pos.x < 1.f ? 1. : 0.;
+        mean_x += shape_sample.pos.x;
+        mean_y += shape_sample.pos.y;
+    }
+
+    constexpr f64 NUM_SAMPLES = STRATA * STRATA * STRATA;
+    REQUIRE_THAT(first_triangle / NUM_SAMPLES, Catch::Matchers::WithinAbs(0.25, 1e-3));
+
+    // The mean is the centroid of the triangles weighted by area
+    REQUIRE_THAT(mean_x / NUM_SAMPLES,
+                 Catch::Matchers::WithinAbs(0.25 / 3. + 0.75 * 2., 1e-2));
+    REQUIRE_THAT(mean_y / NUM_SAMPLES, Catch::Matchers::WithinAbs(1. / 3., 1e-2));
+}
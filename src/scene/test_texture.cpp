@@ -0,0 +1,194 @@
+#include "../color/rgb2spec.h"
+#include "texture.h"
+
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/matchers/catch_matchers_floating_point.hpp>
+
+#include <cmath>
+#include <vector>
+
+namespace {
+
+/// Texel (x, y) of the finest level has the value (x, y, 1)
+ImageTexture
+make_gradient_texture(i32 width, i32 height, TextureDataType data_type) {
+    std::vector<f32> rgba{};
+    for (i32 y = 0; y < height; y++) {
+        for (i32 x = 0; x < width; x++) {
+            rgba.insert(rgba.end(), {static_cast<f32>(x), static_cast<f32>(y), 1.f, 1.f});
+        }
+    }
+
+    return ImageTexture::make_mipmapped(width, height, std::move(rgba), data_type, false);
+}
+
+} // namespace
+
+TEST_CASE("Mip pyramid layout", "[texture]") {
+    auto texture = make_gradient_texture(10, 3, TextureDataType::F32);
+
+    // 10x3, 5x1, 2x1, 1x1
+    REQUIRE(texture.get_num_levels() == 4);
+
+    for (u32 y = 0; y < 3; y++) {
+        for (u32 x = 0; x < 10; x++) {
+            auto texel = texture.texel<TextureDataType::F32>(0, x, y);
+            REQUIRE(texel.x == static_cast<f32>(x));
+            REQUIRE(texel.y == static_cast<f32>(y));
+        }
+    }
+
+    // Box filter of texels (2, 0), (3, 0), (2, 1) and (3, 1)
+    auto texel = texture.texel<TextureDataType::F32>(1, 1, 0);
+    REQUIRE_THAT(texel.x, Catch::Matchers::WithinAbs(2.5f, 1e-5));
+    REQUIRE_THAT(texel.y, Catch::Matchers::WithinAbs(0.5f, 1e-5));
+
+    texture.free();
+}
+
+TEST_CASE("Filtered texture lookups", "[texture]") {
+    auto texture = make_gradient_texture(8, 8, TextureDataType::F32);
+
+    SECTION("Bilinear lookup at a texel center") {
+        // v is flipped, the first row is at the top of the image
+        vec2 uv = vec2(2.5f / 8.f, 1.f - 5.5f / 8.f);
+        auto value = texture.fetch<TextureDataType::F32>(TexCoords{uv});
+        REQUIRE_THAT(value.x, Catch::Matchers::WithinAbs(2.f, 1e-5));
+        REQUIRE_THAT(value.y, Catch::Matchers::WithinAbs(5.f, 1e-5));
+    }
+
+    SECTION("Bilinear lookup between texels") {
+        vec2 uv = vec2(3.f / 8.f, 1.f - 5.5f / 8.f);
+        auto value = texture.fetch<TextureDataType::F32>(TexCoords{uv});
+        REQUIRE_THAT(value.x, Catch::Matchers::WithinAbs(2.5f, 1e-5));
+    }
+
+    SECTION("Coordinates wrap around") {
+        vec2 uv = vec2(2.5f / 8.f, 1.f - 5.5f / 8.f);
+        auto value = texture.fetch<TextureDataType::F32>(TexCoords{uv + vec2(3.f, -2.f)});
+        REQUIRE_THAT(value.x, Catch::Matchers::WithinAbs(2.f, 1e-5));
+        REQUIRE_THAT(value.y, Catch::Matchers::WithinAbs(5.f, 1e-5));
+    }
+
+    SECTION("Footprint of the whole texture selects the coarsest level") {
+        auto value = texture.fetch<TextureDataType::F32>(
+            TexCoords{.uv = vec2(0.3f, 0.6f), .footprint = 2.f});
+        REQUIRE_THAT(value.x, Catch::Matchers::WithinAbs(3.5f, 1e-5));
+        REQUIRE_THAT(value.y, Catch::Matchers::WithinAbs(3.5f, 1e-5));
+    }
+
+    SECTION("Footprint between levels blends them") {
+        // Exactly level 1.5
+        f32 footprint = std::exp2(1.5f) / 8.f;
+        vec2 uv = vec2(0.5f, 0.5f);
+
+        auto level_1 = texture.fetch_bilinear<TextureDataType::F32>(1, uv);
+        auto level_2 = texture.fetch_bilinear<TextureDataType::F32>(2, uv);
+        auto value = texture.fetch<TextureDataType::F32>(
+            TexCoords{.uv = uv, .footprint = footprint});
+
+        f32 expected = (level_1.x + level_2.x) * 0.5f;
+        REQUIRE_THAT(value.x, Catch::Matchers::WithinAbs(expected, 1e-5));
+    }
+
+    texture.free();
+}
+
+TEST_CASE("8-bit textures", "[texture]") {
+    std::vector<f32> rgba = {0.f, 0.5f, 1.f, 1.f};
+    auto texture = ImageTexture::make_mipmapped(1, 1, std::move(rgba),
+                                                TextureDataType::U8, false);
+
+    auto value = texture.fetch<TextureDataType::U8>(TexCoords{vec2(0.2f, 0.7f)});
+    REQUIRE(value.x == 0.f);
+    REQUIRE_THAT(value.y, Catch::Matchers::WithinAbs(128.f / 255.f, 1e-5));
+    REQUIRE(value.z == 1.f);
+
+    texture.free();
+}
+
+TEST_CASE("Quantized coefficient textures", "[texture]") {
+    // Saturated, dark, grey and black texels, black has infinite coefficients
+    std::vector<f32> rgba{};
+    for (u32 i = 0; i < 64; i++) {
+        f32 t = static_cast<f32>(i) / 63.f;
+        rgba.insert(rgba.end(), {t, 0.9f * (1.f - t), (i % 4) == 0 ? t : 0.3f, 1.f});
+    }
+    rgba[4 * 9 + 0] = rgba[4 * 9 + 1] = rgba[4 * 9 + 2] = 0.f;
+
+    auto reference = ImageTexture::make_mipmapped(8, 8, std::vector<f32>(rgba),
+                                                  TextureDataType::F32, true);
+
+    for (auto data_type : {TextureDataType::F16, TextureDataType::U16}) {
+        auto texture =
+            ImageTexture::make_mipmapped(8, 8, std::vector<f32>(rgba), data_type, true);
+        REQUIRE(texture.size_bytes() * 2 == reference.size_bytes());
+        // Reflectances of saturated colors, whose coefficients are large, are off by up
+        // to 1.3% with F16 and 0.09% with U16
+        f32 tolerance = data_type == TextureDataType::F16 ? 2e-2f : 2e-3f;
+
+        for (u32 level = 0; level < reference.get_num_levels(); level++) {
+            u32 size = 8 >> level;
+            for (u32 i = 0; i < size * size; i++) {
+                auto expected =
+                    reference.texel<TextureDataType::F32>(level, i % size, i / size);
+                auto value = data_type == TextureDataType::F16
+                                 ? texture.texel<TextureDataType::F16>(level, i % size,
+                                                                       i / size)
+                                 : texture.texel<TextureDataType::U16>(level, i % size,
+                                                                       i / size);
+
+                for (f32 lambda = 360.f; lambda <= 830.f; lambda += 47.f) {
+                    REQUIRE_THAT(RGB2Spec::eval(value, lambda),
+                                 Catch::Matchers::WithinAbs(
+                                     RGB2Spec::eval(expected, lambda), tolerance));
+                }
+            }
+        }
+
+        texture.free();
+    }
+
+    reference.free();
+}
+
+TEST_CASE("Filtering between black and white texels", "[texture]") {
+    // The coefficients of black and white are -inf and inf
+    std::vector<f32> rgba = {0.f, 0.f, 0.f, 1.f, 1.f, 1.f, 1.f, 1.f};
+    auto lambdas = SampledLambdas::new_sample_uniform(0.4f);
+
+    for (auto data_type :
+         {TextureDataType::F32, TextureDataType::F16, TextureDataType::U16}) {
+        auto texture =
+            ImageTexture::make_mipmapped(2, 1, std::vector<f32>(rgba), data_type, true);
+
+        auto fetch = [&](const TexCoords &tex_coords) {
+            switch (data_type) {
+            case TextureDataType::F16:
+                return texture.fetch_spectrum<TextureDataType::F16>(tex_coords, lambdas);
+            case TextureDataType::U16:
+                return texture.fetch_spectrum<TextureDataType::U16>(tex_coords, lambdas);
+            default:
+                return texture.fetch_spectrum<TextureDataType::F32>(tex_coords, lambdas);
+            }
+        };
+
+        // Texel centers, halfway between them and halfway between the black texel and
+        // the grey level above it
+        Array<Tuple<TexCoords, f32>, 4> lookups = {{
+            {TexCoords{vec2(0.25f, 0.5f)}, 0.f},
+            {TexCoords{vec2(0.75f, 0.5f)}, 1.f},
+            {TexCoords{vec2(0.5f, 0.5f)}, 0.5f},
+            {TexCoords{vec2(0.25f, 0.5f), 0.5f * std::sqrt(2.f)}, 0.25f},
+        }};
+
+        for (const auto &[tex_coords, expected] : lookups) {
+            auto value = fetch(tex_coords);
+            for (u32 i = 0; i < N_SPECTRUM_SAMPLES; i++) {
+                REQUIRE_THAT(value[i], Catch::Matchers::WithinAbs(expected, 1e-3));
+            }
+        }
+
+        texture.free();
+    }
+}
@@ -0,0 +1,160 @@
+#include "../utils/task_pool.h"
+#include "test_images.h"
+#include "texture_cache.h"
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <filesystem>
+#include <string>
+
+namespace {
+
+/// Binary PPM with a pattern that differs in every texel
+TempPpm
+write_ppm(const std::string &name, u32 width, u32 height) {
+    return TempPpm(name, width, height, [](u32 x, u32 y) {
+        return Array<u8, 3>{static_cast<u8>(x), static_cast<u8>(y),
+                            static_cast<u8>((x * 7 + y * 13) % 256)};
+    });
+}
+
+/// Compares lookups through the cache with lookups of the fully loaded image
+void
+require_same_lookups(CachedTexture *texture, const ImageTexture &reference) {
+    for (f32 footprint : {0.f, 0.002f, 0.01f, 0.1f, 1.f}) {
+        for (u32 i = 0; i < 64; i++) {
+            auto uv = vec2(static_cast<f32>(i % 8) / 8.f + 0.03f,
+                           static_cast<f32>(i / 8) / 8.f + 0.01f);
+            auto tex_coords = TexCoords{.uv = uv, .footprint = footprint};
+
+            auto cached = texture->fetch<TextureDataType::U8>(tex_coords);
+            auto expected = reference.fetch<TextureDataType::U8>(tex_coords);
+            REQUIRE(cached.x == expected.x);
+            REQUIRE(cached.y == expected.y);
+            REQUIRE(cached.z == expected.z);
+        }
+    }
+}
+
+} // namespace
+
+TEST_CASE("Textures are deduplicated by path", "[texture_cache]") {
+    auto ppm = write_ppm("pt_test_dedup.ppm", 4, 4);
+    const auto &path = ppm.get_path();
+
+    TextureCache cache{};
+    auto *texture = cache.add(path, false);
+    REQUIRE(cache.add(path, false) == texture);
+    REQUIRE(cache.add(path, true) != texture);
+    REQUIRE(cache.get_textures().size() == 2);
+
+    REQUIRE_THROWS(cache.add(path + ".missing", false));
+}
+
+TEST_CASE("Textures are loaded on first access", "[texture_cache]") {
+    auto ppm = write_ppm("pt_test_lazy.ppm", 100, 60);
+    const auto &path = ppm.get_path();
+    auto reference = ImageTexture::make(path, false);
+
+    TextureCache cache{};
+    auto *texture = cache.add(path, false);
+    REQUIRE(cache.get_resident_bytes() == 0);
+
+    require_same_lookups(texture, reference);
+    REQUIRE(cache.get_resident_bytes() == reference.size_bytes());
+
+    reference.free();
+}
+
+TEST_CASE("Textures are preloaded on a pool", "[texture_cache]") {
+    auto first_ppm = write_ppm("pt_test_preload_1.ppm", 30, 20);
+    auto second_ppm = write_ppm("pt_test_preload_2.ppm", 17, 9);
+    const auto &first_path = first_ppm.get_path();
+    const auto &second_path = second_ppm.get_path();
+    auto reference = ImageTexture::make(first_path, false);
+
+    TextureCache cache{};
+    auto *texture = cache.add(first_path, false);
+    cache.add(second_path, false);
+
+    TaskPool pool(2);
+    cache.preload(pool);
+    REQUIRE(cache.get_num_decodes() == 2);
+
+    // Already loaded textures are skipped
+    cache.preload(pool);
+    require_same_lookups(texture, reference);
+    REQUIRE(cache.get_num_decodes() == 2);
+
+    reference.free();
+}
+
+TEST_CASE("RGB textures are read from the coefficient cache", "[texture_cache]") {
+    auto ppm = write_ppm("pt_test_coeffs.ppm", 100, 60);
+    const auto &path = ppm.get_path();
+    auto dir = (std::filesystem::temp_directory_path() / "pt_test_coeff_cache").string();
+    std::filesystem::remove_all(dir);
+
+    for (auto coeff_type : {TextureDataType::F32, TextureDataType::U16}) {
+        auto reference = ImageTexture::make(path, true, coeff_type);
+        auto fetch = [&](CachedTexture *texture, const TexCoords &tex_coords) {
+            return coeff_type == TextureDataType::F32
+                       ? texture->fetch<TextureDataType::F32>(tex_coords)
+                       : texture->fetch<TextureDataType::U16>(tex_coords);
+        };
+        auto expected = [&](const TexCoords &tex_coords) {
+            return coeff_type == TextureDataType::F32
+                       ? reference.fetch<TextureDataType::F32>(tex_coords)
+                       : reference.fetch<TextureDataType::U16>(tex_coords);
+        };
+
+        // The first run decodes the image, the others map the file or read its pages
+        for (u32 run = 0; run < 3; run++) {
+            TextureCache cache{};
+            cache.set_memory_budget(run == 2 ? 64 * 1024 : 0);
+            cache.set_coeff_type(coeff_type);
+            cache.set_coeff_cache_dir(dir);
+            auto *texture = cache.add(path, true);
+
+            for (u32 i = 0; i < 64; i++) {
+                auto tex_coords =
+                    TexCoords{.uv = vec2(static_cast<f32>(i % 8) / 8.f + 0.03f,
+                                         static_cast<f32>(i / 8) / 8.f + 0.01f),
+                              .footprint = static_cast<f32>(i % 3) * 0.02f};
+
+                auto value = fetch(texture, tex_coords);
+                auto reference_value = expected(tex_coords);
+                REQUIRE(value.x == reference_value.x);
+                REQUIRE(value.y == reference_value.y);
+                REQUIRE(value.z == reference_value.z);
+            }
+
+            REQUIRE(cache.get_num_decodes() == (run == 0 ? 1 : 0));
+        }
+
+        reference.free();
+    }
+
+    REQUIRE(std::distance(std::filesystem::directory_iterator(dir),
+                          std::filesystem::directory_iterator()) == 2);
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Pages are evicted under a memory budget", "[texture_cache]") {
+    auto ppm = write_ppm("pt_test_budget.ppm", 512, 512);
+    const auto &path = ppm.get_path();
+    auto reference = ImageTexture::make(path, false);
+
+    // 4 of the 86 pages of the pyramid
+    constexpr u64 BUDGET = 4 * CachedTexture::PAGE_TEXELS * ImageTexture::NUM_CHANNELS;
+
+    TextureCache cache{};
+    cache.set_memory_budget(BUDGET);
+    auto *texture = cache.add(path, false);
+
+    require_same_lookups(texture, reference);
+    REQUIRE(cache.get_resident_bytes() <= BUDGET);
+    REQUIRE(cache.get_num_evictions() > 0);
+
+    reference.free();
+}
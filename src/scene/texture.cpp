@@ -5,6 +5,10 @@
 #include "../color/spectrum.h"
 #include "texture.h"
 
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
 void
 transform_rgb_to_spectrum(f32 *pixels, i32 width, i32 height) {
     for (i32 p = 0; p < width * height; p++) {
@@ -28,11 +32,11 @@ check_texture_dimensions(i32 width, i32 height) {
 }
 
 ImageTexture
-load_exr_texture(const std::string &texture_path, bool is_rgb) {
+load_exr_texture(const std::string &texture_path, bool is_rgb,
+                 TextureDataType coeff_type) {
     f32 *pixels = nullptr;
     i32 width = 0;
     i32 height = 0;
-    constexpr u32 num_channels = 4;
 
     const char *err = nullptr;
     i32 ret = LoadEXR(&pixels, &width, &height, texture_path.c_str(), &err);
@@ -46,15 +50,18 @@ load_exr_texture(const std::string &texture_path, bool is_rgb) {
 
     check_texture_dimensions(width, height);
 
-    if (is_rgb) {
-        transform_rgb_to_spectrum(pixels, width, height);
-    }
+    // LoadEXR always returns RGBA
+    std::vector<f32> rgba(pixels, pixels + static_cast<u64>(width) * height * 4);
+    std::free(pixels);
 
-    return ImageTexture(0, 0, pixels, num_channels, TextureDataType::F32);
+    auto data_type = ImageTexture::data_type_for(texture_path, is_rgb, coeff_type);
+    return ImageTexture::make_mipmapped(width, height, std::move(rgba), data_type,
+                                        is_rgb);
 }
 
 ImageTexture
-load_other_format_texture(const std::string &texture_path, bool is_rgb) {
+load_other_format_texture(const std::string &texture_path, bool is_rgb,
+                          TextureDataType coeff_type) {
     i32 width = 0;
     i32 height = 0;
     i32 num_channels = 0;
@@ -62,45 +69,211 @@ load_other_format_texture(const std::string &texture_path, bool is_rgb) {
     u8 *pixels = stbi_load(texture_path.c_str(), &width, &height, &num_channels, 0);
     check_texture_dimensions(width, height);
 
-    if (is_rgb) {
-        if (num_channels < 3 || num_channels > 4) {
-            throw std::runtime_error("Invalid RGB texture channel count");
+    if (is_rgb && (num_channels < 3 || num_channels > 4)) {
+        stbi_image_free(pixels);
+        throw std::runtime_error("Invalid RGB texture channel count");
+    } else if (num_channels > 4 || num_channels < 1) {
+        stbi_image_free(pixels);
+        throw std::runtime_error("Invalid texture channel count");
+    }
+
+    // Expand to RGBA, grey images are replicated to RGB
+    std::vector<f32> rgba(static_cast<u64>(width) * height * 4);
+    for (u64 p = 0; p < static_cast<u64>(width) * height; p++) {
+        const u8 *texel = &pixels[num_channels * p];
+        bool is_grey = num_channels < 3;
+
+        rgba[4 * p + 0] = static_cast<f32>(texel[0]) / 255.f;
+        rgba[4 * p + 1] = static_cast<f32>(texel[is_grey ? 0 : 1]) / 255.f;
+        rgba[4 * p + 2] = static_cast<f32>(texel[is_grey ? 0 : 2]) / 255.f;
+        rgba[4 * p + 3] = num_channels == 2 || num_channels == 4
+                              ? static_cast<f32>(texel[num_channels - 1]) / 255.f
+                              : 1.f;
+    }
+    stbi_image_free(pixels);
+
+    auto data_type = ImageTexture::data_type_for(texture_path, is_rgb, coeff_type);
+    return ImageTexture::make_mipmapped(width, height, std::move(rgba), data_type,
+                                        is_rgb);
+}
+
+/// 2x2 box filter, the last row or column of odd sizes is dropped
+std::vector<f32>
+downsample(const std::vector<f32> &rgba, u32 width, u32 height) {
+    u32 half_width = std::max(width / 2, 1U);
+    u32 half_height = std::max(height / 2, 1U);
+    std::vector<f32> half(static_cast<u64>(half_width) * half_height * 4);
+
+    for (u32 y = 0; y < half_height; y++) {
+        u32 y0 = std::min(2 * y, height - 1);
+        u32 y1 = std::min(2 * y + 1, height - 1);
+
+        for (u32 x = 0; x < half_width; x++) {
+            u32 x0 = std::min(2 * x, width - 1);
+            u32 x1 = std::min(2 * x + 1, width - 1);
+
+            for (u32 c = 0; c < 4; c++) {
+                f32 sum = rgba[4 * (static_cast<u64>(y0) * width + x0) + c] +
+                          rgba[4 * (static_cast<u64>(y0) * width + x1) + c] +
+                          rgba[4 * (static_cast<u64>(y1) * width + x0) + c] +
+                          rgba[4 * (static_cast<u64>(y1) * width + x1) + c];
+                half[4 * (static_cast<u64>(y) * half_width + x) + c] = sum * 0.25f;
+            }
         }
+    }
 
-        constexpr int num_channels_converted = 4;
+    return half;
+}
 
-        // Transform u8s to f32s
-        f32 *pixels_f32 = reinterpret_cast<f32 *>(
-            std::malloc(width * height * num_channels_converted * sizeof(f32)));
+/// Range of the normalized coefficients of all levels, infinities are stored separately
+QuantizationRange
+find_quant_range(const std::vector<std::vector<f32>> &levels) {
+    Array<f32, 3> min_coeff{};
+    Array<f32, 3> max_coeff{};
+    min_coeff.fill(std::numeric_limits<f32>::max());
+    max_coeff.fill(std::numeric_limits<f32>::lowest());
 
-        for (i32 p = 0; p < width * height; p++) {
-            pixels_f32[4 * p + 0] =
-                static_cast<f32>(pixels[num_channels * p + 0]) / 255.f;
-            pixels_f32[4 * p + 1] =
-                static_cast<f32>(pixels[num_channels * p + 1]) / 255.f;
-            pixels_f32[4 * p + 2] =
-                static_cast<f32>(pixels[num_channels * p + 2]) / 255.f;
-            pixels_f32[4 * p + 3] = 1.f;
+    for (const auto &coeffs : levels) {
+        for (u64 p = 0; p < coeffs.size() / 4; p++) {
+            auto normalized = to_normalized_coeffs(
+                tuple3(coeffs[4 * p + 0], coeffs[4 * p + 1], coeffs[4 * p + 2]));
+            for (u32 c = 0; c < 3; c++) {
+                if (std::isfinite(normalized[c])) {
+                    min_coeff[c] = std::min(min_coeff[c], normalized[c]);
+                    max_coeff[c] = std::max(max_coeff[c], normalized[c]);
+                }
+            }
         }
+    }
 
-        stbi_image_free(pixels);
-        transform_rgb_to_spectrum(pixels_f32, width, height);
-        return ImageTexture(width, height, pixels_f32, num_channels_converted,
-                            TextureDataType::F32);
-    } else {
-        if (num_channels > 4 || num_channels < 1) {
-            throw std::runtime_error("Invalid texture channel count");
+    QuantizationRange range{};
+    for (u32 c = 0; c < 3; c++) {
+        if (min_coeff[c] <= max_coeff[c]) {
+            range.min[c] = min_coeff[c];
+            range.scale[c] = (max_coeff[c] - min_coeff[c]) / QuantizationRange::NUM_STEPS;
         }
+    }
 
-        return ImageTexture(width, height, pixels, num_channels, TextureDataType::U8);
+    return range;
+}
+
+void
+ImageTexture::init_levels() {
+    num_levels = 0;
+    num_texels = 0;
+
+    u32 level_width = width;
+    u32 level_height = height;
+    while (true) {
+        u32 tiles_x = (level_width + TILE_SIZE - 1) / TILE_SIZE;
+        u32 tiles_y = (level_height + TILE_SIZE - 1) / TILE_SIZE;
+
+        levels[num_levels] = MipLevel{
+            .width = level_width,
+            .height = level_height,
+            .tiles_x = tiles_x,
+            .offset = num_texels,
+        };
+        num_levels++;
+        num_texels += static_cast<u64>(tiles_x) * tiles_y * TILE_SIZE * TILE_SIZE;
+
+        if ((level_width == 1 && level_height == 1) || num_levels == MAX_MIP_LEVELS) {
+            break;
+        }
+
+        level_width = std::max(level_width / 2, 1U);
+        level_height = std::max(level_height / 2, 1U);
+    }
+}
+
+void
+ImageTexture::store_level(u32 level, const std::vector<f32> &rgba) {
+    const auto &mip = levels[level];
+
+    for (u32 y = 0; y < mip.height; y++) {
+        for (u32 x = 0; x < mip.width; x++) {
+            const f32 *src = &rgba[4 * (static_cast<u64>(y) * mip.width + x)];
+            u64 index = texel_index(level, x, y) * NUM_CHANNELS;
+
+            if (data_type == TextureDataType::F32) {
+                std::memcpy(static_cast<f32 *>(pixels) + index, src, 4 * sizeof(f32));
+            } else if (data_type == TextureDataType::F16 ||
+                       data_type == TextureDataType::U16) {
+                u16 *dst = static_cast<u16 *>(pixels) + index;
+                auto normalized = to_normalized_coeffs(tuple3(src[0], src[1], src[2]));
+                for (u32 c = 0; c < 3; c++) {
+                    dst[c] = data_type == TextureDataType::F16
+                                 ? f32_to_half(normalized[c])
+                                 : quantize_u16(normalized[c], c);
+                }
+                f32 alpha = std::clamp(src[3], 0.f, 1.f);
+                dst[3] = data_type == TextureDataType::F16
+                             ? f32_to_half(alpha)
+                             : static_cast<u16>(std::lround(alpha * 65535.f));
+            } else {
+                u8 *dst = static_cast<u8 *>(pixels) + index;
+                for (u32 c = 0; c < 4; c++) {
+                    f32 value = std::clamp(src[c], 0.f, 1.f) * 255.f;
+                    dst[c] = static_cast<u8>(std::lround(value));
+                }
+            }
+        }
+    }
+}
+
+ImageTexture
+ImageTexture::make_mipmapped(i32 width, i32 height, std::vector<f32> &&rgba,
+                             TextureDataType data_type, bool is_rgb) {
+    if (data_type != TextureDataType::U8 && data_type != TextureDataType::F32 &&
+        !is_rgb) {
+        throw std::runtime_error("Quantized textures have to contain RGB colors");
+    }
+
+    ImageTexture texture{};
+    texture.width = width;
+    texture.height = height;
+    texture.data_type = data_type;
+    texture.init_levels();
+
+    // Padding of partial tiles is zeroed
+    texture.pixels = std::calloc(texture.size_bytes(), 1);
+    if (texture.pixels == nullptr) {
+        throw std::bad_alloc();
     }
+
+    // U16 needs the range of every level before the first one is stored
+    std::vector<std::vector<f32>> levels_rgba{};
+    levels_rgba.push_back(std::move(rgba));
+    for (u32 level = 0; level < texture.num_levels; level++) {
+        const auto &mip = texture.levels[level];
+
+        if (level + 1 < texture.num_levels) {
+            levels_rgba.push_back(downsample(levels_rgba[level], mip.width, mip.height));
+        }
+
+        if (is_rgb) {
+            transform_rgb_to_spectrum(levels_rgba[level].data(), mip.width, mip.height);
+        }
+    }
+
+    if (data_type == TextureDataType::U16) {
+        texture.quant_range = find_quant_range(levels_rgba);
+    }
+
+    for (u32 level = 0; level < texture.num_levels; level++) {
+        texture.store_level(level, levels_rgba[level]);
+        levels_rgba[level] = {};
+    }
+
+    return texture;
 }
 
 ImageTexture
-ImageTexture::make(const std::string &texture_path, bool is_rgb) {
+ImageTexture::make(const std::string &texture_path, bool is_rgb,
+                   TextureDataType coeff_type) {
     if (texture_path.ends_with(".exr")) {
-        return load_exr_texture(texture_path, is_rgb);
+        return load_exr_texture(texture_path, is_rgb, coeff_type);
     } else {
-        return load_other_format_texture(texture_path, is_rgb);
+        return load_other_format_texture(texture_path, is_rgb, coeff_type);
     }
 }
@@ -14,6 +14,8 @@
 #include "../math/vecmath.h"
 #include "../utils/basic_types.h"
 #include "../utils/chunk_allocator.h"
+#include "image_texture.h"
+#include "texture_cache.h"
 
 template <typename T> struct ConstantTexture {
     static ConstantTexture
@@ -31,82 +33,14 @@ template <typename T> struct ConstantTexture {
     T value;
 };
 
-enum class TextureDataType : u8 {
-    U8,
-    F32,
-};
-
-class ImageTexture {
-public:
-    ImageTexture() = default;
-
-    ImageTexture(i32 width, i32 height, void *pixels, u32 num_channels,
-                 TextureDataType data_type)
-        : width{width}, height{height}, pixels{pixels}, num_channels{num_channels},
-          data_type{data_type} {}
-
-    static ImageTexture
-    make(const std::string &texture_path, bool is_rgb);
-
-    tuple3
-    fetch(const vec2 &uv) const {
-        f32 foo;
-        f32 ufrac = std::modf(uv.x, &foo);
-        f32 vfrac = std::modf(uv.y, &foo);
-
-        f32 u = ufrac < 0.f ? 1.f + ufrac : ufrac;
-        f32 v = vfrac < 0.f ? 1.f + vfrac : vfrac;
-
-        vec2 xy_sized = vec2(u, 1.f - v) * vec2(width - 1U, height - 1U);
-
-        u32 x = xy_sized.x;
-        u32 y = xy_sized.y;
-        u64 pixel_index = x + (width * y);
-
-        // TODO: FIXME: figure out a better texture representation
-        switch (data_type) {
-        case TextureDataType::U8: {
-            u8 *pixels_u8 = reinterpret_cast<u8 *>(pixels);
-            assert(num_channels == 3);
-
-            f32 a = (f32)pixels_u8[num_channels * pixel_index] / 255.f;
-            f32 b = (f32)pixels_u8[num_channels * pixel_index + 1] / 255.f;
-            f32 c = (f32)pixels_u8[num_channels * pixel_index + 2] / 255.f;
-
-            return tuple3(a, b, c);
-        }
-        case TextureDataType::F32: {
-            f32 *pixels_f32 = reinterpret_cast<f32 *>(pixels);
-            // assert(num_channels == 3);
-
-            f32 a = pixels_f32[num_channels * pixel_index];
-            f32 b = pixels_f32[num_channels * pixel_index + 1];
-            f32 c = pixels_f32[num_channels * pixel_index + 2];
-
-            return tuple3(a, b, c);
-        }
-        default:
-            assert(false);
-        }
-    };
-
-    void
-    free() const {
-        std::free(pixels);
-    }
-
-protected:
-    i32 width = 0;
-    i32 height = 0;
-    void *pixels;
-    u32 num_channels;
-    TextureDataType data_type;
-};
-
 enum class TextureType : u8 {
     ConstantF32,
     ConstantRgb,
-    Image,
+    /// Images are separate types per data type, so that the lookups are specialized
+    ImageU8,
+    ImageF32,
+    ImageF16,
+    ImageU16,
 };
 
 // TODO: templated texture ? IDK if it's a good idea
@@ -114,11 +48,25 @@ class Texture {
 public:
     Texture() = default;
 
+    /// The image is owned by the texture cache
     static Texture
-    make_image_texture(const std::string &texture_path, bool is_rgb) {
+    make_image_texture(CachedTexture *image_texture) {
         Texture tex{};
-        tex.texture_type = TextureType::Image;
-        tex.inner.image_texture = ImageTexture::make(texture_path, is_rgb);
+        switch (image_texture->get_data_type()) {
+        case TextureDataType::U8:
+            tex.texture_type = TextureType::ImageU8;
+            break;
+        case TextureDataType::F32:
+            tex.texture_type = TextureType::ImageF32;
+            break;
+        case TextureDataType::F16:
+            tex.texture_type = TextureType::ImageF16;
+            break;
+        case TextureDataType::U16:
+            tex.texture_type = TextureType::ImageU16;
+            break;
+        }
+        tex.inner.image_texture = image_texture;
 
         return tex;
     }
@@ -142,31 +90,56 @@ public:
     }
 
     tuple3
-    fetch(const vec2 &uv) const {
+    fetch(const TexCoords &tex_coords) const {
         switch (texture_type) {
         case TextureType::ConstantF32:
             return tuple3(inner.constant_texture_f32.fetch());
         case TextureType::ConstantRgb:
             return inner.constant_texture_rgb.fetch().sigmoid_coeff;
-        case TextureType::Image:
-            return inner.image_texture.fetch(uv);
+        case TextureType::ImageU8:
+            return inner.image_texture->fetch<TextureDataType::U8>(tex_coords);
+        case TextureType::ImageF32:
+            return inner.image_texture->fetch<TextureDataType::F32>(tex_coords);
+        case TextureType::ImageF16:
+            return inner.image_texture->fetch<TextureDataType::F16>(tex_coords);
+        case TextureType::ImageU16:
+            return inner.image_texture->fetch<TextureDataType::U16>(tex_coords);
         default:
             assert(false);
         }
     };
 
-    void
-    free() const {
-        if (texture_type == TextureType::Image) {
-            inner.image_texture.free();
+    /// Reflectance for textures of sigmoid coefficients
+    spectral
+    fetch_spectrum(const TexCoords &tex_coords, const SampledLambdas &lambdas) const {
+        switch (texture_type) {
+        case TextureType::ConstantF32:
+            return RgbSpectrum::from_coeff(tuple3(inner.constant_texture_f32.fetch()))
+                .eval(lambdas);
+        case TextureType::ConstantRgb:
+            return inner.constant_texture_rgb.fetch().eval(lambdas);
+        case TextureType::ImageU8:
+            return inner.image_texture->fetch_spectrum<TextureDataType::U8>(tex_coords,
+                                                                            lambdas);
+        case TextureType::ImageF32:
+            return inner.image_texture->fetch_spectrum<TextureDataType::F32>(tex_coords,
+                                                                             lambdas);
+        case TextureType::ImageF16:
+            return inner.image_texture->fetch_spectrum<TextureDataType::F16>(tex_coords,
+                                                                             lambdas);
+        case TextureType::ImageU16:
+            return inner.image_texture->fetch_spectrum<TextureDataType::U16>(tex_coords,
+                                                                             lambdas);
+        default:
+            assert(false);
         }
-    }
+    };
 
     TextureType texture_type{};
     union {
         ConstantTexture<f32> constant_texture_f32;
         ConstantTexture<RgbSpectrum> constant_texture_rgb;
-        ImageTexture image_texture;
+        CachedTexture *image_texture;
     } inner{};
 };
 
@@ -0,0 +1,589 @@
+#include "texture_cache.h"
+
+#include "../color/spectrum.h"
+#include "../utils/hash.h"
+#include "../utils/task_pool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <spdlog/spdlog.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+std::atomic<u32> num_temp_files{0};
+
+constexpr u32 COEFF_CACHE_MAGIC = 0x43435450; // "PTCC"
+/// Bump when the layout of the file or the encoding of the texels changes
+constexpr u32 COEFF_CACHE_VERSION = 1;
+/// The pixels start on a page boundary, so that they can be mapped
+constexpr u64 COEFF_CACHE_PIXELS_OFFSET = 4096;
+
+struct CoeffCacheHeader {
+    u32 magic;
+    u32 version;
+    u64 source_hash;
+    u64 table_hash;
+    i32 width;
+    i32 height;
+    u32 data_type;
+    u32 padding;
+    QuantizationRange quant_range;
+    u64 pixels_offset;
+    u64 pixels_size;
+};
+
+static_assert(sizeof(CoeffCacheHeader) <= COEFF_CACHE_PIXELS_OFFSET);
+
+/// Layout of the pyramid in the file, nothing if the file was written for a different
+/// image or is truncated
+Option<ImageTexture>
+check_coeff_cache(const CoeffCacheHeader &header, u64 source_hash,
+                  TextureDataType data_type, u64 file_size) {
+    if (header.magic != COEFF_CACHE_MAGIC || header.version != COEFF_CACHE_VERSION ||
+        header.source_hash != source_hash ||
+        header.table_hash != RgbSpectrum::table_hash() ||
+        header.data_type != static_cast<u32>(data_type) || header.width < 1 ||
+        header.height < 1 || header.width > 0x10'00'00 || header.height > 0x10'00'00) {
+        return {};
+    }
+
+    ImageTexture layout(header.width, header.height, nullptr, data_type);
+    layout.set_quant_range(header.quant_range);
+    if (header.pixels_size != layout.size_bytes() ||
+        header.pixels_offset != COEFF_CACHE_PIXELS_OFFSET ||
+        file_size < header.pixels_offset + header.pixels_size) {
+        return {};
+    }
+
+    return layout;
+}
+
+/// The file is written under a temporary name and renamed, so that other processes
+/// never see a partial file
+void
+write_coeff_cache(const std::string &cache_path, u64 source_hash,
+                  const ImageTexture &image) {
+    CoeffCacheHeader header{
+        .magic = COEFF_CACHE_MAGIC,
+        .version = COEFF_CACHE_VERSION,
+        .source_hash = source_hash,
+        .table_hash = RgbSpectrum::table_hash(),
+        .width = image.get_width(),
+        .height = image.get_height(),
+        .data_type = static_cast<u32>(image.get_data_type()),
+        .padding = 0,
+        .quant_range = image.get_quant_range(),
+        .pixels_offset = COEFF_CACHE_PIXELS_OFFSET,
+        .pixels_size = image.size_bytes(),
+    };
+
+    auto tmp_path = fmt::format("{}.{}-{}.tmp", cache_path, ::getpid(), num_temp_files++);
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        std::vector<char> header_bytes(COEFF_CACHE_PIXELS_OFFSET, 0);
+        std::memcpy(header_bytes.data(), &header, sizeof(header));
+        out.write(header_bytes.data(), static_cast<std::streamsize>(header_bytes.size()));
+        out.write(static_cast<const char *>(image.get_pixels()),
+                  static_cast<std::streamsize>(image.size_bytes()));
+        out.flush();
+        if (!out) {
+            std::filesystem::remove(tmp_path);
+            throw std::runtime_error(fmt::format("Couldn't write '{}'", tmp_path));
+        }
+    }
+
+    std::filesystem::rename(tmp_path, cache_path);
+}
+
+bool
+read_at(i32 fd, u8 *dst, u64 size, u64 offset) {
+    while (size > 0) {
+        ssize_t read = ::pread(fd, dst, size, static_cast<off_t>(offset));
+        if (read < 0 && errno == EINTR) {
+            continue;
+        } else if (read <= 0) {
+            return false;
+        }
+
+        dst += read;
+        size -= read;
+        offset += read;
+    }
+
+    return true;
+}
+
+/// Writes the pyramid to a temporary file and returns a descriptor of it. The file is
+/// unlinked right away, so it's removed even if the process crashes.
+i32
+write_spill_file(const ImageTexture &image) {
+    auto path = std::filesystem::temp_directory_path() /
+                fmt::format("pt-texture-{}-{}.bin", ::getpid(), num_temp_files++);
+
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(static_cast<const char *>(image.get_pixels()),
+                  static_cast<std::streamsize>(image.size_bytes()));
+        out.flush();
+        if (!out) {
+            std::filesystem::remove(path);
+            throw std::runtime_error(fmt::format("Couldn't write '{}'", path.string()));
+        }
+    }
+
+    i32 fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    std::filesystem::remove(path);
+    if (fd < 0) {
+        throw std::runtime_error(fmt::format("Couldn't open '{}': {}", path.string(),
+                                             std::strerror(errno)));
+    }
+
+    return fd;
+}
+
+} // namespace
+
+CachedTexture::~CachedTexture() {
+    if (!layout_ready.load()) {
+        return;
+    }
+
+    if (mapping.size() > 0) {
+        // The layout points into the mapping
+    } else if (layout.get_pixels() != nullptr) {
+        layout.free();
+    } else {
+        for (u64 page = 0; page < num_pages; page++) {
+            std::free(const_cast<u8 *>(pages[page].load()));
+        }
+    }
+
+    if (owns_source_fd) {
+        ::close(source_fd);
+    }
+}
+
+void
+CachedTexture::set_source(i32 fd, u64 offset, const ImageTexture &source_layout) {
+    std::lock_guard lock(mutex);
+    if (layout_ready.load()) {
+        return;
+    }
+
+    source_fd = fd;
+    source_offset = offset;
+    layout = ImageTexture(source_layout.get_width(), source_layout.get_height(), nullptr,
+                          data_type);
+    layout.set_quant_range(source_layout.get_quant_range());
+    init_pages();
+}
+
+bool
+CachedTexture::open_coeff_cache(const std::string &cache_path, u64 source_hash) {
+    if (!std::filesystem::exists(cache_path)) {
+        return false;
+    }
+
+    if (cache->memory_budget == 0) {
+        MappedFile file(cache_path);
+        CoeffCacheHeader header{};
+        if (file.size() < sizeof(header)) {
+            return false;
+        }
+        std::memcpy(&header, file.bytes().data(), sizeof(header));
+
+        auto file_layout = check_coeff_cache(header, source_hash, data_type, file.size());
+        if (!file_layout.has_value()) {
+            return false;
+        }
+
+        mapping = std::move(file);
+        auto *pixels = const_cast<u8 *>(mapping.bytes().data() + header.pixels_offset);
+        layout = ImageTexture(header.width, header.height, pixels, data_type);
+        layout.set_quant_range(header.quant_range);
+        return true;
+    }
+
+    i32 fd = ::open(cache_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat file_stat {};
+    CoeffCacheHeader header{};
+    Option<ImageTexture> file_layout{};
+    if (::fstat(fd, &file_stat) == 0 &&
+        read_at(fd, reinterpret_cast<u8 *>(&header), sizeof(header), 0)) {
+        file_layout = check_coeff_cache(header, source_hash, data_type,
+                                        static_cast<u64>(file_stat.st_size));
+    }
+
+    if (!file_layout.has_value()) {
+        ::close(fd);
+        return false;
+    }
+
+    source_fd = fd;
+    source_offset = header.pixels_offset;
+    owns_source_fd = true;
+    layout = file_layout.value();
+    return true;
+}
+
+void
+CachedTexture::load_layout() {
+    std::lock_guard lock(mutex);
+    if (layout_ready.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    // Keyed by the contents of the image, so that it doesn't matter where it's stored
+    std::string coeff_cache_path{};
+    u64 source_hash = 0;
+    if (is_rgb && !cache->coeff_cache_dir.empty()) {
+        try {
+            MappedFile source(path);
+            source_hash = hash_bytes(source.bytes());
+
+            Array<u64, 3> key = {source_hash, RgbSpectrum::table_hash(),
+                                 static_cast<u64>(data_type)};
+            u64 key_hash = hash_bytes(
+                Span<const u8>(reinterpret_cast<const u8 *>(key.data()), sizeof(key)));
+            coeff_cache_path = (std::filesystem::path(cache->coeff_cache_dir) /
+                                fmt::format("{:016x}.ptc", key_hash))
+                                   .string();
+
+            if (open_coeff_cache(coeff_cache_path, source_hash)) {
+                cache->num_coeff_cache_reads.fetch_add(1, std::memory_order_relaxed);
+                init_pages();
+                return;
+            }
+        } catch (const std::exception &e) {
+            spdlog::warn("Coefficient cache of texture '{}' isn't used: {}", path,
+                         e.what());
+            coeff_cache_path.clear();
+        }
+    }
+
+    ImageTexture image{};
+    bool decoded = true;
+    try {
+        image = decode();
+    } catch (const std::exception &e) {
+        spdlog::error("Couldn't load texture '{}', it's rendered as 0: {}", path,
+                      e.what());
+        image = ImageTexture::make_mipmapped(1, 1, std::vector<f32>(4, 0.f), data_type,
+                                            false);
+        decoded = false;
+    }
+    cache->num_decodes.fetch_add(1, std::memory_order_relaxed);
+
+    if (!coeff_cache_path.empty() && decoded) {
+        // The cache file replaces the spill file
+        try {
+            write_coeff_cache(coeff_cache_path, source_hash, image);
+            if (open_coeff_cache(coeff_cache_path, source_hash)) {
+                image.free();
+                init_pages();
+                return;
+            }
+        } catch (const std::exception &e) {
+            spdlog::warn("Couldn't write the coefficient cache of texture '{}': {}", path,
+                         e.what());
+        }
+    }
+
+    if (cache->memory_budget > 0 && decoded) {
+        // The pages are read back from a spill file, so that they can be evicted
+        try {
+            source_fd = write_spill_file(image);
+            owns_source_fd = true;
+            layout = ImageTexture(image.get_width(), image.get_height(), nullptr,
+                                  data_type);
+            image.free();
+        } catch (const std::exception &e) {
+            spdlog::warn("Texture '{}' stays resident: {}", path, e.what());
+            layout = image;
+        }
+    } else {
+        layout = image;
+    }
+
+    init_pages();
+}
+
+void
+CachedTexture::init_pages() {
+    num_pages = (layout.get_num_texels() + PAGE_TEXELS - 1) / PAGE_TEXELS;
+    pages = std::make_unique<std::atomic<const u8 *>[]>(num_pages);
+    referenced = std::make_unique<std::atomic<u8>[]>(num_pages);
+
+    // A resident pyramid is never evicted, its page table points into it
+    if (layout.get_pixels() != nullptr) {
+        const u8 *pixels = static_cast<const u8 *>(layout.get_pixels());
+        for (u64 page = 0; page < num_pages; page++) {
+            pages[page].store(pixels + page * page_bytes(), std::memory_order_relaxed);
+        }
+
+        cache->add_resident(layout.size_bytes());
+    }
+
+    layout_ready.store(true, std::memory_order_release);
+}
+
+const u8 *
+CachedTexture::load_page(u64 page) {
+    std::lock_guard lock(mutex);
+
+    const u8 *loaded = pages[page].load(std::memory_order_acquire);
+    if (loaded != nullptr) {
+        return loaded;
+    }
+
+    u64 bytes = page_bytes();
+    cache->evict(bytes);
+
+    u8 *data = static_cast<u8 *>(std::malloc(bytes));
+    if (data == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    // The last page of the pyramid is only partially filled
+    u64 start = page * bytes;
+    u64 size = std::min(bytes, layout.size_bytes() - start);
+    if (!read_at(source_fd, data, size, source_offset + start)) {
+        spdlog::error("Couldn't read a page of texture '{}': {}", path,
+                      std::strerror(errno));
+        size = 0;
+    }
+    std::memset(data + size, 0, bytes - size);
+
+    referenced[page].store(1, std::memory_order_relaxed);
+    pages[page].store(data, std::memory_order_release);
+
+    cache->add_resident(bytes);
+    cache->num_page_loads.fetch_add(1, std::memory_order_relaxed);
+    return data;
+}
+
+TextureCache::~TextureCache() {
+    for (const auto &page : retired) {
+        std::free(const_cast<u8 *>(page.data));
+    }
+
+    textures.clear();
+
+    for (i32 fd : source_fds) {
+        ::close(fd);
+    }
+}
+
+CachedTexture *
+TextureCache::add(const std::string &path, bool is_rgb) {
+    auto key = fmt::format("{}:{}", is_rgb, path);
+    auto id = texture_ids.find(key);
+    if (id != texture_ids.end()) {
+        return textures[id->second].get();
+    }
+
+    // The file is only decoded when it's first sampled, so report missing files now
+    if (!std::filesystem::exists(path)) {
+        throw std::runtime_error(fmt::format("Texture '{}' doesn't exist", path));
+    }
+
+    texture_ids.emplace(key, textures.size());
+    textures.push_back(std::make_unique<CachedTexture>(this, path, is_rgb, coeff_type));
+    return textures.back().get();
+}
+
+void
+TextureCache::preload(TaskPool &pool) {
+    // Each texture has its own lock, so the textures are decoded concurrently
+    pool.parallel_for(textures.size(), 1, [this](u64 i) {
+        if (!textures[i]->layout_ready.load(std::memory_order_acquire)) {
+            textures[i]->load_layout();
+        }
+    });
+}
+
+void
+TextureCache::set_coeff_cache_dir(const std::string &dir) {
+    if (!dir.empty()) {
+        std::filesystem::create_directories(dir);
+    }
+
+    coeff_cache_dir = dir;
+}
+
+i32
+TextureCache::add_source(i32 fd) {
+    source_fds.push_back(fd);
+    return fd;
+}
+
+void
+TextureCache::set_num_threads(u32 a_num_threads) {
+    num_threads = a_num_threads;
+    threads = std::make_unique<ThreadState[]>(num_threads);
+}
+
+void
+TextureCache::quiescent(u32 thread_id) {
+    auto &state = threads[thread_id];
+    state.lookups.store(texture_counters.lookups, std::memory_order_relaxed);
+    state.epoch.store(global_epoch.load());
+
+    if (retired_bytes.load(std::memory_order_relaxed) > 0) {
+        std::unique_lock lock(eviction_mutex, std::try_to_lock);
+        if (lock.owns_lock()) {
+            reclaim();
+        }
+    }
+}
+
+void
+TextureCache::offline(u32 thread_id) {
+    auto &state = threads[thread_id];
+    state.lookups.store(texture_counters.lookups, std::memory_order_relaxed);
+    state.epoch.store(OFFLINE);
+}
+
+void
+TextureCache::add_resident(u64 bytes) {
+    u64 resident = resident_bytes.fetch_add(bytes) + bytes;
+    u64 peak = peak_resident_bytes.load(std::memory_order_relaxed);
+    while (resident > peak &&
+           !peak_resident_bytes.compare_exchange_weak(peak, resident)) {
+    }
+}
+
+void
+TextureCache::evict(u64 bytes) {
+    if (memory_budget == 0 || resident_bytes.load() + bytes <= memory_budget) {
+        return;
+    }
+
+    // Loaders wait for each other, otherwise pages are added faster than they are
+    // evicted
+    std::lock_guard lock(eviction_mutex);
+    if (resident_bytes.load() + bytes <= memory_budget) {
+        return;
+    }
+
+    // Evict a bit more than needed, so that the next misses don't have to evict again
+    u64 target = memory_budget - std::min(memory_budget, memory_budget / 16 + bytes);
+
+    // Two rounds of the hand clear all reference bits and evict every page
+    u64 max_steps = textures.size();
+    for (const auto &texture : textures) {
+        if (texture->layout_ready.load(std::memory_order_acquire)) {
+            max_steps += 2 * texture->num_pages;
+        }
+    }
+
+    u64 first_retired = retired.size();
+    for (u64 step = 0; step < max_steps && resident_bytes.load() > target; step++) {
+        if (hand_texture >= textures.size()) {
+            hand_texture = 0;
+            hand_page = 0;
+        }
+
+        auto &texture = *textures[hand_texture];
+        if (!texture.layout_ready.load(std::memory_order_acquire) ||
+            texture.layout.get_pixels() != nullptr || hand_page >= texture.num_pages) {
+            hand_texture++;
+            hand_page = 0;
+            continue;
+        }
+
+        u64 page = hand_page++;
+        if (texture.pages[page].load(std::memory_order_relaxed) == nullptr ||
+            texture.referenced[page].exchange(0, std::memory_order_relaxed) != 0) {
+            continue;
+        }
+
+        // Pages are only published by loaders that saw nullptr, so this can't race
+        // with a load of the same page
+        const u8 *data = texture.pages[page].exchange(nullptr);
+        u64 page_bytes = texture.page_bytes();
+        retired.push_back(RetiredPage{.data = data, .bytes = page_bytes, .epoch = 0});
+        resident_bytes.fetch_sub(page_bytes);
+        retired_bytes.fetch_add(page_bytes);
+        num_evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (retired.size() > first_retired) {
+        // Threads that pass a quiescent point after this can't see the evicted pages
+        u64 epoch = global_epoch.fetch_add(1) + 1;
+        for (u64 i = first_retired; i < retired.size(); i++) {
+            retired[i].epoch = epoch;
+        }
+    }
+
+    reclaim();
+}
+
+void
+TextureCache::reclaim() {
+    if (retired.empty()) {
+        return;
+    }
+
+    // Without registered threads only the caller fetches textures
+    u64 min_epoch = OFFLINE;
+    for (u32 t = 0; t < num_threads; t++) {
+        min_epoch = std::min(min_epoch, threads[t].epoch.load());
+    }
+
+    std::erase_if(retired, [&](const RetiredPage &page) {
+        if (page.epoch > min_epoch) {
+            return false;
+        }
+
+        std::free(const_cast<u8 *>(page.data));
+        retired_bytes.fetch_sub(page.bytes);
+        return true;
+    });
+}
+
+void
+TextureCache::log_stats() const {
+    if (textures.empty()) {
+        return;
+    }
+
+    u64 lookups = texture_counters.lookups;
+    if (num_threads > 0) {
+        lookups = 0;
+        for (u32 t = 0; t < num_threads; t++) {
+            lookups += threads[t].lookups.load(std::memory_order_relaxed);
+        }
+    }
+
+    u64 loads = num_decodes.load() + num_coeff_cache_reads.load() + num_page_loads.load();
+    u64 misses = std::min(loads, lookups);
+    f64 hit_rate = 100.;
+    if (lookups > 0) {
+        hit_rate = 100. * static_cast<f64>(lookups - misses) / static_cast<f64>(lookups);
+    }
+
+    auto mib = [](u64 bytes) { return static_cast<f64>(bytes) / (1024. * 1024.); };
+    auto budget = memory_budget > 0 ? fmt::format("{:.1f} MiB", mib(memory_budget))
+                                    : std::string("unlimited");
+
+    spdlog::info("Texture cache: {:.2f}% hits ({} lookups, {} of {} textures decoded, {} "
+                 "from the coefficient cache, {} page loads, {} evictions)",
+                 hit_rate, lookups, num_decodes.load(), textures.size(),
+                 num_coeff_cache_reads.load(), num_page_loads.load(),
+                 num_evictions.load());
+    spdlog::info("Texture cache: {:.1f} MiB resident, {:.1f} MiB peak, budget {}",
+                 mib(resident_bytes.load()), mib(peak_resident_bytes.load()), budget);
+}
@@ -0,0 +1,302 @@
+#ifndef PT_TEXTURE_CACHE_H
+#define PT_TEXTURE_CACHE_H
+
+#include "../utils/basic_types.h"
+#include "../utils/mapped_file.h"
+#include "image_texture.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Per-thread texture statistics, copied into the cache at quiescent points
+struct TextureCounters {
+    u64 lookups = 0;
+};
+
+inline thread_local TextureCounters texture_counters{};
+
+class TaskPool;
+class TextureCache;
+
+/// Image texture whose mip pyramid is loaded in pages of PAGE_TEXELS texels on first
+/// access. Pages are read from a backing file: the scene cache, the coefficient cache or
+/// a spill file written when the image is first decoded. Without a memory budget the
+/// decoded pyramid stays resident instead, or the coefficient cache file is mapped.
+class CachedTexture {
+public:
+    /// 256 tiles of 4x4 texels, 64 KiB of float texels
+    static constexpr u64 PAGE_TEXELS = 4096;
+
+    CachedTexture(TextureCache *cache, std::string path, bool is_rgb,
+                  TextureDataType coeff_type)
+        : cache{cache}, path{std::move(path)}, is_rgb{is_rgb},
+          data_type{ImageTexture::data_type_for(this->path, is_rgb, coeff_type)} {}
+
+    ~CachedTexture();
+
+    CachedTexture(const CachedTexture &) = delete;
+    CachedTexture &
+    operator=(const CachedTexture &) = delete;
+
+    template <TextureDataType DT>
+    tuple3
+    fetch(const TexCoords &tex_coords) {
+        texture_counters.lookups++;
+        if (!layout_ready.load(std::memory_order_acquire)) {
+            load_layout();
+        }
+
+        return layout.fetch<DT>(tex_coords,
+                                [this](u64 index) { return texel_data<DT>(index); });
+    }
+
+    template <TextureDataType DT>
+    spectral
+    fetch_spectrum(const TexCoords &tex_coords, const SampledLambdas &lambdas) {
+        texture_counters.lookups++;
+        if (!layout_ready.load(std::memory_order_acquire)) {
+            load_layout();
+        }
+
+        return layout.fetch_spectrum<DT>(
+            tex_coords, lambdas, [this](u64 index) { return texel_data<DT>(index); });
+    }
+
+    /// Decodes the image file, the pixels are owned by the caller
+    ImageTexture
+    decode() const {
+        return ImageTexture::make(path, is_rgb, data_type);
+    }
+
+    /// Pages are read from fd at offset from now on, the pyramid there has to have the
+    /// layout (and the quantization range) of source_layout
+    void
+    set_source(i32 fd, u64 offset, const ImageTexture &source_layout);
+
+    const std::string &
+    get_path() const {
+        return path;
+    }
+
+    bool
+    get_is_rgb() const {
+        return is_rgb;
+    }
+
+    TextureDataType
+    get_data_type() const {
+        return data_type;
+    }
+
+private:
+    friend class TextureCache;
+
+    template <TextureDataType DT>
+    const void *
+    texel_data(u64 index) {
+        u64 page = index / PAGE_TEXELS;
+        const u8 *data = pages[page].load(std::memory_order_acquire);
+        if (data == nullptr) {
+            data = load_page(page);
+        } else if (referenced[page].load(std::memory_order_relaxed) == 0) {
+            // Only written when it changes, so that hits don't share cache lines
+            referenced[page].store(1, std::memory_order_relaxed);
+        }
+
+        return data + (index % PAGE_TEXELS) * ImageTexture::texel_size(DT);
+    }
+
+    /// Decodes the image on first access, or reads it from the coefficient cache
+    void
+    load_layout();
+
+    /// Uses the coefficient cache file as the source of the pages, returns false if
+    /// it's missing or was written for a different image
+    bool
+    open_coeff_cache(const std::string &cache_path, u64 source_hash);
+
+    const u8 *
+    load_page(u64 page);
+
+    /// Allocates the page table for the layout and publishes it
+    void
+    init_pages();
+
+    u64
+    page_bytes() const {
+        return PAGE_TEXELS * ImageTexture::texel_size(data_type);
+    }
+
+    TextureCache *cache;
+    std::string path;
+    bool is_rgb;
+    TextureDataType data_type;
+
+    /// Guards loading the layout and the pages
+    std::mutex mutex;
+    std::atomic<bool> layout_ready{false};
+    /// Sizes of the levels, pixels point to the whole pyramid if it's resident
+    ImageTexture layout{};
+    u64 num_pages = 0;
+    std::unique_ptr<std::atomic<const u8 *>[]> pages{};
+    /// Set on access, cleared by the CLOCK sweep of the eviction
+    std::unique_ptr<std::atomic<u8>[]> referenced{};
+
+    i32 source_fd = -1;
+    u64 source_offset = 0;
+    /// Spill files belong to the texture, the scene cache file to the TextureCache
+    bool owns_source_fd = false;
+    /// Coefficient cache file that the resident layout points into
+    MappedFile mapping{};
+};
+
+/// Owns the image textures of a scene. Textures are deduplicated by path and loaded on
+/// demand or by preload. With a memory budget, pages are evicted with the CLOCK
+/// algorithm once the resident pages exceed it.
+///
+/// Lookups of resident pages don't take any locks. Evicted pages may still be read by
+/// other threads, so they are only freed once every registered thread has passed a
+/// quiescent point (between render jobs) or gone offline. Threads that fetch textures
+/// while pages may be evicted have to be registered with set_num_threads.
+class TextureCache {
+public:
+    TextureCache() = default;
+
+    ~TextureCache();
+
+    TextureCache(const TextureCache &) = delete;
+    TextureCache &
+    operator=(const TextureCache &) = delete;
+
+    /// Budget for the resident pages in bytes, 0 means unlimited
+    void
+    set_memory_budget(u64 bytes) {
+        memory_budget = bytes;
+    }
+
+    u64
+    get_memory_budget() const {
+        return memory_budget;
+    }
+
+    /// Directory where the pyramids of RGB textures are stored after they are first
+    /// decoded, keyed by the contents of the image and by the rgb2spec table. Later runs
+    /// read them from there instead of decoding the image. Empty disables it.
+    void
+    set_coeff_cache_dir(const std::string &dir);
+
+    /// Data type of the sigmoid coefficients of RGB textures added from now on
+    void
+    set_coeff_type(TextureDataType type) {
+        coeff_type = type;
+    }
+
+    /// Returns the texture of the file, the first call for a path adds it. Doesn't read
+    /// the file.
+    CachedTexture *
+    add(const std::string &path, bool is_rgb);
+
+    /// Decodes the textures that aren't loaded yet on the pool, instead of on the render
+    /// thread that first samples them
+    void
+    preload(TaskPool &pool);
+
+    const std::vector<std::unique_ptr<CachedTexture>> &
+    get_textures() const {
+        return textures;
+    }
+
+    /// Adds the descriptor of a file that pages are read from, the cache closes it
+    i32
+    add_source(i32 fd);
+
+    /// All threads start offline
+    void
+    set_num_threads(u32 num_threads);
+
+    /// The thread doesn't hold any pointers to pages from before this point
+    void
+    quiescent(u32 thread_id);
+
+    /// The thread won't fetch textures until the next quiescent point
+    void
+    offline(u32 thread_id);
+
+    u64
+    get_resident_bytes() const {
+        return resident_bytes.load();
+    }
+
+    u64
+    get_num_evictions() const {
+        return num_evictions.load();
+    }
+
+    u64
+    get_num_decodes() const {
+        return num_decodes.load();
+    }
+
+    void
+    log_stats() const;
+
+private:
+    friend class CachedTexture;
+
+    struct RetiredPage {
+        const u8 *data;
+        u64 bytes;
+        u64 epoch;
+    };
+
+    struct alignas(64) ThreadState {
+        std::atomic<u64> epoch{OFFLINE};
+        std::atomic<u64> lookups{0};
+    };
+
+    static constexpr u64 OFFLINE = ~0ULL;
+
+    void
+    add_resident(u64 bytes);
+
+    /// Evicts pages until another bytes fit into the budget
+    void
+    evict(u64 bytes);
+
+    /// Frees the retired pages that no thread can read anymore, eviction_mutex has to
+    /// be held
+    void
+    reclaim();
+
+    u64 memory_budget = 0;
+    std::string coeff_cache_dir{};
+    TextureDataType coeff_type = TextureDataType::F32;
+    std::vector<std::unique_ptr<CachedTexture>> textures{};
+    std::unordered_map<std::string, u32> texture_ids{};
+    std::vector<i32> source_fds{};
+
+    /// Pages in the page tables, without the retired ones
+    std::atomic<u64> resident_bytes{0};
+    std::atomic<u64> peak_resident_bytes{0};
+    std::atomic<u64> retired_bytes{0};
+    std::atomic<u64> num_decodes{0};
+    std::atomic<u64> num_coeff_cache_reads{0};
+    std::atomic<u64> num_page_loads{0};
+    std::atomic<u64> num_evictions{0};
+
+    std::mutex eviction_mutex;
+    /// Position of the CLOCK hand
+    u32 hand_texture = 0;
+    u64 hand_page = 0;
+    std::vector<RetiredPage> retired{};
+
+    std::atomic<u64> global_epoch{1};
+    u32 num_threads = 0;
+    std::unique_ptr<ThreadState[]> threads{};
+};
+
+#endif // PT_TEXTURE_CACHE_H
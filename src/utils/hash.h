@@ -0,0 +1,47 @@
+#ifndef PT_HASH_H
+#define PT_HASH_H
+
+#include "basic_types.h"
+
+#include <cstring>
+
+/// Finalizer of MurmurHash3
+inline u64
+mix_u64(u64 x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/// Fast non-cryptographic 64-bit hash for detecting changed files. Four independent
+/// lanes, so that hashing isn't limited by the latency of the multiplications.
+inline u64
+hash_bytes(Span<const u8> bytes, u64 seed = 0) {
+    constexpr u64 PRIME = 0x9e3779b97f4a7c15ULL;
+
+    Array<u64, 4> lanes = {seed, seed + PRIME, seed - PRIME, ~seed};
+    u64 offset = 0;
+    for (; offset + 32 <= bytes.size(); offset += 32) {
+        for (u32 lane = 0; lane < 4; lane++) {
+            u64 word = 0;
+            std::memcpy(&word, bytes.data() + offset + lane * 8, 8);
+            lanes[lane] = (lanes[lane] ^ mix_u64(word)) * PRIME;
+        }
+    }
+
+    u64 hash = bytes.size();
+    for (u64 lane : lanes) {
+        hash = mix_u64(hash ^ lane) * PRIME;
+    }
+
+    for (; offset < bytes.size(); offset++) {
+        hash = (hash ^ bytes[offset]) * PRIME;
+    }
+
+    return mix_u64(hash);
+}
+
+#endif // PT_HASH_H
@@ -0,0 +1,119 @@
+#ifndef PT_MAPPED_FILE_H
+#define PT_MAPPED_FILE_H
+
+#include "basic_types.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Read-only memory mapping of a whole file. Processes mapping the same file share its
+/// pages in the page cache.
+class MappedFile {
+public:
+    MappedFile() = default;
+
+    /// With keep_open, the descriptor stays open as long as the mapping, so that the
+    /// mapped file can be read through get_fd() even if the path is replaced
+    explicit MappedFile(const std::string &path, bool keep_open = false) {
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error(
+                fmt::format("Couldn't open '{}': {}", path, std::strerror(errno)));
+        }
+
+        struct stat file_stat {};
+        if (::fstat(fd, &file_stat) != 0) {
+            close_fd();
+            throw std::runtime_error(
+                fmt::format("Couldn't stat '{}': {}", path, std::strerror(errno)));
+        }
+
+        length = file_stat.st_size;
+        if (length > 0) {
+            mapping = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+
+        if (mapping == MAP_FAILED) {
+            mapping = nullptr;
+            close_fd();
+            throw std::runtime_error(
+                fmt::format("Couldn't map '{}': {}", path, std::strerror(errno)));
+        }
+
+        if (!keep_open) {
+            close_fd();
+        }
+    }
+
+    ~MappedFile() {
+        if (mapping != nullptr) {
+            ::munmap(mapping, length);
+        }
+        close_fd();
+    }
+
+    MappedFile(MappedFile &&other) noexcept
+        : mapping{std::exchange(other.mapping, nullptr)},
+          length{std::exchange(other.length, 0)}, fd{std::exchange(other.fd, -1)} {}
+
+    MappedFile &
+    operator=(MappedFile &&other) noexcept {
+        std::swap(mapping, other.mapping);
+        std::swap(length, other.length);
+        std::swap(fd, other.fd);
+        return *this;
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &
+    operator=(const MappedFile &) = delete;
+
+    /// Tells the kernel that the file will be read front to back
+    void
+    advise_sequential() const {
+        if (mapping != nullptr) {
+            ::madvise(mapping, length, MADV_SEQUENTIAL);
+            ::madvise(mapping, length, MADV_WILLNEED);
+        }
+    }
+
+    Span<const u8>
+    bytes() const {
+        return Span<const u8>(static_cast<const u8 *>(mapping), length);
+    }
+
+    size_t
+    size() const {
+        return length;
+    }
+
+    /// -1 unless the file was opened with keep_open
+    i32
+    get_fd() const {
+        return fd;
+    }
+
+private:
+    void
+    close_fd() {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    void *mapping = nullptr;
+    size_t length = 0;
+    i32 fd = -1;
+};
+
+#endif // PT_MAPPED_FILE_H
@@ -1,20 +1,10 @@
 #include "render_threads.h"
 
-static constexpr u32 TILE_SIZE = 8;
-
-struct Tile {
-    static Tile
-    make_from_tile_index(u32 tile_index, uvec2 dimensions);
-
-    u32 start_x;
-    u32 end_x;
-    u32 start_y;
-    u32 end_y;
-};
+#include <algorithm>
 
 Tile
 Tile::make_from_tile_index(u32 tile_index, uvec2 dimensions) {
-    u32 tiles_per_row = dimensions.x / TILE_SIZE;
+    u32 tiles_per_row = (dimensions.x + TILE_SIZE - 1) / TILE_SIZE;
     u32 tile_on_column = tile_index % tiles_per_row;
     u32 tile_on_row = tile_index / tiles_per_row;
 
@@ -40,74 +30,539 @@ Tile::make_from_tile_index(u32 tile_index, uvec2 dimensions) {
     };
 }
 
-u32
-get_num_threads() {
-    u32 num_threads = std::thread::hardware_concurrency();
-    if (num_threads == 0) {
-        spdlog::warn("Could not get the number of CPU cores, defaulting to 1 thread");
-        num_threads = 1;
+void
+JobQueue::push(const RenderJob &job) {
+    std::lock_guard lock(mutex);
+    jobs.push_back(job);
+}
+
+Option<RenderJob>
+JobQueue::pop() {
+    std::lock_guard lock(mutex);
+    if (jobs.empty()) {
+        return {};
     }
 
-    return num_threads;
+    RenderJob job = jobs.front();
+    jobs.pop_front();
+    return job;
+}
+
+Option<RenderJob>
+JobQueue::steal() {
+    std::lock_guard lock(mutex);
+    if (jobs.empty()) {
+        return {};
+    }
+
+    RenderJob job = jobs.back();
+    jobs.pop_back();
+    return job;
+}
+
+u32
+JobQueue::clear() {
+    std::lock_guard lock(mutex);
+    u32 count = jobs.size();
+    jobs.clear();
+    return count;
 }
 
-RenderThreads::RenderThreads(const SceneAttribs &scene_attribs, Integrator *integrator)
-    : integrator{integrator}, num_threads(get_num_threads()), start_work{num_threads + 1},
-      end_work{num_threads + 1},
+RenderThreads::RenderThreads(const SceneAttribs &scene_attribs,
+                             std::vector<ThreadPlacement> thread_placements, bool numa,
+                             const AdaptiveSampling &adaptive, Integrator *integrator,
+                             Framebuffer *fb, TextureCache *texture_cache)
+    : integrator{integrator}, fb{fb}, texture_cache{texture_cache},
+      num_threads(thread_placements.size()),
+      placements(std::move(thread_placements)), threads_ready(num_threads),
+      adaptive{adaptive}, budget_left{static_cast<i64>(adaptive.sample_budget)},
       dimensions(uvec2(scene_attribs.resx, scene_attribs.resy)) {
+    tiles_x = (dimensions.x + TILE_SIZE - 1) / TILE_SIZE;
+    tiles_y = (dimensions.y + TILE_SIZE - 1) / TILE_SIZE;
+
+    assign_tiles(numa);
+    tile_converged.resize(tiles_x * tiles_y, 0);
+
+    queues = std::make_unique<JobQueue[]>(num_threads);
+    busy_ns = std::make_unique<std::atomic<u64>[]>(num_threads);
+    jobs_done = std::make_unique<std::atomic<u64>[]>(num_threads);
+    steals = std::make_unique<std::atomic<u64>[]>(num_threads);
+    samples = std::make_unique<std::atomic<u64>[]>(num_threads);
+    rays = std::make_unique<std::atomic<u64>[]>(num_threads);
+    packet_rays = std::make_unique<std::atomic<u64>[]>(num_threads);
+    packet_lanes = std::make_unique<std::atomic<u64>[]>(num_threads);
+
+    texture_cache->set_num_threads(num_threads);
+
     threads.reserve(num_threads);
 
-    for (int i = 0; i < num_threads; ++i) {
+    for (u32 i = 0; i < num_threads; ++i) {
         auto t = std::jthread([=, this] { render(i); });
         threads.push_back(std::move(t));
     }
 
-    u64 frame_area = scene_attribs.resx * scene_attribs.resy;
-    u64 tile_area = TILE_SIZE * TILE_SIZE;
+    // Wait until the threads are pinned and have cleared their part of the framebuffer
+    threads_ready.wait();
+}
+
+void
+RenderThreads::assign_tiles(bool numa) {
+    // Without NUMA, all threads are treated as if they were on a single node
+    std::vector<u32> thread_nodes(num_threads, 0);
+    if (numa) {
+        for (u32 t = 0; t < num_threads; t++) {
+            thread_nodes[t] = placements[t].numa_node;
+        }
+    }
+
+    std::vector<u32> nodes = thread_nodes;
+    std::sort(nodes.begin(), nodes.end());
+    nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+
+    thread_tiles.resize(num_threads);
+    thread_fb_rows.resize(num_threads, {0, 0});
+    steal_order.resize(num_threads);
+
+    // Each node gets a band of tile rows proportional to its number of threads
+    u32 threads_before = 0;
+    for (u32 node : nodes) {
+        std::vector<u32> node_threads{};
+        for (u32 t = 0; t < num_threads; t++) {
+            if (thread_nodes[t] == node) {
+                node_threads.push_back(t);
+            }
+        }
+
+        u32 row_start = static_cast<u64>(tiles_y) * threads_before / num_threads;
+        threads_before += node_threads.size();
+        u32 row_end = static_cast<u64>(tiles_y) * threads_before / num_threads;
+
+        // Spread the band's tiles over the node's threads in contiguous ranges, so that
+        // stealing from the back of a queue takes tiles far away from the owner's.
+        u32 first_band_tile = row_start * tiles_x;
+        u32 num_band_tiles = (row_end - row_start) * tiles_x;
+        for (u32 i = 0; i < node_threads.size(); i++) {
+            u32 first_tile = static_cast<u64>(num_band_tiles) * i / node_threads.size();
+            u32 last_tile =
+                static_cast<u64>(num_band_tiles) * (i + 1) / node_threads.size();
+
+            for (u32 tile = first_tile; tile < last_tile; tile++) {
+                thread_tiles[node_threads[i]].push_back(first_band_tile + tile);
+            }
+        }
+
+        // Framebuffer rows go top-down while tiles go bottom-up.
+        // The band's first thread clears it.
+        u32 y_start = std::min(row_start * TILE_SIZE, dimensions.y);
+        u32 y_end = std::min(row_end * TILE_SIZE, dimensions.y);
+        thread_fb_rows[node_threads[0]] = {dimensions.y - y_end, dimensions.y - y_start};
 
-    tiles_per_frame = (frame_area + tile_area - 1) / tile_area;
-    tile_counter = tiles_per_frame;
+        // Steal from the threads on the same node first
+        for (u32 t : node_threads) {
+            for (u32 i = 1; i < num_threads; i++) {
+                u32 victim = (t + i) % num_threads;
+                if (thread_nodes[victim] == node) {
+                    steal_order[t].push_back(victim);
+                }
+            }
+
+            for (u32 i = 1; i < num_threads; i++) {
+                u32 victim = (t + i) % num_threads;
+                if (thread_nodes[victim] != node) {
+                    steal_order[t].push_back(victim);
+                }
+            }
+        }
+    }
+
+    spdlog::info("Using {} render threads on {} NUMA node(s)", num_threads, nodes.size());
 }
 
 void
 RenderThreads::schedule_stop() {
-    should_stop = true;
-    start_work.arrive_and_wait();
+    {
+        std::lock_guard lock(batch_mutex);
+        should_stop = true;
+    }
+
+    batch_start.notify_all();
 }
 
 void
-RenderThreads::start_new_frame() {
-    tile_counter = 0;
+RenderThreads::start_samples(u32 sample_target) {
+    u32 num_jobs = 0;
+    for (u32 t = 0; t < num_threads; t++) {
+        for (u32 tile_index : thread_tiles[t]) {
+            if (!tile_converged[tile_index]) {
+                num_jobs++;
+            }
+        }
+    }
+
+    // Has to be set before the jobs can be taken
+    jobs_remaining = num_jobs;
+
+    for (u32 t = 0; t < num_threads; t++) {
+        for (u32 tile_index : thread_tiles[t]) {
+            if (tile_converged[tile_index]) {
+                continue;
+            }
+
+            queues[t].push(RenderJob{
+                .tile = Tile::make_from_tile_index(tile_index, dimensions),
+                .tile_index = tile_index,
+                .sample_target = sample_target,
+            });
+        }
+    }
+
+    render_start = std::chrono::steady_clock::now();
+
+    {
+        std::lock_guard lock(batch_mutex);
+        batch_id++;
+    }
 
-    start_work.arrive_and_wait();
-    end_work.arrive_and_wait();
+    batch_start.notify_all();
+}
+
+bool
+RenderThreads::wait_samples(std::chrono::milliseconds timeout) {
+    std::unique_lock lock(batch_mutex);
+    bool done =
+        batch_end.wait_for(lock, timeout, [this] { return jobs_remaining.load() == 0; });
+
+    if (done) {
+        wall_time += std::chrono::steady_clock::now() - render_start;
+    }
+
+    return done;
+}
+
+void
+RenderThreads::cancel_batch() {
+    u32 cancelled = 0;
+    for (u32 t = 0; t < num_threads; t++) {
+        cancelled += queues[t].clear();
+    }
+
+    if (cancelled > 0 && jobs_remaining.fetch_sub(cancelled) == cancelled) {
+        std::lock_guard lock(batch_mutex);
+        batch_end.notify_all();
+    }
+}
+
+u64
+RenderThreads::samples_done() const {
+    u64 count = 0;
+    for (u32 t = 0; t < num_threads; t++) {
+        count += samples[t].load(std::memory_order_relaxed);
+    }
+
+    return count;
+}
+
+bool
+RenderThreads::adaptive_done() const {
+    if (!adaptive.enabled()) {
+        return false;
+    }
+
+    return budget_left.load() <= 0 || num_converged_tiles() == tile_converged.size();
+}
+
+u32
+RenderThreads::num_converged_tiles() const {
+    return std::count(tile_converged.begin(), tile_converged.end(), 1);
+}
+
+RenderStats
+RenderThreads::stats() const {
+    RenderStats stats{
+        .wall_time = wall_time,
+        .num_threads = num_threads,
+    };
+
+    for (u32 t = 0; t < num_threads; t++) {
+        stats.busy_time += std::chrono::nanoseconds(busy_ns[t].load());
+        stats.num_jobs += jobs_done[t].load();
+        stats.num_steals += steals[t].load();
+        stats.num_samples += samples[t].load();
+        stats.num_rays += rays[t].load();
+        stats.num_packet_rays += packet_rays[t].load();
+        stats.num_packet_lanes += packet_lanes[t].load();
+    }
+
+    return stats;
+}
+
+Option<RenderJob>
+RenderThreads::find_job(u32 thread_id) {
+    auto job = queues[thread_id].pop();
+    if (job.has_value()) {
+        return job;
+    }
+
+    for (u32 victim : steal_order[thread_id]) {
+        job = queues[victim].steal();
+        if (job.has_value()) {
+            steals[thread_id].fetch_add(1, std::memory_order_relaxed);
+            return job;
+        }
+    }
+
+    return {};
+}
+
+void
+RenderThreads::gen_job_samples(const RenderJob &job,
+                               std::vector<PixelSample> &job_samples) {
+    auto &tile = job.tile;
+
+    // Pixels can have different sample counts with adaptive sampling, sample indices
+    // continue from the pixel's current count
+    u32 pixel_samples[TILE_SIZE * TILE_SIZE]{};
+    u32 max_passes = 0;
+    u64 samples_needed = 0;
+
+    for (u32 y = tile.start_y; y <= tile.end_y; ++y) {
+        const FramebufferPixel *row = fb->get_row(dimensions.y - 1U - y);
+        const f64 *lum_sq_row = fb->get_lum_sq_row(dimensions.y - 1U - y);
+
+        for (u32 x = tile.start_x; x <= tile.end_x; ++x) {
+            u32 i = (y - tile.start_y) * TILE_SIZE + (x - tile.start_x);
+            const FramebufferPixel &pixel = row[x];
+
+            pixel_samples[i] = pixel.num_samples;
+            if (adaptive.enabled() && pixel.num_samples >= adaptive.min_samples &&
+                Framebuffer::relative_error(pixel, lum_sq_row[x]) < adaptive.threshold) {
+                // Converged, no more samples
+                pixel_samples[i] = job.sample_target;
+            }
+
+            if (pixel_samples[i] < job.sample_target) {
+                u32 passes = job.sample_target - pixel_samples[i];
+                max_passes = std::max(max_passes, passes);
+                samples_needed += passes;
+            }
+        }
+    }
+
+    // Take the samples out of the budget up front, so that the budget is only touched
+    // once per job
+    u64 samples_granted = samples_needed;
+    if (adaptive.enabled()) {
+        i64 left = budget_left.fetch_sub(static_cast<i64>(samples_needed));
+        samples_granted = std::clamp<i64>(left, 0, static_cast<i64>(samples_needed));
+    }
+
+    job_samples.clear();
+
+    for (u32 pass = 0; pass < max_passes && job_samples.size() < samples_granted;
+         pass++) {
+        for (u32 y = tile.start_y; y <= tile.end_y; ++y) {
+            for (u32 x = tile.start_x; x <= tile.end_x; ++x) {
+                u32 i = (y - tile.start_y) * TILE_SIZE + (x - tile.start_x);
+                u32 s = pixel_samples[i] + pass;
+                if (s >= job.sample_target || job_samples.size() >= samples_granted) {
+                    continue;
+                }
+
+                job_samples.push_back(
+                    PixelSample{.pixel = uvec2(x, y), .sample_index = s});
+            }
+        }
+    }
+}
+
+void
+RenderThreads::flush_job(const RenderJob &job, u32 thread_id,
+                         Span<const PixelSample> job_samples, Span<const vec3> results) {
+    auto &tile = job.tile;
+
+    TileAccumulator accum{};
+    for (u32 i = 0; i < job_samples.size(); i++) {
+        const uvec2 &pixel = job_samples[i].pixel;
+        accum.add(pixel.x - tile.start_x, pixel.y - tile.start_y, results[i]);
+    }
+
+    // Flush the tile, the framebuffer rows go top-down
+    for (u32 y = tile.start_y; y <= tile.end_y; ++y) {
+        FramebufferPixel *row = fb->get_row(dimensions.y - 1U - y);
+        f64 *lum_sq_row = fb->get_lum_sq_row(dimensions.y - 1U - y);
+
+        for (u32 x = tile.start_x; x <= tile.end_x; ++x) {
+            u32 i = (y - tile.start_y) * TILE_SIZE + (x - tile.start_x);
+            row[x].xyz += accum.get(x - tile.start_x, y - tile.start_y);
+            row[x].num_samples += accum.num_samples[i];
+            lum_sq_row[x] += accum.lum_sq[i];
+        }
+    }
+
+    if (adaptive.enabled() && is_tile_converged(tile)) {
+        tile_converged[job.tile_index] = 1;
+    }
+
+    samples[thread_id].fetch_add(job_samples.size(), std::memory_order_relaxed);
+    rays[thread_id].store(ray_counters.rays + ray_counters.shadow_rays,
+                          std::memory_order_relaxed);
+    packet_rays[thread_id].store(ray_counters.packet_rays, std::memory_order_relaxed);
+    packet_lanes[thread_id].store(ray_counters.packet_lanes, std::memory_order_relaxed);
+}
+
+void
+RenderThreads::run_job(const RenderJob &job, u32 thread_id, RenderScratch &scratch) {
+    auto &job_samples = scratch.samples;
+    gen_job_samples(job, job_samples);
+
+    auto &results = scratch.results;
+    results.resize(job_samples.size(), vec3(0.f));
+
+    integrator->integrate_pixels(job_samples,
+                                 Span<vec3>(results.data(), results.size()));
+
+    flush_job(job, thread_id, job_samples, results);
+}
+
+void
+RenderThreads::run_wavefront_jobs(u32 thread_id, RenderScratch &scratch) {
+    auto &free_jobs = scratch.free_jobs;
+    auto busy_start = std::chrono::steady_clock::now();
+
+    auto next_job = [&]() -> WavefrontJob * {
+        auto job = find_job(thread_id);
+        if (!job.has_value()) {
+            return nullptr;
+        }
+
+        if (free_jobs.empty()) {
+            free_jobs.push_back(std::make_unique<WavefrontTileJob>());
+        }
+
+        // Owned by the integrator until it's done
+        WavefrontTileJob *tile_job = free_jobs.back().release();
+        free_jobs.pop_back();
+
+        tile_job->job = job.value();
+        gen_job_samples(tile_job->job, tile_job->samples);
+        tile_job->results.resize(tile_job->samples.size(), vec3(0.f));
+        tile_job->next_sample = 0;
+        tile_job->samples_left = tile_job->samples.size();
+
+        return tile_job;
+    };
+
+    auto job_done = [&](WavefrontJob &job) {
+        auto *tile_job = static_cast<WavefrontTileJob *>(&job);
+        flush_job(tile_job->job, thread_id, tile_job->samples, tile_job->results);
+        free_jobs.emplace_back(tile_job);
+
+        // Jobs overlap, so the busy time is counted from one finished job to the next
+        const auto now = std::chrono::steady_clock::now();
+        busy_ns[thread_id].fetch_add(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(now - busy_start)
+                .count(),
+            std::memory_order_relaxed);
+        busy_start = now;
+
+        job_finished(thread_id);
+    };
+
+    scratch.wavefront->render(next_job, job_done);
+}
+
+void
+RenderThreads::job_finished(u32 thread_id) {
+    texture_cache->quiescent(thread_id);
+    jobs_done[thread_id].fetch_add(1, std::memory_order_relaxed);
+
+    if (jobs_remaining.fetch_sub(1) == 1) {
+        // Take the lock so the main thread can't miss the notification
+        std::lock_guard lock(batch_mutex);
+        batch_end.notify_all();
+    }
+}
+
+bool
+RenderThreads::is_tile_converged(const Tile &tile) const {
+    for (u32 y = tile.start_y; y <= tile.end_y; ++y) {
+        const FramebufferPixel *row = fb->get_row(dimensions.y - 1U - y);
+        const f64 *lum_sq_row = fb->get_lum_sq_row(dimensions.y - 1U - y);
+
+        for (u32 x = tile.start_x; x <= tile.end_x; ++x) {
+            if (row[x].num_samples < adaptive.min_samples ||
+                Framebuffer::relative_error(row[x], lum_sq_row[x]) >=
+                    adaptive.threshold) {
+                return false;
+            }
+        }
+    }
+
+    return true;
 }
 
 void
 RenderThreads::render(u32 thread_id) {
+    auto &placement = placements[thread_id];
+    if (placement.cpu.has_value() && !pin_current_thread(placement.cpu.value())) {
+        spdlog::warn("Could not pin render thread {} to CPU {}", thread_id,
+                     placement.cpu.value());
+    }
+
+    // First-touch places the pages of the band on this thread's NUMA node
+    auto [row_start, row_end] = thread_fb_rows[thread_id];
+    if (row_start < row_end) {
+        fb->clear_rows(row_start, row_end);
+    }
+
+    // Allocated by the thread itself, so that the memory is on its NUMA node
+    RenderScratch scratch{};
+    if (integrator->get_type() == IntegratorType::Wavefront) {
+        scratch.wavefront = std::make_unique<WavefrontIntegrator>(integrator);
+    }
+
+    threads_ready.count_down();
+
+    u64 seen_batch_id = 0;
+
     while (true) {
-        start_work.arrive_and_wait();
+        {
+            std::unique_lock lock(batch_mutex);
+            batch_start.wait(lock,
+                             [&] { return should_stop || batch_id != seen_batch_id; });
 
-        if (should_stop) {
-            return;
+            if (should_stop) {
+                return;
+            }
+
+            seen_batch_id = batch_id;
         }
 
-        while (true) {
-            const u32 tile_index = tile_counter.fetch_add(1);
+        texture_cache->quiescent(thread_id);
 
-            if (tile_index < tiles_per_frame) {
-                auto tile = Tile::make_from_tile_index(tile_index, dimensions);
+        if (scratch.wavefront != nullptr) {
+            run_wavefront_jobs(thread_id, scratch);
+            texture_cache->offline(thread_id);
+            continue;
+        }
 
-                for (int x = tile.start_x; x <= tile.end_x; ++x) {
-                    for (int y = tile.start_y; y <= tile.end_y; ++y) {
-                        integrator->integrate_pixel(uvec2(x, y));
-                    }
-                }
-            } else {
+        while (true) {
+            auto job = find_job(thread_id);
+            if (!job.has_value()) {
                 break;
             }
+
+            const auto job_start = std::chrono::steady_clock::now();
+            run_job(job.value(), thread_id, scratch);
+            const auto job_end = std::chrono::steady_clock::now();
+
+            busy_ns[thread_id].fetch_add(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(job_end - job_start)
+                    .count(),
+                std::memory_order_relaxed);
+            job_finished(thread_id);
         }
 
-        end_work.arrive_and_wait();
+        texture_cache->offline(thread_id);
     }
 }
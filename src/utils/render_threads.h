@@ -2,41 +2,296 @@
 #define PT_RENDER_THREADS_H
 
 #include "../integrator/integrator.h"
+#include "../integrator/wavefront_integrator.h"
 #include "../io/scene_loader.h"
 #include "basic_types.h"
+#include "thread_placement.h"
 
 #include <atomic>
-#include <barrier>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <latch>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 
+static constexpr u32 TILE_SIZE = 8;
+
+struct Tile {
+    static Tile
+    make_from_tile_index(u32 tile_index, uvec2 dimensions);
+
+    u32 start_x;
+    u32 end_x;
+    u32 start_y;
+    u32 end_y;
+};
+
+/// A unit of work: render every pixel of a tile until it has sample_target samples.
+/// There is only ever one job per tile in a batch, so jobs never write to the same
+/// pixels concurrently.
+struct RenderJob {
+    Tile tile;
+    u32 tile_index;
+    u32 sample_target;
+};
+
+/// Accumulates the samples of a job on the stack of the render thread, so that the
+/// framebuffer is only written to once per job.
+struct alignas(Framebuffer::CACHE_LINE_SIZE) TileAccumulator {
+    void
+    add(u32 local_x, u32 local_y, const vec3 &val) {
+        u32 i = local_y * TILE_SIZE + local_x;
+        xyz[i][0] += val.x;
+        xyz[i][1] += val.y;
+        xyz[i][2] += val.z;
+        lum_sq[i] += sqr(val.y);
+        num_samples[i]++;
+    }
+
+    vec3
+    get(u32 local_x, u32 local_y) const {
+        u32 i = local_y * TILE_SIZE + local_x;
+        return vec3(xyz[i][0], xyz[i][1], xyz[i][2]);
+    }
+
+    f32 xyz[TILE_SIZE * TILE_SIZE][3]{};
+    f32 lum_sq[TILE_SIZE * TILE_SIZE]{};
+    u32 num_samples[TILE_SIZE * TILE_SIZE]{};
+};
+
+/// A job whose samples are in flight in the wavefront integrator
+struct WavefrontTileJob : WavefrontJob {
+    RenderJob job;
+};
+
+/// Buffers a render thread reuses between jobs
+struct RenderScratch {
+    std::vector<PixelSample> samples{};
+    std::vector<vec3> results{};
+    /// Only used with the wavefront integrator
+    std::unique_ptr<WavefrontIntegrator> wavefront{};
+    /// Jobs the wavefront integrator is done with, reused for the next ones
+    std::vector<std::unique_ptr<WavefrontTileJob>> free_jobs{};
+};
+
+struct AdaptiveSampling {
+    bool
+    enabled() const {
+        return threshold > 0.f;
+    }
+
+    /// Pixels whose relative error drops below this stop getting samples, 0 disables
+    /// adaptive sampling.
+    f32 threshold = 0.f;
+    /// Pixels aren't tested for convergence before they have this many samples
+    u32 min_samples = 16;
+    /// Total number of samples that can be spent on the image
+    u64 sample_budget = 0;
+};
+
+/// Job deque of a single thread. The owner pops from the front and other threads steal
+/// from the back, so thieves take the tiles furthest away from the ones being rendered.
+class alignas(64) JobQueue {
+public:
+    void
+    push(const RenderJob &job);
+
+    Option<RenderJob>
+    pop();
+
+    Option<RenderJob>
+    steal();
+
+    /// Removes all jobs, returns how many were removed.
+    u32
+    clear();
+
+private:
+    std::mutex mutex;
+    std::deque<RenderJob> jobs{};
+};
+
+struct RenderStats {
+    std::chrono::duration<f64> wall_time{0.};
+    /// Sum of the time the threads spent rendering jobs
+    std::chrono::duration<f64> busy_time{0.};
+    u32 num_threads = 0;
+    u64 num_jobs = 0;
+    u64 num_steals = 0;
+    u64 num_samples = 0;
+    u64 num_rays = 0;
+    u64 num_packet_rays = 0;
+    u64 num_packet_lanes = 0;
+
+    f64
+    utilization() const {
+        if (wall_time.count() == 0. || num_threads == 0) {
+            return 0.;
+        }
+
+        return busy_time.count() / (wall_time.count() * static_cast<f64>(num_threads));
+    }
+
+    /// Fraction of the intersection packet lanes that carried a ray
+    f64
+    packet_occupancy() const {
+        if (num_packet_lanes == 0) {
+            return 0.;
+        }
+
+        return static_cast<f64>(num_packet_rays) / static_cast<f64>(num_packet_lanes);
+    }
+};
+
+/// Renders batches of samples with a pool of worker threads.
+/// Threads only synchronize with the main thread at the end of a batch, which is when an
+/// image snapshot is needed. Inside a batch, each thread works through its own job deque
+/// and steals from the other threads when it runs out.
+///
+/// In NUMA mode the image is split into horizontal bands, one per NUMA node. Threads of a
+/// node first-touch the framebuffer memory of their band, get the band's tiles and
+/// steal from threads on the same node before trying other nodes.
+///
+/// With adaptive sampling, pixels stop getting samples once their relative error is
+/// below the threshold and tiles with only converged pixels don't get jobs anymore.
+/// Batches may go past the nominal sample count, so the samples saved on converged
+/// pixels are spent on the noisy ones until the sample budget runs out.
+///
+/// The end of each job is a quiescent point of the texture cache and threads waiting
+/// for a batch are offline, so that evicted texture pages can be freed.
 class RenderThreads {
 public:
-    RenderThreads(const SceneAttribs &scene_attribs, Integrator *integrator);
+    RenderThreads(const SceneAttribs &scene_attribs,
+                  std::vector<ThreadPlacement> thread_placements, bool numa,
+                  const AdaptiveSampling &adaptive, Integrator *integrator,
+                  Framebuffer *fb, TextureCache *texture_cache);
+
+    /// Stops the threads if they haven't been stopped yet, they are joined afterwards
+    ~RenderThreads() {
+        schedule_stop();
+    }
+
+    RenderThreads(const RenderThreads &) = delete;
+    RenderThreads &
+    operator=(const RenderThreads &) = delete;
 
+    /// The threads exit once they are done with the current batch
     void
     schedule_stop();
 
+    /// Schedules rendering until all pixels have sample_target samples, doesn't block.
     void
-    start_new_frame();
+    start_samples(u32 sample_target);
+
+    /// Waits until the current batch is done or the timeout expires.
+    /// Returns true if the batch is done.
+    bool
+    wait_samples(std::chrono::milliseconds timeout);
+
+    /// Drops the jobs that haven't started yet, jobs that are in flight are finished.
+    /// The batch still has to be waited for with wait_samples().
+    void
+    cancel_batch();
+
+    /// Number of samples rendered so far, summed over all pixels
+    u64
+    samples_done() const;
+
+    /// True if all tiles converged or the sample budget was used up.
+    /// Only valid between batches.
+    bool
+    adaptive_done() const;
+
+    u32
+    num_converged_tiles() const;
+
+    RenderStats
+    stats() const;
 
     void
     render(u32 thread_id);
 
 private:
+    void
+    assign_tiles(bool numa);
+
+    Option<RenderJob>
+    find_job(u32 thread_id);
+
+    /// Lists the samples that the pixels of the job still need
+    void
+    gen_job_samples(const RenderJob &job, std::vector<PixelSample> &job_samples);
+
+    /// Adds the results of the job's samples to the framebuffer
+    void
+    flush_job(const RenderJob &job, u32 thread_id, Span<const PixelSample> job_samples,
+              Span<const vec3> results);
+
+    void
+    run_job(const RenderJob &job, u32 thread_id, RenderScratch &scratch);
+
+    /// Feeds all jobs the thread can find to the wavefront integrator at once, so that
+    /// its path pool doesn't drain at the end of every job
+    void
+    run_wavefront_jobs(u32 thread_id, RenderScratch &scratch);
+
+    /// Called once the job was flushed
+    void
+    job_finished(u32 thread_id);
+
+    bool
+    is_tile_converged(const Tile &tile) const;
+
     Integrator *integrator;
+    Framebuffer *fb;
+    TextureCache *texture_cache;
 
     u32 num_threads;
-    std::vector<std::jthread> threads{};
+    std::vector<ThreadPlacement> placements;
+    std::unique_ptr<JobQueue[]> queues;
+    /// Tiles that are initially pushed into each thread's queue
+    std::vector<std::vector<u32>> thread_tiles{};
+    /// Framebuffer rows each thread has to clear before rendering
+    std::vector<Tuple<u32, u32>> thread_fb_rows{};
+    /// Order in which a thread tries to steal from other threads
+    std::vector<std::vector<u32>> steal_order{};
+    std::latch threads_ready;
+
+    std::mutex batch_mutex;
+    std::condition_variable batch_start;
+    std::condition_variable batch_end;
+    u64 batch_id = 0;
     bool should_stop = false;
 
-    std::barrier<> start_work;
-    std::barrier<> end_work;
+    std::atomic<u32> jobs_remaining{0};
+
+    AdaptiveSampling adaptive;
+    /// Samples that can still be reserved by jobs, goes negative once used up
+    std::atomic<i64> budget_left{0};
+    /// Written by the thread that rendered the tile, read between batches
+    std::vector<u8> tile_converged{};
+
+    /// Per-thread statistics, only written by the owning thread
+    std::unique_ptr<std::atomic<u64>[]> busy_ns;
+    std::unique_ptr<std::atomic<u64>[]> jobs_done;
+    std::unique_ptr<std::atomic<u64>[]> steals;
+    std::unique_ptr<std::atomic<u64>[]> samples;
+    std::unique_ptr<std::atomic<u64>[]> rays;
+    std::unique_ptr<std::atomic<u64>[]> packet_rays;
+    std::unique_ptr<std::atomic<u64>[]> packet_lanes;
+    std::chrono::steady_clock::time_point render_start{};
+    std::chrono::steady_clock::duration wall_time{};
 
-    /// 4x4 tiles
     uvec2 dimensions;
-    u32 tiles_per_frame;
-    std::atomic<u32> tile_counter;
+    u32 tiles_x;
+    u32 tiles_y;
+
+    /// Declared last, so that the threads are joined before the state they use is
+    /// destroyed
+    std::vector<std::jthread> threads{};
 };
 
 #endif // PT_RENDER_THREADS_H
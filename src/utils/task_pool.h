@@ -0,0 +1,146 @@
+#ifndef PT_TASK_POOL_H
+#define PT_TASK_POOL_H
+
+#include "basic_types.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Simple pool of worker threads for the loading of the scene.
+///
+/// A thread waiting in parallel_for() runs queued tasks in the meantime, so
+/// parallel_for() can be nested (e.g. transforming vertices of a mesh that is loaded in
+/// a task) without deadlocking.
+class TaskPool {
+public:
+    /// The calling thread also runs tasks, so num_threads - 1 workers are started
+    explicit TaskPool(u32 num_threads) {
+        num_threads = std::max(num_threads, 1U);
+        for (u32 i = 1; i < num_threads; i++) {
+            workers.emplace_back(
+                [this](std::stop_token stop_token) { worker_loop(stop_token); });
+        }
+    }
+
+    ~TaskPool() {
+        for (auto &worker : workers) {
+            worker.request_stop();
+        }
+        tasks_changed.notify_all();
+    }
+
+    TaskPool(const TaskPool &) = delete;
+    TaskPool &
+    operator=(const TaskPool &) = delete;
+
+    /// Calls fn(i) for i in [0, count), in chunks of grain_size indices. The first
+    /// exception thrown by fn is rethrown here once all chunks are done.
+    template <typename F>
+    void
+    parallel_for(u64 count, u64 grain_size, F &&fn) {
+        if (count == 0) {
+            return;
+        }
+
+        grain_size = std::max<u64>(grain_size, 1);
+        u64 num_chunks = (count + grain_size - 1) / grain_size;
+        if (num_chunks == 1 || workers.empty()) {
+            for (u64 i = 0; i < count; i++) {
+                fn(i);
+            }
+            return;
+        }
+
+        std::atomic<u64> chunks_left{num_chunks};
+        std::mutex error_mutex;
+        std::exception_ptr error{};
+
+        {
+            std::lock_guard lock(mutex);
+            for (u64 chunk = 0; chunk < num_chunks; chunk++) {
+                tasks.emplace_back([&, chunk] {
+                    try {
+                        u64 end = std::min(count, (chunk + 1) * grain_size);
+                        for (u64 i = chunk * grain_size; i < end; i++) {
+                            fn(i);
+                        }
+                    } catch (...) {
+                        std::lock_guard error_lock(error_mutex);
+                        if (!error) {
+                            error = std::current_exception();
+                        }
+                    }
+
+                    chunks_left.fetch_sub(1, std::memory_order_release);
+                });
+            }
+        }
+        tasks_changed.notify_all();
+
+        while (chunks_left.load(std::memory_order_acquire) > 0) {
+            if (!try_run_task()) {
+                std::this_thread::yield();
+            }
+        }
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    u32
+    num_threads() const {
+        return workers.size() + 1;
+    }
+
+private:
+    bool
+    try_run_task() {
+        std::function<void()> task;
+        {
+            std::lock_guard lock(mutex);
+            if (tasks.empty()) {
+                return false;
+            }
+
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+
+        task();
+        return true;
+    }
+
+    void
+    worker_loop(std::stop_token stop_token) {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock lock(mutex);
+                tasks_changed.wait(lock, stop_token, [this] { return !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+
+            task();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable_any tasks_changed;
+    std::deque<std::function<void()>> tasks{};
+    std::vector<std::jthread> workers{};
+};
+
+#endif // PT_TASK_POOL_H
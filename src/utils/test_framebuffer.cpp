@@ -0,0 +1,127 @@
+#include "../framebuffer.h"
+#include "basic_types.h"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/*
+ * Compares writing every sample straight into an unpadded vec3 framebuffer (how the
+ * integrator used to do it) with accumulating a tile locally and flushing it into the
+ * padded Framebuffer once per tile. The difference mostly shows on many-core machines.
+ * Run with: tests "[!benchmark]"
+ * */
+
+static constexpr u32 BENCH_RES_X = 1920;
+static constexpr u32 BENCH_RES_Y = 1080;
+static constexpr u32 BENCH_TILE_SIZE = 8;
+static constexpr u32 BENCH_SAMPLES = 16;
+
+static vec3
+fake_sample(u32 x, u32 y, u32 s) {
+    u32 h = (x * 73856093U) ^ (y * 19349663U) ^ (s * 83492791U);
+    f32 v = static_cast<f32>(h & 0xffff) / 65535.f;
+    return vec3(v, v * 0.5f, v * 0.25f);
+}
+
+template <typename F>
+static void
+render_tiles_in_parallel(F &&render_tile) {
+    u32 tiles_x = (BENCH_RES_X + BENCH_TILE_SIZE - 1) / BENCH_TILE_SIZE;
+    u32 tiles_y = (BENCH_RES_Y + BENCH_TILE_SIZE - 1) / BENCH_TILE_SIZE;
+    u32 num_tiles = tiles_x * tiles_y;
+    u32 num_threads = std::max(std::thread::hardware_concurrency(), 1U);
+
+    std::atomic<u32> tile_counter{0};
+    std::vector<std::jthread> threads{};
+
+    for (u32 t = 0; t < num_threads; t++) {
+        threads.emplace_back([&] {
+            u32 tile;
+            while ((tile = tile_counter.fetch_add(1)) < num_tiles) {
+                u32 start_x = (tile % tiles_x) * BENCH_TILE_SIZE;
+                u32 start_y = (tile / tiles_x) * BENCH_TILE_SIZE;
+                u32 end_x = std::min(start_x + BENCH_TILE_SIZE, BENCH_RES_X);
+                u32 end_y = std::min(start_y + BENCH_TILE_SIZE, BENCH_RES_Y);
+                render_tile(start_x, end_x, start_y, end_y);
+            }
+        });
+    }
+}
+
+TEST_CASE("Framebuffer accumulation", "[!benchmark][framebuffer]") {
+    BENCHMARK("Direct writes into vec3 framebuffer") {
+        std::vector<vec3> pixels(BENCH_RES_X * BENCH_RES_Y, vec3(0.f));
+
+        render_tiles_in_parallel([&](u32 start_x, u32 end_x, u32 start_y, u32 end_y) {
+            for (u32 s = 0; s < BENCH_SAMPLES; s++) {
+                for (u32 y = start_y; y < end_y; y++) {
+                    for (u32 x = start_x; x < end_x; x++) {
+                        pixels[(BENCH_RES_Y - 1U - y) * BENCH_RES_X + x] +=
+                            fake_sample(x, y, s);
+                    }
+                }
+            }
+        });
+
+        return pixels[0].x;
+    };
+
+    BENCHMARK("Tile-local accumulation into padded framebuffer") {
+        Framebuffer fb(BENCH_RES_X, BENCH_RES_Y);
+        fb.clear_rows(0, BENCH_RES_Y);
+
+        render_tiles_in_parallel([&](u32 start_x, u32 end_x, u32 start_y, u32 end_y) {
+            alignas(Framebuffer::CACHE_LINE_SIZE)
+                f32 accum[BENCH_TILE_SIZE * BENCH_TILE_SIZE][3]{};
+
+            for (u32 s = 0; s < BENCH_SAMPLES; s++) {
+                for (u32 y = start_y; y < end_y; y++) {
+                    for (u32 x = start_x; x < end_x; x++) {
+                        vec3 xyz = fake_sample(x, y, s);
+                        u32 i = (y - start_y) * BENCH_TILE_SIZE + (x - start_x);
+                        accum[i][0] += xyz.x;
+                        accum[i][1] += xyz.y;
+                        accum[i][2] += xyz.z;
+                    }
+                }
+            }
+
+            for (u32 y = start_y; y < end_y; y++) {
+                FramebufferPixel *row = fb.get_row(BENCH_RES_Y - 1U - y);
+                for (u32 x = start_x; x < end_x; x++) {
+                    u32 i = (y - start_y) * BENCH_TILE_SIZE + (x - start_x);
+                    row[x].xyz += vec3(accum[i][0], accum[i][1], accum[i][2]);
+                }
+            }
+        });
+
+        return fb.get_row(0)[0].xyz.x;
+    };
+}
+
+TEST_CASE("Tile rows don't share cache lines", "[framebuffer]") {
+    constexpr u32 RES_X = 101;
+    constexpr u32 RES_Y = 13;
+    Framebuffer fb(RES_X, RES_Y);
+    fb.clear_rows(0, RES_Y);
+
+    auto line_offset = [](const void *ptr) {
+        return reinterpret_cast<uintptr_t>(ptr) % Framebuffer::CACHE_LINE_SIZE;
+    };
+
+    for (u32 y = 0; y < RES_Y; y++) {
+        for (u32 x = 0; x < RES_X; x += BENCH_TILE_SIZE) {
+            REQUIRE(line_offset(&fb.get_row(y)[x]) == 0);
+            REQUIRE(line_offset(&fb.get_lum_sq_row(y)[x]) == 0);
+        }
+    }
+
+    // A whole tile row of both buffers fits into whole cache lines
+    constexpr size_t line = Framebuffer::CACHE_LINE_SIZE;
+    REQUIRE(BENCH_TILE_SIZE * sizeof(FramebufferPixel) % line == 0);
+    REQUIRE(BENCH_TILE_SIZE * sizeof(*fb.get_lum_sq_row(0)) % line == 0);
+}
@@ -0,0 +1,246 @@
+#include "thread_placement.h"
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <fmt/core.h>
+#include <pthread.h>
+#include <sched.h>
+#include <spdlog/spdlog.h>
+
+std::vector<u32>
+parse_cpu_list(const std::string &list) {
+    std::vector<u32> cpus{};
+
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        range.erase(std::remove_if(range.begin(), range.end(),
+                                   [](char c) {
+                                       return std::isspace(static_cast<unsigned char>(c));
+                                   }),
+                    range.end());
+        if (range.empty()) {
+            continue;
+        }
+
+        try {
+            auto dash = range.find('-');
+            if (dash == std::string::npos) {
+                cpus.push_back(std::stoul(range));
+            } else {
+                u32 first = std::stoul(range.substr(0, dash));
+                u32 last = std::stoul(range.substr(dash + 1));
+                if (last < first) {
+                    throw std::runtime_error("");
+                }
+
+                for (u32 cpu = first; cpu <= last; cpu++) {
+                    cpus.push_back(cpu);
+                }
+            }
+        } catch (const std::exception &) {
+            throw std::runtime_error(fmt::format("Invalid CPU list: '{}'", list));
+        }
+    }
+
+    return cpus;
+}
+
+void
+ThreadConfig::set_affinity(const std::string &p_affinity) {
+    if (p_affinity == "none") {
+        affinity = AffinityMode::None;
+    } else if (p_affinity == "compact") {
+        affinity = AffinityMode::Compact;
+    } else if (p_affinity == "scatter") {
+        affinity = AffinityMode::Scatter;
+    } else {
+        affinity = AffinityMode::List;
+        cpu_list = parse_cpu_list(p_affinity);
+
+        if (cpu_list.empty()) {
+            throw std::runtime_error(fmt::format("Invalid CPU list: '{}'", p_affinity));
+        }
+    }
+}
+
+std::vector<u32>
+get_allowed_cpus() {
+    std::vector<u32> cpus{};
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (u32 cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+
+    if (cpus.empty()) {
+        u32 num_cpus = std::max(std::thread::hardware_concurrency(), 1U);
+        for (u32 cpu = 0; cpu < num_cpus; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+
+    return cpus;
+}
+
+CpuTopology
+CpuTopology::detect() {
+    CpuTopology topology{};
+    std::vector<u32> allowed_cpus = get_allowed_cpus();
+
+    const std::filesystem::path nodes_path = "/sys/devices/system/node";
+    std::vector<u32> node_ids{};
+
+    std::error_code ec;
+    for (const auto &entry : std::filesystem::directory_iterator(nodes_path, ec)) {
+        std::string name = entry.path().filename().string();
+        if (name.starts_with("node") && name.size() > 4 &&
+            std::all_of(name.begin() + 4, name.end(), [](char c) {
+                return std::isdigit(static_cast<unsigned char>(c));
+            })) {
+            node_ids.push_back(std::stoul(name.substr(4)));
+        }
+    }
+
+    std::sort(node_ids.begin(), node_ids.end());
+
+    for (u32 node_id : node_ids) {
+        std::ifstream cpulist_file(nodes_path / fmt::format("node{}", node_id) /
+                                   "cpulist");
+        std::string cpulist{};
+        std::getline(cpulist_file, cpulist);
+
+        std::vector<u32> node_cpus{};
+        try {
+            node_cpus = parse_cpu_list(cpulist);
+        } catch (const std::exception &) {
+            continue;
+        }
+
+        // Only keep CPUs that this process is allowed to run on
+        std::erase_if(node_cpus, [&](u32 cpu) {
+            return std::find(allowed_cpus.begin(), allowed_cpus.end(), cpu) ==
+                   allowed_cpus.end();
+        });
+
+        if (!node_cpus.empty()) {
+            topology.nodes.push_back(std::move(node_cpus));
+        }
+    }
+
+    if (topology.nodes.empty()) {
+        topology.nodes.push_back(std::move(allowed_cpus));
+    }
+
+    return topology;
+}
+
+u32
+CpuTopology::num_cpus() const {
+    u32 count = 0;
+    for (const auto &node : nodes) {
+        count += node.size();
+    }
+
+    return count;
+}
+
+u32
+CpuTopology::node_of_cpu(u32 cpu) const {
+    for (u32 n = 0; n < nodes.size(); n++) {
+        if (std::find(nodes[n].begin(), nodes[n].end(), cpu) != nodes[n].end()) {
+            return n;
+        }
+    }
+
+    return 0;
+}
+
+std::vector<ThreadPlacement>
+plan_thread_placement(const ThreadConfig &config, const CpuTopology &topology) {
+    AffinityMode affinity = config.affinity;
+    if (config.numa && affinity == AffinityMode::None) {
+        // Threads have to stay on their node in NUMA mode
+        affinity = AffinityMode::Scatter;
+    }
+
+    std::vector<u32> cpu_order{};
+    switch (affinity) {
+    case AffinityMode::None:
+    case AffinityMode::Compact:
+        for (const auto &node : topology.nodes) {
+            cpu_order.insert(cpu_order.end(), node.begin(), node.end());
+        }
+        break;
+    case AffinityMode::Scatter: {
+        size_t max_node_size = 0;
+        for (const auto &node : topology.nodes) {
+            max_node_size = std::max(max_node_size, node.size());
+        }
+
+        for (size_t i = 0; i < max_node_size; i++) {
+            for (const auto &node : topology.nodes) {
+                if (i < node.size()) {
+                    cpu_order.push_back(node[i]);
+                }
+            }
+        }
+        break;
+    }
+    case AffinityMode::List:
+        cpu_order = config.cpu_list;
+        break;
+    }
+
+    u32 num_threads = config.num_threads;
+    if (num_threads == 0) {
+        num_threads = cpu_order.size();
+    }
+
+    if (affinity != AffinityMode::None && num_threads > cpu_order.size()) {
+        spdlog::warn("More threads ({}) than CPUs to pin them to ({}), some CPUs will be "
+                     "oversubscribed",
+                     num_threads, cpu_order.size());
+    }
+
+    std::vector<ThreadPlacement> placements{};
+    placements.reserve(num_threads);
+
+    for (u32 t = 0; t < num_threads; t++) {
+        if (affinity == AffinityMode::None) {
+            placements.push_back(ThreadPlacement{});
+        } else {
+            u32 cpu = cpu_order[t % cpu_order.size()];
+            placements.push_back(ThreadPlacement{
+                .cpu = cpu,
+                .numa_node = topology.node_of_cpu(cpu),
+            });
+        }
+    }
+
+    return placements;
+}
+
+bool
+pin_current_thread(u32 cpu) {
+    if (cpu >= CPU_SETSIZE) {
+        return false;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
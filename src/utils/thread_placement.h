@@ -0,0 +1,66 @@
+#ifndef PT_THREAD_PLACEMENT_H
+#define PT_THREAD_PLACEMENT_H
+
+#include "basic_types.h"
+
+#include <string>
+#include <vector>
+
+enum class AffinityMode : u8 {
+    /// Let the OS schedule the threads
+    None,
+    /// Fill the CPUs of one NUMA node before moving onto the next one
+    Compact,
+    /// Distribute threads round-robin across NUMA nodes
+    Scatter,
+    /// Pin the threads to an explicit list of CPUs
+    List,
+};
+
+struct ThreadConfig {
+    /// Parses the --affinity option: "none", "compact", "scatter" or a CPU list.
+    void
+    set_affinity(const std::string &affinity);
+
+    /// 0 means all CPUs available to the process
+    u32 num_threads = 0;
+    AffinityMode affinity = AffinityMode::None;
+    std::vector<u32> cpu_list{};
+    /// Render threads on a NUMA node render the part of the image whose framebuffer
+    /// memory lives on that node
+    bool numa = false;
+};
+
+/// CPUs available to this process, grouped by NUMA node.
+struct CpuTopology {
+    static CpuTopology
+    detect();
+
+    u32
+    num_cpus() const;
+
+    u32
+    node_of_cpu(u32 cpu) const;
+
+    std::vector<std::vector<u32>> nodes{};
+};
+
+struct ThreadPlacement {
+    /// CPU the thread is pinned to, if any
+    Option<u32> cpu{};
+    u32 numa_node = 0;
+};
+
+/// Returns the placement of every render thread.
+std::vector<ThreadPlacement>
+plan_thread_placement(const ThreadConfig &config, const CpuTopology &topology);
+
+/// Parses Linux-style CPU lists, e.g. "0-3,8,10-11".
+std::vector<u32>
+parse_cpu_list(const std::string &list);
+
+/// Pins the calling thread to a CPU, returns false on failure.
+bool
+pin_current_thread(u32 cpu);
+
+#endif // PT_THREAD_PLACEMENT_H